@@ -0,0 +1,129 @@
+#!/usr/bin/env python
+###############################################################################
+## The MIT License
+##
+## SPDX short identifier: MIT
+##
+## Copyright 2019 Genentech Inc. South San Francisco
+##
+## Permission is hereby granted, free of charge, to any person obtaining a
+## copy of this software and associated documentation files (the "Software"),
+## to deal in the Software without restriction, including without limitation
+## the rights to use, copy, modify, merge, publish, distribute, sublicense,
+## and/or sell copies of the Software, and to permit persons to whom the
+## Software is furnished to do so, subject to the following conditions:
+##
+## The above copyright notice and this permission notice shall be included
+## in all copies or substantial portions of the Software.
+##
+## THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+## OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+## FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+## AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+## LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+## FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+## DEALINGS IN THE SOFTWARE.
+###############################################################################
+
+
+
+from sys import stdout, exit
+import sys
+import glob
+from simtk.openmm import app, KcalPerKJ
+from simtk import unit as u
+from openmmani import *
+
+
+
+def saveANIInfo(oFileName, netDir, netParamFile, atomFitFile, nEnsambles):
+    with open(oFileName, "wt") as oaf:
+       print(netDir, file=oaf)
+       print(netParamFile, file=oaf)
+       print(atomFitFile, file=oaf)
+       print(nEnsambles, file=oaf)
+
+
+def warn(*argv):
+    # write to stderr
+    print(*argv, file=sys.stderr, flush=True)
+
+
+
+
+if __name__ == '__main__':
+
+    import argparse
+
+    parser = argparse.ArgumentParser(formatter_class=argparse.RawTextHelpFormatter,
+                                     description="Minimize many molecules in one batched ANI optimization")
+
+    parser.add_argument('-netDir', help='directory with ANI network definitions e.g. ASE_ANI/ani_models/ani-1ccx_8x',
+                        metavar='netDir' ,  type=str, required=True)
+
+    parser.add_argument('-paramFile', help='name of ANI parameter file default=netDir/*.params',
+                        metavar='paramF' ,  type=str)
+
+    parser.add_argument('-atFitFile', help='File with atomization energies default=netDir/*.dat',
+                        metavar='atFitFile' ,  type=str)
+
+    parser.add_argument('-tolerance', help='RMS force convergence criterion [kJ/mol/nm] default=0.1',
+                        metavar='tol' ,  type=float, default=0.1)
+
+    parser.add_argument('-maxIter', help='maximum number of iterations per molecule default=1000',
+                        metavar='n' ,  type=int, default=1000)
+
+    parser.add_argument('-in', help='Molecules to minimize, each is written to <name>.min.pdb',
+                        dest='inFiles', metavar='pdb' ,  type=str, nargs='+', required=True)
+
+    args = parser.parse_args()
+
+    # make parsed parameter local variables
+    locals().update(args.__dict__)
+
+    if paramFile is None:
+        paramFile = glob.glob1(netDir,"*.params")
+        if len(paramFile) != 1: 
+            warn("paramFile does not exist or is not uique: %s" %(paramFile))
+            sys.exit(1)
+        paramFile = paramFile[0]
+
+    if atFitFile is None:
+        atFitFile = glob.glob1(netDir,"*.dat")
+        if len(atFitFile) != 1:
+            warn("atFitFile does not exist or is not uique: %s" %(atFitFile))
+            sys.exit(1)
+        atFitFile = atFitFile[0]
+
+    nEnsambles = len(glob.glob1(netDir,"train[0-9]") + glob.glob1(netDir,"train[1-9][0-9]"))
+    if nEnsambles <= 0:
+        warn("No train* directories found in " + netDir)
+        sys.exit(1)
+
+    saveANIInfo("aniInfo.txt", netDir, paramFile, atFitFile, nEnsambles)
+
+    #################################################
+    # all molecules are minimized together, each batch
+    # evaluates every molecule that has not converged
+    opt = ANIOptimizer("aniInfo.txt")
+    opt.setTolerance(tolerance)
+    opt.setMaxIterations(maxIter)
+    #################################################
+
+    pdbs = []
+    for inFile in inFiles:
+        pdb = app.PDBFile(inFile)
+        atomSym = [ atom.element.symbol for atom in pdb.topology.atoms() ]
+        opt.addMolecule(atomSym, pdb.positions.value_in_unit(u.nanometer))
+        pdbs.append(pdb)
+
+    opt.minimize()
+
+    for i, (inFile, pdb) in enumerate(zip(inFiles, pdbs)):
+        outFile = inFile.rsplit('.', 1)[0] + '.min.pdb'
+        with open(outFile, 'w') as outF:
+            app.PDBFile.writeFile(pdb.topology, opt.getPositions(i) * u.nanometer, outF)
+        print( '%s: Energy at Minima is %3.3f kcal/mol after %d iterations%s'
+               % (inFile, opt.getEnergy(i) * KcalPerKJ, opt.getNumIterations(i),
+                  '' if opt.isConverged(i) else ' (not converged)'))
+    print( '%d batched ANI evaluations' % opt.getNumBatchEvaluations())
@@ -0,0 +1,105 @@
+#ifndef OPENMM_ANI_ENGINE_H_
+#define OPENMM_ANI_ENGINE_H_
+
+/* -------------------------------------------------------------------------- *
+ * The MIT License
+ *
+ * SPDX short identifier: MIT
+ *
+ * Copyright 2019 Genentech Inc. South San Francisco
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ * -------------------------------------------------------------------------- */
+
+
+#include <string>
+#include <vector>
+#include "internal/windowsExportANI.h"
+
+#define NM_TO_ANGST 10
+#define HARTREE_TO_KJ_MOL 2625.50
+#define HARTREE_A_TO_KJ_MOL_NM (HARTREE_TO_KJ_MOL * NM_TO_ANGST)
+
+
+namespace ANIPlugin {
+
+/**
+ * One structure to be evaluated by an ANIEngine.  Coordinates are in Angstrom,
+ * the energy is in Hartree and forces are in Hartree/Angstrom, which are the
+ * units the ANI networks work in.  All buffers are owned by the caller.
+ */
+struct ANIEvaluation {
+    ANIEvaluation() : symbols(NULL), positions(NULL), cell(NULL), forces(NULL), virial(NULL), ensembleEnergies(NULL), energy(0.0) {
+    }
+    /** the atom symbols of the structure */
+    const std::vector<std::string>* symbols;
+    /** 3*numAtoms coordinates */
+    const float* positions;
+    /** the 3x3 periodic cell (row major) or NULL for a non periodic structure */
+    const float* cell;
+    /** receives 3*numAtoms forces, NULL if only the energy is needed */
+    float* forces;
+    /**
+     * receives the 3x3 virial W[3*a+b] = sum r_a*f_b (row major, in Hartree) over the
+     * displacements r between atoms and the forces f along them, or NULL if it is
+     * not needed.  Only engines that support it look at this (see CpuANIEngine).
+     */
+    double* virial;
+    /**
+     * receives the energy of each member of the ensemble (in Hartree), whose
+     * mean is the energy, or NULL if they are not needed.  Only engines that
+     * support it look at this (see CpuANIEngine).
+     */
+    double* ensembleEnergies;
+    /** receives the energy */
+    double energy;
+};
+
+/**
+ * An ANIEngine evaluates an ANI ensemble on batches of structures.  Batching
+ * lets callers that need many independent evaluations, such as an optimizer
+ * working on a set of conformers, hand all of them to the engine in one call.
+ */
+class OPENMM_EXPORT_NN ANIEngine {
+public:
+    virtual ~ANIEngine() {
+    }
+    /**
+     * Compute the energy and, if requested, the forces of every structure in the batch.
+     *
+     * @param batch   the structures to evaluate; results are stored back into its elements
+     */
+    virtual void computeBatch(std::vector<ANIEvaluation>& batch) = 0;
+    /**
+     * Create an engine for the network described by an ANI info file.
+     * The caller takes ownership of the returned object.
+     *
+     * @param aniInfoFile   the path to the file containing ani info
+     * @param engineName    the implementation to use: "NeuroChem" to evaluate the
+     *                      networks with libcppNeuroChem, "CPU" to evaluate
+     *                      them natively on the CPU, "CPUFast" to do so with
+     *                      faster, slightly less precise activation functions, or
+     *                      "CPUTabulated" to compute the AEVs from spline tables
+     */
+    static ANIEngine* create(const std::string& aniInfoFile, const std::string& engineName="NeuroChem");
+};
+
+} // namespace ANIPlugin
+
+#endif /*OPENMM_ANI_ENGINE_H_*/
@@ -0,0 +1,143 @@
+#ifndef OPENMM_ANI_FEATURIZER_H_
+#define OPENMM_ANI_FEATURIZER_H_
+
+/* -------------------------------------------------------------------------- *
+ * The MIT License
+ *
+ * SPDX short identifier: MIT
+ *
+ * Copyright 2019 Genentech Inc. South San Francisco
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ * -------------------------------------------------------------------------- */
+
+#include "openmm/Vec3.h"
+#include <cstdio>
+#include <future>
+#include <string>
+#include <vector>
+#include "internal/windowsExportANI.h"
+
+namespace ANIPlugin {
+
+class CpuANIEngine;
+
+/**
+ * This class computes the atomic environment vectors (AEVs) of many structures
+ * with the native CPU code and writes them to a file, for training networks
+ * and active learning.  Structures are collected into batches that are
+ * featurized on all cores.  Each batch is appended to the file as one chunk
+ * while the next one is being computed.
+ *
+ * The AEVs have the layout described in CpuANIEngine::computeAEVs(), so the
+ * species blocks follow the order of the species in the model's .params file.
+ * The file is laid out so that it can be memory mapped, with every section
+ * starting at a multiple of 64 bytes (native byte order):
+ *
+ *   - a 64 byte header: char magic[8] "ANIAEV", int32 version (1),
+ *     int32 aevLength, int32 numSpecies, int32 dataOffset, int64 numStructures,
+ *     int64 numAtoms, int64 indexOffset and 16 reserved bytes
+ *   - the symbols of the model's species in AEV order, as char[4] each
+ *   - at dataOffset, numAtoms rows of aevLength float32 values
+ *   - at indexOffset, numStructures+1 int64 row offsets (the atoms of
+ *     structure i are rows offsets[i] to offsets[i+1]-1), followed by the
+ *     species index of every atom as int8
+ *
+ * The counts and the index are written by close().  Until then numStructures
+ * in the header is 0.
+ */
+class OPENMM_EXPORT_NN ANIFeaturizer {
+public:
+    /**
+     * Create an ANIFeaturizer and the output file.
+     *
+     * @param aniInfoFile   the path to the file containing ani info
+     * @param outputFile    the file to write
+     * @param batchSize     the number of structures featurized together
+     * @param numThreads    the number of threads to use, or 0 to use one per core
+     */
+    ANIFeaturizer(const std::string& aniInfoFile, const std::string& outputFile, int batchSize=256, int numThreads=0);
+    /**
+     * Close the file if close() has not been called.
+     */
+    ~ANIFeaturizer();
+    /**
+     * Get the number of values in the AEV of one atom.
+     */
+    int getAEVLength() const;
+    /**
+     * Get the symbols of the model's species in the order of the AEV blocks.
+     */
+    const std::vector<std::string>& getSpecies() const;
+    /**
+     * Add a non-periodic structure.
+     *
+     * @param atomSymbols   the symbols of the atoms
+     * @param positions     the positions in nm
+     */
+    void addStructure(const std::vector<std::string>& atomSymbols, const std::vector<OpenMM::Vec3>& positions);
+    /**
+     * Add a periodic structure.
+     *
+     * @param atomSymbols   the symbols of the atoms
+     * @param positions     the positions in nm
+     * @param boxVectors    the three periodic box vectors in nm
+     */
+    void addStructure(const std::vector<std::string>& atomSymbols, const std::vector<OpenMM::Vec3>& positions, const std::vector<OpenMM::Vec3>& boxVectors);
+    /**
+     * Add a structure given in the engine's units.
+     *
+     * @param atomSymbols   the symbols of the atoms
+     * @param positions     3*numAtoms coordinates in Angstrom
+     * @param cell          the 3x3 periodic cell (row major) in Angstrom, or NULL
+     */
+    void addStructure(const std::vector<std::string>& atomSymbols, const float* positions, const float* cell);
+    /**
+     * Get the number of structures that have been added.
+     */
+    long long getNumStructures() const;
+    /**
+     * Featurize the pending structures, write the index and complete the file.
+     * No structures can be added afterward.
+     */
+    void close();
+private:
+    struct Structure {
+        std::vector<std::string> symbols;
+        std::vector<float> positions, cell;
+    };
+    ANIFeaturizer(const ANIFeaturizer&);
+    ANIFeaturizer& operator=(const ANIFeaturizer&);
+    void flush();
+    void writeHeader();
+    CpuANIEngine* engine;
+    std::string fileName;
+    FILE* file;
+    int batchSize, numPending, currentBuffer;
+    long long dataSize;
+    std::vector<Structure> pending;
+    std::vector<float> buffers[2];
+    std::future<void> writing;
+    std::vector<long long> offsets;
+    std::vector<signed char> atomSpecies;
+};
+
+} // namespace ANIPlugin
+
+#endif /*OPENMM_ANI_FEATURIZER_H_*/
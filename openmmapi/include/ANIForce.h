@@ -34,6 +34,7 @@
 
 #include "openmm/Context.h"
 #include "openmm/Force.h"
+#include <memory>
 #include <string>
 #include <vector>
 #include "internal/windowsExportANI.h"
@@ -49,18 +50,41 @@ namespace ANIPlugin {
 class OPENMM_EXPORT_NN ANIForce : public OpenMM::Force {
 public:
     /**
-     * Create a ANIForce.  The network parameters are given in a txt file
+     * Create a ANIForce.  The network parameters are given in a txt file.
+     * The model starts loading in the background right away, so that creating
+     * a Context later only waits for whatever is left of the load.  The force
+     * keeps the model until it is deleted, and all its Contexts share it.
      *
      * @param aniInfoFile   the path to the file containing ani info
      * @param atomSymbols of atoms in system
      */
     ANIForce(const string& aniInfoFile, vector<string> atomSymbols);
 
+    /**
+     * Start loading a model in the background before any ANIForce exists, for
+     * example while the rest of the system is being prepared.  The next Context
+     * created for an ANIForce with this info file uses the loaded model.
+     *
+     * @param aniInfoFile   the path to the file containing ani info
+     */
+    static void preloadModel(const string& aniInfoFile);
+
     /**
      * String containing arguments needed to load and initialize ANI network
      */
     const string& getInfoFile() const;
 
+    /**
+     * Switch to a different model, for example one trained on other data or
+     * with a different number of ensemble members.  The model starts loading
+     * in the background right away.  To switch the model of an existing
+     * Context, call updateParametersInContext() afterwards.  The new model must
+     * support the elements of all atoms.
+     *
+     * @param aniInfoFile   the path to the file containing ani info
+     */
+    void setInfoFile(const string& aniInfoFile);
+
     /**
      * Return a vector with the atomic numbers of the atoms in topology order.
      */
@@ -78,13 +102,207 @@ public:
      */
     bool usesPeriodicBoundaryConditions() const;
 
+    /**
+     * Set whether Contexts share one engine for evaluating this force.  All Contexts
+     * in the process whose ANIForce uses the same info file and enables this submit
+     * their evaluations to one engine, which combines requests that arrive at the
+     * same time into a single batch.  This is useful for replica exchange and
+     * parallel tempering, where many small replicas are stepped on separate threads.
+     * It is supported by the Reference and CPU platforms, rejected by the OpenCL
+     * platform, and ignored by the CUDA platform.
+     */
+    void setUseSharedEngine(bool shared);
+
+    /**
+     * Get whether Contexts share one engine for evaluating this force.
+     */
+    bool getUseSharedEngine() const;
+
+    /**
+     * Set the longest time (in seconds) an evaluation on a shared engine waits for
+     * requests from other Contexts before the batch is evaluated.  It stops waiting
+     * early once every Context sharing the engine has submitted a request.  With the
+     * default of 0, batches only combine requests that arrive while the previous
+     * batch is being evaluated.
+     */
+    void setMaxBatchWait(double wait);
+
+    /**
+     * Get the longest time (in seconds) an evaluation on a shared engine waits for
+     * requests from other Contexts.
+     */
+    double getMaxBatchWait() const;
+
+    /**
+     * Evaluate this force on an ani-server process running on the same node,
+     * instead of in the calling process.  Many simulations of small systems can
+     * then share one copy of each model, and the server evaluates requests from
+     * different simulations that arrive together as one batch.  The server
+     * opens the info file itself, so relative paths in it must make sense in
+     * the server's working directory.  getMaxBatchWait() is passed to the
+     * server.  It is supported by the Reference and CPU platforms and rejected
+     * by the OpenCL and CUDA platforms, and it cannot be combined with a shared
+     * engine, domain workers, a memory limit or an alchemical force.
+     *
+     * @param socketPath   the Unix domain socket the server listens on, or an
+     *                     empty string to evaluate the force in this process
+     */
+    void setServer(const string& socketPath);
+
+    /**
+     * Get the socket of the server that evaluates this force, or an empty
+     * string if it is evaluated in this process.
+     */
+    const string& getServer() const;
+
+    /**
+     * Set the number of worker processes that evaluate this force.  With more than
+     * zero workers, the system is divided into that many spatial domains, and each
+     * domain is evaluated in its own process on the same node, with the cores
+     * divided between them.  The energy and forces are bitwise identical to those
+     * of a single process.  This is meant for systems of 100,000 atoms and more
+     * on machines with several sockets.  It is supported by the Reference and CPU
+     * platforms and rejected by the OpenCL and CUDA platforms.  The default of 0
+     * evaluates the force in the calling process.
+     */
+    void setNumDomainWorkers(int workers);
+
+    /**
+     * Get the number of worker processes that evaluate this force.
+     */
+    int getNumDomainWorkers() const;
+
+    /**
+     * Set a limit (in megabytes) on the scratch memory used to evaluate this
+     * force.  If evaluating the whole system at once would need more, it is
+     * divided into spatial chunks that are evaluated one after another, each
+     * with a halo of the atoms within the cutoff of it.  The energy and forces
+     * are bitwise identical either way.  Chunks cannot be smaller than the
+     * cutoff, so evaluating the force throws an exception if even they would
+     * need more than the limit.  It is supported by the Reference and CPU
+     * platforms, rejected by the OpenCL and CUDA platforms, and cannot be
+     * combined with a shared engine, domain workers or an alchemical force.
+     * Frozen (zero mass) particles are not cached when a limit is set.  The
+     * default of 0 means no limit.
+     */
+    void setMaxMemory(double megabytes);
+
+    /**
+     * Get the limit (in megabytes) on the scratch memory used to evaluate this
+     * force, or 0 if there is none.
+     */
+    double getMaxMemory() const;
+
+    /**
+     * Record the structures this force evaluates, together with the energies
+     * and forces computed for them, to a compact binary log.  The ani-replay
+     * tool replays a log with any engine, to benchmark a real workload or to
+     * reproduce a problem.  Recording is supported by the Reference, CPU, CUDA
+     * and OpenCL platforms; the OpenCL platform only records energies.  Every
+     * Context created from this force writes the file anew, and only one Context
+     * in the process can record to a file at a time: creating another one while
+     * it exists throws an exception.
+     *
+     * @param file          the file to write, or an empty string to not record
+     * @param interval      record every interval'th evaluation, starting with the first
+     * @param maxMegabytes  stop recording before the file grows beyond this size
+     */
+    void setRecording(const string& file, int interval=1, double maxMegabytes=1000);
+
+    /**
+     * Get the file evaluations are recorded to, or an empty string if they are not.
+     */
+    const string& getRecordingFile() const;
+
+    /**
+     * Get how often evaluations are recorded: every getRecordingInterval()'th one.
+     */
+    int getRecordingInterval() const;
+
+    /**
+     * Get the size (in megabytes) the recording may grow to.
+     */
+    double getMaxRecordingSize() const;
+
+    /**
+     * Turn this force into an alchemical transformation between two end states,
+     * for free energy calculations.  The symbols passed to the constructor
+     * describe state A and these describe state B.  In either list an empty
+     * string marks an atom that does not exist in that state.  The energy is
+     * (1-lambda)*E_A + lambda*E_B, where lambda is a global parameter of the
+     * Context (see setAlchemicalParameter()), and its derivative with respect to
+     * lambda is reported as an energy parameter derivative.  Only the atoms
+     * within the cutoff of an atom that differs between the states are
+     * evaluated twice, so this costs little more than a single state.  It is
+     * supported by the Reference and CPU platforms.  Pass an empty vector to
+     * turn it off again.
+     *
+     * @param symbols   the symbols of the atoms in state B
+     */
+    void setAlchemicalSymbols(const vector<string>& symbols);
+
+    /**
+     * Get the symbols of the atoms in state B, or an empty vector if this force
+     * is not alchemical.
+     */
+    const vector<string>& getAlchemicalSymbols() const;
+
+    /**
+     * Set the name of the global Context parameter that mixes the alchemical
+     * states.  The default is "lambda_ani".
+     */
+    void setAlchemicalParameter(const string& name);
+
+    /**
+     * Get the name of the global Context parameter that mixes the alchemical states.
+     */
+    const string& getAlchemicalParameter() const;
+
+    /**
+     * Compute the virial of this force for the current positions and periodic box
+     * of a Context: the 3x3 tensor W[a][b] = sum r_a*f_b over the displacements r
+     * between atoms and the forces f along them, in kJ/mol.  Together with the
+     * kinetic energy it gives the pressure tensor, P = (sum m*v*v + W)/V, without
+     * finite differences.  This is not available on the CUDA platform.
+     *
+     * @param context   the Context to evaluate
+     * @return the three rows of the virial
+     */
+    std::vector<OpenMM::Vec3> computeVirial(OpenMM::Context& context);
+
+    /**
+     * Update a Context to use the model set by setInfoFile().  Only the networks
+     * are replaced; the rest of the Context, including positions, velocities and
+     * the state of its other forces, is kept, which is much cheaper than
+     * creating a new Context.  Other settings of this force, such as the atom
+     * symbols or the alchemical states, cannot be changed this way.  The model
+     * of a Context that records its evaluations (see setRecording()) cannot be
+     * changed either, because the recording names the model it was made with.
+     */
+    void updateParametersInContext(OpenMM::Context& context);
+
+    /**
+     * Get the most scratch memory (in megabytes) that evaluating this force in
+     * a Context has used so far.  This is useful for choosing a limit with
+     * setMaxMemory() and for sizing jobs.  It is available on the Reference and
+     * CPU platforms, unless the force uses a shared engine or domain workers.
+     *
+     * @param context   the Context to query
+     */
+    double getPeakMemory(OpenMM::Context& context);
+
 protected:
     OpenMM::ForceImpl* createImpl() const;
 
 private:
     string aniInfoFile;
-    bool usePeriodic;
+    bool usePeriodic, useSharedEngine;
+    double maxBatchWait, maxMemory, maxRecordingSize;
+    int numDomainWorkers, recordingInterval;
     const vector<string> atomSymbols;
+    vector<string> alchemicalSymbols;
+    string alchemicalParameter, recordingFile, serverPath;
+    std::shared_ptr<void> heldModel;
 };
 
 } // namespace NNPlugin
@@ -0,0 +1,142 @@
+#ifndef OPENMM_ANI_HESSIAN_H_
+#define OPENMM_ANI_HESSIAN_H_
+
+/* -------------------------------------------------------------------------- *
+ * The MIT License
+ *
+ * SPDX short identifier: MIT
+ *
+ * Copyright 2019 Genentech Inc. South San Francisco
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ * -------------------------------------------------------------------------- */
+
+
+#include "ANIEngine.h"
+#include "openmm/Vec3.h"
+#include <string>
+#include <vector>
+#include "internal/windowsExportANI.h"
+
+namespace ANIPlugin {
+
+/**
+ * This class computes the ANI Hessian of a molecule by central finite differences
+ * of the forces.  All 6N displaced structures (plus the reference structure) are
+ * generated up front and handed to the ANIEngine in as few batched calls as the
+ * maximum batch size allows.  The engine sees single precision coordinates, so
+ * each difference is divided by the displacement actually applied after rounding.
+ * The result is symmetrized and can be diagonalized
+ * to obtain harmonic frequencies and mass weighted normal modes.
+ *
+ * Positions are in nm, the Hessian is in kJ/mol/nm^2 and frequencies are in cm^-1.
+ */
+class OPENMM_EXPORT_NN ANIHessian {
+public:
+    /**
+     * Create an ANIHessian that loads its own engine.
+     *
+     * @param aniInfoFile   the path to the file containing ani info
+     * @param engineName    the ANIEngine implementation to use (see ANIEngine::create()).
+     *                      The default CPU engine evaluates the structures of a batch
+     *                      on all cores.
+     */
+    ANIHessian(const std::string& aniInfoFile, const std::string& engineName="CPU");
+    /**
+     * Create an ANIHessian that uses an existing engine.  The engine must
+     * outlive this object.
+     */
+    ANIHessian(ANIEngine& engine);
+
+    ~ANIHessian();
+
+    /**
+     * Get the size (in nm) of the displacement used for the finite differences.
+     */
+    double getDisplacement() const;
+    /**
+     * Set the size (in nm) of the displacement used for the finite differences.
+     */
+    void setDisplacement(double displacement);
+    /**
+     * Get the maximum number of structures passed to the engine in one call.
+     * 0 means all displaced structures are evaluated in a single call.
+     */
+    int getMaxBatchSize() const;
+    /**
+     * Set the maximum number of structures passed to the engine in one call.
+     * 0 means all displaced structures are evaluated in a single call.
+     */
+    void setMaxBatchSize(int size);
+    /**
+     * Compute the Hessian of a molecule.
+     *
+     * @param atomSymbols   the symbols of the atoms
+     * @param positions     the positions in nm
+     */
+    void computeHessian(const std::vector<std::string>& atomSymbols, const std::vector<OpenMM::Vec3>& positions);
+    /**
+     * Diagonalize the mass weighted Hessian computed by the last call to computeHessian().
+     *
+     * @param masses   the atomic masses in amu
+     */
+    void computeNormalModes(const std::vector<double>& masses);
+    /**
+     * Get the number of atoms of the molecule passed to computeHessian().
+     */
+    int getNumAtoms() const;
+    /**
+     * Get the energy at the reference geometry in kJ/mol.
+     */
+    double getEnergy() const;
+    /**
+     * Get the forces at the reference geometry in kJ/mol/nm.
+     */
+    std::vector<OpenMM::Vec3> getForces() const;
+    /**
+     * Get the symmetrized 3N x 3N Hessian in row major order (kJ/mol/nm^2).
+     */
+    const std::vector<double>& getHessian() const;
+    /**
+     * Get the harmonic frequencies in cm^-1 in ascending order.  Negative values
+     * stand for imaginary frequencies.
+     */
+    const std::vector<double>& getFrequencies() const;
+    /**
+     * Get a normalized, mass weighted normal mode.  Modes are ordered like the frequencies.
+     */
+    std::vector<OpenMM::Vec3> getNormalMode(int index) const;
+    /**
+     * Get the number of batched engine calls made by the last call to computeHessian().
+     */
+    int getNumBatchEvaluations() const;
+
+private:
+    ANIHessian(const ANIHessian&);
+    ANIHessian& operator=(const ANIHessian&);
+    ANIEngine* engine;
+    bool ownsEngine;
+    double displacement, energy;
+    int maxBatchSize, numAtoms, numBatchEvaluations;
+    std::vector<double> forces, hessian, frequencies, modes;
+};
+
+} // namespace ANIPlugin
+
+#endif /*OPENMM_ANI_HESSIAN_H_*/
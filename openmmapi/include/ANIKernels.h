@@ -37,6 +37,7 @@
 #include "openmm/Platform.h"
 #include "openmm/System.h"
 #include <string>
+#include <vector>
 
 namespace ANIPlugin {
 
@@ -68,6 +69,30 @@ public:
      * @return the potential energy due to the force
      */
     virtual double execute(OpenMM::ContextImpl& context, bool includeForces, bool includeEnergy) = 0;
+    /**
+     * Copy changed parameters over to a context.  This switches to the model of
+     * the force if its info file has changed.
+     *
+     * @param context        the context to copy parameters to
+     * @param force          the ANIForce to copy the parameters from
+     */
+    virtual void copyParametersToContext(OpenMM::ContextImpl& context, const ANIForce& force) = 0;
+    /**
+     * Compute the virial of the force for the current positions and box: the
+     * 3x3 tensor W[a][b] = sum r_a*f_b (in kJ/mol) over the displacements r
+     * between atoms and the forces f along them.
+     *
+     * @param context        the context in which to execute this kernel
+     * @param virial         on exit, the three rows of the virial
+     */
+    virtual void computeVirial(OpenMM::ContextImpl& context, std::vector<OpenMM::Vec3>& virial) = 0;
+    /**
+     * Get the most scratch memory (in megabytes) that evaluating the force has
+     * used so far.
+     *
+     * @param context        the context in which to execute this kernel
+     */
+    virtual double getPeakMemory(OpenMM::ContextImpl& context) = 0;
 };
 
 } // namespace ANIPlugin
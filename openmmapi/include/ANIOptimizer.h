@@ -0,0 +1,154 @@
+#ifndef OPENMM_ANI_OPTIMIZER_H_
+#define OPENMM_ANI_OPTIMIZER_H_
+
+/* -------------------------------------------------------------------------- *
+ * The MIT License
+ *
+ * SPDX short identifier: MIT
+ *
+ * Copyright 2019 Genentech Inc. South San Francisco
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ * -------------------------------------------------------------------------- */
+
+
+#include "ANIEngine.h"
+#include "openmm/Vec3.h"
+#include <string>
+#include <vector>
+#include "internal/windowsExportANI.h"
+
+namespace ANIPlugin {
+
+/**
+ * This class minimizes the ANI energy of many molecules at once.  Every molecule
+ * keeps its own L-BFGS history and line search, but all molecules that have not
+ * converged yet are evaluated together in one ANIEngine::computeBatch() call per
+ * iteration.  Molecules drop out of the batch as soon as they converge.
+ *
+ * Positions are given in nm, energies are reported in kJ/mol and the tolerance
+ * is in kJ/mol/nm, as in OpenMM's LocalEnergyMinimizer.
+ */
+class OPENMM_EXPORT_NN ANIOptimizer {
+public:
+    /**
+     * Create an ANIOptimizer that loads its own engine.
+     *
+     * @param aniInfoFile   the path to the file containing ani info
+     * @param engineName    the ANIEngine implementation to use (see ANIEngine::create())
+     */
+    ANIOptimizer(const std::string& aniInfoFile, const std::string& engineName="CPU");
+    /**
+     * Create an ANIOptimizer that uses an existing engine.  The engine must
+     * outlive the optimizer.
+     */
+    ANIOptimizer(ANIEngine& engine);
+
+    ~ANIOptimizer();
+
+    /**
+     * Add a molecule to be minimized.
+     *
+     * @param atomSymbols   the symbols of the atoms
+     * @param positions     the starting positions in nm
+     * @return the index of the molecule
+     */
+    int addMolecule(const std::vector<std::string>& atomSymbols, const std::vector<OpenMM::Vec3>& positions);
+    /**
+     * Get the number of molecules that have been added.
+     */
+    int getNumMolecules() const;
+    /**
+     * Get the convergence tolerance: a molecule is converged once the root mean
+     * square of its force components drops below this value (in kJ/mol/nm).
+     */
+    double getTolerance() const;
+    /**
+     * Set the convergence tolerance in kJ/mol/nm.
+     */
+    void setTolerance(double tolerance);
+    /**
+     * Get the maximum number of iterations per molecule.  0 means no limit.
+     */
+    int getMaxIterations() const;
+    /**
+     * Set the maximum number of iterations per molecule.  0 means no limit.
+     */
+    void setMaxIterations(int maxIterations);
+    /**
+     * Get the number of correction pairs each molecule keeps in its L-BFGS history.
+     */
+    int getHistorySize() const;
+    /**
+     * Set the number of correction pairs each molecule keeps in its L-BFGS history.
+     */
+    void setHistorySize(int size);
+    /**
+     * Get the largest distance (in nm) any atom may move in a single step.
+     */
+    double getMaxStepSize() const;
+    /**
+     * Set the largest distance (in nm) any atom may move in a single step.
+     */
+    void setMaxStepSize(double size);
+    /**
+     * Minimize all molecules that have not converged yet.
+     */
+    void minimize();
+    /**
+     * Get the current positions of a molecule in nm.
+     */
+    std::vector<OpenMM::Vec3> getPositions(int molecule) const;
+    /**
+     * Get the current energy of a molecule in kJ/mol.
+     */
+    double getEnergy(int molecule) const;
+    /**
+     * Get the number of iterations (accepted steps) taken for a molecule.
+     */
+    int getNumIterations(int molecule) const;
+    /**
+     * Get whether a molecule has reached the convergence tolerance.
+     */
+    bool isConverged(int molecule) const;
+    /**
+     * Get the number of batched engine calls made by minimize() so far.
+     */
+    int getNumBatchEvaluations() const;
+
+private:
+    class MoleculeState;
+    ANIOptimizer(const ANIOptimizer&);
+    ANIOptimizer& operator=(const ANIOptimizer&);
+    void computeDirection(MoleculeState& mol);
+    void startLineSearch(MoleculeState& mol);
+    void acceptTrial(MoleculeState& mol);
+    void rejectTrial(MoleculeState& mol);
+    bool isTrialAcceptable(const MoleculeState& mol) const;
+    bool isConverged(const MoleculeState& mol) const;
+    ANIEngine* engine;
+    bool ownsEngine;
+    double tolerance, maxStepSize;
+    int maxIterations, historySize, numBatchEvaluations;
+    std::vector<MoleculeState*> molecules;
+};
+
+} // namespace ANIPlugin
+
+#endif /*OPENMM_ANI_OPTIMIZER_H_*/
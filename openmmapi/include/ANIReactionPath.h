@@ -0,0 +1,190 @@
+#ifndef OPENMM_ANI_REACTION_PATH_H_
+#define OPENMM_ANI_REACTION_PATH_H_
+
+/* -------------------------------------------------------------------------- *
+ * The MIT License
+ *
+ * SPDX short identifier: MIT
+ *
+ * Copyright 2019 Genentech Inc. South San Francisco
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ * -------------------------------------------------------------------------- */
+
+
+#include "ANIEngine.h"
+#include "openmm/Vec3.h"
+#include <string>
+#include <vector>
+#include "internal/windowsExportANI.h"
+
+namespace ANIPlugin {
+
+/**
+ * This class finds minimum energy paths between two structures of a molecule with
+ * the nudged elastic band method.  The path is represented by a chain of images
+ * whose end points stay fixed.  Every iteration evaluates all moving images in
+ * one ANIEngine::computeBatch() call, and then moves each image along the component
+ * of its ANI force perpendicular to the path plus a spring force along the path
+ * (using the improved tangent of Henkelman and Jonsson) that keeps the images
+ * evenly spaced.  All images are advanced together by the FIRE algorithm.
+ *
+ * With a climbing image, the highest energy image feels no spring force and has
+ * the component of its force along the path inverted, so it converges to the
+ * saddle point and its energy gives the barrier.
+ *
+ * Positions are given in nm, energies are reported in kJ/mol, the spring constant
+ * is in kJ/mol/nm^2 and the tolerance is in kJ/mol/nm.
+ */
+class OPENMM_EXPORT_NN ANIReactionPath {
+public:
+    /**
+     * Create an ANIReactionPath that loads its own engine.
+     *
+     * @param aniInfoFile   the path to the file containing ani info
+     * @param atomSymbols   the symbols of the atoms, which are the same for all images
+     * @param engineName    the ANIEngine implementation to use (see ANIEngine::create())
+     */
+    ANIReactionPath(const std::string& aniInfoFile, const std::vector<std::string>& atomSymbols, const std::string& engineName="CPU");
+    /**
+     * Create an ANIReactionPath that uses an existing engine.  The engine must
+     * outlive this object.
+     */
+    ANIReactionPath(ANIEngine& engine, const std::vector<std::string>& atomSymbols);
+
+    ~ANIReactionPath();
+
+    /**
+     * Add an image to the end of the path.  The first and last images are the
+     * fixed end points.
+     *
+     * @param positions     the positions of the image in nm
+     * @return the index of the image
+     */
+    int addImage(const std::vector<OpenMM::Vec3>& positions);
+    /**
+     * Replace all images by a linear interpolation between two end points.
+     *
+     * @param start         the positions of the first image in nm
+     * @param end           the positions of the last image in nm
+     * @param numImages     the total number of images, including the end points
+     */
+    void interpolate(const std::vector<OpenMM::Vec3>& start, const std::vector<OpenMM::Vec3>& end, int numImages);
+    /**
+     * Get the number of images, including the end points.
+     */
+    int getNumImages() const;
+    /**
+     * Get the spring constant between neighboring images in kJ/mol/nm^2.
+     */
+    double getSpringConstant() const;
+    /**
+     * Set the spring constant between neighboring images in kJ/mol/nm^2.
+     */
+    void setSpringConstant(double k);
+    /**
+     * Get whether the highest energy image climbs to the saddle point.
+     */
+    bool getUseClimbingImage() const;
+    /**
+     * Set whether the highest energy image climbs to the saddle point.  It is
+     * often best to first converge the path loosely without a climbing image.
+     */
+    void setUseClimbingImage(bool use);
+    /**
+     * Get the convergence tolerance: the path is converged once the root mean
+     * square of the force components of every moving image drops below this
+     * value (in kJ/mol/nm).
+     */
+    double getTolerance() const;
+    /**
+     * Set the convergence tolerance in kJ/mol/nm.
+     */
+    void setTolerance(double tolerance);
+    /**
+     * Get the maximum number of iterations per call to optimize().
+     */
+    int getMaxIterations() const;
+    /**
+     * Set the maximum number of iterations per call to optimize().
+     */
+    void setMaxIterations(int maxIterations);
+    /**
+     * Get the largest distance (in nm) any atom may move in a single step.
+     */
+    double getMaxStepSize() const;
+    /**
+     * Set the largest distance (in nm) any atom may move in a single step.
+     */
+    void setMaxStepSize(double size);
+    /**
+     * Optimize the path until it converges or the maximum number of iterations
+     * is reached.
+     */
+    void optimize();
+    /**
+     * Get the current positions of an image in nm.
+     */
+    std::vector<OpenMM::Vec3> getPositions(int image) const;
+    /**
+     * Get the ANI energy of an image in kJ/mol, as of the last evaluation.
+     */
+    double getEnergy(int image) const;
+    /**
+     * Get the ANI forces on an image in kJ/mol/nm, as of the last evaluation.
+     */
+    std::vector<OpenMM::Vec3> getForces(int image) const;
+    /**
+     * Get the index of the climbing image, or -1 if there is none.
+     */
+    int getClimbingImage() const;
+    /**
+     * Get whether the path reached the convergence tolerance.
+     */
+    bool isConverged() const;
+    /**
+     * Get the number of iterations taken by optimize() so far.
+     */
+    int getNumIterations() const;
+    /**
+     * Get the number of batched engine calls made so far.
+     */
+    int getNumBatchEvaluations() const;
+
+private:
+    ANIReactionPath(const ANIReactionPath&);
+    ANIReactionPath& operator=(const ANIReactionPath&);
+    void evaluate(int firstImage, int lastImage);
+    double computePathForces();
+    ANIEngine* engine;
+    bool ownsEngine;
+    std::vector<std::string> symbols;
+    double springConstant, tolerance, maxStepSize;
+    int maxIterations, numIterations, numBatchEvaluations, climbingImage;
+    bool useClimbingImage, evaluated, converged;
+    std::vector<std::vector<double> > x, v, pathForces;
+    std::vector<std::vector<float> > positions, forces;
+    std::vector<double> energies;
+    double timeStep, mixing;
+    int numStepsSinceReset;
+};
+
+} // namespace ANIPlugin
+
+#endif /*OPENMM_ANI_REACTION_PATH_H_*/
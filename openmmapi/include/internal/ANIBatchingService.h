@@ -0,0 +1,110 @@
+#ifndef OPENMM_ANI_BATCHING_SERVICE_H_
+#define OPENMM_ANI_BATCHING_SERVICE_H_
+
+/* -------------------------------------------------------------------------- *
+ * The MIT License
+ *
+ * SPDX short identifier: MIT
+ *
+ * Copyright 2019 Genentech Inc. South San Francisco
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ * -------------------------------------------------------------------------- */
+
+
+#include "ANIEngine.h"
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace ANIPlugin {
+
+/**
+ * Lets several Contexts in one process share an ANIEngine.  Each caller
+ * submits one structure and blocks until it has been evaluated.  Requests
+ * that are pending at the same time, for example from replicas of a replica
+ * exchange simulation that are stepped on different threads, are combined
+ * into a single batch, so the engine can spread them over its threads.
+ *
+ * There is no dispatcher thread: the first caller that finds the engine idle
+ * evaluates everything that is pending, while the other callers wait for it.
+ * Before starting, it waits up to the maximum wait of the pending requests for
+ * more to arrive, unless every client already has a request pending.
+ */
+class OPENMM_EXPORT_NN ANIBatchingService {
+public:
+    /**
+     * Get the service for a model and engine, creating it if no client is
+     * using one yet.  The service is deleted when the last reference is released.
+     *
+     * @param aniInfoFile   the path to the file containing ani info
+     * @param engineName    the engine to create (see ANIEngine::create())
+     */
+    static std::shared_ptr<ANIBatchingService> get(const std::string& aniInfoFile, const std::string& engineName);
+    /**
+     * Create a service.  It takes ownership of the engine.
+     */
+    ANIBatchingService(ANIEngine* engine);
+    ~ANIBatchingService();
+    /**
+     * Register a client that submits requests.  When all clients have a
+     * request pending, a batch is started without waiting any longer.
+     */
+    void addClient();
+    /**
+     * Unregister a client added with addClient().
+     */
+    void removeClient();
+    /**
+     * Evaluate a structure as part of the next batch.  This blocks until the
+     * results have been stored in eval.  If evaluating it throws an exception,
+     * the exception is rethrown to this caller only.
+     *
+     * @param eval      the structure to evaluate
+     * @param maxWait   the longest time in seconds to wait for requests from
+     *                  other clients before the batch is evaluated
+     */
+    void evaluate(ANIEvaluation& eval, double maxWait);
+    /**
+     * Get the number of batches evaluated so far.
+     */
+    int getNumBatches() const;
+    /**
+     * Get the number of structures evaluated so far.
+     */
+    long long getNumEvaluations() const;
+private:
+    struct Request;
+    void evaluatePending(std::unique_lock<std::mutex>& lock);
+    ANIEngine* engine;
+    mutable std::mutex lock;
+    std::condition_variable condition;
+    std::vector<Request*> pending, running;
+    std::vector<ANIEvaluation> batch;
+    bool busy;
+    int numClients, numBatches;
+    long long numEvaluations;
+};
+
+} // namespace ANIPlugin
+
+#endif /*OPENMM_ANI_BATCHING_SERVICE_H_*/
@@ -0,0 +1,146 @@
+#ifndef OPENMM_ANI_DOMAIN_DECOMPOSITION_H_
+#define OPENMM_ANI_DOMAIN_DECOMPOSITION_H_
+
+/* -------------------------------------------------------------------------- *
+ * The MIT License
+ *
+ * SPDX short identifier: MIT
+ *
+ * Copyright 2019 Genentech Inc. South San Francisco
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ * -------------------------------------------------------------------------- */
+
+
+#include "ANIEngine.h"
+#include "internal/ANIModel.h"
+#include "internal/ANIModelInfo.h"
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <sys/types.h>
+#include <thread>
+#include <vector>
+
+namespace ANIPlugin {
+
+/**
+ * An ANIEngine for very large systems that splits every structure into a grid
+ * of spatial domains and evaluates each domain in its own worker process on
+ * the same node.  A worker sees the atoms of its domain and a halo of all atoms
+ * within the AEV cutoff of them, and evaluates it with a CpuANIEngine.  Each
+ * worker is bound to its own share of the cores, so the workers can be spread
+ * over several sockets with their memory local to them.
+ *
+ * The workers are forked when the engine is created and communicate through a
+ * shared memory mapping: the calling process writes the positions, every
+ * worker selects its own domain and halo from them, and returns its
+ * contributions to the energy and forces in fixed point (see
+ * CpuANIEngine::computeDomain()).  Adding them up gives bitwise the same
+ * energy, forces and virial as evaluating the structure in one process.
+ *
+ * The workers are killed when the calling process exits.  If a worker dies,
+ * the engine cannot be used any more, and every later evaluation throws an
+ * exception.
+ */
+class OPENMM_EXPORT_NN ANIDomainDecomposition : public ANIEngine {
+public:
+    /**
+     * Create the engine and start its worker processes.
+     *
+     * @param model                the model to evaluate
+     * @param numWorkers           the number of worker processes, which is also the number of domains
+     * @param maxAtoms             the largest number of atoms in a structure that will be evaluated
+     * @param threadsPerWorker     the number of threads of each worker, or 0 to divide the
+     *                             available cores evenly between the workers
+     * @param useFastActivations   whether to use faster, slightly less precise activation functions
+     */
+    ANIDomainDecomposition(const ANIModel& model, int numWorkers, int maxAtoms, int threadsPerWorker=0, bool useFastActivations=false);
+    /**
+     * Stop the worker processes.
+     */
+    ~ANIDomainDecomposition();
+    /**
+     * Evaluate the structures one after another, each one split over all workers.
+     * ANIEvaluation::ensembleEnergies is not supported.
+     */
+    void computeBatch(std::vector<ANIEvaluation>& batch);
+    /**
+     * Get the number of worker processes.
+     */
+    int getNumWorkers() const {
+        return numWorkers;
+    }
+    /**
+     * Get the process IDs of the workers.
+     */
+    const std::vector<pid_t>& getWorkerProcesses() const {
+        return workers;
+    }
+    /**
+     * Choose how many domains to place along each axis of a box with the given
+     * extent, so that the domains have the smallest surface.
+     */
+    static void chooseGrid(int numDomains, const double* extent, int* grid);
+    /**
+     * Find the atoms of one domain and its halo.  All domains together contain
+     * each atom exactly once.  The halo holds every atom that is within the
+     * cutoff of an atom of the domain, and possibly a few more.
+     *
+     * @param numAtoms     the number of atoms in the structure
+     * @param positions    3*numAtoms coordinates
+     * @param cell         the periodic cell (row major) or NULL
+     * @param numDomains   the number of domains
+     * @param domain       the index of the domain to find
+     * @param cutoff       the AEV cutoff
+     * @param atoms        on exit, the indices of the atoms of the domain and its halo, in increasing order
+     * @param isHalo       on exit, whether each element of atoms belongs to the halo
+     */
+    static void findDomain(int numAtoms, const float* positions, const float* cell, int numDomains, int domain, float cutoff,
+                           std::vector<int>& atoms, std::vector<char>& isHalo);
+private:
+    struct SharedHeader;
+    struct WorkerResults;
+    void runLauncher(int numThreads, const std::vector<std::vector<int> >& cpus, bool useFastActivations);
+    void runWorker(int index, pid_t parent, int numThreads, const std::vector<int>& cpus, bool useFastActivations);
+    void waitForWorkers();
+    void stopWorkers();
+    void stopLauncher();
+    WorkerResults& getResults(int index);
+    int* getResultAtoms(int index);
+    long long* getResultGradient(int index);
+    ANIModel model;
+    int numWorkers, maxAtoms;
+    bool failed;
+    std::vector<pid_t> workers;
+    std::thread launcher;
+    std::mutex launcherMutex;
+    std::condition_variable launcherCondition;
+    bool launched, launcherStopped;
+    char* shared;
+    size_t sharedSize, resultsOffset, resultsSize;
+    SharedHeader* header;
+    float* sharedPositions;
+    char* sharedSymbols;
+    std::vector<long long> fixedGradient;
+};
+
+} // namespace ANIPlugin
+
+#endif /*OPENMM_ANI_DOMAIN_DECOMPOSITION_H_*/
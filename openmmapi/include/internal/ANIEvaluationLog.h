@@ -0,0 +1,158 @@
+#ifndef OPENMM_ANI_EVALUATION_LOG_H_
+#define OPENMM_ANI_EVALUATION_LOG_H_
+
+/* -------------------------------------------------------------------------- *
+ * The MIT License
+ *
+ * SPDX short identifier: MIT
+ *
+ * Copyright 2019 Genentech Inc. South San Francisco
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ * -------------------------------------------------------------------------- */
+
+
+#include "windowsExportANI.h"
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace ANIPlugin {
+
+/**
+ * Evaluation logs record the structures an ANIForce evaluated during a run,
+ * together with the results, so that a workload can be replayed later with any
+ * engine (see the ani-replay tool).  The file has the following layout (all
+ * values little endian):
+ *
+ *   header:     char[8] "ANIEVLOG", int32 version (1), int32 number of atoms,
+ *               int32 length and chars of the info file, int32 number of distinct
+ *               symbols, each as int32 length and chars, and uint8[atoms] the index
+ *               of every atom's symbol
+ *   per record: int64 number of the call, counting from 0, int32 flags (1: periodic,
+ *               2: forces), float32[9] cell (if flag 1), float32[3*atoms] positions,
+ *               float64 energy, float32[3*atoms] forces (if flag 2)
+ *
+ * Positions and the cell are in Angstrom, the energy in Hartree and forces in
+ * Hartree/Angstrom.
+ */
+struct ANILoggedEvaluation {
+    /** the number of the call that was recorded, counting from 0 */
+    long long call;
+    /** the 3x3 periodic cell (row major), or empty for a non periodic structure */
+    std::vector<float> cell;
+    /** 3*numAtoms coordinates */
+    std::vector<float> positions;
+    /** the energy that was computed */
+    double energy;
+    /** the forces that were computed, or empty if they were not */
+    std::vector<float> forces;
+};
+
+/**
+ * Writes an evaluation log.  Only every interval'th call is recorded, and
+ * recording stops before the file would grow beyond a size limit.  Every
+ * record is flushed to the file, so the log is complete up to the last record
+ * even if the run is killed.
+ */
+class OPENMM_EXPORT_NN ANIEvaluationLogWriter {
+public:
+    /**
+     * Create a log file.  Only one writer in the process may write a file at
+     * a time; creating a second one throws an exception.
+     *
+     * @param fileName   the file to write
+     * @param infoFile   the info file of the model that is evaluated
+     * @param symbols    the symbols of the atoms
+     * @param interval   record every interval'th call, starting with the first
+     * @param maxBytes   the largest size the file may grow to
+     */
+    ANIEvaluationLogWriter(const std::string& fileName, const std::string& infoFile, const std::vector<std::string>& symbols,
+                           int interval, size_t maxBytes);
+    ~ANIEvaluationLogWriter();
+    /**
+     * Start a new call.  This returns whether it should be recorded, in which
+     * case record() must be called once its results are known.
+     */
+    bool startCall();
+    /**
+     * Record the call started last.
+     *
+     * @param positions   3*numAtoms coordinates
+     * @param cell        the periodic cell (row major) or NULL
+     * @param energy      the energy that was computed
+     * @param forces      the forces that were computed, or NULL
+     */
+    void record(const float* positions, const float* cell, double energy, const float* forces);
+    /**
+     * Get the number of calls that have been recorded.
+     */
+    long long getNumRecords() const {
+        return numRecords;
+    }
+private:
+    void writeBytes(const void* data, size_t size);
+    std::string fileName, canonicalPath;
+    FILE* file;
+    int numAtoms, interval;
+    size_t maxBytes, size;
+    long long numCalls, numRecords;
+};
+
+/**
+ * Reads an evaluation log written by ANIEvaluationLogWriter.
+ */
+class OPENMM_EXPORT_NN ANIEvaluationLogReader {
+public:
+    /**
+     * Open a log file and read its header.
+     */
+    ANIEvaluationLogReader(const std::string& fileName);
+    ~ANIEvaluationLogReader();
+    /**
+     * Get the info file of the model that was evaluated.
+     */
+    const std::string& getInfoFile() const {
+        return infoFile;
+    }
+    /**
+     * Get the symbols of the atoms.
+     */
+    const std::vector<std::string>& getSymbols() const {
+        return symbols;
+    }
+    /**
+     * Read the next record.
+     *
+     * @param evaluation   receives the record
+     * @return false if there are no more records
+     */
+    bool read(ANILoggedEvaluation& evaluation);
+private:
+    void readBytes(void* data, size_t size);
+    std::string readString();
+    std::string fileName;
+    FILE* file;
+    std::string infoFile;
+    std::vector<std::string> symbols;
+};
+
+} // namespace ANIPlugin
+
+#endif /*OPENMM_ANI_EVALUATION_LOG_H_*/
@@ -0,0 +1,167 @@
+#ifndef OPENMM_ANI_EVALUATION_SERVER_H_
+#define OPENMM_ANI_EVALUATION_SERVER_H_
+
+/* -------------------------------------------------------------------------- *
+ * The MIT License
+ *
+ * SPDX short identifier: MIT
+ *
+ * Copyright 2019 Genentech Inc. South San Francisco
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ * -------------------------------------------------------------------------- */
+
+
+#include "ANIEngine.h"
+#include "internal/ANIBatchingService.h"
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace ANIPlugin {
+
+/**
+ * A server that evaluates ANI models for other processes on the same node.
+ * Many simulations of small systems can then share one copy of each model
+ * and one pool of threads, instead of each loading the ensemble and
+ * evaluating its tiny structure on its own.
+ *
+ * Clients (see ANIEvaluationClient) connect to a Unix domain socket and name
+ * the info file of the model and the atoms of their structure.  Each client
+ * creates a shared memory segment for its positions and results and passes it
+ * to the server with the connection, so an evaluation only sends a few bytes
+ * through the socket.  Every connection is served by its own thread, and all
+ * connections using the same model submit their evaluations to one
+ * ANIBatchingService, which evaluates requests that are pending at the same
+ * time as a single batch.
+ *
+ * Models are loaded when the first client asks for them and kept until the
+ * server is deleted.  The socket is only accessible to the user running the
+ * server.
+ */
+class OPENMM_EXPORT_NN ANIEvaluationServer {
+public:
+    /**
+     * Create a server listening on a socket.  A socket left at that path by
+     * an earlier server is replaced; any other file is an error.
+     *
+     * @param socketPath   the path of the Unix domain socket
+     * @param engineName   the engine that evaluates the models (see ANIEngine::create())
+     */
+    ANIEvaluationServer(const std::string& socketPath, const std::string& engineName="CPU");
+    /**
+     * Stop the server if it is running, close all connections and remove the socket.
+     */
+    ~ANIEvaluationServer();
+    /**
+     * Serve clients on the calling thread until stop() is called.
+     */
+    void run();
+    /**
+     * Serve clients on a background thread.
+     */
+    void start();
+    /**
+     * Make run() return, or stop the background thread started by start().
+     * This may be called from a signal handler.
+     */
+    void stop();
+    /**
+     * Get the path of the socket.
+     */
+    const std::string& getSocketPath() const {
+        return socketPath;
+    }
+    /**
+     * Get the number of clients that are connected.
+     */
+    int getNumClients() const;
+    /**
+     * Get the number of models that have been loaded.
+     */
+    int getNumModels() const;
+    /**
+     * Get the number of batches evaluated so far, over all models.
+     */
+    long long getNumBatches() const;
+    /**
+     * Get the number of structures evaluated so far, over all models.
+     */
+    long long getNumEvaluations() const;
+private:
+    struct Session;
+    void serveClient(Session* session);
+    void closeSessions();
+    std::shared_ptr<ANIBatchingService> getService(const std::string& infoFile, std::vector<std::string>& species);
+    std::string socketPath, engineName;
+    int listenSocket, wakePipe[2];
+    std::thread background;
+    mutable std::mutex lock;
+    std::map<std::string, std::shared_ptr<ANIBatchingService> > services;
+    std::map<std::string, std::vector<std::string> > modelSpecies;
+    std::vector<Session*> sessions;
+    std::atomic<int> numClients;
+};
+
+/**
+ * An ANIEngine that evaluates structures on an ANIEvaluationServer.  A client
+ * is created for one structure: every evaluation must have the atoms given to
+ * the constructor.  Requests from clients that are pending at the same time
+ * are evaluated as one batch by the server.
+ */
+class OPENMM_EXPORT_NN ANIEvaluationClient : public ANIEngine {
+public:
+    /**
+     * Connect to a server.
+     *
+     * @param socketPath   the path of the server's socket
+     * @param infoFile     the info file of the model to evaluate, as a path the server can open
+     * @param symbols      the symbols of the atoms
+     * @param maxWait      the longest time in seconds the server waits for requests from
+     *                     other clients before evaluating a batch
+     *                     (see ANIBatchingService::evaluate())
+     */
+    ANIEvaluationClient(const std::string& socketPath, const std::string& infoFile, const std::vector<std::string>& symbols,
+                        double maxWait=0.0);
+    /**
+     * Disconnect from the server.
+     */
+    ~ANIEvaluationClient();
+    /**
+     * Evaluate the structures one after another on the server.
+     * ANIEvaluation::ensembleEnergies is not supported.
+     */
+    void computeBatch(std::vector<ANIEvaluation>& batch);
+private:
+    struct Shared;
+    void exchange(int command);
+    std::vector<std::string> symbols;
+    double maxWait;
+    int socket;
+    Shared* shared;
+    size_t sharedSize;
+};
+
+} // namespace ANIPlugin
+
+#endif /*OPENMM_ANI_EVALUATION_SERVER_H_*/
@@ -67,14 +67,23 @@ public:
     double calcForcesAndEnergy(OpenMM::ContextImpl& context, bool includeForces, bool includeEnergy, int groups);
 
     std::map<std::string, double> getDefaultParameters() {
-        return std::map<std::string, double>(); // This force field doesn't define any parameters.
+        // Only an alchemical force defines a parameter: the mixing of its states.
+        std::map<std::string, double> parameters;
+        if (!owner.getAlchemicalSymbols().empty())
+            parameters[owner.getAlchemicalParameter()] = 0.0;
+        return parameters;
     }
 
     std::vector<std::string> getKernelNames();
 
+    void computeVirial(OpenMM::ContextImpl& context, std::vector<OpenMM::Vec3>& virial);
+
+    void updateParametersInContext(OpenMM::ContextImpl& context);
+
+    double getPeakMemory(OpenMM::ContextImpl& context);
+
 
 private:
-    static string compileError(string varName, string fileName);
     const ANIForce& owner;
     OpenMM::Kernel kernel;
 };
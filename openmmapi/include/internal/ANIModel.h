@@ -0,0 +1,114 @@
+#ifndef OPENMM_ANI_MODEL_H_
+#define OPENMM_ANI_MODEL_H_
+
+/* -------------------------------------------------------------------------- *
+ * The MIT License
+ *
+ * SPDX short identifier: MIT
+ *
+ * Copyright 2019 Genentech Inc. South San Francisco
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ * -------------------------------------------------------------------------- */
+
+
+#include "internal/ANIModelInfo.h"
+#include "windowsExportANI.h"
+#include <string>
+#include <vector>
+
+namespace ANIPlugin {
+
+/**
+ * The parameters of an ANI ensemble read from the NeuroChem model files: the AEV
+ * hyperparameters from the .params file, the atomic self energies and for every
+ * ensemble member one network per species (trainN/networks/ANN-X.nnf).
+ */
+class OPENMM_EXPORT_NN ANIModel {
+public:
+    /**
+     * Activation functions, numbered as in NeuroChem.
+     */
+    enum Activation {
+        Gaussian = 5,
+        Linear = 6,
+        CELU = 9
+    };
+    /**
+     * A fully connected layer.  weights holds outputSize rows of inputSize values.
+     */
+    struct Layer {
+        int inputSize, outputSize;
+        Activation activation;
+        std::vector<float> weights, biases;
+    };
+    typedef std::vector<Layer> Network;
+
+    /**
+     * Load all files of the model described by an ANI info file.
+     */
+    static ANIModel load(const ANIModelInfo& info);
+    /**
+     * Read the AEV hyperparameters from a NeuroChem .params file.
+     */
+    void readParameters(const std::string& paramFile);
+    /**
+     * Read the atomic self energies from a NeuroChem linear fit (.dat) file.
+     */
+    void readSelfEnergies(const std::string& atomFitFile);
+    /**
+     * Read one network from a NeuroChem .nnf file and the weight files it refers to.
+     */
+    static Network readNetwork(const std::string& nnfFile);
+
+    /**
+     * Get the index of a species in the AEV layout, or -1 if the model does not know it.
+     */
+    int getSpeciesIndex(const std::string& symbol) const;
+    int getNumSpecies() const {
+        return species.size();
+    }
+    int getNumSpeciesPairs() const {
+        return species.size()*(species.size()+1)/2;
+    }
+    int getRadialSubLength() const {
+        return etaR.size()*shfR.size();
+    }
+    int getAngularSubLength() const {
+        return etaA.size()*zeta.size()*shfA.size()*shfZ.size();
+    }
+    int getAEVLength() const {
+        return getNumSpecies()*getRadialSubLength() + getNumSpeciesPairs()*getAngularSubLength();
+    }
+    int getNumEnsembles() const {
+        return networks.size();
+    }
+
+    float radialCutoff, angularCutoff;
+    std::vector<float> etaR, shfR, etaA, zeta, shfA, shfZ;
+    std::vector<std::string> species;
+    /** self energy (Hartree) of every species */
+    std::vector<double> selfEnergies;
+    /** networks[e][s] is the network of species s in ensemble member e */
+    std::vector<std::vector<Network> > networks;
+};
+
+} // namespace ANIPlugin
+
+#endif /*OPENMM_ANI_MODEL_H_*/
@@ -0,0 +1,55 @@
+#ifndef OPENMM_ANI_MODEL_INFO_H_
+#define OPENMM_ANI_MODEL_INFO_H_
+
+/* -------------------------------------------------------------------------- *
+ * The MIT License
+ *
+ * SPDX short identifier: MIT
+ *
+ * Copyright 2019 Genentech Inc. South San Francisco
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ * -------------------------------------------------------------------------- */
+
+
+#include "windowsExportANI.h"
+#include <string>
+
+namespace ANIPlugin {
+
+/**
+ * The content of an ANI info file.  The file has one entry per line:
+ * the network directory, the name of the .params file, the name of the
+ * atomic self energy fit file and the number of networks in the ensemble.
+ */
+struct OPENMM_EXPORT_NN ANIModelInfo {
+    std::string netWorkDir;
+    std::string paramFile;
+    std::string atomFitFile;
+    int nEnsembles;
+
+    /**
+     * Read an ANI info file.  An OpenMMException is thrown if a line is missing.
+     */
+    static ANIModelInfo read(const std::string& infoFile);
+};
+
+} // namespace ANIPlugin
+
+#endif /*OPENMM_ANI_MODEL_INFO_H_*/
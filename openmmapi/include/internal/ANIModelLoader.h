@@ -0,0 +1,80 @@
+#ifndef OPENMM_ANI_MODEL_LOADER_H_
+#define OPENMM_ANI_MODEL_LOADER_H_
+
+/* -------------------------------------------------------------------------- *
+ * The MIT License
+ *
+ * SPDX short identifier: MIT
+ *
+ * Copyright 2019 Genentech Inc. South San Francisco
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ * -------------------------------------------------------------------------- */
+
+#include "internal/ANIModel.h"
+#include "windowsExportANI.h"
+#include <memory>
+#include <string>
+
+namespace ANIPlugin {
+
+/**
+ * Loads models on background threads, so that reading and parsing the model
+ * files overlaps with whatever the process does before it needs them.
+ * ANIForce starts loading its model when it is created, and the kernels that
+ * evaluate it take the finished model when a Context is created, waiting only
+ * for the part of the load that has not completed yet.
+ *
+ * An ANIForce holds on to its model, so every Context created for it shares
+ * the one loaded model, and the model is released when the last ANIForce using
+ * it is deleted.  A model preloaded without a holder is handed out once.
+ * Requests for a file nobody holds load it again, so changes to the files are
+ * picked up by new Contexts.
+ */
+class OPENMM_EXPORT_NN ANIModelLoader {
+public:
+    /**
+     * Start loading the model described by an ANI info file on a background
+     * thread.  This does nothing if a load of the file is already pending.
+     * Errors are reported by get().
+     */
+    static void preload(const std::string& aniInfoFile);
+    /**
+     * Start loading a model like preload(), and keep it for as long as the
+     * returned handle or any copy of it exists.  Until then get() returns the
+     * same model every time.
+     */
+    static std::shared_ptr<void> hold(const std::string& aniInfoFile);
+    /**
+     * Get the model described by an ANI info file.  If a load was started with
+     * preload() or hold(), this waits for it to finish and rethrows any
+     * exception it threw.  Otherwise the model is loaded on the calling thread.
+     */
+    static std::shared_ptr<const ANIModel> get(const std::string& aniInfoFile);
+    /**
+     * Drop a loaded or pending model that is not going to be used, for example
+     * because the platform loads the model in its own way.  This does not wait
+     * for a pending load.  A later call to get() loads the model again.
+     */
+    static void discard(const std::string& aniInfoFile);
+};
+
+} // namespace ANIPlugin
+
+#endif /*OPENMM_ANI_MODEL_LOADER_H_*/
@@ -0,0 +1,120 @@
+#ifndef OPENMM_ANI_TRAJECTORY_READER_H_
+#define OPENMM_ANI_TRAJECTORY_READER_H_
+
+/* -------------------------------------------------------------------------- *
+ * The MIT License
+ *
+ * SPDX short identifier: MIT
+ *
+ * Copyright 2019 Genentech Inc. South San Francisco
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ * -------------------------------------------------------------------------- */
+
+
+#include "windowsExportANI.h"
+#include <string>
+#include <vector>
+
+namespace ANIPlugin {
+
+/**
+ * Reads the frames of a DCD or XYZ trajectory one after another from a memory
+ * mapping of the file, so trajectories larger than the available memory can
+ * be processed.  The kernel reads the file ahead because it is accessed
+ * sequentially, and the pages of frames that have been read are released again.
+ *
+ * DCD files are read as written by OpenMM, CHARMM and NAMD (little endian,
+ * 32 bit record markers, no fixed atoms).  The unit cell, if present, is
+ * converted to reduced box vectors.  XYZ files may contain any number of
+ * frames.  A periodic cell is read from the comment line of extended XYZ
+ * files (Lattice="ax ay az bx by bz cx cy cz").  Positions are in Angstrom.
+ */
+class OPENMM_EXPORT_NN ANITrajectoryReader {
+public:
+    /**
+     * Open a trajectory.
+     *
+     * @param fileName   the file to read
+     * @param format     "dcd" or "xyz", or an empty string to choose by the file extension
+     */
+    ANITrajectoryReader(const std::string& fileName, const std::string& format="");
+    ~ANITrajectoryReader();
+    /**
+     * Get the number of atoms in each frame.
+     */
+    int getNumAtoms() const {
+        return numAtoms;
+    }
+    /**
+     * Get the atom symbols stored in the trajectory.  DCD files do not store
+     * them, so this is empty for them.
+     */
+    const std::vector<std::string>& getSymbols() const {
+        return symbols;
+    }
+    /**
+     * Get whether the frames have a periodic cell.
+     */
+    bool hasCell() const {
+        return periodic;
+    }
+    /**
+     * Get the number of frames that have been read so far.
+     */
+    long long getNumFramesRead() const {
+        return numFramesRead;
+    }
+    /**
+     * Read the next frame.
+     *
+     * @param positions   receives 3*numAtoms coordinates
+     * @param cell        receives the 3x3 cell (row major) if hasCell() is true.  May be NULL.
+     * @return false if there are no more frames
+     */
+    bool readFrame(float* positions, float* cell);
+    /**
+     * Read the next structure of an XYZ file whose structures may differ in
+     * their atoms, as in a data set of molecules.  getNumAtoms() and
+     * getSymbols() only describe the first structure of such files.
+     *
+     * @param symbols     receives the symbols of the atoms
+     * @param positions   receives 3*numAtoms coordinates
+     * @param cell        receives the 3x3 cell (row major), or is cleared if the
+     *                    structure has no lattice
+     * @return false if there are no more structures
+     */
+    bool readStructure(std::vector<std::string>& symbols, std::vector<float>& positions, std::vector<float>& cell);
+private:
+    void readDcdHeader();
+    bool readDcdFrame(float* positions, float* cell);
+    bool readXyzFrame(float* positions, float* cell, std::vector<std::string>* frameSymbols, std::vector<float>* framePositions=NULL);
+    void releaseReadPages();
+    std::string fileName;
+    bool isDcd, periodic;
+    int fileDescriptor, numAtoms;
+    const char* data;
+    size_t size, offset, released;
+    long long numFramesRead;
+    std::vector<std::string> symbols;
+};
+
+} // namespace ANIPlugin
+
+#endif /*OPENMM_ANI_TRAJECTORY_READER_H_*/
@@ -0,0 +1,113 @@
+#ifndef OPENMM_CPU_ANI_ALCHEMY_H_
+#define OPENMM_CPU_ANI_ALCHEMY_H_
+
+/* -------------------------------------------------------------------------- *
+ * The MIT License
+ *
+ * SPDX short identifier: MIT
+ *
+ * Copyright 2019 Genentech Inc. South San Francisco
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ * -------------------------------------------------------------------------- */
+
+#include "internal/CpuANIEngine.h"
+#include <string>
+#include <vector>
+
+namespace ANIPlugin {
+
+/**
+ * Evaluates both end states of an alchemical transformation, such as ligand A
+ * turning into ligand B in a relative free energy calculation, for the price
+ * of little more than one of them.
+ *
+ * The two states share the positions of all atoms but give some of them
+ * different symbols, or no symbol at all for atoms that only exist in one
+ * state.  Only the atoms within the cutoff of such a changed atom have
+ * different AEVs in the two states.  Every other atom is evaluated once,
+ * as a domain (see CpuANIEngine::computeDomain()) of the atoms both states
+ * have in common, and only the affected atoms are evaluated once per state.
+ * All contributions are summed in fixed point, so the energy of each state is
+ * bitwise the same as evaluating it on its own, and the difference between
+ * the states contains no rounding error from the shared atoms.
+ */
+class OPENMM_EXPORT_NN CpuANIAlchemy {
+public:
+    /**
+     * Create a CpuANIAlchemy.
+     *
+     * @param engine     the engine to evaluate the states with.  It must outlive this object.
+     * @param symbolsA   the symbols of the atoms in state A, or empty strings for
+     *                   atoms that do not exist in that state
+     * @param symbolsB   the symbols of the atoms in state B, in the same way
+     */
+    CpuANIAlchemy(CpuANIEngine& engine, const std::vector<std::string>& symbolsA, const std::vector<std::string>& symbolsB);
+    /**
+     * Compute the energies of both states and the forces and virial of the
+     * mixed potential (1-lambda)*E_A + lambda*E_B.  Its derivative with respect
+     * to lambda is energyB-energyA.
+     *
+     * @param positions   3*numAtoms coordinates in Angstrom, for the atoms of both states
+     * @param cell        the periodic cell (row major) or NULL
+     * @param lambda      the mixing parameter
+     * @param energyA     receives the energy of state A in Hartree
+     * @param energyB     receives the energy of state B in Hartree
+     * @param forces      receives 3*numAtoms mixed forces in Hartree/Angstrom, or NULL
+     * @param virial      receives the mixed virial in Hartree, or NULL
+     */
+    void compute(const float* positions, const float* cell, double lambda, double& energyA, double& energyB, float* forces, double* virial);
+    /**
+     * Get the number of atoms that were evaluated separately for each state by
+     * the last call to compute().
+     */
+    int getNumAffectedAtoms() const {
+        return numAffected;
+    }
+private:
+    /**
+     * One evaluation: a subset of the atoms, some of which are only neighbors.
+     */
+    struct Part {
+        std::vector<int> atoms;
+        std::vector<std::string> symbols;
+        std::vector<float> positions;
+        std::vector<char> isHalo;
+        std::vector<long long> gradient;
+        CpuANIDomain domain;
+        bool hasDomainAtoms;
+    };
+    void findDistances(const float* positions, const float* cell);
+    void selectAffected(const std::vector<std::string>& symbols, Part& part);
+    void evaluate(Part& part, const float* positions, const float* cell, bool computeGradient, bool computeVirial);
+    CpuANIEngine& engine;
+    std::vector<std::string> symbolsA, symbolsB;
+    std::vector<int> changedAtoms;
+    std::vector<float> distance;
+    std::vector<long long> fixedGradientA, fixedGradientB;
+    float cutoff;
+    bool filterHalo;
+    double selfEnergyA, selfEnergyB;
+    int numAffected;
+    Part shared, partA, partB;
+};
+
+} // namespace ANIPlugin
+
+#endif /*OPENMM_CPU_ANI_ALCHEMY_H_*/
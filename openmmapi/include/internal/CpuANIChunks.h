@@ -0,0 +1,103 @@
+#ifndef OPENMM_CPU_ANI_CHUNKS_H_
+#define OPENMM_CPU_ANI_CHUNKS_H_
+
+/* -------------------------------------------------------------------------- *
+ * The MIT License
+ *
+ * SPDX short identifier: MIT
+ *
+ * Copyright 2019 Genentech Inc. South San Francisco
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ * -------------------------------------------------------------------------- */
+
+#include "internal/CpuANIEngine.h"
+#include <string>
+#include <vector>
+
+namespace ANIPlugin {
+
+/**
+ * Evaluates a large structure within a limit on the engine's scratch memory.
+ *
+ * The structure is sorted into a grid of bins at least one cutoff wide, and
+ * the grid is divided into blocks, or chunks, that are evaluated one after
+ * another as domains (see CpuANIEngine::computeDomain()).  The halo of a chunk
+ * holds the atoms in the bins adjacent to it, which includes every atom within
+ * the cutoff of it.  The contributions of the chunks are added in fixed point,
+ * so the results are bitwise the same as evaluating the whole structure.
+ *
+ * Before each evaluation the grid is divided into as few chunks as keep the
+ * estimated memory (see CpuANIEngine::estimateMemoryUsage()) of the largest
+ * chunk and its halo within the limit.  Chunks cannot be smaller than a bin,
+ * so compute() throws an exception if even the smallest ones exceed it.
+ */
+class OPENMM_EXPORT_NN CpuANIChunks {
+public:
+    /**
+     * Create a CpuANIChunks.
+     *
+     * @param engine      the engine to evaluate the structure with.  It must outlive this object.
+     * @param symbols     the symbols of the atoms
+     * @param maxMemory   the limit on scratch memory, in bytes
+     */
+    CpuANIChunks(CpuANIEngine& engine, const std::vector<std::string>& symbols, size_t maxMemory);
+    /**
+     * Evaluate the structure, exactly like CpuANIEngine::computeBatch() with a
+     * single structure.  Only the positions, cell, forces and virial of eval
+     * are used.
+     */
+    void compute(ANIEvaluation& eval);
+    /**
+     * Get the number of chunks the last call to compute() evaluated.
+     */
+    int getNumChunks() const {
+        return numChunks;
+    }
+    /**
+     * Get the most memory, in bytes, that the engine and this object have held
+     * at the end of any call to compute().
+     */
+    size_t getPeakMemory() const {
+        return peakMemory;
+    }
+private:
+    void assignBins(const float* positions, const float* cell);
+    void getChunkBins(int axis, int chunk, int numChunksOnAxis, int& first, int& last, std::vector<int>& bins) const;
+    int getMaxChunkAtoms(const int* numChunksPerAxis);
+    size_t getOwnMemoryUsage() const;
+    CpuANIEngine& engine;
+    std::vector<std::string> symbols;
+    size_t maxMemory, peakMemory;
+    float cutoff;
+    double selfEnergy, volume;
+    int numChunks;
+    bool periodic;
+    int numBins[3];
+    std::vector<int> atomBin, binStart, binNext, binAtoms, axisBins[3];
+    std::vector<int> chunkAtoms;
+    std::vector<std::string> chunkSymbols;
+    std::vector<float> chunkPositions;
+    std::vector<char> isHalo;
+    std::vector<long long> chunkGradient, fixedGradient;
+};
+
+} // namespace ANIPlugin
+
+#endif /*OPENMM_CPU_ANI_CHUNKS_H_*/
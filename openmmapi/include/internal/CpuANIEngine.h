@@ -0,0 +1,217 @@
+#ifndef OPENMM_CPU_ANI_ENGINE_H_
+#define OPENMM_CPU_ANI_ENGINE_H_
+
+/* -------------------------------------------------------------------------- *
+ * The MIT License
+ *
+ * SPDX short identifier: MIT
+ *
+ * Copyright 2019 Genentech Inc. South San Francisco
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ * -------------------------------------------------------------------------- */
+
+
+#include "ANIEngine.h"
+#include "internal/ANIModel.h"
+#include "internal/ANIModelInfo.h"
+#include <string>
+#include <vector>
+
+namespace OpenMM {
+    class ThreadPool;
+}
+
+namespace ANIPlugin {
+
+class CpuANIComputation;
+struct CpuANIWorkspace;
+
+/**
+ * Describes one spatial domain of a larger structure for
+ * CpuANIEngine::computeDomain(), and receives the domain's contributions to the
+ * energy, forces and virial in 32.32 fixed point.
+ */
+struct CpuANIDomain {
+    CpuANIDomain() : isHalo(NULL), computeVirial(false), fixedEnergy(0), fixedGradient(NULL) {
+    }
+    /** for every atom of the evaluation, whether it belongs to the halo */
+    const char* isHalo;
+    /** whether to compute fixedVirial */
+    bool computeVirial;
+    /** receives the network energy of the domain's atoms, without their self energies */
+    long long fixedEnergy;
+    /** receives 3*numAtoms gradients of that energy, or NULL if they are not needed */
+    long long* fixedGradient;
+    /** receives the virial of that energy */
+    long long fixedVirial[9];
+};
+
+/**
+ * An ANIEngine that evaluates the networks natively on the CPU, without
+ * NeuroChem.  Structures of a batch are distributed over a pool of threads,
+ * or when there are fewer structures than threads, all threads work on each
+ * structure together.  Forces are accumulated in fixed point, so the results
+ * do not depend on the number of threads.
+ *
+ * The AEV and network code is compiled for the layouts of the published
+ * models (H,C,N,O with 16 radial, 4 angular distance and 8 angle shifts, and
+ * H,C,N,O,S,F,Cl with 16, 8 and 4) so all loop bounds and AEV offsets are
+ * constants.  Models with any other layout use a generic version.
+ *
+ * The engine can also compute the virial of each structure (see
+ * ANIEvaluation::virial) from the same gradients as the forces, and the
+ * energies of the individual ensemble members (see
+ * ANIEvaluation::ensembleEnergies), whose spread estimates the model's
+ * uncertainty.
+ */
+class OPENMM_EXPORT_NN CpuANIEngine : public ANIEngine {
+public:
+    /**
+     * Create a CpuANIEngine.
+     *
+     * @param info                   describes the model files
+     * @param numThreads             the number of threads to use, or 0 to use one per core
+     * @param useSpecializedLayouts  if false, always use the generic layout (for testing)
+     * @param useFastActivations     if true, evaluate the activation functions with a lower
+     *                               precision exp() (relative error 3.6e-6 instead of 8.3e-8)
+     * @param useFusedAEVs           if true, compute the AEVs of each tile of atoms right before
+     *                               its networks run instead of storing the AEVs and their
+     *                               gradients for the whole structure.  The results are identical.
+     * @param useSplineTables        if true, look up the radial terms of the AEVs, the cutoff
+     *                               functions and their derivatives in cubic spline tables built
+     *                               when the engine is created, instead of computing exponentials
+     *                               and cosines for every pair and triple (relative error about 1e-6)
+     */
+    CpuANIEngine(const ANIModelInfo& info, int numThreads=0, bool useSpecializedLayouts=true, bool useFastActivations=false,
+                 bool useFusedAEVs=false, bool useSplineTables=false);
+    /**
+     * Create a CpuANIEngine for a model that has already been loaded, for
+     * example by ANIModelLoader.  The other parameters are as above.
+     */
+    CpuANIEngine(const ANIModel& model, int numThreads=0, bool useSpecializedLayouts=true, bool useFastActivations=false,
+                 bool useFusedAEVs=false, bool useSplineTables=false);
+    ~CpuANIEngine();
+    void computeBatch(std::vector<ANIEvaluation>& batch);
+    /**
+     * Get the model this engine evaluates.
+     */
+    const ANIModel& getModel() const {
+        return model;
+    }
+    /**
+     * Switch to a different model, for example one with a different ensemble
+     * size or training set.  The threads and their scratch memory are kept, so
+     * this is much cheaper than creating a new engine.  Call reserve() again
+     * if the engine should not allocate memory on the next evaluation.
+     */
+    void setModel(const ANIModel& model);
+    /**
+     * Get whether the model's layout has a specialized implementation.
+     */
+    bool isSpecialized() const;
+    /**
+     * Check that a structure can be evaluated by this engine.  An exception is
+     * thrown if it contains unknown elements or its periodic cell is too small.
+     */
+    void checkStructure(const ANIEvaluation& eval) const;
+    /**
+     * Size the scratch memory of every thread for structures with the given
+     * number of atoms, so that evaluating them does not allocate memory.
+     */
+    void reserve(int numAtoms);
+    /**
+     * Let the engine reuse its neighbor lists when a periodic structure is
+     * evaluated again after being scaled uniformly together with its cell, as
+     * a Monte Carlo barostat does for trial volume changes when every atom is
+     * its own molecule.  The cached pair distances are then scaled instead of
+     * searching for pairs again.
+     *
+     * @param margin   how far the structure may shrink (as a fraction of its size)
+     *                 before the lists must be rebuilt.  Larger margins make each
+     *                 full rebuild more expensive.  0 disables reuse.
+     */
+    void setScalingMargin(float margin);
+    /**
+     * Set the size from which structures are processed in spatial order.  The
+     * atoms of large structures are visited along a Morton (Z-order) curve
+     * through the cell or bounding box, so atoms processed together share
+     * their neighbors and the memory they touch stays in cache.  The order
+     * only affects speed: the results are bitwise identical.  The default is
+     * 2048 atoms.
+     */
+    void setSortingThreshold(int numAtoms);
+    /**
+     * Get the number of bytes of scratch memory the engine holds: the buffers
+     * and neighbor lists of all its threads.  They are kept for the next
+     * evaluation, so this is the most any evaluation so far has needed.
+     */
+    size_t getMemoryUsage() const;
+    /**
+     * Estimate how many bytes of scratch memory evaluating a structure with
+     * computeBatch() or computeDomain() takes.
+     *
+     * @param numAtoms           the number of atoms, including any halo
+     * @param neighborsPerAtom   the average number of atoms within the cutoff of an atom
+     */
+    size_t estimateMemoryUsage(int numAtoms, double neighborsPerAtom) const;
+    /**
+     * Evaluate one spatial domain of a larger structure.  eval holds the atoms
+     * of the domain together with a halo of all other atoms within the cutoff
+     * of them, in the same relative order as in the full structure, and the
+     * cell of the full structure.  Only the domain's atoms contribute energy.
+     *
+     * Every contribution is computed exactly as when evaluating the full
+     * structure, and the results are returned in fixed point, so adding up
+     * the results of all domains gives bitwise the same energy, forces and
+     * virial as computeBatch().  The outputs of eval are not used.
+     */
+    void computeDomain(ANIEvaluation& eval, CpuANIDomain& domain);
+    /**
+     * Get the number of values in the AEV of one atom.
+     */
+    int getAEVLength() const;
+    /**
+     * Compute the atomic environment vectors of a batch of structures, as the
+     * networks see them, instead of their energies.  The AEV of every atom
+     * starts with one radial block per species, in the order of the species
+     * in the model's .params file, followed by one angular block per pair of
+     * species (s1,s2) with s1 <= s2, ordered by s1 and then s2.  Only the
+     * symbols, positions and cell of each evaluation are used.  Structures are
+     * distributed over the threads, one structure per thread at a time.
+     *
+     * @param batch   the structures
+     * @param aevs    for each structure, an array that receives numAtoms*getAEVLength()
+     *                values, one AEV per atom in atom order
+     */
+    void computeAEVs(std::vector<ANIEvaluation>& batch, const std::vector<float*>& aevs);
+private:
+    class BatchTask;
+    CpuANIComputation* createComputation() const;
+    ANIModel model;
+    CpuANIComputation* computation;
+    OpenMM::ThreadPool* threads;
+    std::vector<CpuANIWorkspace*> workspaces;
+    BatchTask* task;
+    bool useSpecializedLayouts, useFastActivations, useFusedAEVs, useSplineTables;
+};
+
+} // namespace ANIPlugin
+
+#endif /*OPENMM_CPU_ANI_ENGINE_H_*/
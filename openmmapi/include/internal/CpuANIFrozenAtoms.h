@@ -0,0 +1,113 @@
+#ifndef OPENMM_CPU_ANI_FROZEN_ATOMS_H_
+#define OPENMM_CPU_ANI_FROZEN_ATOMS_H_
+
+/* -------------------------------------------------------------------------- *
+ * The MIT License
+ *
+ * SPDX short identifier: MIT
+ *
+ * Copyright 2019 Genentech Inc. South San Francisco
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ * -------------------------------------------------------------------------- */
+
+#include "internal/CpuANIEngine.h"
+#include <string>
+#include <vector>
+
+namespace ANIPlugin {
+
+/**
+ * Evaluates a structure in which most atoms are frozen, such as a binding site
+ * inside a rigid protein, at a cost that grows with the mobile region rather
+ * than the whole structure.
+ *
+ * Only atoms within the cutoff of a mobile atom can have their AEVs change.
+ * The energy, gradient and virial of all other frozen atoms are computed once,
+ * as a domain (see CpuANIEngine::computeDomain()) of the frozen atoms, and
+ * cached.  Each evaluation then only computes the mobile atoms and the frozen
+ * atoms near them, and adds the cached contributions in fixed point, so the
+ * results are bitwise the same as evaluating the whole structure.
+ *
+ * The frozen atoms near the mobile ones are chosen with a margin, so the
+ * cache stays valid until a mobile atom has moved further than that.  It is
+ * also rebuilt whenever a frozen atom or the periodic cell changes.
+ */
+class OPENMM_EXPORT_NN CpuANIFrozenAtoms {
+public:
+    /**
+     * Create a CpuANIFrozenAtoms.
+     *
+     * @param engine     the engine to evaluate the structure with.  It must outlive this object.
+     * @param symbols    the symbols of the atoms
+     * @param isFrozen   for every atom, whether it never moves
+     */
+    CpuANIFrozenAtoms(CpuANIEngine& engine, const std::vector<std::string>& symbols, const std::vector<char>& isFrozen);
+    /**
+     * Evaluate the structure, exactly like CpuANIEngine::computeBatch() with a
+     * single structure.  Only the positions, cell, forces and virial of eval
+     * are used.
+     */
+    void compute(ANIEvaluation& eval);
+    /**
+     * Get the number of atoms, mobile or frozen, that are evaluated on every
+     * call to compute() with the current cache.
+     */
+    int getNumActiveAtoms() const {
+        return numActive;
+    }
+    /**
+     * Get how many times the cached contributions of the frozen atoms have
+     * been computed.
+     */
+    int getNumCacheBuilds() const {
+        return numCacheBuilds;
+    }
+private:
+    /**
+     * One evaluation: a subset of the atoms, some of which are only neighbors.
+     */
+    struct Part {
+        std::vector<int> atoms;
+        std::vector<std::string> symbols;
+        std::vector<float> positions;
+        std::vector<char> isHalo;
+        std::vector<long long> gradient;
+        CpuANIDomain domain;
+        bool hasDomainAtoms;
+    };
+    bool isCacheValid(const float* positions, const float* cell) const;
+    void buildCache(const float* positions, const float* cell);
+    void evaluate(Part& part, const float* positions, const float* cell, bool computeGradient, bool computeVirial);
+    CpuANIEngine& engine;
+    std::vector<std::string> symbols;
+    std::vector<char> isFrozen;
+    std::vector<int> mobileAtoms;
+    std::vector<float> distance, cachedPositions, cachedCell;
+    std::vector<long long> fixedGradient;
+    float cutoff;
+    double selfEnergy;
+    bool hasCache;
+    int numActive, numCacheBuilds;
+    Part frozen, active;
+};
+
+} // namespace ANIPlugin
+
+#endif /*OPENMM_CPU_ANI_FROZEN_ATOMS_H_*/
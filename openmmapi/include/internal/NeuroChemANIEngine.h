@@ -0,0 +1,85 @@
+#ifndef OPENMM_NEUROCHEM_ANI_ENGINE_H_
+#define OPENMM_NEUROCHEM_ANI_ENGINE_H_
+
+/* -------------------------------------------------------------------------- *
+ * The MIT License
+ *
+ * SPDX short identifier: MIT
+ *
+ * Copyright 2019 Genentech Inc. South San Francisco
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ * -------------------------------------------------------------------------- */
+
+
+#include "ANIEngine.h"
+#include "internal/ANIModelInfo.h"
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace ANIPlugin {
+
+/**
+ * An ANIEngine backed by libcppNeuroChem.  NeuroChem keeps its network and
+ * periodic cell in process wide state, so the structures of a batch are
+ * evaluated one after the other while holding a process wide lock.
+ *
+ * NeuroChem can only hold one ensemble at a time.  Every user of it in the
+ * process, including the CUDA kernel, registers the model it needs with
+ * acquireEnsemble() and releases it with releaseEnsemble(), so that users of
+ * the same model share the ensemble and a different model is refused while
+ * the current one is in use.
+ */
+class OPENMM_EXPORT_NN NeuroChemANIEngine : public ANIEngine {
+public:
+    NeuroChemANIEngine(const ANIModelInfo& info);
+    ~NeuroChemANIEngine();
+    void computeBatch(std::vector<ANIEvaluation>& batch);
+    /**
+     * Get the lock that must be held while calling into NeuroChem.
+     */
+    static std::mutex& getLock();
+    /**
+     * Load a model into NeuroChem, or share it if it is already loaded.  An
+     * exception is thrown if a different model is in use.  The caller must
+     * hold getLock().
+     */
+    static void acquireEnsemble(const ANIModelInfo& info);
+    /**
+     * Release a model acquired with acquireEnsemble().  NeuroChem is shut
+     * down when its last user releases it.  The caller must hold getLock().
+     */
+    static void releaseEnsemble();
+    /**
+     * Set the periodic cell NeuroChem uses for the next evaluation, or turn
+     * periodic boundary conditions off if it is NULL.  The caller must hold
+     * getLock().
+     *
+     * @param cell   the 3x3 periodic cell in Angstroms (row major), or NULL
+     */
+    static void setCell(const float* cell);
+private:
+    std::vector<float> positions;
+    std::vector<std::string> symbols;
+};
+
+} // namespace ANIPlugin
+
+#endif /*OPENMM_NEUROCHEM_ANI_ENGINE_H_*/
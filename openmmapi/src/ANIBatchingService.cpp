@@ -0,0 +1,149 @@
+/* -------------------------------------------------------------------------- *
+ * The MIT License
+ *
+ * SPDX short identifier: MIT
+ *
+ * Copyright 2019 Genentech Inc. South San Francisco
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ * -------------------------------------------------------------------------- */
+
+#include "internal/ANIBatchingService.h"
+#include <chrono>
+#include <map>
+
+using namespace ANIPlugin;
+using namespace std;
+
+struct ANIBatchingService::Request {
+    ANIEvaluation* eval;
+    chrono::steady_clock::time_point deadline;
+    exception_ptr error;
+    bool done;
+};
+
+static mutex servicesLock;
+static map<pair<string, string>, weak_ptr<ANIBatchingService> > services;
+
+shared_ptr<ANIBatchingService> ANIBatchingService::get(const string& aniInfoFile, const string& engineName) {
+    lock_guard<mutex> guard(servicesLock);
+    weak_ptr<ANIBatchingService>& entry = services[make_pair(aniInfoFile, engineName)];
+    shared_ptr<ANIBatchingService> service = entry.lock();
+    if (!service) {
+        service = make_shared<ANIBatchingService>(ANIEngine::create(aniInfoFile, engineName));
+        entry = service;
+    }
+    return service;
+}
+
+ANIBatchingService::ANIBatchingService(ANIEngine* engine) : engine(engine), busy(false), numClients(0), numBatches(0), numEvaluations(0) {
+}
+
+ANIBatchingService::~ANIBatchingService() {
+    delete engine;
+}
+
+void ANIBatchingService::addClient() {
+    lock_guard<mutex> guard(lock);
+    numClients++;
+}
+
+void ANIBatchingService::removeClient() {
+    lock_guard<mutex> guard(lock);
+    numClients--;
+    condition.notify_all();
+}
+
+int ANIBatchingService::getNumBatches() const {
+    lock_guard<mutex> guard(lock);
+    return numBatches;
+}
+
+long long ANIBatchingService::getNumEvaluations() const {
+    lock_guard<mutex> guard(lock);
+    return numEvaluations;
+}
+
+void ANIBatchingService::evaluate(ANIEvaluation& eval, double maxWait) {
+    Request request;
+    request.eval = &eval;
+    request.deadline = chrono::steady_clock::now() + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(maxWait));
+    request.done = false;
+    unique_lock<mutex> guard(lock);
+    pending.push_back(&request);
+    condition.notify_all();
+    while (!request.done) {
+        if (busy)
+            condition.wait(guard);
+        else
+            evaluatePending(guard);
+    }
+    if (request.error)
+        rethrow_exception(request.error);
+}
+
+void ANIBatchingService::evaluatePending(unique_lock<mutex>& guard) {
+    busy = true;
+
+    // Wait for more requests until the earliest deadline of the pending ones.
+
+    while (numClients == 0 || pending.size() < numClients) {
+        chrono::steady_clock::time_point deadline = pending[0]->deadline;
+        for (Request* request : pending)
+            deadline = min(deadline, request->deadline);
+        if (condition.wait_until(guard, deadline) == cv_status::timeout)
+            break;
+    }
+    running.swap(pending);
+    pending.clear();
+    guard.unlock();
+
+    // Evaluate them.  If that fails, evaluate them one at a time so each
+    // caller gets only the error caused by its own structure.
+
+    batch.resize(running.size());
+    for (int i = 0; i < running.size(); i++)
+        batch[i] = *running[i]->eval;
+    try {
+        engine->computeBatch(batch);
+        for (int i = 0; i < running.size(); i++)
+            running[i]->eval->energy = batch[i].energy;
+    }
+    catch (...) {
+        for (Request* request : running) {
+            batch.resize(1);
+            batch[0] = *request->eval;
+            try {
+                engine->computeBatch(batch);
+                request->eval->energy = batch[0].energy;
+            }
+            catch (...) {
+                request->error = current_exception();
+            }
+        }
+    }
+    guard.lock();
+    for (Request* request : running)
+        request->done = true;
+    numBatches++;
+    numEvaluations += running.size();
+    running.clear();
+    busy = false;
+    condition.notify_all();
+}
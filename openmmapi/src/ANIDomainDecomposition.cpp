@@ -0,0 +1,489 @@
+/* -------------------------------------------------------------------------- *
+ * The MIT License
+ *
+ * SPDX short identifier: MIT
+ *
+ * Copyright 2019 Genentech Inc. South San Francisco
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ * -------------------------------------------------------------------------- */
+
+#include "internal/ANIDomainDecomposition.h"
+#include "internal/CpuANIEngine.h"
+#include "CpuANINeighborList.h"
+#include "openmm/OpenMMException.h"
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <ctime>
+#include <sched.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace ANIPlugin;
+using namespace OpenMM;
+using namespace std;
+
+// Atom symbols are stored in shared memory as null terminated strings of this size.
+static const int SYMBOL_LENGTH = 4;
+static const int MESSAGE_LENGTH = 256;
+
+enum Command {EVALUATE, EXIT};
+
+/**
+ * The start of the shared memory.  The calling process fills in a command,
+ * posts the start semaphore of every worker and waits for each of them to post
+ * done.  Semaphores are used rather than a condition variable, because posting
+ * one never waits for other processes, so a dead worker cannot block the
+ * calling process.
+ */
+struct ANIDomainDecomposition::SharedHeader {
+    sem_t done;
+    int command;
+    int numAtoms;
+    bool periodic, computeForces, computeVirial;
+    float cell[9];
+};
+
+/**
+ * The results of one worker.  It is followed by the global indices of the
+ * worker's atoms and their gradients.
+ */
+struct ANIDomainDecomposition::WorkerResults {
+    sem_t start;
+    char error[MESSAGE_LENGTH];
+    long long fixedEnergy;
+    long long fixedVirial[9];
+    int numAtoms;
+};
+
+static size_t alignSize(size_t size) {
+    return (size+63) & ~((size_t) 63);
+}
+
+ANIDomainDecomposition::ANIDomainDecomposition(const ANIModel& model, int numWorkers, int maxAtoms, int threadsPerWorker, bool useFastActivations) :
+        model(model), numWorkers(numWorkers), maxAtoms(maxAtoms), failed(false), launched(false), launcherStopped(false) {
+    if (numWorkers < 1)
+        throw OpenMMException("ANIDomainDecomposition: at least one worker is needed");
+    if (maxAtoms < 1)
+        throw OpenMMException("ANIDomainDecomposition: the maximum number of atoms must be positive");
+
+    // Lay out the shared memory: the header, the positions and symbols of the
+    // structure, and the results of every worker.  The mapping is anonymous,
+    // so it is inherited by the workers and disappears with the processes.
+
+    size_t positionsOffset = alignSize(sizeof(SharedHeader));
+    size_t symbolsOffset = positionsOffset + alignSize(3*maxAtoms*sizeof(float));
+    resultsOffset = symbolsOffset + alignSize(SYMBOL_LENGTH*maxAtoms);
+    resultsSize = alignSize(sizeof(WorkerResults)) + alignSize(maxAtoms*sizeof(int)) + alignSize(3*maxAtoms*sizeof(long long));
+    sharedSize = resultsOffset + numWorkers*resultsSize;
+    void* mapping = mmap(NULL, sharedSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED)
+        throw OpenMMException("ANIDomainDecomposition: cannot allocate shared memory");
+    shared = (char*) mapping;
+    header = new(shared) SharedHeader();
+    sharedPositions = (float*) (shared+positionsOffset);
+    sharedSymbols = shared+symbolsOffset;
+    sem_init(&header->done, 1, 0);
+    for (int w = 0; w < numWorkers; w++)
+        sem_init(&getResults(w).start, 1, 0);
+
+    // Give every worker a contiguous share of the cores this process may use.
+    // Cores are usually numbered socket by socket, so with one worker per
+    // socket each worker stays on its own socket.
+
+    vector<int> cpus;
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        for (int i = 0; i < CPU_SETSIZE; i++)
+            if (CPU_ISSET(i, &allowed))
+                cpus.push_back(i);
+    }
+    int numCpus = max(1, (int) cpus.size());
+    int numThreads = (threadsPerWorker > 0 ? threadsPerWorker : max(1, numCpus/numWorkers));
+    vector<vector<int> > workerCpus(numWorkers);
+    if (!cpus.empty())
+        for (int w = 0; w < numWorkers; w++) {
+            for (int i = w*numCpus/numWorkers; i < (w+1)*numCpus/numWorkers; i++)
+                workerCpus[w].push_back(cpus[i]);
+            if (workerCpus[w].empty())
+                workerCpus[w].push_back(cpus[w%numCpus]);
+        }
+    launcher = thread(&ANIDomainDecomposition::runLauncher, this, numThreads, workerCpus, useFastActivations);
+    {
+        unique_lock<mutex> lock(launcherMutex);
+        launcherCondition.wait(lock, [&] () {return launched;});
+    }
+    try {
+        if (workers.size() < numWorkers)
+            throw OpenMMException("ANIDomainDecomposition: cannot start a worker process");
+
+        // Wait for the workers to create their engines.
+
+        waitForWorkers();
+        for (int w = 0; w < numWorkers; w++)
+            if (getResults(w).error[0] != 0)
+                throw OpenMMException(string("ANIDomainDecomposition: ")+getResults(w).error);
+    }
+    catch (...) {
+        stopWorkers();
+        stopLauncher();
+        munmap(shared, sharedSize);
+        throw;
+    }
+}
+
+ANIDomainDecomposition::~ANIDomainDecomposition() {
+    stopWorkers();
+    stopLauncher();
+    for (int w = 0; w < numWorkers; w++)
+        sem_destroy(&getResults(w).start);
+    sem_destroy(&header->done);
+    munmap(shared, sharedSize);
+}
+
+ANIDomainDecomposition::WorkerResults& ANIDomainDecomposition::getResults(int index) {
+    return *(WorkerResults*) (shared+resultsOffset+index*resultsSize);
+}
+
+int* ANIDomainDecomposition::getResultAtoms(int index) {
+    return (int*) (shared+resultsOffset+index*resultsSize+alignSize(sizeof(WorkerResults)));
+}
+
+long long* ANIDomainDecomposition::getResultGradient(int index) {
+    return (long long*) ((char*) getResultAtoms(index)+alignSize(maxAtoms*sizeof(int)));
+}
+
+void ANIDomainDecomposition::runLauncher(int numThreads, const vector<vector<int> >& cpus, bool useFastActivations) {
+    // A worker is sent SIGKILL when the thread that forked it exits, not when
+    // the process does, so the workers are forked by this thread, which lives
+    // as long as the engine rather than as long as the thread that created it.
+
+    pid_t parent = getpid();
+    for (int w = 0; w < numWorkers; w++) {
+        pid_t pid = fork();
+        if (pid < 0)
+            break;
+        if (pid == 0)
+            runWorker(w, parent, numThreads, cpus[w], useFastActivations);
+        workers.push_back(pid);
+    }
+    unique_lock<mutex> lock(launcherMutex);
+    launched = true;
+    launcherCondition.notify_all();
+    launcherCondition.wait(lock, [&] () {return launcherStopped;});
+}
+
+void ANIDomainDecomposition::stopLauncher() {
+    {
+        unique_lock<mutex> lock(launcherMutex);
+        launcherStopped = true;
+        launcherCondition.notify_all();
+    }
+    launcher.join();
+}
+
+void ANIDomainDecomposition::stopWorkers() {
+    // A worker that is still busy with an evaluation the calling process gave
+    // up on sees the command when it finishes.
+
+    header->command = EXIT;
+    for (int w = 0; w < workers.size(); w++)
+        if (workers[w] > 0)
+            sem_post(&getResults(w).start);
+    for (pid_t pid : workers)
+        if (pid > 0)
+            waitpid(pid, NULL, 0);
+    workers.clear();
+}
+
+void ANIDomainDecomposition::waitForWorkers() {
+    // Check every second whether a worker has died, so a crashed worker
+    // causes an exception rather than a hang.  The domains of a dead worker
+    // can never be evaluated again, so the engine is marked as failed.
+
+    int numDone = 0;
+    while (numDone < numWorkers) {
+        timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += 1;
+        if (sem_timedwait(&header->done, &deadline) == 0)
+            numDone++;
+        else if (errno == ETIMEDOUT)
+            for (pid_t& pid : workers)
+                if (pid > 0 && waitpid(pid, NULL, WNOHANG) == pid) {
+                    pid = -1;
+                    failed = true;
+                    throw OpenMMException("ANIDomainDecomposition: a worker process exited unexpectedly");
+                }
+    }
+}
+
+void ANIDomainDecomposition::runWorker(int index, pid_t parent, int numThreads, const vector<int>& cpus, bool useFastActivations) {
+    // Make sure the worker does not outlive the process that started it.  If
+    // that process exited before the signal was requested, it will never come.
+
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    if (getppid() != parent)
+        _exit(1);
+    if (!cpus.empty()) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu : cpus)
+            CPU_SET(cpu, &set);
+        sched_setaffinity(0, sizeof(set), &set);
+    }
+    WorkerResults& results = getResults(index);
+    int* resultAtoms = getResultAtoms(index);
+    long long* resultGradient = getResultGradient(index);
+    CpuANIEngine* engine = NULL;
+    string startupError;
+    try {
+        engine = new CpuANIEngine(model, numThreads, true, useFastActivations);
+    }
+    catch (const exception& e) {
+        startupError = e.what();
+    }
+    strncpy(results.error, startupError.c_str(), MESSAGE_LENGTH-1);
+    results.error[MESSAGE_LENGTH-1] = 0;
+    float cutoff = max(model.radialCutoff, model.angularCutoff);
+    vector<int> atoms;
+    vector<char> isHalo;
+    vector<string> symbols;
+    vector<float> positions;
+    sem_post(&header->done);
+    while (true) {
+        while (sem_wait(&results.start) != 0)
+            ;
+        if (header->command == EXIT)
+            break;
+        try {
+            if (engine == NULL)
+                throw OpenMMException(startupError);
+            results.error[0] = 0;
+            const float* cell = (header->periodic ? header->cell : NULL);
+            findDomain(header->numAtoms, sharedPositions, cell, numWorkers, index, cutoff, atoms, isHalo);
+            int numLocal = atoms.size();
+            symbols.resize(numLocal);
+            positions.resize(3*numLocal);
+            for (int i = 0; i < numLocal; i++) {
+                symbols[i] = &sharedSymbols[SYMBOL_LENGTH*atoms[i]];
+                for (int j = 0; j < 3; j++)
+                    positions[3*i+j] = sharedPositions[3*atoms[i]+j];
+            }
+            copy(atoms.begin(), atoms.end(), resultAtoms);
+            results.numAtoms = numLocal;
+            results.fixedEnergy = 0;
+            fill(results.fixedVirial, results.fixedVirial+9, 0);
+            if (numLocal > 0) {
+                ANIEvaluation eval;
+                eval.symbols = &symbols;
+                eval.positions = positions.data();
+                eval.cell = cell;
+                CpuANIDomain domain;
+                domain.isHalo = isHalo.data();
+                domain.computeVirial = header->computeVirial;
+                domain.fixedGradient = (header->computeForces ? resultGradient : NULL);
+                engine->computeDomain(eval, domain);
+                results.fixedEnergy = domain.fixedEnergy;
+                if (domain.computeVirial)
+                    copy(domain.fixedVirial, domain.fixedVirial+9, results.fixedVirial);
+            }
+        }
+        catch (const exception& e) {
+            strncpy(results.error, e.what(), MESSAGE_LENGTH-1);
+            results.error[MESSAGE_LENGTH-1] = 0;
+        }
+        sem_post(&header->done);
+    }
+    delete engine;
+    _exit(0);
+}
+
+void ANIDomainDecomposition::computeBatch(vector<ANIEvaluation>& batch) {
+    for (ANIEvaluation& eval : batch) {
+        const vector<string>& symbols = *eval.symbols;
+        const int numAtoms = symbols.size();
+        if (numAtoms > maxAtoms)
+            throw OpenMMException("ANIDomainDecomposition: the structure has more atoms than the engine was created for");
+        if (eval.ensembleEnergies != NULL)
+            throw OpenMMException("ANIDomainDecomposition: ensemble energies are not supported");
+        if (failed)
+            throw OpenMMException("ANIDomainDecomposition: a worker process exited unexpectedly");
+        if (eval.cell != NULL)
+            CpuANINeighborList::checkCell(eval.cell, max(model.radialCutoff, model.angularCutoff));
+
+        // Publish the structure and start the workers.
+
+        double selfEnergy = 0;
+        for (int i = 0; i < numAtoms; i++) {
+            int species = model.getSpeciesIndex(symbols[i]);
+            if (species == -1)
+                throw OpenMMException("ANI: the model does not support element "+symbols[i]);
+            selfEnergy += model.selfEnergies[species];
+            strncpy(&sharedSymbols[SYMBOL_LENGTH*i], symbols[i].c_str(), SYMBOL_LENGTH-1);
+            sharedSymbols[SYMBOL_LENGTH*i+SYMBOL_LENGTH-1] = 0;
+        }
+        copy(eval.positions, eval.positions+3*numAtoms, sharedPositions);
+        header->numAtoms = numAtoms;
+        header->periodic = (eval.cell != NULL);
+        if (eval.cell != NULL)
+            copy(eval.cell, eval.cell+9, header->cell);
+        header->computeForces = (eval.forces != NULL);
+        header->computeVirial = (eval.virial != NULL);
+        header->command = EVALUATE;
+        for (int w = 0; w < numWorkers; w++)
+            sem_post(&getResults(w).start);
+        waitForWorkers();
+
+        // Add up the contributions of the workers.  They are integers, so the
+        // order does not matter.
+
+        for (int w = 0; w < numWorkers; w++)
+            if (getResults(w).error[0] != 0)
+                throw OpenMMException(getResults(w).error);
+        long long fixedEnergy = 0;
+        long long fixedVirial[9] = {0};
+        if (eval.forces != NULL)
+            fixedGradient.assign(3*numAtoms, 0);
+        for (int w = 0; w < numWorkers; w++) {
+            WorkerResults& results = getResults(w);
+            fixedEnergy += results.fixedEnergy;
+            for (int k = 0; k < 9; k++)
+                fixedVirial[k] += results.fixedVirial[k];
+            if (eval.forces != NULL) {
+                const int* atoms = getResultAtoms(w);
+                const long long* gradient = getResultGradient(w);
+                for (int i = 0; i < results.numAtoms; i++)
+                    for (int j = 0; j < 3; j++)
+                        fixedGradient[3*atoms[i]+j] += gradient[3*i+j];
+            }
+        }
+        eval.energy = fixedEnergy/(double) 0x100000000 + selfEnergy;
+        if (eval.forces != NULL)
+            for (int i = 0; i < 3*numAtoms; i++)
+                eval.forces[i] = (float) (-fixedGradient[i]/(double) 0x100000000);
+        if (eval.virial != NULL)
+            for (int k = 0; k < 9; k++)
+                eval.virial[k] = fixedVirial[k]/(double) 0x100000000;
+    }
+}
+
+void ANIDomainDecomposition::chooseGrid(int numDomains, const double* extent, int* grid) {
+    double bestSurface = 0;
+    for (int x = 1; x <= numDomains; x++) {
+        if (numDomains%x != 0)
+            continue;
+        for (int y = 1; y <= numDomains/x; y++) {
+            if ((numDomains/x)%y != 0)
+                continue;
+            int z = numDomains/(x*y);
+            double dx = extent[0]/x+1e-6, dy = extent[1]/y+1e-6, dz = extent[2]/z+1e-6;
+            double surface = dx*dy + dy*dz + dx*dz;
+            if ((x == 1 && y == 1) || surface < bestSurface) {
+                bestSurface = surface;
+                grid[0] = x;
+                grid[1] = y;
+                grid[2] = z;
+            }
+        }
+    }
+}
+
+void ANIDomainDecomposition::findDomain(int numAtoms, const float* positions, const float* cell, int numDomains, int domain, float cutoff,
+                                        vector<int>& atoms, vector<char>& isHalo) {
+    atoms.clear();
+    isHalo.clear();
+    if (numAtoms == 0)
+        return;
+
+    // Work in fractional coordinates: of the cell for periodic structures,
+    // otherwise of the bounding box.  margin is the cutoff in those units.
+
+    double extent[3], margin[3], minPos[3] = {0, 0, 0};
+    if (cell != NULL) {
+        const float* a = cell;
+        const float* b = cell+3;
+        const float* c = cell+6;
+        double volume = a[0]*b[1]*c[2];
+        double bc[3] = {b[1]*c[2]-b[2]*c[1], b[2]*c[0]-b[0]*c[2], b[0]*c[1]-b[1]*c[0]};
+        double ca[3] = {c[1]*a[2]-c[2]*a[1], c[2]*a[0]-c[0]*a[2], c[0]*a[1]-c[1]*a[0]};
+        double ab[3] = {a[1]*b[2]-a[2]*b[1], a[2]*b[0]-a[0]*b[2], a[0]*b[1]-a[1]*b[0]};
+        extent[0] = volume/sqrt(bc[0]*bc[0]+bc[1]*bc[1]+bc[2]*bc[2]);
+        extent[1] = volume/sqrt(ca[0]*ca[0]+ca[1]*ca[1]+ca[2]*ca[2]);
+        extent[2] = volume/sqrt(ab[0]*ab[0]+ab[1]*ab[1]+ab[2]*ab[2]);
+    }
+    else {
+        double maxPos[3];
+        for (int k = 0; k < 3; k++)
+            minPos[k] = maxPos[k] = positions[k];
+        for (int i = 1; i < numAtoms; i++)
+            for (int k = 0; k < 3; k++) {
+                minPos[k] = min(minPos[k], (double) positions[3*i+k]);
+                maxPos[k] = max(maxPos[k], (double) positions[3*i+k]);
+            }
+        for (int k = 0; k < 3; k++)
+            extent[k] = maxPos[k]-minPos[k];
+    }
+    for (int k = 0; k < 3; k++)
+        margin[k] = (extent[k] > 0 ? 1.0001*cutoff/extent[k] + 1e-6 : 2.0);
+    int grid[3];
+    chooseGrid(numDomains, extent, grid);
+    int cellIndex[3] = {domain%grid[0], (domain/grid[0])%grid[1], domain/(grid[0]*grid[1])};
+    for (int i = 0; i < numAtoms; i++) {
+        const float* p = &positions[3*i];
+        double f[3];
+        if (cell != NULL) {
+            f[2] = p[2]/cell[8];
+            f[1] = (p[1]-cell[7]*f[2])/cell[4];
+            f[0] = (p[0]-cell[6]*f[2]-cell[3]*f[1])/cell[0];
+            for (int k = 0; k < 3; k++)
+                f[k] -= floor(f[k]);
+        }
+        else
+            for (int k = 0; k < 3; k++)
+                f[k] = (extent[k] > 0 ? (p[k]-minPos[k])/extent[k] : 0.0);
+        bool owned = true, halo = true;
+        for (int k = 0; k < 3; k++) {
+            int bin = min(grid[k]-1, (int) (f[k]*grid[k]));
+            if (bin == cellIndex[k])
+                continue;
+            owned = false;
+
+            // The distance to the domain along this axis, across the periodic
+            // boundary if there is one.
+
+            double low = cellIndex[k]/(double) grid[k], high = (cellIndex[k]+1)/(double) grid[k];
+            double distance = (f[k] < low ? low-f[k] : f[k]-high);
+            if (cell != NULL)
+                distance = min(distance, min(f[k]+1-high, low-(f[k]-1)));
+            if (distance > margin[k])
+                halo = false;
+        }
+        if (owned || halo) {
+            atoms.push_back(i);
+            isHalo.push_back(!owned);
+        }
+    }
+}
@@ -0,0 +1,48 @@
+/* -------------------------------------------------------------------------- *
+ * The MIT License
+ *
+ * SPDX short identifier: MIT
+ *
+ * Copyright 2019 Genentech Inc. South San Francisco
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ * -------------------------------------------------------------------------- */
+
+
+#include "ANIEngine.h"
+#include "internal/ANIModelInfo.h"
+#include "internal/ANIModelLoader.h"
+#include "internal/CpuANIEngine.h"
+#include "internal/NeuroChemANIEngine.h"
+#include "openmm/OpenMMException.h"
+
+using namespace ANIPlugin;
+using namespace std;
+
+ANIEngine* ANIEngine::create(const string& aniInfoFile, const string& engineName) {
+    if (engineName == "NeuroChem")
+        return new NeuroChemANIEngine(ANIModelInfo::read(aniInfoFile));
+    if (engineName == "CPU")
+        return new CpuANIEngine(*ANIModelLoader::get(aniInfoFile));
+    if (engineName == "CPUFast")
+        return new CpuANIEngine(*ANIModelLoader::get(aniInfoFile), 0, true, true);
+    if (engineName == "CPUTabulated")
+        return new CpuANIEngine(*ANIModelLoader::get(aniInfoFile), 0, true, false, false, true);
+    throw OpenMM::OpenMMException("ANI: unknown engine "+engineName);
+}
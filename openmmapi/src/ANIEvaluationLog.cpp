@@ -0,0 +1,229 @@
+/* -------------------------------------------------------------------------- *
+ * The MIT License
+ *
+ * SPDX short identifier: MIT
+ *
+ * Copyright 2019 Genentech Inc. South San Francisco
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ * -------------------------------------------------------------------------- */
+
+#include "internal/ANIEvaluationLog.h"
+#include "openmm/OpenMMException.h"
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <set>
+
+using namespace ANIPlugin;
+using namespace OpenMM;
+using namespace std;
+
+static const char MAGIC[8] = {'A', 'N', 'I', 'E', 'V', 'L', 'O', 'G'};
+static const int VERSION = 1;
+static const int PERIODIC_FLAG = 1;
+static const int FORCES_FLAG = 2;
+
+// The files that writers in this process have open.  A second writer would
+// truncate the file and interleave its records with the first one's.
+
+static mutex writersLock;
+static set<string> openFiles;
+
+/**
+ * Get a name that is the same however a file is referred to, so two writers
+ * of it are recognized.  The file itself may not exist yet.
+ */
+static string getCanonicalPath(const string& fileName) {
+    size_t pos = fileName.find_last_of('/');
+    string dir = (pos == string::npos ? "." : fileName.substr(0, max(pos, (size_t) 1)));
+    char resolved[PATH_MAX];
+    if (realpath(dir.c_str(), resolved) == NULL)
+        return fileName;
+    return string(resolved)+"/"+fileName.substr(pos == string::npos ? 0 : pos+1);
+}
+
+ANIEvaluationLogWriter::ANIEvaluationLogWriter(const string& fileName, const string& infoFile, const vector<string>& symbols,
+            int interval, size_t maxBytes) : fileName(fileName), file(NULL), numAtoms(symbols.size()), interval(interval),
+            maxBytes(maxBytes), size(0), numCalls(0), numRecords(0) {
+    if (interval < 1)
+        throw OpenMMException("ANI: the recording interval must be at least 1");
+    vector<string> distinct;
+    vector<unsigned char> species(numAtoms);
+    for (int i = 0; i < numAtoms; i++) {
+        int index = find(distinct.begin(), distinct.end(), symbols[i])-distinct.begin();
+        if (index == distinct.size()) {
+            if (distinct.size() == 256)
+                throw OpenMMException("ANI: too many distinct symbols to record");
+            distinct.push_back(symbols[i]);
+        }
+        species[i] = (unsigned char) index;
+    }
+    canonicalPath = getCanonicalPath(fileName);
+    {
+        lock_guard<mutex> lock(writersLock);
+        if (!openFiles.insert(canonicalPath).second)
+            throw OpenMMException("ANI: "+fileName+" is already being recorded by another Context");
+    }
+    try {
+        file = fopen(fileName.c_str(), "wb");
+        if (file == NULL)
+            throw OpenMMException("Cannot create "+fileName);
+        int header[2] = {VERSION, numAtoms};
+        writeBytes(MAGIC, sizeof(MAGIC));
+        writeBytes(header, sizeof(header));
+        int length = infoFile.size();
+        writeBytes(&length, sizeof(int));
+        writeBytes(infoFile.data(), length);
+        int numDistinct = distinct.size();
+        writeBytes(&numDistinct, sizeof(int));
+        for (const string& symbol : distinct) {
+            length = symbol.size();
+            writeBytes(&length, sizeof(int));
+            writeBytes(symbol.data(), length);
+        }
+        writeBytes(species.data(), numAtoms);
+        fflush(file);
+    }
+    catch (...) {
+        if (file != NULL)
+            fclose(file);
+        lock_guard<mutex> lock(writersLock);
+        openFiles.erase(canonicalPath);
+        throw;
+    }
+}
+
+ANIEvaluationLogWriter::~ANIEvaluationLogWriter() {
+    if (file != NULL)
+        fclose(file);
+    lock_guard<mutex> lock(writersLock);
+    openFiles.erase(canonicalPath);
+}
+
+void ANIEvaluationLogWriter::writeBytes(const void* data, size_t bytes) {
+    if (fwrite(data, 1, bytes, file) != bytes)
+        throw OpenMMException("Error writing "+fileName);
+    size += bytes;
+}
+
+bool ANIEvaluationLogWriter::startCall() {
+    return (numCalls++ % interval == 0);
+}
+
+void ANIEvaluationLogWriter::record(const float* positions, const float* cell, double energy, const float* forces) {
+    // Once the file is full, the remaining calls are silently skipped, so a
+    // long run keeps its first records rather than failing.
+
+    size_t recordSize = sizeof(long long) + sizeof(int) + (cell == NULL ? 0 : 9*sizeof(float)) +
+                        3*numAtoms*sizeof(float) + sizeof(double) + (forces == NULL ? 0 : 3*numAtoms*sizeof(float));
+    if (size+recordSize > maxBytes)
+        return;
+    long long call = numCalls-1;
+    int flags = (cell == NULL ? 0 : PERIODIC_FLAG) | (forces == NULL ? 0 : FORCES_FLAG);
+    writeBytes(&call, sizeof(long long));
+    writeBytes(&flags, sizeof(int));
+    if (cell != NULL)
+        writeBytes(cell, 9*sizeof(float));
+    writeBytes(positions, 3*numAtoms*sizeof(float));
+    writeBytes(&energy, sizeof(double));
+    if (forces != NULL)
+        writeBytes(forces, 3*numAtoms*sizeof(float));
+    fflush(file);
+    numRecords++;
+}
+
+ANIEvaluationLogReader::ANIEvaluationLogReader(const string& fileName) : fileName(fileName), file(NULL) {
+    file = fopen(fileName.c_str(), "rb");
+    if (file == NULL)
+        throw OpenMMException("Cannot open "+fileName);
+    try {
+        char magic[8];
+        int header[2];
+        readBytes(magic, sizeof(magic));
+        if (memcmp(magic, MAGIC, sizeof(MAGIC)) != 0)
+            throw OpenMMException(fileName+" is not an ANI evaluation log");
+        readBytes(header, sizeof(header));
+        if (header[0] != VERSION)
+            throw OpenMMException(fileName+" has an unsupported version");
+        int numAtoms = header[1];
+        infoFile = readString();
+        int numDistinct;
+        readBytes(&numDistinct, sizeof(int));
+        vector<string> distinct(numDistinct);
+        for (string& symbol : distinct)
+            symbol = readString();
+        vector<unsigned char> species(numAtoms);
+        readBytes(species.data(), numAtoms);
+        for (unsigned char s : species) {
+            if (s >= numDistinct)
+                throw OpenMMException(fileName+" has a corrupt header");
+            symbols.push_back(distinct[s]);
+        }
+    }
+    catch (...) {
+        fclose(file);
+        throw;
+    }
+}
+
+ANIEvaluationLogReader::~ANIEvaluationLogReader() {
+    fclose(file);
+}
+
+void ANIEvaluationLogReader::readBytes(void* data, size_t bytes) {
+    if (fread(data, 1, bytes, file) != bytes)
+        throw OpenMMException("Unexpected end of "+fileName);
+}
+
+string ANIEvaluationLogReader::readString() {
+    int length;
+    readBytes(&length, sizeof(int));
+    if (length < 0 || length > 1<<16)
+        throw OpenMMException(fileName+" has a corrupt header");
+    string result(length, ' ');
+    readBytes(&result[0], length);
+    return result;
+}
+
+bool ANIEvaluationLogReader::read(ANILoggedEvaluation& evaluation) {
+    // A run that was killed while writing may leave a partial record at the
+    // end, which is treated like the end of the log.
+
+    if (fread(&evaluation.call, sizeof(long long), 1, file) != 1)
+        return false;
+    const int numAtoms = symbols.size();
+    int flags;
+    try {
+        readBytes(&flags, sizeof(int));
+        evaluation.cell.resize((flags & PERIODIC_FLAG) ? 9 : 0);
+        readBytes(evaluation.cell.data(), evaluation.cell.size()*sizeof(float));
+        evaluation.positions.resize(3*numAtoms);
+        readBytes(evaluation.positions.data(), 3*numAtoms*sizeof(float));
+        readBytes(&evaluation.energy, sizeof(double));
+        evaluation.forces.resize((flags & FORCES_FLAG) ? 3*numAtoms : 0);
+        readBytes(evaluation.forces.data(), evaluation.forces.size()*sizeof(float));
+    }
+    catch (const OpenMMException& e) {
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,532 @@
+/* -------------------------------------------------------------------------- *
+ * The MIT License
+ *
+ * SPDX short identifier: MIT
+ *
+ * Copyright 2019 Genentech Inc. South San Francisco
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ * -------------------------------------------------------------------------- */
+
+
+#include "internal/ANIEvaluationServer.h"
+#include "internal/ANIModelLoader.h"
+#include "openmm/OpenMMException.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <sstream>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace ANIPlugin;
+using namespace OpenMM;
+using namespace std;
+
+// Identifies the protocol in the first message of a connection.
+static const unsigned int PROTOCOL_MAGIC = 0x53494e41;
+static const int PROTOCOL_VERSION = 1;
+static const int MESSAGE_LENGTH = 256;
+// Limits on the strings of the first message, so a bad client cannot make the
+// server allocate unbounded memory.
+static const int MAX_PATH_LENGTH = 4096;
+static const int MAX_SYMBOL_LENGTH = 4;
+
+enum Command {EVALUATE};
+
+/**
+ * The first message of a connection.  It carries the client's shared memory
+ * segment as a file descriptor and is followed by the info file and the
+ * symbols of the atoms, separated by spaces.
+ */
+struct Hello {
+    unsigned int magic;
+    int version, numAtoms, infoFileLength, symbolsLength;
+    double maxWait;
+};
+
+/**
+ * Sent by the server in reply to the first message and to every request.
+ */
+struct Reply {
+    int status;
+    char message[MESSAGE_LENGTH];
+};
+
+/**
+ * The start of a client's shared memory segment.  The client fills in the
+ * structure to evaluate and the server the results.  It is followed by the
+ * positions and the forces, 3*numAtoms floats each.
+ */
+struct SharedState {
+    int numAtoms;
+    int periodic, computeForces, computeVirial;
+    float cell[9];
+    double energy;
+    double virial[9];
+};
+
+struct ANIEvaluationClient::Shared : public SharedState {
+};
+
+/**
+ * A connection to one client.  The socket is closed by whoever joins the
+ * thread, so it cannot be reused while the server may still shut it down.
+ */
+struct ANIEvaluationServer::Session {
+    int socket;
+    thread worker;
+    atomic<bool> finished;
+};
+
+static size_t alignSize(size_t size) {
+    return (size+63) & ~((size_t) 63);
+}
+
+static size_t getSharedSize(int numAtoms) {
+    return alignSize(sizeof(SharedState)) + 2*alignSize(3*numAtoms*sizeof(float));
+}
+
+static float* getSharedPositions(SharedState* shared) {
+    return (float*) ((char*) shared + alignSize(sizeof(SharedState)));
+}
+
+static float* getSharedForces(SharedState* shared) {
+    return getSharedPositions(shared) + alignSize(3*shared->numAtoms*sizeof(float))/sizeof(float);
+}
+
+static void setAddress(const string& path, sockaddr_un& address) {
+    if (path.size() >= sizeof(address.sun_path))
+        throw OpenMMException("ANI: the socket path is too long: "+path);
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path)-1);
+}
+
+static bool sendAll(int socket, const void* data, size_t size) {
+    const char* bytes = (const char*) data;
+    while (size > 0) {
+        ssize_t sent = send(socket, bytes, size, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent <= 0)
+            return false;
+        bytes += sent;
+        size -= sent;
+    }
+    return true;
+}
+
+static bool receiveAll(int socket, void* data, size_t size) {
+    char* bytes = (char*) data;
+    while (size > 0) {
+        ssize_t received = recv(socket, bytes, size, 0);
+        if (received < 0 && errno == EINTR)
+            continue;
+        if (received <= 0)
+            return false;
+        bytes += received;
+        size -= received;
+    }
+    return true;
+}
+
+static bool sendReply(int socket, const string& error) {
+    Reply reply;
+    memset(&reply, 0, sizeof(reply));
+    reply.status = (error.empty() ? 0 : 1);
+    strncpy(reply.message, error.c_str(), MESSAGE_LENGTH-1);
+    return sendAll(socket, &reply, sizeof(reply));
+}
+
+ANIEvaluationServer::ANIEvaluationServer(const string& socketPath, const string& engineName) : socketPath(socketPath),
+        engineName(engineName), listenSocket(-1), numClients(0) {
+    sockaddr_un address;
+    setAddress(socketPath, address);
+
+    // Replace a socket left behind by a server that did not exit cleanly, but
+    // never anything else.
+
+    struct stat status;
+    if (lstat(socketPath.c_str(), &status) == 0) {
+        if (!S_ISSOCK(status.st_mode))
+            throw OpenMMException("ANIEvaluationServer: "+socketPath+" exists and is not a socket");
+        unlink(socketPath.c_str());
+    }
+    if (pipe(wakePipe) != 0)
+        throw OpenMMException("ANIEvaluationServer: cannot create a pipe");
+    listenSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenSocket < 0 || bind(listenSocket, (sockaddr*) &address, sizeof(address)) != 0 ||
+            chmod(socketPath.c_str(), S_IRUSR | S_IWUSR) != 0 || listen(listenSocket, SOMAXCONN) != 0) {
+        string error = strerror(errno);
+        if (listenSocket >= 0)
+            close(listenSocket);
+        close(wakePipe[0]);
+        close(wakePipe[1]);
+        throw OpenMMException("ANIEvaluationServer: cannot listen on "+socketPath+": "+error);
+    }
+}
+
+ANIEvaluationServer::~ANIEvaluationServer() {
+    if (background.joinable()) {
+        stop();
+        background.join();
+    }
+    closeSessions();
+    close(listenSocket);
+    unlink(socketPath.c_str());
+    close(wakePipe[0]);
+    close(wakePipe[1]);
+}
+
+void ANIEvaluationServer::start() {
+    if (background.joinable())
+        throw OpenMMException("ANIEvaluationServer: the server is already running");
+    background = thread(&ANIEvaluationServer::run, this);
+}
+
+void ANIEvaluationServer::stop() {
+    char byte = 0;
+    ssize_t written = write(wakePipe[1], &byte, 1);
+    (void) written;
+}
+
+void ANIEvaluationServer::run() {
+    pollfd fds[2];
+    fds[0].fd = listenSocket;
+    fds[0].events = POLLIN;
+    fds[1].fd = wakePipe[0];
+    fds[1].events = POLLIN;
+    while (true) {
+        // Wake up every second to clean up after clients that disconnected.
+
+        int ready = poll(fds, 2, 1000);
+        {
+            lock_guard<mutex> guard(lock);
+            for (int i = sessions.size()-1; i >= 0; i--)
+                if (sessions[i]->finished) {
+                    sessions[i]->worker.join();
+                    close(sessions[i]->socket);
+                    delete sessions[i];
+                    sessions.erase(sessions.begin()+i);
+                }
+        }
+        if (ready < 0 && errno != EINTR)
+            break;
+        if (ready <= 0)
+            continue;
+        if (fds[1].revents != 0) {
+            char byte;
+            ssize_t received = read(wakePipe[0], &byte, 1);
+            (void) received;
+            break;
+        }
+        if (fds[0].revents & POLLIN) {
+            int clientSocket = accept(listenSocket, NULL, NULL);
+            if (clientSocket < 0)
+                continue;
+            Session* session = new Session();
+            session->socket = clientSocket;
+            session->finished = false;
+            lock_guard<mutex> guard(lock);
+            sessions.push_back(session);
+            session->worker = thread(&ANIEvaluationServer::serveClient, this, session);
+        }
+    }
+    closeSessions();
+}
+
+void ANIEvaluationServer::closeSessions() {
+    // Shutting down the sockets makes every session thread return.
+
+    vector<Session*> closing;
+    {
+        lock_guard<mutex> guard(lock);
+        closing.swap(sessions);
+    }
+    for (Session* session : closing)
+        shutdown(session->socket, SHUT_RDWR);
+    for (Session* session : closing) {
+        session->worker.join();
+        close(session->socket);
+        delete session;
+    }
+}
+
+shared_ptr<ANIBatchingService> ANIEvaluationServer::getService(const string& infoFile, vector<string>& species) {
+    lock_guard<mutex> guard(lock);
+    shared_ptr<ANIBatchingService>& service = services[infoFile];
+    if (!service) {
+        try {
+            modelSpecies[infoFile] = ANIModelLoader::get(infoFile)->species;
+            service = make_shared<ANIBatchingService>(ANIEngine::create(infoFile, engineName));
+        }
+        catch (...) {
+            services.erase(infoFile);
+            modelSpecies.erase(infoFile);
+            throw;
+        }
+    }
+    species = modelSpecies[infoFile];
+    return service;
+}
+
+int ANIEvaluationServer::getNumClients() const {
+    return numClients;
+}
+
+int ANIEvaluationServer::getNumModels() const {
+    lock_guard<mutex> guard(lock);
+    return services.size();
+}
+
+long long ANIEvaluationServer::getNumBatches() const {
+    lock_guard<mutex> guard(lock);
+    long long count = 0;
+    for (auto& service : services)
+        count += service.second->getNumBatches();
+    return count;
+}
+
+long long ANIEvaluationServer::getNumEvaluations() const {
+    lock_guard<mutex> guard(lock);
+    long long count = 0;
+    for (auto& service : services)
+        count += service.second->getNumEvaluations();
+    return count;
+}
+
+void ANIEvaluationServer::serveClient(Session* session) {
+    int socket = session->socket;
+    SharedState* shared = NULL;
+    size_t sharedSize = 0;
+    shared_ptr<ANIBatchingService> service;
+    vector<string> symbols;
+    Hello hello;
+    try {
+        // Receive the first message together with the shared memory segment.
+
+        int memoryFile = -1;
+        char control[CMSG_SPACE(sizeof(int))];
+        iovec data = {&hello, sizeof(hello)};
+        msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = &data;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        ssize_t received = recvmsg(socket, &message, 0);
+        if (received <= 0)
+            throw OpenMMException("the client closed the connection");
+        cmsghdr* header = CMSG_FIRSTHDR(&message);
+        if (header != NULL && header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS)
+            memcpy(&memoryFile, CMSG_DATA(header), sizeof(int));
+        bool valid = receiveAll(socket, (char*) &hello+received, sizeof(hello)-received) && memoryFile >= 0 &&
+                hello.magic == PROTOCOL_MAGIC && hello.version == PROTOCOL_VERSION && hello.numAtoms > 0 &&
+                hello.infoFileLength > 0 && hello.infoFileLength <= MAX_PATH_LENGTH && hello.symbolsLength > 0 &&
+                hello.symbolsLength <= (MAX_SYMBOL_LENGTH+1)*(long long) hello.numAtoms && hello.maxWait >= 0 && hello.maxWait < 1e6;
+        if (valid) {
+            sharedSize = getSharedSize(hello.numAtoms);
+            struct stat status;
+            valid = (fstat(memoryFile, &status) == 0 && status.st_size >= (off_t) sharedSize);
+        }
+        if (valid) {
+            void* mapping = mmap(NULL, sharedSize, PROT_READ | PROT_WRITE, MAP_SHARED, memoryFile, 0);
+            if (mapping != MAP_FAILED)
+                shared = (SharedState*) mapping;
+        }
+        if (memoryFile >= 0)
+            close(memoryFile);
+        if (shared == NULL)
+            throw OpenMMException("invalid request from client");
+        string infoFile(hello.infoFileLength, ' '), symbolText(hello.symbolsLength, ' ');
+        if (!receiveAll(socket, &infoFile[0], infoFile.size()) || !receiveAll(socket, &symbolText[0], symbolText.size()))
+            throw OpenMMException("the client closed the connection");
+        istringstream symbolStream(symbolText);
+        string symbol;
+        while (symbolStream >> symbol)
+            symbols.push_back(symbol);
+        if (symbols.size() != (size_t) hello.numAtoms || shared->numAtoms != hello.numAtoms)
+            throw OpenMMException("the number of atoms does not match the symbols");
+
+        // Check the atoms against the model now, so the client gets the error
+        // when it connects rather than on its first evaluation.
+
+        vector<string> species;
+        service = getService(infoFile, species);
+        for (const string& s : symbols)
+            if (find(species.begin(), species.end(), s) == species.end())
+                throw OpenMMException("the model does not support element "+s);
+    }
+    catch (const exception& e) {
+        sendReply(socket, string("ANIEvaluationServer: ")+e.what());
+        if (shared != NULL)
+            munmap(shared, sharedSize);
+        session->finished = true;
+        return;
+    }
+    numClients++;
+    service->addClient();
+    bool connected = sendReply(socket, "");
+
+    // Evaluate requests until the client disconnects.
+
+    float* positions = getSharedPositions(shared);
+    float* forces = getSharedForces(shared);
+    while (connected) {
+        int command;
+        if (!receiveAll(socket, &command, sizeof(command)) || command != EVALUATE)
+            break;
+        string error;
+        try {
+            ANIEvaluation eval;
+            eval.symbols = &symbols;
+            eval.positions = positions;
+            eval.cell = (shared->periodic ? shared->cell : NULL);
+            eval.forces = (shared->computeForces ? forces : NULL);
+            eval.virial = (shared->computeVirial ? shared->virial : NULL);
+            service->evaluate(eval, hello.maxWait);
+            shared->energy = eval.energy;
+        }
+        catch (const exception& e) {
+            error = e.what();
+        }
+        connected = sendReply(socket, error);
+    }
+    service->removeClient();
+    numClients--;
+    munmap(shared, sharedSize);
+    session->finished = true;
+}
+
+ANIEvaluationClient::ANIEvaluationClient(const string& socketPath, const string& infoFile, const vector<string>& symbols, double maxWait) :
+        symbols(symbols), maxWait(maxWait), socket(-1), shared(NULL), sharedSize(0) {
+    sockaddr_un address;
+    setAddress(socketPath, address);
+    for (const string& symbol : symbols)
+        if (symbol.empty() || symbol.size() > MAX_SYMBOL_LENGTH || symbol.find(' ') != string::npos)
+            throw OpenMMException("ANIEvaluationClient: invalid atom symbol '"+symbol+"'");
+    if (symbols.empty())
+        throw OpenMMException("ANIEvaluationClient: the structure has no atoms");
+
+    // Create the shared memory segment.  Its name is removed right away, so
+    // nothing is left behind however the processes exit: the client and
+    // server keep it alive through their mappings.
+
+    static atomic<int> counter(0);
+    string name = "/openmm-ani-"+to_string(getpid())+"-"+to_string(counter++);
+    int memoryFile = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+    if (memoryFile < 0)
+        throw OpenMMException("ANIEvaluationClient: cannot create shared memory");
+    shm_unlink(name.c_str());
+    sharedSize = getSharedSize(symbols.size());
+    void* mapping = MAP_FAILED;
+    if (ftruncate(memoryFile, sharedSize) == 0)
+        mapping = mmap(NULL, sharedSize, PROT_READ | PROT_WRITE, MAP_SHARED, memoryFile, 0);
+    if (mapping == MAP_FAILED) {
+        close(memoryFile);
+        throw OpenMMException("ANIEvaluationClient: cannot create shared memory");
+    }
+    shared = (Shared*) mapping;
+    shared->numAtoms = symbols.size();
+
+    // Connect and send the first message with the segment attached.
+
+    string symbolText;
+    for (const string& symbol : symbols)
+        symbolText += symbol+" ";
+    Hello hello = {PROTOCOL_MAGIC, PROTOCOL_VERSION, (int) symbols.size(), (int) infoFile.size(), (int) symbolText.size(), maxWait};
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+    iovec data = {&hello, sizeof(hello)};
+    msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &data;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    cmsghdr* header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(header), &memoryFile, sizeof(int));
+    socket = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    bool sent = (socket >= 0 && connect(socket, (sockaddr*) &address, sizeof(address)) == 0 &&
+                 sendmsg(socket, &message, MSG_NOSIGNAL) == sizeof(hello) &&
+                 sendAll(socket, infoFile.c_str(), infoFile.size()) && sendAll(socket, symbolText.c_str(), symbolText.size()));
+    close(memoryFile);
+    Reply reply;
+    if (!sent || !receiveAll(socket, &reply, sizeof(reply))) {
+        string error = "ANIEvaluationClient: cannot connect to the ANI server at "+socketPath;
+        if (socket >= 0)
+            close(socket);
+        munmap(shared, sharedSize);
+        throw OpenMMException(error);
+    }
+    if (reply.status != 0) {
+        close(socket);
+        munmap(shared, sharedSize);
+        reply.message[MESSAGE_LENGTH-1] = 0;
+        throw OpenMMException(reply.message);
+    }
+}
+
+ANIEvaluationClient::~ANIEvaluationClient() {
+    close(socket);
+    munmap(shared, sharedSize);
+}
+
+void ANIEvaluationClient::exchange(int command) {
+    Reply reply;
+    if (!sendAll(socket, &command, sizeof(command)) || !receiveAll(socket, &reply, sizeof(reply)))
+        throw OpenMMException("ANIEvaluationClient: the ANI server closed the connection");
+    if (reply.status != 0) {
+        reply.message[MESSAGE_LENGTH-1] = 0;
+        throw OpenMMException(reply.message);
+    }
+}
+
+void ANIEvaluationClient::computeBatch(vector<ANIEvaluation>& batch) {
+    for (ANIEvaluation& eval : batch) {
+        if (*eval.symbols != symbols)
+            throw OpenMMException("ANIEvaluationClient: the structure does not have the atoms the client was created for");
+        if (eval.ensembleEnergies != NULL)
+            throw OpenMMException("ANIEvaluationClient: ensemble energies are not supported");
+        int numAtoms = symbols.size();
+        copy(eval.positions, eval.positions+3*numAtoms, getSharedPositions(shared));
+        shared->periodic = (eval.cell != NULL);
+        if (eval.cell != NULL)
+            copy(eval.cell, eval.cell+9, shared->cell);
+        shared->computeForces = (eval.forces != NULL);
+        shared->computeVirial = (eval.virial != NULL);
+        exchange(EVALUATE);
+        eval.energy = shared->energy;
+        if (eval.forces != NULL) {
+            const float* forces = getSharedForces(shared);
+            copy(forces, forces+3*numAtoms, eval.forces);
+        }
+        if (eval.virial != NULL)
+            copy(shared->virial, shared->virial+9, eval.virial);
+    }
+}
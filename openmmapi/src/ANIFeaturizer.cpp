@@ -0,0 +1,222 @@
+/* -------------------------------------------------------------------------- *
+ * The MIT License
+ *
+ * SPDX short identifier: MIT
+ *
+ * Copyright 2019 Genentech Inc. South San Francisco
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ * -------------------------------------------------------------------------- */
+
+#include "ANIFeaturizer.h"
+#include "internal/ANIModelLoader.h"
+#include "internal/CpuANIEngine.h"
+#include "openmm/OpenMMException.h"
+#include <cstring>
+
+using namespace ANIPlugin;
+using namespace OpenMM;
+using namespace std;
+
+static const char MAGIC[8] = {'A', 'N', 'I', 'A', 'E', 'V', 0, 0};
+static const int VERSION = 1;
+static const int HEADER_SIZE = 64;
+
+static long long alignOffset(long long offset) {
+    return (offset+63) & ~63LL;
+}
+
+static void writeBytes(FILE* file, const void* data, size_t size, const string& fileName) {
+    if (size > 0 && fwrite(data, 1, size, file) != size)
+        throw OpenMMException("Error writing "+fileName);
+}
+
+static void writePadding(FILE* file, long long size, const string& fileName) {
+    static const char zeros[64] = {0};
+    writeBytes(file, zeros, alignOffset(size)-size, fileName);
+}
+
+ANIFeaturizer::ANIFeaturizer(const string& aniInfoFile, const string& outputFile, int batchSize, int numThreads) :
+        engine(NULL), fileName(outputFile), file(NULL), batchSize(batchSize), numPending(0), currentBuffer(0), dataSize(0) {
+    if (batchSize < 1)
+        throw OpenMMException("ANIFeaturizer: the batch size must be positive");
+    shared_ptr<const ANIModel> model = ANIModelLoader::get(aniInfoFile);
+    if (model->species.size() > 127)
+        throw OpenMMException("ANIFeaturizer: the model has too many species");
+    for (const string& symbol : model->species)
+        if (symbol.size() > 3)
+            throw OpenMMException("ANIFeaturizer: the species name "+symbol+" is too long");
+    engine = new CpuANIEngine(*model, numThreads);
+    file = fopen(outputFile.c_str(), "wb");
+    if (file == NULL) {
+        delete engine;
+        throw OpenMMException("Cannot create "+outputFile);
+    }
+    pending.resize(batchSize);
+    offsets.push_back(0);
+
+    // Write a header without counts now, so the AEVs can follow it.
+
+    writeHeader();
+    for (const string& symbol : getSpecies()) {
+        char name[4] = {0};
+        strncpy(name, symbol.c_str(), 3);
+        writeBytes(file, name, 4, fileName);
+    }
+    writePadding(file, HEADER_SIZE+4*getSpecies().size(), fileName);
+}
+
+ANIFeaturizer::~ANIFeaturizer() {
+    if (file != NULL) {
+        try {
+            close();
+        }
+        catch (...) {
+            // A destructor cannot report errors.  Call close() to see them.
+        }
+        if (file != NULL)
+            fclose(file);
+    }
+    delete engine;
+}
+
+int ANIFeaturizer::getAEVLength() const {
+    return engine->getAEVLength();
+}
+
+const vector<string>& ANIFeaturizer::getSpecies() const {
+    return engine->getModel().species;
+}
+
+void ANIFeaturizer::addStructure(const vector<string>& atomSymbols, const vector<Vec3>& positions) {
+    addStructure(atomSymbols, positions, vector<Vec3>());
+}
+
+void ANIFeaturizer::addStructure(const vector<string>& atomSymbols, const vector<Vec3>& positions, const vector<Vec3>& boxVectors) {
+    if (positions.size() != atomSymbols.size())
+        throw OpenMMException("ANIFeaturizer: the number of positions does not match the number of atoms");
+    if (!boxVectors.empty() && boxVectors.size() != 3)
+        throw OpenMMException("ANIFeaturizer: three box vectors are needed");
+    vector<float> aniPositions(3*positions.size()), cell(9);
+    for (int i = 0; i < positions.size(); i++)
+        for (int j = 0; j < 3; j++)
+            aniPositions[3*i+j] = positions[i][j]*NM_TO_ANGST;
+    for (int i = 0; i < boxVectors.size(); i++)
+        for (int j = 0; j < 3; j++)
+            cell[3*i+j] = boxVectors[i][j]*NM_TO_ANGST;
+    addStructure(atomSymbols, aniPositions.data(), boxVectors.empty() ? NULL : cell.data());
+}
+
+void ANIFeaturizer::addStructure(const vector<string>& atomSymbols, const float* positions, const float* cell) {
+    if (file == NULL)
+        throw OpenMMException("ANIFeaturizer: the file has been closed");
+
+    // Check the structure now rather than failing the whole batch later.
+
+    ANIEvaluation eval;
+    eval.symbols = &atomSymbols;
+    eval.positions = positions;
+    eval.cell = cell;
+    engine->checkStructure(eval);
+    Structure& structure = pending[numPending++];
+    structure.symbols = atomSymbols;
+    structure.positions.assign(positions, positions+3*atomSymbols.size());
+    if (cell == NULL)
+        structure.cell.clear();
+    else
+        structure.cell.assign(cell, cell+9);
+    if (numPending == batchSize)
+        flush();
+}
+
+long long ANIFeaturizer::getNumStructures() const {
+    return offsets.size()-1+numPending;
+}
+
+void ANIFeaturizer::flush() {
+    if (numPending == 0)
+        return;
+    const int aevLength = getAEVLength();
+    vector<ANIEvaluation> batch(numPending);
+    long long numAtoms = 0;
+    for (int i = 0; i < numPending; i++)
+        numAtoms += pending[i].symbols.size();
+
+    // The other buffer may still be written to the file, so this batch goes
+    // to the current one.
+
+    vector<float>& buffer = buffers[currentBuffer];
+    buffer.resize(numAtoms*aevLength);
+    vector<float*> aevs(numPending);
+    long long row = 0;
+    for (int i = 0; i < numPending; i++) {
+        Structure& structure = pending[i];
+        batch[i].symbols = &structure.symbols;
+        batch[i].positions = structure.positions.data();
+        batch[i].cell = (structure.cell.empty() ? NULL : structure.cell.data());
+        aevs[i] = &buffer[row*aevLength];
+        row += structure.symbols.size();
+        offsets.push_back(offsets.back()+structure.symbols.size());
+        for (const string& symbol : structure.symbols)
+            atomSpecies.push_back(engine->getModel().getSpeciesIndex(symbol));
+    }
+    engine->computeAEVs(batch, aevs);
+    numPending = 0;
+    if (writing.valid())
+        writing.get();
+    writing = async(launch::async, [this, &buffer] () {
+        writeBytes(file, buffer.data(), buffer.size()*sizeof(float), fileName);
+    });
+    dataSize += buffer.size()*sizeof(float);
+    currentBuffer = 1-currentBuffer;
+}
+
+void ANIFeaturizer::writeHeader() {
+    char header[HEADER_SIZE] = {0};
+    int values[] = {VERSION, getAEVLength(), (int) getSpecies().size(), (int) alignOffset(HEADER_SIZE+4*getSpecies().size())};
+    long long counts[] = {(long long) offsets.size()-1, offsets.back(), 0};
+    if (counts[0] > 0)
+        counts[2] = alignOffset(values[3]+dataSize);
+    memcpy(header, MAGIC, sizeof(MAGIC));
+    memcpy(header+8, values, sizeof(values));
+    memcpy(header+24, counts, sizeof(counts));
+    writeBytes(file, header, HEADER_SIZE, fileName);
+}
+
+void ANIFeaturizer::close() {
+    if (file == NULL)
+        return;
+    flush();
+    if (writing.valid())
+        writing.get();
+
+    // Append the index and fill in the header.
+
+    writePadding(file, dataSize, fileName);
+    writeBytes(file, offsets.data(), offsets.size()*sizeof(long long), fileName);
+    writeBytes(file, atomSpecies.data(), atomSpecies.size(), fileName);
+    if (fseek(file, 0, SEEK_SET) != 0)
+        throw OpenMMException("Error writing "+fileName);
+    writeHeader();
+    if (fclose(file) != 0) {
+        file = NULL;
+        throw OpenMMException("Error writing "+fileName);
+    }
+    file = NULL;
+}
@@ -31,6 +31,7 @@
 
 #include "ANIForce.h"
 #include "internal/ANIForceImpl.h"
+#include "internal/ANIModelLoader.h"
 #include "openmm/OpenMMException.h"
 #include "openmm/internal/AssertionUtilities.h"
 #include <iostream>
@@ -42,13 +43,23 @@ using namespace OpenMM;
 using namespace std;
 
 ANIForce::ANIForce(const string& aniInfoFile, const vector<string> atomSymbols) : 
-   aniInfoFile(aniInfoFile), usePeriodic(false), atomSymbols(atomSymbols) {
+   aniInfoFile(aniInfoFile), usePeriodic(false), useSharedEngine(false), maxBatchWait(0.0), maxMemory(0.0), maxRecordingSize(1000.0), numDomainWorkers(0), recordingInterval(1), atomSymbols(atomSymbols), alchemicalParameter("lambda_ani") {
+    heldModel = ANIModelLoader::hold(aniInfoFile);
+}
+
+void ANIForce::preloadModel(const string& aniInfoFile) {
+    ANIModelLoader::preload(aniInfoFile);
 }
 
 const string& ANIForce::getInfoFile() const {
     return aniInfoFile;
 }
 
+void ANIForce::setInfoFile(const string& aniInfoFile) {
+    this->aniInfoFile = aniInfoFile;
+    heldModel = ANIModelLoader::hold(aniInfoFile);
+}
+
 const vector<string> ANIForce::getAtomSymbols() const {
     return atomSymbols;
 }
@@ -66,3 +77,103 @@ void ANIForce::setUsesPeriodicBoundaryConditions(bool periodic) {
 bool ANIForce::usesPeriodicBoundaryConditions() const {
     return usePeriodic;
 }
+
+void ANIForce::setUseSharedEngine(bool shared) {
+    useSharedEngine = shared;
+}
+
+bool ANIForce::getUseSharedEngine() const {
+    return useSharedEngine;
+}
+
+void ANIForce::setMaxBatchWait(double wait) {
+    if (wait < 0)
+        throw OpenMMException("ANIForce: the maximum batch wait cannot be negative");
+    maxBatchWait = wait;
+}
+
+double ANIForce::getMaxBatchWait() const {
+    return maxBatchWait;
+}
+
+void ANIForce::setServer(const string& socketPath) {
+    serverPath = socketPath;
+}
+
+const string& ANIForce::getServer() const {
+    return serverPath;
+}
+
+void ANIForce::setNumDomainWorkers(int workers) {
+    if (workers < 0)
+        throw OpenMMException("ANIForce: the number of domain workers cannot be negative");
+    numDomainWorkers = workers;
+}
+
+int ANIForce::getNumDomainWorkers() const {
+    return numDomainWorkers;
+}
+
+void ANIForce::setMaxMemory(double megabytes) {
+    if (megabytes < 0)
+        throw OpenMMException("ANIForce: the memory limit cannot be negative");
+    maxMemory = megabytes;
+}
+
+double ANIForce::getMaxMemory() const {
+    return maxMemory;
+}
+
+void ANIForce::setRecording(const string& file, int interval, double maxMegabytes) {
+    if (interval < 1)
+        throw OpenMMException("ANIForce: the recording interval must be at least 1");
+    if (maxMegabytes < 0)
+        throw OpenMMException("ANIForce: the maximum recording size cannot be negative");
+    recordingFile = file;
+    recordingInterval = interval;
+    maxRecordingSize = maxMegabytes;
+}
+
+const string& ANIForce::getRecordingFile() const {
+    return recordingFile;
+}
+
+int ANIForce::getRecordingInterval() const {
+    return recordingInterval;
+}
+
+double ANIForce::getMaxRecordingSize() const {
+    return maxRecordingSize;
+}
+
+void ANIForce::setAlchemicalSymbols(const vector<string>& symbols) {
+    if (!symbols.empty() && symbols.size() != atomSymbols.size())
+        throw OpenMMException("ANIForce: the alchemical state must have a symbol for every atom");
+    alchemicalSymbols = symbols;
+}
+
+const vector<string>& ANIForce::getAlchemicalSymbols() const {
+    return alchemicalSymbols;
+}
+
+void ANIForce::setAlchemicalParameter(const string& name) {
+    alchemicalParameter = name;
+}
+
+const string& ANIForce::getAlchemicalParameter() const {
+    return alchemicalParameter;
+}
+
+vector<Vec3> ANIForce::computeVirial(Context& context) {
+    vector<Vec3> virial;
+    dynamic_cast<ANIForceImpl&>(getImplInContext(context)).computeVirial(getContextImpl(context), virial);
+    return virial;
+}
+
+void ANIForce::updateParametersInContext(Context& context) {
+    dynamic_cast<ANIForceImpl&>(getImplInContext(context)).updateParametersInContext(getContextImpl(context));
+}
+
+double ANIForce::getPeakMemory(Context& context) {
+    return dynamic_cast<ANIForceImpl&>(getImplInContext(context)).getPeakMemory(getContextImpl(context));
+}
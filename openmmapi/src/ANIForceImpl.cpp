@@ -33,10 +33,6 @@
 #include "ANIKernels.h"
 #include "openmm/OpenMMException.h"
 #include "openmm/internal/ContextImpl.h"
-#include <fstream>
-#include <iostream>
-#include <sstream>
-#include "neurochemcpp_iface.h"
 
 using namespace ANIPlugin;
 using namespace OpenMM;
@@ -46,49 +42,11 @@ ANIForceImpl::ANIForceImpl(const ANIForce& owner) : owner(owner) {
 }
 
 ANIForceImpl::~ANIForceImpl() {
-    // Cleanup instances (required to shut the classes down before the driver shuts down)
-    neurochem::molecule_instances.clear();
 }
 
 
-string ANIForceImpl::compileError(string varName, string fileName) {
-    ostringstream oss;
-    oss << "InfoFile " << fileName << " has no line for " << varName;
-    return oss.str();
-}
-
 void ANIForceImpl::initialize(ContextImpl& context) {
-    // Load the graph from the file.
-
-
-    string infoFile = owner.getInfoFile();
-    ifstream infile( infoFile );
-
-    string netWorkDir;
-    if( ! getline(infile, netWorkDir) )
-        throw OpenMMException(compileError("netWorkDir",infoFile));
-
-    string paramFile;
-    if( ! getline(infile, paramFile) )
-        throw OpenMMException(compileError("paramFile",infoFile));
-
-    string atomFitFile;
-    if( ! getline(infile, atomFitFile) )
-        throw OpenMMException(compileError("atomFitFile",infoFile));
-
-    string dummy;
-    if( ! getline(infile, dummy) )
-        throw OpenMMException(compileError("ensamples",infoFile));
-    int nEnsambles = stoi(dummy);
-
-    cerr << "initilized ANI with args=" << infoFile << " paramFile:" << paramFile
-         << " atomFitFile:"<<atomFitFile << " netWorkDir:"<<netWorkDir
-         << " nEnsambles:"<<nEnsambles << endl;
-
-    // Initialize ANI Network as ensamble of multiple networks
-    neurochem::instantiate_ani_ensemble(paramFile,atomFitFile,netWorkDir,nEnsambles);
-
-    // Create the kernel.
+    // Create the kernel.  Each platform loads the networks in its own way.
     kernel = context.getPlatform().createKernel(CalcANIForceKernel::Name(), context);
     kernel.getAs<CalcANIForceKernel>().initialize(context.getSystem(), owner);
 }
@@ -99,6 +57,19 @@ double ANIForceImpl::calcForcesAndEnergy(ContextImpl& context, bool includeForce
     return 0.0;
 }
 
+void ANIForceImpl::computeVirial(ContextImpl& context, vector<Vec3>& virial) {
+    kernel.getAs<CalcANIForceKernel>().computeVirial(context, virial);
+}
+
+void ANIForceImpl::updateParametersInContext(ContextImpl& context) {
+    kernel.getAs<CalcANIForceKernel>().copyParametersToContext(context, owner);
+    context.systemChanged();
+}
+
+double ANIForceImpl::getPeakMemory(ContextImpl& context) {
+    return kernel.getAs<CalcANIForceKernel>().getPeakMemory(context);
+}
+
 vector<string> ANIForceImpl::getKernelNames() {
     vector<string> names;
     names.push_back(CalcANIForceKernel::Name());
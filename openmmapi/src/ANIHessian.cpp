@@ -0,0 +1,378 @@
+/* -------------------------------------------------------------------------- *
+ * The MIT License
+ *
+ * SPDX short identifier: MIT
+ *
+ * Copyright 2019 Genentech Inc. South San Francisco
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ * -------------------------------------------------------------------------- */
+
+
+#include "ANIHessian.h"
+#include "openmm/OpenMMException.h"
+#include <algorithm>
+#include <cmath>
+
+using namespace ANIPlugin;
+using namespace OpenMM;
+using namespace std;
+
+// Speed of light in cm/ps, converts sqrt(kJ/mol/nm^2/amu) = 1/ps to cm^-1.
+static const double SPEED_OF_LIGHT_CM_PS = 2.99792458e-2;
+
+ANIHessian::ANIHessian(const string& aniInfoFile, const string& engineName) : engine(ANIEngine::create(aniInfoFile, engineName)), ownsEngine(true),
+        displacement(0.001), energy(0.0), maxBatchSize(0), numAtoms(0), numBatchEvaluations(0) {
+}
+
+ANIHessian::ANIHessian(ANIEngine& engine) : engine(&engine), ownsEngine(false),
+        displacement(0.001), energy(0.0), maxBatchSize(0), numAtoms(0), numBatchEvaluations(0) {
+}
+
+ANIHessian::~ANIHessian() {
+    if (ownsEngine)
+        delete engine;
+}
+
+double ANIHessian::getDisplacement() const {
+    return displacement;
+}
+
+void ANIHessian::setDisplacement(double displacement) {
+    if (displacement <= 0.0)
+        throw OpenMMException("ANIHessian: the displacement must be positive");
+    this->displacement = displacement;
+}
+
+int ANIHessian::getMaxBatchSize() const {
+    return maxBatchSize;
+}
+
+void ANIHessian::setMaxBatchSize(int size) {
+    if (size < 0)
+        throw OpenMMException("ANIHessian: the batch size must not be negative");
+    maxBatchSize = size;
+}
+
+void ANIHessian::computeHessian(const vector<string>& atomSymbols, const vector<Vec3>& positions) {
+    if (atomSymbols.size() != positions.size())
+        throw OpenMMException("ANIHessian: number of atom symbols and positions differ");
+    numAtoms = atomSymbols.size();
+    int n3 = 3*numAtoms;
+    vector<float> reference(n3);
+    for (int i = 0; i < numAtoms; i++)
+        for (int j = 0; j < 3; j++)
+            reference[3*i+j] = positions[i][j] * NM_TO_ANGST;
+
+    // Structure 0 is the reference geometry, structures 2k+1 and 2k+2 displace
+    // coordinate k by +delta and -delta.  The engine takes single precision
+    // coordinates, so the displacements are rounded, and each row is scaled by
+    // the distance between the two displaced coordinates that were actually
+    // evaluated.
+
+    double delta = displacement*NM_TO_ANGST;
+    vector<float> plus(n3), minus(n3);
+    vector<double> rowScale(n3);
+    for (int k = 0; k < n3; k++) {
+        plus[k] = (float) (reference[k]+delta);
+        minus[k] = (float) (reference[k]-delta);
+        rowScale[k] = HARTREE_TO_KJ_MOL*NM_TO_ANGST*NM_TO_ANGST/((double) plus[k]-(double) minus[k]);
+    }
+    int numStructures = 2*n3+1;
+    int batchSize = (maxBatchSize > 0 ? min(maxBatchSize, numStructures) : numStructures);
+    vector<float> batchPositions((size_t) batchSize*n3), batchForces((size_t) batchSize*n3);
+    vector<ANIEvaluation> batch;
+    hessian.assign((size_t) n3*n3, 0.0);
+    forces.assign(n3, 0.0);
+    frequencies.clear();
+    modes.clear();
+    numBatchEvaluations = 0;
+    for (int start = 0; start < numStructures; start += batchSize) {
+        int count = min(batchSize, numStructures-start);
+        batch.resize(count);
+        for (int b = 0; b < count; b++) {
+            int s = start+b;
+            float* pos = &batchPositions[(size_t) b*n3];
+            copy(reference.begin(), reference.end(), pos);
+            if (s > 0)
+                pos[(s-1)/2] = ((s-1)%2 == 0 ? plus[(s-1)/2] : minus[(s-1)/2]);
+            batch[b] = ANIEvaluation();
+            batch[b].symbols = &atomSymbols;
+            batch[b].positions = pos;
+            batch[b].forces = &batchForces[(size_t) b*n3];
+        }
+        engine->computeBatch(batch);
+        numBatchEvaluations++;
+        for (int b = 0; b < count; b++) {
+            int s = start+b;
+            const float* f = batch[b].forces;
+            if (s == 0) {
+                energy = batch[b].energy;
+                for (int j = 0; j < n3; j++)
+                    forces[j] = f[j];
+                continue;
+            }
+            int row = (s-1)/2;
+            double sign = ((s-1)%2 == 0 ? -rowScale[row] : rowScale[row]);
+            double* h = &hessian[(size_t) row*n3];
+            for (int j = 0; j < n3; j++)
+                h[j] += sign*f[j];
+        }
+    }
+
+    // Finite differences break the symmetry slightly, restore it.
+
+    for (int i = 0; i < n3; i++)
+        for (int j = 0; j < i; j++) {
+            double average = 0.5*(hessian[(size_t) i*n3+j] + hessian[(size_t) j*n3+i]);
+            hessian[(size_t) i*n3+j] = average;
+            hessian[(size_t) j*n3+i] = average;
+        }
+}
+
+/**
+ * Householder reduction of the symmetric matrix V to tridiagonal form, after
+ * the public domain JAMA implementation.  On return V holds the orthogonal
+ * transformation, d the diagonal and e the off diagonal.
+ */
+static void tridiagonalize(int n, vector<double>& V, vector<double>& d, vector<double>& e) {
+    for (int j = 0; j < n; j++)
+        d[j] = V[(size_t) (n-1)*n+j];
+    for (int i = n-1; i > 0; i--) {
+        double scale = 0.0;
+        double h = 0.0;
+        for (int k = 0; k < i; k++)
+            scale += fabs(d[k]);
+        if (scale == 0.0) {
+            e[i] = d[i-1];
+            for (int j = 0; j < i; j++) {
+                d[j] = V[(size_t) (i-1)*n+j];
+                V[(size_t) i*n+j] = 0.0;
+                V[(size_t) j*n+i] = 0.0;
+            }
+        }
+        else {
+            for (int k = 0; k < i; k++) {
+                d[k] /= scale;
+                h += d[k]*d[k];
+            }
+            double f = d[i-1];
+            double g = sqrt(h);
+            if (f > 0)
+                g = -g;
+            e[i] = scale*g;
+            h = h - f*g;
+            d[i-1] = f - g;
+            for (int j = 0; j < i; j++)
+                e[j] = 0.0;
+            for (int j = 0; j < i; j++) {
+                f = d[j];
+                V[(size_t) j*n+i] = f;
+                g = e[j] + V[(size_t) j*n+j]*f;
+                for (int k = j+1; k <= i-1; k++) {
+                    g += V[(size_t) k*n+j]*d[k];
+                    e[k] += V[(size_t) k*n+j]*f;
+                }
+                e[j] = g;
+            }
+            f = 0.0;
+            for (int j = 0; j < i; j++) {
+                e[j] /= h;
+                f += e[j]*d[j];
+            }
+            double hh = f/(h+h);
+            for (int j = 0; j < i; j++)
+                e[j] -= hh*d[j];
+            for (int j = 0; j < i; j++) {
+                f = d[j];
+                g = e[j];
+                for (int k = j; k <= i-1; k++)
+                    V[(size_t) k*n+j] -= (f*e[k] + g*d[k]);
+                d[j] = V[(size_t) (i-1)*n+j];
+                V[(size_t) i*n+j] = 0.0;
+            }
+        }
+        d[i] = h;
+    }
+    for (int i = 0; i < n-1; i++) {
+        V[(size_t) (n-1)*n+i] = V[(size_t) i*n+i];
+        V[(size_t) i*n+i] = 1.0;
+        double h = d[i+1];
+        if (h != 0.0) {
+            for (int k = 0; k <= i; k++)
+                d[k] = V[(size_t) k*n+i+1]/h;
+            for (int j = 0; j <= i; j++) {
+                double g = 0.0;
+                for (int k = 0; k <= i; k++)
+                    g += V[(size_t) k*n+i+1]*V[(size_t) k*n+j];
+                for (int k = 0; k <= i; k++)
+                    V[(size_t) k*n+j] -= g*d[k];
+            }
+        }
+        for (int k = 0; k <= i; k++)
+            V[(size_t) k*n+i+1] = 0.0;
+    }
+    for (int j = 0; j < n; j++) {
+        d[j] = V[(size_t) (n-1)*n+j];
+        V[(size_t) (n-1)*n+j] = 0.0;
+    }
+    V[(size_t) (n-1)*n+n-1] = 1.0;
+    e[0] = 0.0;
+}
+
+/**
+ * Implicit QL iterations on the tridiagonal matrix produced by tridiagonalize().
+ * On return d holds the eigenvalues in ascending order and the columns of V the
+ * corresponding eigenvectors.
+ */
+static void diagonalizeTridiagonal(int n, vector<double>& V, vector<double>& d, vector<double>& e) {
+    for (int i = 1; i < n; i++)
+        e[i-1] = e[i];
+    e[n-1] = 0.0;
+    double f = 0.0;
+    double tst1 = 0.0;
+    double eps = pow(2.0, -52.0);
+    for (int l = 0; l < n; l++) {
+        tst1 = max(tst1, fabs(d[l]) + fabs(e[l]));
+        int m = l;
+        while (m < n-1 && fabs(e[m]) > eps*tst1)
+            m++;
+        if (m > l) {
+            do {
+                double g = d[l];
+                double p = (d[l+1] - g)/(2.0*e[l]);
+                double r = hypot(p, 1.0);
+                if (p < 0)
+                    r = -r;
+                d[l] = e[l]/(p + r);
+                d[l+1] = e[l]*(p + r);
+                double dl1 = d[l+1];
+                double h = g - d[l];
+                for (int i = l+2; i < n; i++)
+                    d[i] -= h;
+                f += h;
+                p = d[m];
+                double c = 1.0, c2 = c, c3 = c;
+                double el1 = e[l+1];
+                double s = 0.0, s2 = 0.0;
+                for (int i = m-1; i >= l; i--) {
+                    c3 = c2;
+                    c2 = c;
+                    s2 = s;
+                    g = c*e[i];
+                    h = c*p;
+                    r = hypot(p, e[i]);
+                    e[i+1] = s*r;
+                    s = e[i]/r;
+                    c = p/r;
+                    p = c*d[i] - s*g;
+                    d[i+1] = h + s*(c*g + s*d[i]);
+                    for (int k = 0; k < n; k++) {
+                        h = V[(size_t) k*n+i+1];
+                        V[(size_t) k*n+i+1] = s*V[(size_t) k*n+i] + c*h;
+                        V[(size_t) k*n+i] = c*V[(size_t) k*n+i] - s*h;
+                    }
+                }
+                p = -s*s2*c3*el1*e[l]/dl1;
+                e[l] = s*p;
+                d[l] = c*p;
+            } while (fabs(e[l]) > eps*tst1);
+        }
+        d[l] = d[l] + f;
+        e[l] = 0.0;
+    }
+    for (int i = 0; i < n-1; i++) {
+        int k = i;
+        double p = d[i];
+        for (int j = i+1; j < n; j++)
+            if (d[j] < p) {
+                k = j;
+                p = d[j];
+            }
+        if (k != i) {
+            d[k] = d[i];
+            d[i] = p;
+            for (int j = 0; j < n; j++)
+                swap(V[(size_t) j*n+i], V[(size_t) j*n+k]);
+        }
+    }
+}
+
+void ANIHessian::computeNormalModes(const vector<double>& masses) {
+    if (hessian.empty())
+        throw OpenMMException("ANIHessian: computeHessian() must be called before computeNormalModes()");
+    if (masses.size() != numAtoms)
+        throw OpenMMException("ANIHessian: number of masses and atoms differ");
+    int n3 = 3*numAtoms;
+    vector<double> V(hessian.size());
+    for (int i = 0; i < n3; i++)
+        for (int j = 0; j < n3; j++)
+            V[(size_t) i*n3+j] = hessian[(size_t) i*n3+j]/sqrt(masses[i/3]*masses[j/3]);
+    vector<double> eigenvalues(n3), offDiagonal(n3);
+    tridiagonalize(n3, V, eigenvalues, offDiagonal);
+    diagonalizeTridiagonal(n3, V, eigenvalues, offDiagonal);
+
+    // Eigenvalues are in kJ/mol/nm^2/amu = 1/ps^2.
+
+    frequencies.resize(n3);
+    modes.resize(V.size());
+    for (int k = 0; k < n3; k++) {
+        double omega = sqrt(fabs(eigenvalues[k]));
+        frequencies[k] = (eigenvalues[k] < 0 ? -1 : 1) * omega/(2*M_PI*SPEED_OF_LIGHT_CM_PS);
+        for (int j = 0; j < n3; j++)
+            modes[(size_t) k*n3+j] = V[(size_t) j*n3+k];
+    }
+}
+
+int ANIHessian::getNumAtoms() const {
+    return numAtoms;
+}
+
+double ANIHessian::getEnergy() const {
+    return energy * HARTREE_TO_KJ_MOL;
+}
+
+vector<Vec3> ANIHessian::getForces() const {
+    vector<Vec3> result(numAtoms);
+    for (int i = 0; i < numAtoms; i++)
+        result[i] = Vec3(forces[3*i], forces[3*i+1], forces[3*i+2]) * HARTREE_A_TO_KJ_MOL_NM;
+    return result;
+}
+
+const vector<double>& ANIHessian::getHessian() const {
+    return hessian;
+}
+
+const vector<double>& ANIHessian::getFrequencies() const {
+    return frequencies;
+}
+
+vector<Vec3> ANIHessian::getNormalMode(int index) const {
+    if (index < 0 || index >= frequencies.size())
+        throw OpenMMException("ANIHessian: illegal normal mode index");
+    vector<Vec3> mode(numAtoms);
+    const double* v = &modes[(size_t) index*3*numAtoms];
+    for (int i = 0; i < numAtoms; i++)
+        mode[i] = Vec3(v[3*i], v[3*i+1], v[3*i+2]);
+    return mode;
+}
+
+int ANIHessian::getNumBatchEvaluations() const {
+    return numBatchEvaluations;
+}
@@ -0,0 +1,286 @@
+/* -------------------------------------------------------------------------- *
+ * The MIT License
+ *
+ * SPDX short identifier: MIT
+ *
+ * Copyright 2019 Genentech Inc. South San Francisco
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ * -------------------------------------------------------------------------- */
+
+
+#include "internal/ANIModel.h"
+#include "openmm/OpenMMException.h"
+#include <bzlib.h>
+#include <cctype>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+
+using namespace ANIPlugin;
+using namespace OpenMM;
+using namespace std;
+
+static string trim(const string& s) {
+    size_t start = s.find_first_not_of(" \t\r\n");
+    if (start == string::npos)
+        return "";
+    size_t end = s.find_last_not_of(" \t\r\n");
+    return s.substr(start, end-start+1);
+}
+
+static vector<string> splitList(const string& value) {
+    string list = value;
+    for (char& c : list)
+        if (c == '[' || c == ']')
+            c = ' ';
+    vector<string> result;
+    stringstream ss(list);
+    for (string item; getline(ss, item, ','); )
+        if (!trim(item).empty())
+            result.push_back(trim(item));
+    return result;
+}
+
+static vector<float> parseFloats(const string& value) {
+    vector<float> result;
+    for (const string& item : splitList(value))
+        result.push_back(stof(item));
+    return result;
+}
+
+static string directoryOf(const string& path) {
+    size_t pos = path.find_last_of('/');
+    return (pos == string::npos ? "." : path.substr(0, pos));
+}
+
+static string resolvePath(const string& dir, const string& file) {
+    if (file.empty() || file[0] == '/')
+        return file;
+    return dir + "/" + file;
+}
+
+ANIModel ANIModel::load(const ANIModelInfo& info) {
+    ANIModel model;
+    model.readParameters(resolvePath(info.netWorkDir, info.paramFile));
+    model.readSelfEnergies(resolvePath(info.netWorkDir, info.atomFitFile));
+    model.networks.resize(info.nEnsembles);
+    for (int e = 0; e < info.nEnsembles; e++) {
+        for (const string& symbol : model.species) {
+            string nnfFile = info.netWorkDir + "/train" + to_string(e) + "/networks/ANN-" + symbol + ".nnf";
+            Network network = readNetwork(nnfFile);
+            if (network.front().inputSize != model.getAEVLength())
+                throw OpenMMException(nnfFile + " does not match the AEV length of " + info.paramFile);
+            model.networks[e].push_back(network);
+        }
+    }
+    return model;
+}
+
+void ANIModel::readParameters(const string& paramFile) {
+    ifstream infile(paramFile);
+    if (!infile)
+        throw OpenMMException("could not open " + paramFile);
+    radialCutoff = angularCutoff = 0.0f;
+    for (string line; getline(infile, line); ) {
+        size_t pos = line.find('=');
+        if (pos == string::npos)
+            continue;
+        string name = trim(line.substr(0, pos));
+        string value = trim(line.substr(pos+1));
+        if (name == "Rcr")
+            radialCutoff = stof(value);
+        else if (name == "Rca")
+            angularCutoff = stof(value);
+        else if (name == "EtaR")
+            etaR = parseFloats(value);
+        else if (name == "ShfR")
+            shfR = parseFloats(value);
+        else if (name == "EtaA")
+            etaA = parseFloats(value);
+        else if (name == "Zeta")
+            zeta = parseFloats(value);
+        else if (name == "ShfA")
+            shfA = parseFloats(value);
+        else if (name == "ShfZ")
+            shfZ = parseFloats(value);
+        else if (name == "Atyp")
+            species = splitList(value);
+    }
+    if (radialCutoff <= 0 || angularCutoff <= 0 || etaR.empty() || shfR.empty() || etaA.empty() ||
+            zeta.empty() || shfA.empty() || shfZ.empty() || species.empty())
+        throw OpenMMException(paramFile + " is not a complete ANI parameter file");
+}
+
+void ANIModel::readSelfEnergies(const string& atomFitFile) {
+    ifstream infile(atomFitFile);
+    if (!infile)
+        throw OpenMMException("could not open " + atomFitFile);
+    vector<bool> found(species.size(), false);
+    selfEnergies.assign(species.size(), 0.0);
+    for (string line; getline(infile, line); ) {
+        // Lines have the form "H,0=-0.600952980000"
+        size_t pos = line.find('=');
+        if (pos == string::npos)
+            continue;
+        string symbol = trim(line.substr(0, line.find(',')));
+        int index = getSpeciesIndex(symbol);
+        if (index < 0)
+            continue;
+        selfEnergies[index] = stod(line.substr(pos+1));
+        found[index] = true;
+    }
+    for (int i = 0; i < species.size(); i++)
+        if (!found[i])
+            throw OpenMMException(atomFitFile + " has no self energy for " + species[i]);
+}
+
+/**
+ * NeuroChem network files start with a short text header ending in "=" followed
+ * by one separator byte and the bzip2 compressed network description.
+ */
+static string decompressNetworkFile(const string& nnfFile) {
+    ifstream infile(nnfFile, ios::binary);
+    if (!infile)
+        throw OpenMMException("could not open " + nnfFile);
+    string buffer((istreambuf_iterator<char>(infile)), istreambuf_iterator<char>());
+    size_t start = buffer.find('=');
+    if (start == string::npos || start+2 > buffer.size())
+        throw OpenMMException(nnfFile + " is not a NeuroChem network file");
+    start += 2;
+
+    bz_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (BZ2_bzDecompressInit(&stream, 0, 0) != BZ_OK)
+        throw OpenMMException("could not initialize bzip2");
+    stream.next_in = &buffer[start];
+    stream.avail_in = buffer.size()-start;
+    string text;
+    char block[1<<16];
+    int status;
+    do {
+        stream.next_out = block;
+        stream.avail_out = sizeof(block);
+        status = BZ2_bzDecompress(&stream);
+        text.append(block, sizeof(block)-stream.avail_out);
+    } while (status == BZ_OK && (stream.avail_in > 0 || stream.avail_out == 0));
+    BZ2_bzDecompressEnd(&stream);
+    if (status != BZ_STREAM_END)
+        throw OpenMMException("could not decompress " + nnfFile);
+
+    // The description is NUL terminated.
+    size_t end = text.find('\0');
+    if (end != string::npos)
+        text.resize(end);
+    return text;
+}
+
+static vector<float> readParameterFile(const string& fileName, int count) {
+    ifstream infile(fileName, ios::binary);
+    if (!infile)
+        throw OpenMMException("could not open " + fileName);
+    vector<float> values(count);
+    infile.read((char*) values.data(), count*sizeof(float));
+    if (infile.gcount() != count*sizeof(float))
+        throw OpenMMException(fileName + " is too short");
+    return values;
+}
+
+/**
+ * Parse a value of the form "FILE:name[count]".
+ */
+static void parseFileReference(const string& value, const string& nnfFile, string& fileName, int& count) {
+    size_t open = value.find('[');
+    size_t close = value.find(']');
+    if (value.compare(0, 5, "FILE:") != 0 || open == string::npos || close == string::npos || close < open)
+        throw OpenMMException(nnfFile + ": cannot parse parameter file reference " + value);
+    fileName = resolvePath(directoryOf(nnfFile), trim(value.substr(5, open-5)));
+    count = stoi(value.substr(open+1, close-open-1));
+}
+
+ANIModel::Network ANIModel::readNetwork(const string& nnfFile) {
+    string text = decompressNetworkFile(nnfFile);
+    Network network;
+    size_t pos = 0;
+    while ((pos = text.find("layer", pos)) != string::npos) {
+        bool isKeyword = (pos == 0 || !(isalnum(text[pos-1]) || text[pos-1] == '_'));
+        pos += 5;
+        size_t bracket = text.find_first_not_of(" \t\r\n", pos);
+        if (!isKeyword || bracket == string::npos || text[bracket] != '[')
+            continue;
+
+        // Read "name=value;" assignments up to the closing bracket.
+
+        Layer layer;
+        layer.inputSize = layer.outputSize = -1;
+        int activation = -1;
+        string weightFile, biasFile;
+        int weightCount = -1, biasCount = -1;
+        pos = bracket+1;
+        while (true) {
+            pos = text.find_first_not_of(" \t\r\n", pos);
+            if (pos == string::npos)
+                throw OpenMMException(nnfFile + ": unterminated layer");
+            if (text[pos] == ']') {
+                pos++;
+                break;
+            }
+            size_t equals = text.find('=', pos);
+            size_t semicolon = text.find(';', pos);
+            if (equals == string::npos || semicolon == string::npos || semicolon < equals)
+                throw OpenMMException(nnfFile + ": cannot parse layer");
+            string name = trim(text.substr(pos, equals-pos));
+            string value = trim(text.substr(equals+1, semicolon-equals-1));
+            pos = semicolon+1;
+            if (name == "blocksize")
+                layer.inputSize = stoi(value);
+            else if (name == "nodes")
+                layer.outputSize = stoi(value);
+            else if (name == "activation")
+                activation = stoi(value);
+            else if (name == "weights")
+                parseFileReference(value, nnfFile, weightFile, weightCount);
+            else if (name == "biases")
+                parseFileReference(value, nnfFile, biasFile, biasCount);
+        }
+        if (layer.inputSize <= 0 || layer.outputSize <= 0 || weightFile.empty() || biasFile.empty())
+            throw OpenMMException(nnfFile + ": incomplete layer definition");
+        if (weightCount != layer.inputSize*layer.outputSize || biasCount != layer.outputSize)
+            throw OpenMMException(nnfFile + ": bad parameter shape");
+        if (activation != Gaussian && activation != Linear && activation != CELU)
+            throw OpenMMException(nnfFile + ": unsupported activation " + to_string(activation));
+        if (!network.empty() && network.back().outputSize != layer.inputSize)
+            throw OpenMMException(nnfFile + ": layer sizes do not match");
+        layer.activation = (Activation) activation;
+        layer.weights = readParameterFile(weightFile, weightCount);
+        layer.biases = readParameterFile(biasFile, biasCount);
+        network.push_back(layer);
+    }
+    if (network.empty() || network.back().outputSize != 1)
+        throw OpenMMException(nnfFile + ": the network must end in a single output");
+    return network;
+}
+
+int ANIModel::getSpeciesIndex(const string& symbol) const {
+    for (int i = 0; i < species.size(); i++)
+        if (species[i] == symbol)
+            return i;
+    return -1;
+}
@@ -0,0 +1,63 @@
+/* -------------------------------------------------------------------------- *
+ * The MIT License
+ *
+ * SPDX short identifier: MIT
+ *
+ * Copyright 2019 Genentech Inc. South San Francisco
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ * -------------------------------------------------------------------------- */
+
+
+#include "internal/ANIModelInfo.h"
+#include "openmm/OpenMMException.h"
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+using namespace ANIPlugin;
+using namespace OpenMM;
+using namespace std;
+
+static string compileError(string varName, string fileName) {
+    ostringstream oss;
+    oss << "InfoFile " << fileName << " has no line for " << varName;
+    return oss.str();
+}
+
+ANIModelInfo ANIModelInfo::read(const string& infoFile) {
+    ifstream infile( infoFile );
+    ANIModelInfo info;
+
+    if( ! getline(infile, info.netWorkDir) )
+        throw OpenMMException(compileError("netWorkDir",infoFile));
+
+    if( ! getline(infile, info.paramFile) )
+        throw OpenMMException(compileError("paramFile",infoFile));
+
+    if( ! getline(infile, info.atomFitFile) )
+        throw OpenMMException(compileError("atomFitFile",infoFile));
+
+    string dummy;
+    if( ! getline(infile, dummy) )
+        throw OpenMMException(compileError("ensamples",infoFile));
+    info.nEnsembles = stoi(dummy);
+
+    return info;
+}
@@ -0,0 +1,139 @@
+/* -------------------------------------------------------------------------- *
+ * The MIT License
+ *
+ * SPDX short identifier: MIT
+ *
+ * Copyright 2019 Genentech Inc. South San Francisco
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ * -------------------------------------------------------------------------- */
+
+#include "internal/ANIModelLoader.h"
+#include <exception>
+#include <future>
+#include <map>
+#include <mutex>
+#include <thread>
+
+using namespace ANIPlugin;
+using namespace std;
+
+typedef shared_future<shared_ptr<const ANIModel> > ModelFuture;
+
+/**
+ * The state of one info file.  The model is kept while an ANIForce holds it,
+ * or until get() hands it out if it was preloaded without a holder.
+ */
+struct ModelEntry {
+    ModelEntry() : numHolders(0), pinned(false) {
+    }
+    ModelFuture model;
+    int numHolders;
+    bool pinned;
+};
+
+static mutex loadsLock;
+static map<string, ModelEntry> loads;
+
+static shared_ptr<const ANIModel> loadModel(const string& aniInfoFile) {
+    return make_shared<const ANIModel>(ANIModel::load(ANIModelInfo::read(aniInfoFile)));
+}
+
+/**
+ * Start loading a model, unless it is already loaded or being loaded.  The
+ * caller must hold loadsLock.
+ */
+static void startLoad(const string& aniInfoFile, ModelEntry& entry) {
+    if (entry.model.valid())
+        return;
+
+    // The thread is detached rather than joined through std::async, so that
+    // neither discard() nor exiting the process waits for a load nobody needs.
+
+    shared_ptr<promise<shared_ptr<const ANIModel> > > result = make_shared<promise<shared_ptr<const ANIModel> > >();
+    entry.model = result->get_future().share();
+    thread([result, aniInfoFile] () {
+        try {
+            result->set_value(loadModel(aniInfoFile));
+        }
+        catch (...) {
+            result->set_exception(current_exception());
+        }
+    }).detach();
+}
+
+static void release(const string& aniInfoFile) {
+    lock_guard<mutex> guard(loadsLock);
+    map<string, ModelEntry>::iterator entry = loads.find(aniInfoFile);
+    if (entry != loads.end() && --entry->second.numHolders == 0 && !entry->second.pinned)
+        loads.erase(entry);
+}
+
+void ANIModelLoader::preload(const string& aniInfoFile) {
+    lock_guard<mutex> guard(loadsLock);
+    ModelEntry& entry = loads[aniInfoFile];
+    entry.pinned = true;
+    startLoad(aniInfoFile, entry);
+}
+
+shared_ptr<void> ANIModelLoader::hold(const string& aniInfoFile) {
+    lock_guard<mutex> guard(loadsLock);
+    ModelEntry& entry = loads[aniInfoFile];
+    entry.numHolders++;
+    startLoad(aniInfoFile, entry);
+    return shared_ptr<void>(nullptr, [aniInfoFile] (void*) {release(aniInfoFile);});
+}
+
+shared_ptr<const ANIModel> ANIModelLoader::get(const string& aniInfoFile) {
+    ModelFuture pending;
+    {
+        lock_guard<mutex> guard(loadsLock);
+        map<string, ModelEntry>::iterator entry = loads.find(aniInfoFile);
+        if (entry != loads.end() && entry->second.model.valid()) {
+            pending = entry->second.model;
+            if (entry->second.numHolders == 0)
+                loads.erase(entry);
+        }
+    }
+    if (pending.valid())
+        return pending.get();
+
+    // Keep the model for the other Contexts of the forces that hold it.
+
+    shared_ptr<const ANIModel> model = loadModel(aniInfoFile);
+    lock_guard<mutex> guard(loadsLock);
+    map<string, ModelEntry>::iterator entry = loads.find(aniInfoFile);
+    if (entry != loads.end() && entry->second.numHolders > 0 && !entry->second.model.valid()) {
+        promise<shared_ptr<const ANIModel> > result;
+        result.set_value(model);
+        entry->second.model = result.get_future().share();
+    }
+    return model;
+}
+
+void ANIModelLoader::discard(const string& aniInfoFile) {
+    lock_guard<mutex> guard(loadsLock);
+    map<string, ModelEntry>::iterator entry = loads.find(aniInfoFile);
+    if (entry == loads.end())
+        return;
+    entry->second.model = ModelFuture();
+    entry->second.pinned = false;
+    if (entry->second.numHolders == 0)
+        loads.erase(entry);
+}
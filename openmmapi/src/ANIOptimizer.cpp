@@ -0,0 +1,378 @@
+/* -------------------------------------------------------------------------- *
+ * The MIT License
+ *
+ * SPDX short identifier: MIT
+ *
+ * Copyright 2019 Genentech Inc. South San Francisco
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ * -------------------------------------------------------------------------- */
+
+
+#include "ANIOptimizer.h"
+#include "openmm/OpenMMException.h"
+#include <algorithm>
+#include <cmath>
+#include <deque>
+
+using namespace ANIPlugin;
+using namespace OpenMM;
+using namespace std;
+
+// Sufficient decrease parameter of the Armijo condition.
+static const double ARMIJO_C1 = 1e-4;
+// A line search that shrinks the largest atom displacement below this (in A) has failed.
+static const double MIN_DISPLACEMENT = 1e-7;
+// Relative rounding error of the energies the engines compute in single precision.
+static const double ENERGY_PRECISION = 1e-8;
+
+/**
+ * The L-BFGS state of one molecule.  Coordinates are kept in A and gradients in
+ * H/A so they can be handed to the engine without conversion.
+ */
+class ANIOptimizer::MoleculeState {
+public:
+    vector<string> symbols;
+    vector<double> x, g, d;
+    double energy, trialEnergy;
+    deque<vector<double> > s, y;
+    deque<double> rho;
+    double step, slope;
+    vector<float> trialPositions, trialForces;
+    int iterations, iterationsThisCall;
+    bool started, finished, converged;
+};
+
+ANIOptimizer::ANIOptimizer(const string& aniInfoFile, const string& engineName) : engine(ANIEngine::create(aniInfoFile, engineName)), ownsEngine(true),
+        tolerance(10.0), maxStepSize(0.02), maxIterations(0), historySize(10), numBatchEvaluations(0) {
+}
+
+ANIOptimizer::ANIOptimizer(ANIEngine& engine) : engine(&engine), ownsEngine(false),
+        tolerance(10.0), maxStepSize(0.02), maxIterations(0), historySize(10), numBatchEvaluations(0) {
+}
+
+ANIOptimizer::~ANIOptimizer() {
+    for (MoleculeState* mol : molecules)
+        delete mol;
+    if (ownsEngine)
+        delete engine;
+}
+
+int ANIOptimizer::addMolecule(const vector<string>& atomSymbols, const vector<Vec3>& positions) {
+    if (atomSymbols.size() != positions.size())
+        throw OpenMMException("ANIOptimizer: number of atom symbols and positions differ");
+    int numAtoms = atomSymbols.size();
+    MoleculeState* mol = new MoleculeState();
+    mol->symbols = atomSymbols;
+    mol->trialPositions.resize(3*numAtoms);
+    for (int i = 0; i < numAtoms; i++)
+        for (int j = 0; j < 3; j++)
+            mol->trialPositions[3*i+j] = (float) (positions[i][j] * NM_TO_ANGST);
+    mol->x.assign(mol->trialPositions.begin(), mol->trialPositions.end());
+    mol->g.resize(3*numAtoms, 0.0);
+    mol->d.resize(3*numAtoms, 0.0);
+    mol->energy = 0.0;
+    mol->step = mol->slope = 0.0;
+    mol->trialForces.resize(3*numAtoms);
+    mol->iterations = mol->iterationsThisCall = 0;
+    mol->started = mol->finished = mol->converged = false;
+    molecules.push_back(mol);
+    return molecules.size()-1;
+}
+
+int ANIOptimizer::getNumMolecules() const {
+    return molecules.size();
+}
+
+double ANIOptimizer::getTolerance() const {
+    return tolerance;
+}
+
+void ANIOptimizer::setTolerance(double tolerance) {
+    this->tolerance = tolerance;
+}
+
+int ANIOptimizer::getMaxIterations() const {
+    return maxIterations;
+}
+
+void ANIOptimizer::setMaxIterations(int maxIterations) {
+    this->maxIterations = maxIterations;
+}
+
+int ANIOptimizer::getHistorySize() const {
+    return historySize;
+}
+
+void ANIOptimizer::setHistorySize(int size) {
+    if (size < 1)
+        throw OpenMMException("ANIOptimizer: history size must be at least 1");
+    historySize = size;
+}
+
+double ANIOptimizer::getMaxStepSize() const {
+    return maxStepSize;
+}
+
+void ANIOptimizer::setMaxStepSize(double size) {
+    maxStepSize = size;
+}
+
+vector<Vec3> ANIOptimizer::getPositions(int molecule) const {
+    const MoleculeState& mol = *molecules.at(molecule);
+    vector<Vec3> positions(mol.symbols.size());
+    for (int i = 0; i < positions.size(); i++)
+        positions[i] = Vec3(mol.x[3*i], mol.x[3*i+1], mol.x[3*i+2]) / NM_TO_ANGST;
+    return positions;
+}
+
+double ANIOptimizer::getEnergy(int molecule) const {
+    return molecules.at(molecule)->energy * HARTREE_TO_KJ_MOL;
+}
+
+int ANIOptimizer::getNumIterations(int molecule) const {
+    return molecules.at(molecule)->iterations;
+}
+
+bool ANIOptimizer::isConverged(int molecule) const {
+    return molecules.at(molecule)->converged;
+}
+
+int ANIOptimizer::getNumBatchEvaluations() const {
+    return numBatchEvaluations;
+}
+
+bool ANIOptimizer::isConverged(const MoleculeState& mol) const {
+    double sum = 0.0;
+    for (double gi : mol.g)
+        sum += gi*gi;
+    double rms = sqrt(sum/max((size_t) 1, mol.g.size())) * HARTREE_A_TO_KJ_MOL_NM;
+    return rms <= tolerance;
+}
+
+void ANIOptimizer::minimize() {
+    for (MoleculeState* mol : molecules) {
+        mol->iterationsThisCall = 0;
+        if (mol->started) {
+            mol->converged = isConverged(*mol);
+            mol->finished = mol->converged;
+            if (!mol->finished) {
+                computeDirection(*mol);
+                startLineSearch(*mol);
+            }
+        }
+    }
+
+    // Each pass evaluates the pending trial point of every molecule that is still
+    // running in a single batch, then advances each molecule's line search.
+
+    vector<MoleculeState*> active;
+    vector<ANIEvaluation> batch;
+    while (true) {
+        active.clear();
+        for (MoleculeState* mol : molecules)
+            if (!mol->finished)
+                active.push_back(mol);
+        if (active.empty())
+            break;
+        batch.resize(active.size());
+        for (int i = 0; i < active.size(); i++) {
+            batch[i] = ANIEvaluation();
+            batch[i].symbols = &active[i]->symbols;
+            batch[i].positions = active[i]->trialPositions.data();
+            batch[i].forces = active[i]->trialForces.data();
+        }
+        engine->computeBatch(batch);
+        numBatchEvaluations++;
+
+        for (int i = 0; i < active.size(); i++) {
+            MoleculeState& mol = *active[i];
+            mol.trialEnergy = batch[i].energy;
+            if (!mol.started) {
+                mol.started = true;
+                mol.energy = mol.trialEnergy;
+                for (int j = 0; j < mol.g.size(); j++)
+                    mol.g[j] = -mol.trialForces[j];
+                mol.converged = isConverged(mol);
+                mol.finished = mol.converged;
+                if (!mol.finished) {
+                    computeDirection(mol);
+                    startLineSearch(mol);
+                }
+            }
+            else if (isTrialAcceptable(mol))
+                acceptTrial(mol);
+            else
+                rejectTrial(mol);
+        }
+    }
+}
+
+void ANIOptimizer::computeDirection(MoleculeState& mol) {
+    // Standard two loop recursion over the stored correction pairs.
+
+    int n = mol.g.size();
+    int m = mol.s.size();
+    vector<double> alpha(m);
+    vector<double>& q = mol.d;
+    q = mol.g;
+    for (int k = m-1; k >= 0; k--) {
+        double a = 0.0;
+        for (int j = 0; j < n; j++)
+            a += mol.s[k][j]*q[j];
+        a *= mol.rho[k];
+        alpha[k] = a;
+        for (int j = 0; j < n; j++)
+            q[j] -= a*mol.y[k][j];
+    }
+    if (m > 0) {
+        double yy = 0.0;
+        for (int j = 0; j < n; j++)
+            yy += mol.y[m-1][j]*mol.y[m-1][j];
+        double gamma = 1.0/(mol.rho[m-1]*yy);
+        for (int j = 0; j < n; j++)
+            q[j] *= gamma;
+    }
+    for (int k = 0; k < m; k++) {
+        double b = 0.0;
+        for (int j = 0; j < n; j++)
+            b += mol.y[k][j]*q[j];
+        b *= mol.rho[k];
+        for (int j = 0; j < n; j++)
+            q[j] += mol.s[k][j]*(alpha[k]-b);
+    }
+    mol.slope = 0.0;
+    for (int j = 0; j < n; j++) {
+        mol.d[j] = -q[j];
+        mol.slope += mol.g[j]*mol.d[j];
+    }
+
+    // Fall back to steepest descent if the history no longer gives a descent direction.
+
+    if (!(mol.slope < 0.0)) {
+        mol.s.clear();
+        mol.y.clear();
+        mol.rho.clear();
+        mol.slope = 0.0;
+        for (int j = 0; j < n; j++) {
+            mol.d[j] = -mol.g[j];
+            mol.slope -= mol.g[j]*mol.g[j];
+        }
+    }
+}
+
+static double maxAtomDisplacement(const vector<double>& d) {
+    double maxDisp2 = 0.0;
+    for (int i = 0; i < d.size(); i += 3)
+        maxDisp2 = max(maxDisp2, d[i]*d[i] + d[i+1]*d[i+1] + d[i+2]*d[i+2]);
+    return sqrt(maxDisp2);
+}
+
+void ANIOptimizer::startLineSearch(MoleculeState& mol) {
+    mol.step = 1.0;
+    double maxDisp = maxAtomDisplacement(mol.d);
+    double maxStep = maxStepSize*NM_TO_ANGST;
+    if (maxDisp > maxStep)
+        mol.step = maxStep/maxDisp;
+    for (int j = 0; j < mol.x.size(); j++)
+        mol.trialPositions[j] = (float) (mol.x[j] + mol.step*mol.d[j]);
+}
+
+void ANIOptimizer::acceptTrial(MoleculeState& mol) {
+    int n = mol.x.size();
+    vector<double> s(n), y(n);
+    double sy = 0.0;
+
+    // The engine evaluated the trial positions rounded to float, so those are
+    // the positions the energy and forces belong to.
+
+    for (int j = 0; j < n; j++) {
+        double newX = mol.trialPositions[j];
+        double newG = -mol.trialForces[j];
+        s[j] = newX - mol.x[j];
+        y[j] = newG - mol.g[j];
+        sy += s[j]*y[j];
+        mol.x[j] = newX;
+        mol.g[j] = newG;
+    }
+    mol.energy = mol.trialEnergy;
+    mol.iterations++;
+    mol.iterationsThisCall++;
+
+    // Only keep pairs that preserve a positive definite inverse Hessian estimate.
+
+    if (sy > 1e-12) {
+        mol.s.push_back(s);
+        mol.y.push_back(y);
+        mol.rho.push_back(1.0/sy);
+        if (mol.s.size() > historySize) {
+            mol.s.pop_front();
+            mol.y.pop_front();
+            mol.rho.pop_front();
+        }
+    }
+    mol.converged = isConverged(mol);
+    mol.finished = mol.converged || (maxIterations > 0 && mol.iterationsThisCall >= maxIterations);
+    if (!mol.finished) {
+        computeDirection(mol);
+        startLineSearch(mol);
+    }
+}
+
+bool ANIOptimizer::isTrialAcceptable(const MoleculeState& mol) const {
+    if (mol.trialEnergy <= mol.energy + ARMIJO_C1*mol.step*mol.slope)
+        return true;
+
+    // Close to a minimum the energy changes by less than its rounding error, so
+    // the Armijo condition can fail for every step.  A trial point whose energy
+    // is the same within that error is accepted if it reduces the gradient.
+
+    if (mol.trialEnergy-mol.energy > ENERGY_PRECISION*fabs(mol.energy))
+        return false;
+    double g2 = 0.0, trialG2 = 0.0;
+    for (int j = 0; j < mol.g.size(); j++) {
+        g2 += mol.g[j]*mol.g[j];
+        trialG2 += mol.trialForces[j]*mol.trialForces[j];
+    }
+    return trialG2 < g2;
+}
+
+void ANIOptimizer::rejectTrial(MoleculeState& mol) {
+    // Backtrack, using the minimum of the quadratic through the current point and
+    // the rejected trial point when it lies in a sensible range.
+
+    double curvature = 2.0*(mol.trialEnergy - mol.energy - mol.slope*mol.step);
+    double step = (curvature > 0.0 ? -mol.slope*mol.step*mol.step/curvature : 0.5*mol.step);
+    mol.step = max(0.1*mol.step, min(0.5*mol.step, step));
+    if (mol.step*maxAtomDisplacement(mol.d) < MIN_DISPLACEMENT) {
+        if (mol.s.empty()) {
+            // Even steepest descent cannot lower the energy any further.
+            mol.finished = true;
+            return;
+        }
+        mol.s.clear();
+        mol.y.clear();
+        mol.rho.clear();
+        computeDirection(mol);
+        startLineSearch(mol);
+        return;
+    }
+    for (int j = 0; j < mol.x.size(); j++)
+        mol.trialPositions[j] = (float) (mol.x[j] + mol.step*mol.d[j]);
+}
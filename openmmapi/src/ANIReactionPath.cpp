@@ -0,0 +1,415 @@
+/* -------------------------------------------------------------------------- *
+ * The MIT License
+ *
+ * SPDX short identifier: MIT
+ *
+ * Copyright 2019 Genentech Inc. South San Francisco
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ * -------------------------------------------------------------------------- */
+
+
+#include "ANIReactionPath.h"
+#include "openmm/OpenMMException.h"
+#include <algorithm>
+#include <cmath>
+
+using namespace ANIPlugin;
+using namespace OpenMM;
+using namespace std;
+
+// Parameters of the FIRE minimizer (Bitzek et al., Phys. Rev. Lett. 97, 170201).
+// Coordinates are in A and forces in H/A, and each step moves an image by about
+// F*dt^2, so the time steps correspond to the usual defaults in eV based codes.
+static const double FIRE_TIME_STEP = 0.5;
+static const double FIRE_MAX_TIME_STEP = 5.0;
+static const int FIRE_MIN_STEPS = 5;
+static const double FIRE_INCREASE = 1.1;
+static const double FIRE_DECREASE = 0.5;
+static const double FIRE_MIXING = 0.1;
+static const double FIRE_MIXING_DECAY = 0.99;
+
+ANIReactionPath::ANIReactionPath(const string& aniInfoFile, const vector<string>& atomSymbols, const string& engineName) :
+        engine(ANIEngine::create(aniInfoFile, engineName)), ownsEngine(true), symbols(atomSymbols), springConstant(1000.0), tolerance(10.0),
+        maxStepSize(0.02), maxIterations(1000), numIterations(0), numBatchEvaluations(0), climbingImage(-1), useClimbingImage(false),
+        evaluated(false), converged(false), timeStep(FIRE_TIME_STEP), mixing(FIRE_MIXING), numStepsSinceReset(0) {
+}
+
+ANIReactionPath::ANIReactionPath(ANIEngine& engine, const vector<string>& atomSymbols) :
+        engine(&engine), ownsEngine(false), symbols(atomSymbols), springConstant(1000.0), tolerance(10.0),
+        maxStepSize(0.02), maxIterations(1000), numIterations(0), numBatchEvaluations(0), climbingImage(-1), useClimbingImage(false),
+        evaluated(false), converged(false), timeStep(FIRE_TIME_STEP), mixing(FIRE_MIXING), numStepsSinceReset(0) {
+}
+
+ANIReactionPath::~ANIReactionPath() {
+    if (ownsEngine)
+        delete engine;
+}
+
+int ANIReactionPath::addImage(const vector<Vec3>& imagePositions) {
+    if (imagePositions.size() != symbols.size())
+        throw OpenMMException("ANIReactionPath: number of atom symbols and positions differ");
+    int numAtoms = symbols.size();
+    vector<double> image(3*numAtoms);
+    for (int i = 0; i < numAtoms; i++)
+        for (int j = 0; j < 3; j++)
+            image[3*i+j] = imagePositions[i][j] * NM_TO_ANGST;
+    x.push_back(image);
+    v.push_back(vector<double>(3*numAtoms, 0.0));
+    pathForces.push_back(vector<double>(3*numAtoms, 0.0));
+    positions.push_back(vector<float>(image.begin(), image.end()));
+    forces.push_back(vector<float>(3*numAtoms, 0.0f));
+    energies.push_back(0.0);
+
+    // Changing the path invalidates the end point energies and the FIRE state.
+
+    evaluated = false;
+    converged = false;
+    climbingImage = -1;
+    timeStep = FIRE_TIME_STEP;
+    mixing = FIRE_MIXING;
+    numStepsSinceReset = 0;
+    for (vector<double>& vi : v)
+        fill(vi.begin(), vi.end(), 0.0);
+    return x.size()-1;
+}
+
+void ANIReactionPath::interpolate(const vector<Vec3>& start, const vector<Vec3>& end, int numImages) {
+    if (numImages < 3)
+        throw OpenMMException("ANIReactionPath: the path needs at least three images");
+    if (start.size() != symbols.size() || end.size() != symbols.size())
+        throw OpenMMException("ANIReactionPath: number of atom symbols and positions differ");
+    x.clear();
+    v.clear();
+    pathForces.clear();
+    positions.clear();
+    forces.clear();
+    energies.clear();
+    for (int image = 0; image < numImages; image++) {
+        double t = image/(double) (numImages-1);
+        vector<Vec3> imagePositions(symbols.size());
+        for (int i = 0; i < symbols.size(); i++)
+            imagePositions[i] = start[i]*(1-t) + end[i]*t;
+        addImage(imagePositions);
+    }
+}
+
+int ANIReactionPath::getNumImages() const {
+    return x.size();
+}
+
+double ANIReactionPath::getSpringConstant() const {
+    return springConstant;
+}
+
+void ANIReactionPath::setSpringConstant(double k) {
+    if (k < 0.0)
+        throw OpenMMException("ANIReactionPath: the spring constant must not be negative");
+    springConstant = k;
+}
+
+bool ANIReactionPath::getUseClimbingImage() const {
+    return useClimbingImage;
+}
+
+void ANIReactionPath::setUseClimbingImage(bool use) {
+    if (use != useClimbingImage)
+        converged = false;
+    useClimbingImage = use;
+}
+
+double ANIReactionPath::getTolerance() const {
+    return tolerance;
+}
+
+void ANIReactionPath::setTolerance(double tolerance) {
+    this->tolerance = tolerance;
+}
+
+int ANIReactionPath::getMaxIterations() const {
+    return maxIterations;
+}
+
+void ANIReactionPath::setMaxIterations(int maxIterations) {
+    this->maxIterations = maxIterations;
+}
+
+double ANIReactionPath::getMaxStepSize() const {
+    return maxStepSize;
+}
+
+void ANIReactionPath::setMaxStepSize(double size) {
+    maxStepSize = size;
+}
+
+vector<Vec3> ANIReactionPath::getPositions(int image) const {
+    const vector<double>& xi = x.at(image);
+    vector<Vec3> result(symbols.size());
+    for (int i = 0; i < result.size(); i++)
+        result[i] = Vec3(xi[3*i], xi[3*i+1], xi[3*i+2]) / NM_TO_ANGST;
+    return result;
+}
+
+double ANIReactionPath::getEnergy(int image) const {
+    return energies.at(image) * HARTREE_TO_KJ_MOL;
+}
+
+vector<Vec3> ANIReactionPath::getForces(int image) const {
+    const vector<float>& fi = forces.at(image);
+    vector<Vec3> result(symbols.size());
+    for (int i = 0; i < result.size(); i++)
+        result[i] = Vec3(fi[3*i], fi[3*i+1], fi[3*i+2]) * HARTREE_A_TO_KJ_MOL_NM;
+    return result;
+}
+
+int ANIReactionPath::getClimbingImage() const {
+    return climbingImage;
+}
+
+bool ANIReactionPath::isConverged() const {
+    return converged;
+}
+
+int ANIReactionPath::getNumIterations() const {
+    return numIterations;
+}
+
+int ANIReactionPath::getNumBatchEvaluations() const {
+    return numBatchEvaluations;
+}
+
+void ANIReactionPath::evaluate(int firstImage, int lastImage) {
+    vector<ANIEvaluation> batch(lastImage-firstImage+1);
+    for (int image = firstImage; image <= lastImage; image++) {
+        ANIEvaluation& eval = batch[image-firstImage];
+        eval.symbols = &symbols;
+        eval.positions = positions[image].data();
+        eval.forces = forces[image].data();
+    }
+    engine->computeBatch(batch);
+    numBatchEvaluations++;
+    for (int image = firstImage; image <= lastImage; image++)
+        energies[image] = batch[image-firstImage].energy;
+}
+
+/**
+ * Remove the components of a force that would translate or rotate an image as
+ * a rigid body.  Those motions do not change the energy, so nothing else stops
+ * the spring forces from spending the spacing between images on them.
+ */
+static void removeRigidMotion(const vector<double>& x, vector<double>& f) {
+    const int numAtoms = x.size()/3;
+    double center[3] = {0, 0, 0};
+    for (int i = 0; i < numAtoms; i++)
+        for (int j = 0; j < 3; j++)
+            center[j] += x[3*i+j]/numAtoms;
+    vector<vector<double> > modes;
+    for (int axis = 0; axis < 6; axis++) {
+        vector<double> mode(x.size(), 0.0);
+        for (int i = 0; i < numAtoms; i++) {
+            if (axis < 3)
+                mode[3*i+axis] = 1.0;
+            else {
+                double r[3] = {x[3*i]-center[0], x[3*i+1]-center[1], x[3*i+2]-center[2]};
+                int a = (axis-2)%3, b = (axis-1)%3;
+                mode[3*i+a] = -r[b];
+                mode[3*i+b] = r[a];
+            }
+        }
+
+        // Orthonormalize against the previous modes.  Linear molecules have
+        // only two rotations, so degenerate modes are dropped.
+
+        for (const vector<double>& other : modes) {
+            double dot = 0.0;
+            for (int j = 0; j < mode.size(); j++)
+                dot += mode[j]*other[j];
+            for (int j = 0; j < mode.size(); j++)
+                mode[j] -= dot*other[j];
+        }
+        double norm = 0.0;
+        for (double m : mode)
+            norm += m*m;
+        if (norm < 1e-8*numAtoms)
+            continue;
+        norm = sqrt(norm);
+        for (double& m : mode)
+            m /= norm;
+        modes.push_back(mode);
+    }
+    for (const vector<double>& mode : modes) {
+        double dot = 0.0;
+        for (int j = 0; j < f.size(); j++)
+            dot += f[j]*mode[j];
+        for (int j = 0; j < f.size(); j++)
+            f[j] -= dot*mode[j];
+    }
+}
+
+double ANIReactionPath::computePathForces() {
+    const int numImages = x.size();
+    const int n = 3*symbols.size();
+    const double k = springConstant / HARTREE_TO_KJ_MOL / (NM_TO_ANGST*NM_TO_ANGST);
+    climbingImage = -1;
+    if (useClimbingImage) {
+        climbingImage = 1;
+        for (int image = 2; image < numImages-1; image++)
+            if (energies[image] > energies[climbingImage])
+                climbingImage = image;
+    }
+    vector<double> tangent(n);
+    double maxRms = 0.0;
+    for (int image = 1; image < numImages-1; image++) {
+        // The improved tangent points towards the higher energy neighbor, and
+        // is a weighted average of both directions at extrema of the energy.
+
+        const vector<double>& prev = x[image-1];
+        const vector<double>& curr = x[image];
+        const vector<double>& next = x[image+1];
+        double energyPrev = energies[image-1], energy = energies[image], energyNext = energies[image+1];
+        double weightNext, weightPrev;
+        if (energyNext > energy && energy > energyPrev) {
+            weightNext = 1.0;
+            weightPrev = 0.0;
+        }
+        else if (energyNext < energy && energy < energyPrev) {
+            weightNext = 0.0;
+            weightPrev = 1.0;
+        }
+        else {
+            double maxDelta = max(fabs(energyNext-energy), fabs(energyPrev-energy));
+            double minDelta = min(fabs(energyNext-energy), fabs(energyPrev-energy));
+            weightNext = (energyNext > energyPrev ? maxDelta : minDelta);
+            weightPrev = (energyNext > energyPrev ? minDelta : maxDelta);
+        }
+        double distNext = 0.0, distPrev = 0.0, norm = 0.0;
+        for (int j = 0; j < n; j++) {
+            double deltaNext = next[j]-curr[j];
+            double deltaPrev = curr[j]-prev[j];
+            distNext += deltaNext*deltaNext;
+            distPrev += deltaPrev*deltaPrev;
+            tangent[j] = weightNext*deltaNext + weightPrev*deltaPrev;
+            norm += tangent[j]*tangent[j];
+        }
+        if (norm == 0.0) {
+            // Both neighbors have the same energy: fall back to the central difference.
+
+            for (int j = 0; j < n; j++) {
+                tangent[j] = next[j]-prev[j];
+                norm += tangent[j]*tangent[j];
+            }
+        }
+        norm = sqrt(norm);
+        if (norm > 0.0)
+            for (int j = 0; j < n; j++)
+                tangent[j] /= norm;
+
+        // Keep the perpendicular part of the true force and add the spring
+        // force along the path, or invert the parallel part for the climbing image.
+
+        const vector<float>& f = forces[image];
+        double parallel = 0.0;
+        for (int j = 0; j < n; j++)
+            parallel += f[j]*tangent[j];
+        double spring = k*(sqrt(distNext)-sqrt(distPrev));
+        vector<double>& pf = pathForces[image];
+        for (int j = 0; j < n; j++) {
+            if (image == climbingImage)
+                pf[j] = f[j] - 2*parallel*tangent[j];
+            else
+                pf[j] = f[j] - parallel*tangent[j] + spring*tangent[j];
+        }
+        removeRigidMotion(curr, pf);
+        double sum = 0.0;
+        for (int j = 0; j < n; j++)
+            sum += pf[j]*pf[j];
+        maxRms = max(maxRms, sqrt(sum/max(1, n)) * HARTREE_A_TO_KJ_MOL_NM);
+    }
+    return maxRms;
+}
+
+void ANIReactionPath::optimize() {
+    const int numImages = x.size();
+    if (numImages < 3)
+        throw OpenMMException("ANIReactionPath: the path needs at least three images");
+    const int n = 3*symbols.size();
+
+    // The end points never move, so they are only evaluated together with the
+    // first batch of moving images.
+
+    if (!evaluated) {
+        evaluate(0, numImages-1);
+        evaluated = true;
+    }
+    int iterationsThisCall = 0;
+    while (true) {
+        converged = (computePathForces() <= tolerance);
+        if (converged || iterationsThisCall >= maxIterations)
+            break;
+
+        // One FIRE step for all moving images together: steer the velocity
+        // towards the force while going downhill, and stop as soon as the
+        // path starts going uphill.
+
+        double power = 0.0, vNorm = 0.0, fNorm = 0.0;
+        for (int image = 1; image < numImages-1; image++)
+            for (int j = 0; j < n; j++) {
+                power += pathForces[image][j]*v[image][j];
+                vNorm += v[image][j]*v[image][j];
+                fNorm += pathForces[image][j]*pathForces[image][j];
+            }
+        if (power > 0.0) {
+            double scale = (fNorm > 0.0 ? mixing*sqrt(vNorm/fNorm) : 0.0);
+            for (int image = 1; image < numImages-1; image++)
+                for (int j = 0; j < n; j++)
+                    v[image][j] = (1-mixing)*v[image][j] + scale*pathForces[image][j];
+            if (numStepsSinceReset > FIRE_MIN_STEPS) {
+                timeStep = min(timeStep*FIRE_INCREASE, FIRE_MAX_TIME_STEP);
+                mixing *= FIRE_MIXING_DECAY;
+            }
+            numStepsSinceReset++;
+        }
+        else {
+            for (int image = 1; image < numImages-1; image++)
+                fill(v[image].begin(), v[image].end(), 0.0);
+            timeStep *= FIRE_DECREASE;
+            mixing = FIRE_MIXING;
+            numStepsSinceReset = 0;
+        }
+        double maxDisp2 = 0.0;
+        for (int image = 1; image < numImages-1; image++) {
+            for (int j = 0; j < n; j++)
+                v[image][j] += timeStep*pathForces[image][j];
+            for (int i = 0; i < n; i += 3) {
+                double dx = timeStep*v[image][i], dy = timeStep*v[image][i+1], dz = timeStep*v[image][i+2];
+                maxDisp2 = max(maxDisp2, dx*dx + dy*dy + dz*dz);
+            }
+        }
+        double maxStep = maxStepSize*NM_TO_ANGST;
+        double scale = (maxDisp2 > maxStep*maxStep ? maxStep/sqrt(maxDisp2) : 1.0);
+        for (int image = 1; image < numImages-1; image++)
+            for (int j = 0; j < n; j++) {
+                x[image][j] += scale*timeStep*v[image][j];
+                positions[image][j] = (float) x[image][j];
+            }
+        evaluate(1, numImages-2);
+        numIterations++;
+        iterationsThisCall++;
+    }
+}
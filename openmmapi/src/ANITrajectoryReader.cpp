@@ -0,0 +1,318 @@
+/* -------------------------------------------------------------------------- *
+ * The MIT License
+ *
+ * SPDX short identifier: MIT
+ *
+ * Copyright 2019 Genentech Inc. South San Francisco
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ * -------------------------------------------------------------------------- */
+
+#include "internal/ANITrajectoryReader.h"
+#include "openmm/OpenMMException.h"
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace ANIPlugin;
+using namespace OpenMM;
+using namespace std;
+
+// Pages of frames that have been read are released in chunks of this many bytes.
+static const size_t RELEASE_CHUNK_SIZE = 16*1024*1024;
+
+ANITrajectoryReader::ANITrajectoryReader(const string& fileName, const string& format) : fileName(fileName), periodic(false),
+        numAtoms(0), data(NULL), size(0), offset(0), released(0), numFramesRead(0) {
+    string type = format;
+    if (type.empty()) {
+        size_t dot = fileName.rfind('.');
+        if (dot != string::npos)
+            type = fileName.substr(dot+1);
+    }
+    transform(type.begin(), type.end(), type.begin(), ::tolower);
+    if (type != "dcd" && type != "xyz")
+        throw OpenMMException("Unknown trajectory format for "+fileName+": use .dcd or .xyz");
+    isDcd = (type == "dcd");
+    fileDescriptor = open(fileName.c_str(), O_RDONLY);
+    if (fileDescriptor < 0)
+        throw OpenMMException("Cannot open "+fileName);
+    struct stat status;
+    if (fstat(fileDescriptor, &status) != 0 || status.st_size == 0) {
+        close(fileDescriptor);
+        throw OpenMMException("Cannot read "+fileName);
+    }
+    size = status.st_size;
+    void* mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileDescriptor, 0);
+    if (mapping == MAP_FAILED) {
+        close(fileDescriptor);
+        throw OpenMMException("Cannot map "+fileName);
+    }
+    data = (const char*) mapping;
+    madvise(mapping, size, MADV_SEQUENTIAL);
+    try {
+        if (isDcd)
+            readDcdHeader();
+        else {
+            // The first frame defines the atoms.
+
+            if (!readXyzFrame(NULL, NULL, &symbols))
+                throw OpenMMException("No frames in "+fileName);
+            numAtoms = symbols.size();
+            offset = 0;
+        }
+    }
+    catch (...) {
+        munmap(mapping, size);
+        close(fileDescriptor);
+        throw;
+    }
+}
+
+ANITrajectoryReader::~ANITrajectoryReader() {
+    munmap((void*) data, size);
+    close(fileDescriptor);
+}
+
+bool ANITrajectoryReader::readFrame(float* positions, float* cell) {
+    bool found = (isDcd ? readDcdFrame(positions, cell) : readXyzFrame(positions, cell, NULL));
+    if (found)
+        numFramesRead++;
+    releaseReadPages();
+    return found;
+}
+
+bool ANITrajectoryReader::readStructure(vector<string>& symbols, vector<float>& positions, vector<float>& cell) {
+    if (isDcd)
+        throw OpenMMException(fileName+": DCD files cannot hold structures with different atoms");
+    symbols.clear();
+    cell.resize(9);
+    bool found = readXyzFrame(NULL, cell.data(), &symbols, &positions);
+    if (!periodic)
+        cell.clear();
+    if (found)
+        numFramesRead++;
+    releaseReadPages();
+    return found;
+}
+
+void ANITrajectoryReader::releaseReadPages() {
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    size_t end = (offset/pageSize)*pageSize;
+    if (end-released >= RELEASE_CHUNK_SIZE) {
+        madvise((void*) (data+released), end-released, MADV_DONTNEED);
+        released = end;
+    }
+}
+
+/**
+ * Read a value of type T at an offset and advance the offset.
+ */
+template <class T>
+static T readValue(const char* data, size_t size, size_t& offset, const string& fileName) {
+    if (offset+sizeof(T) > size)
+        throw OpenMMException("Unexpected end of "+fileName);
+    T value;
+    memcpy(&value, data+offset, sizeof(T));
+    offset += sizeof(T);
+    return value;
+}
+
+void ANITrajectoryReader::readDcdHeader() {
+    if (size < 92 || readValue<int>(data, size, offset, fileName) != 84 || strncmp(data+offset, "CORD", 4) != 0)
+        throw OpenMMException(fileName+" is not a little endian DCD file");
+    offset += 4;
+    int control[20];
+    for (int i = 0; i < 20; i++)
+        control[i] = readValue<int>(data, size, offset, fileName);
+    if (readValue<int>(data, size, offset, fileName) != 84)
+        throw OpenMMException(fileName+" has an unsupported DCD header");
+
+    // CHARMM style files (nonzero version in the last entry) flag unit cells
+    // and a fourth dimension.
+
+    bool charmm = (control[19] != 0);
+    if (control[8] != 0)
+        throw OpenMMException(fileName+" has fixed atoms, which are not supported");
+    if (charmm && control[11] != 0)
+        throw OpenMMException(fileName+" has four dimensional coordinates, which are not supported");
+    periodic = (charmm && control[10] != 0);
+
+    // Skip the title and read the number of atoms.
+
+    int titleLength = readValue<int>(data, size, offset, fileName);
+    offset += titleLength;
+    if (readValue<int>(data, size, offset, fileName) != titleLength)
+        throw OpenMMException(fileName+" has a corrupt DCD title");
+    if (readValue<int>(data, size, offset, fileName) != 4)
+        throw OpenMMException(fileName+" has a corrupt DCD header");
+    numAtoms = readValue<int>(data, size, offset, fileName);
+    if (readValue<int>(data, size, offset, fileName) != 4 || numAtoms <= 0)
+        throw OpenMMException(fileName+" has a corrupt DCD header");
+}
+
+bool ANITrajectoryReader::readDcdFrame(float* positions, float* cell) {
+    // A partially written last frame, as left by a simulation that was
+    // stopped, is treated as the end of the file.
+
+    size_t frameSize = 3*(2*sizeof(int) + numAtoms*sizeof(float)) + (periodic ? 2*sizeof(int)+6*sizeof(double) : 0);
+    if (offset+frameSize > size)
+        return false;
+    if (periodic) {
+        if (readValue<int>(data, size, offset, fileName) != 48)
+            throw OpenMMException(fileName+" has a corrupt unit cell in frame "+to_string(numFramesRead));
+        double values[6];
+        for (int i = 0; i < 6; i++)
+            values[i] = readValue<double>(data, size, offset, fileName);
+        offset += sizeof(int);
+
+        // The cell is stored as A, gamma, B, beta, alpha, C.  Older programs
+        // store the angles in degrees, newer ones store their cosines.
+
+        double a = values[0], b = values[2], c = values[5];
+        double cosAngles[3] = {values[4], values[3], values[1]};
+        if (fabs(cosAngles[0]) > 1 || fabs(cosAngles[1]) > 1 || fabs(cosAngles[2]) > 1)
+            for (int i = 0; i < 3; i++)
+                cosAngles[i] = cos(cosAngles[i]*M_PI/180);
+        double cosAlpha = cosAngles[0], cosBeta = cosAngles[1], cosGamma = cosAngles[2];
+        double sinGamma = sqrt(1-cosGamma*cosGamma);
+        if (cell != NULL) {
+            double cx = c*cosBeta;
+            double cy = c*(cosAlpha-cosBeta*cosGamma)/sinGamma;
+            double box[9] = {a, 0, 0, b*cosGamma, b*sinGamma, 0, cx, cy, sqrt(max(0.0, c*c-cx*cx-cy*cy))};
+            for (int i = 0; i < 9; i++)
+                cell[i] = (float) (fabs(box[i]) < 1e-6*a ? 0.0 : box[i]);
+        }
+    }
+    for (int axis = 0; axis < 3; axis++) {
+        if (readValue<int>(data, size, offset, fileName) != (int) (numAtoms*sizeof(float)))
+            throw OpenMMException(fileName+" has a corrupt coordinate record in frame "+to_string(numFramesRead));
+        const float* values = (const float*) (data+offset);
+        for (int i = 0; i < numAtoms; i++)
+            memcpy(&positions[3*i+axis], &values[i], sizeof(float));
+        offset += numAtoms*sizeof(float) + sizeof(int);
+    }
+    return true;
+}
+
+/**
+ * Find the end of the line starting at an offset.
+ */
+static size_t findLineEnd(const char* data, size_t size, size_t offset) {
+    const char* end = (const char*) memchr(data+offset, '\n', size-offset);
+    return (end == NULL ? size : end-data);
+}
+
+/**
+ * Split a line into whitespace separated fields, storing the start of each in fields.
+ */
+static int splitLine(const char* data, size_t start, size_t end, const char** fields, int maxFields) {
+    int numFields = 0;
+    size_t i = start;
+    while (numFields < maxFields) {
+        while (i < end && isspace(data[i]))
+            i++;
+        if (i == end)
+            break;
+        fields[numFields++] = data+i;
+        while (i < end && !isspace(data[i]))
+            i++;
+    }
+    return numFields;
+}
+
+bool ANITrajectoryReader::readXyzFrame(float* positions, float* cell, vector<string>* frameSymbols, vector<float>* framePositions) {
+    // Skip blank lines between frames.
+
+    size_t lineEnd;
+    const char* fields[4];
+    while (true) {
+        if (offset >= size)
+            return false;
+        lineEnd = findLineEnd(data, size, offset);
+        if (splitLine(data, offset, lineEnd, fields, 1) == 1)
+            break;
+        offset = lineEnd+1;
+    }
+    // Frames must all have the same atoms, unless the caller collects the
+    // symbols of each one.
+
+    int frameAtoms = atoi(fields[0]);
+    if (frameAtoms <= 0 || (frameSymbols == NULL && frameAtoms != numAtoms))
+        throw OpenMMException(fileName+": frame "+to_string(numFramesRead)+" has the wrong number of atoms");
+    if (framePositions != NULL) {
+        framePositions->resize(3*frameAtoms);
+        positions = framePositions->data();
+    }
+
+    // The comment line may hold an extended XYZ lattice.
+
+    size_t commentStart = lineEnd+1;
+    if (commentStart >= size)
+        throw OpenMMException("Unexpected end of "+fileName);
+    size_t commentEnd = findLineEnd(data, size, commentStart);
+    string comment(data+commentStart, commentEnd-commentStart);
+    size_t lattice = comment.find("Lattice=\"");
+    if (frameSymbols != NULL)
+        periodic = (lattice != string::npos);
+    else if (periodic && lattice == string::npos)
+        throw OpenMMException(fileName+": frame "+to_string(numFramesRead)+" has no lattice");
+    if (periodic && cell != NULL) {
+        const char* text = comment.c_str()+lattice+9;
+        for (int i = 0; i < 9; i++) {
+            char* end;
+            cell[i] = strtof(text, &end);
+            if (end == text)
+                throw OpenMMException(fileName+": frame "+to_string(numFramesRead)+" has an invalid lattice");
+            text = end;
+        }
+    }
+
+    // Read the atoms.  The numbers are parsed from a copy of each line, since
+    // the mapped file is not null terminated.
+
+    offset = commentEnd+1;
+    char line[256];
+    for (int i = 0; i < frameAtoms; i++) {
+        if (offset >= size)
+            throw OpenMMException("Unexpected end of "+fileName);
+        lineEnd = findLineEnd(data, size, offset);
+        size_t length = min(lineEnd-offset, sizeof(line)-1);
+        memcpy(line, data+offset, length);
+        line[length] = 0;
+        if (splitLine(line, 0, length, fields, 4) != 4)
+            throw OpenMMException(fileName+": invalid atom line in frame "+to_string(numFramesRead));
+        if (frameSymbols != NULL) {
+            const char* end = fields[0];
+            while (*end != 0 && !isspace(*end))
+                end++;
+            frameSymbols->push_back(string(fields[0], end));
+        }
+        if (positions != NULL)
+            for (int j = 0; j < 3; j++)
+                positions[3*i+j] = strtof(fields[j+1], NULL);
+        offset = lineEnd+1;
+    }
+    return true;
+}
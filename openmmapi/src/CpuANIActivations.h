@@ -0,0 +1,134 @@
+#ifndef OPENMM_CPU_ANI_ACTIVATIONS_H_
+#define OPENMM_CPU_ANI_ACTIVATIONS_H_
+
+/* -------------------------------------------------------------------------- *
+ * The MIT License
+ *
+ * SPDX short identifier: MIT
+ *
+ * Copyright 2019 Genentech Inc. South San Francisco
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ * -------------------------------------------------------------------------- */
+
+
+#include "internal/ANIModel.h"
+#include <cstdint>
+
+namespace ANIPlugin {
+
+/**
+ * Activation functions for the CPU networks, applied to whole arrays at a time.
+ *
+ * The loops contain no branches or library calls, so the compiler vectorizes
+ * them for whatever SIMD instruction set it targets (with GCC and Clang this
+ * needs -fno-trapping-math, which CMakeLists.txt sets).  Both variants use
+ * the same range reduction exp(x) = 2^n*exp(r) with |r| <= ln(2)/2 and
+ * differ only in the polynomial used for exp(r).  Maximum relative errors of
+ * exp(x), measured over -87 <= x <= 0:
+ *
+ *   Accurate  degree 7 polynomial (Cephes expf)       8.3e-8, about 1 ulp
+ *   Fast      degree 4 Chebyshev interpolation       3.6e-6
+ *
+ * Inputs below -87 are clamped, so exp() never returns a denormal.  The
+ * derivatives are expressed through the activation's output and need no
+ * further exponentials.
+ */
+class CpuANIActivations {
+public:
+    enum Precision {
+        Accurate,
+        Fast
+    };
+    /**
+     * Compute exp(x) for a non positive x.
+     */
+    template <Precision PRECISION>
+    static inline float expNonPositive(float x) {
+        x = (x > -87.0f ? x : -87.0f);
+        int32_t n = (int32_t) (x*1.44269504088896341f - 0.5f);
+        float nf = (float) n;
+        float r = x - nf*0.693359375f + nf*2.12194440e-4f;
+        float p;
+        if (PRECISION == Accurate) {
+            p = 1.9875691500e-4f;
+            p = p*r + 1.3981999507e-3f;
+            p = p*r + 8.3334519073e-3f;
+            p = p*r + 4.1665795894e-2f;
+            p = p*r + 1.6666665459e-1f;
+            p = p*r + 5.0000001201e-1f;
+            p = p*r*r + r + 1.0f;
+        }
+        else {
+            p = 4.1875644e-2f;
+            p = p*r + 1.6792143e-1f;
+            p = p*r + 4.9999372e-1f;
+            p = p*r + 9.9996229e-1f;
+            p = p*r + 1.0f;
+        }
+        union {
+            int32_t i;
+            float f;
+        } scale;
+        scale.i = (n+127) << 23;
+        return p*scale.f;
+    }
+    /**
+     * Apply an activation function to size values.
+     */
+    template <Precision PRECISION>
+    static void apply(ANIModel::Activation activation, const float* input, float* output, int size) {
+        if (activation == ANIModel::CELU) {
+            // CELU with alpha = 0.1
+            for (int i = 0; i < size; i++) {
+                float x = input[i];
+                float negative = 0.1f*(expNonPositive<PRECISION>(10.0f*(x < 0.0f ? x : 0.0f))-1.0f);
+                output[i] = (x > 0.0f ? x : negative);
+            }
+        }
+        else if (activation == ANIModel::Gaussian) {
+            for (int i = 0; i < size; i++)
+                output[i] = expNonPositive<PRECISION>(-input[i]*input[i]);
+        }
+        else {
+            for (int i = 0; i < size; i++)
+                output[i] = input[i];
+        }
+    }
+    /**
+     * Multiply the gradient with respect to an activation's output by the
+     * derivative of the activation, given its input and output.
+     */
+    static void applyDerivative(ANIModel::Activation activation, const float* input, const float* output, float* grad, int size) {
+        if (activation == ANIModel::CELU) {
+            for (int i = 0; i < size; i++) {
+                float negative = 10.0f*output[i]+1.0f;
+                grad[i] *= (input[i] > 0.0f ? 1.0f : negative);
+            }
+        }
+        else if (activation == ANIModel::Gaussian) {
+            for (int i = 0; i < size; i++)
+                grad[i] *= -2.0f*input[i]*output[i];
+        }
+    }
+};
+
+} // namespace ANIPlugin
+
+#endif /*OPENMM_CPU_ANI_ACTIVATIONS_H_*/
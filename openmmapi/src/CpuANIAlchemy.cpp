@@ -0,0 +1,187 @@
+/* -------------------------------------------------------------------------- *
+ * The MIT License
+ *
+ * SPDX short identifier: MIT
+ *
+ * Copyright 2019 Genentech Inc. South San Francisco
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ * -------------------------------------------------------------------------- */
+
+#include "internal/CpuANIAlchemy.h"
+#include "CpuANINeighborList.h"
+#include "openmm/OpenMMException.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+using namespace ANIPlugin;
+using namespace OpenMM;
+using namespace std;
+
+// Atoms are classified with slightly enlarged cutoffs.  Treating an atom as
+// affected when it is not only costs time, so rounding must only err that way.
+static const float CUTOFF_SCALE = 1.001f;
+static const float CUTOFF_PADDING = 0.01f;
+
+CpuANIAlchemy::CpuANIAlchemy(CpuANIEngine& engine, const vector<string>& symbolsA, const vector<string>& symbolsB) :
+        engine(engine), symbolsA(symbolsA), symbolsB(symbolsB), selfEnergyA(0), selfEnergyB(0), numAffected(0) {
+    if (symbolsA.size() != symbolsB.size())
+        throw OpenMMException("ANI: both alchemical states must have the same number of atoms");
+    const ANIModel& model = engine.getModel();
+    cutoff = max(model.radialCutoff, model.angularCutoff);
+    for (int i = 0; i < symbolsA.size(); i++) {
+        for (const string* symbol : {&symbolsA[i], &symbolsB[i]})
+            if (!symbol->empty() && model.getSpeciesIndex(*symbol) == -1)
+                throw OpenMMException("ANI: the model does not support element "+*symbol);
+        if (!symbolsA[i].empty())
+            selfEnergyA += model.selfEnergies[model.getSpeciesIndex(symbolsA[i])];
+        if (!symbolsB[i].empty())
+            selfEnergyB += model.selfEnergies[model.getSpeciesIndex(symbolsB[i])];
+
+        // The atoms both states agree on are evaluated together.
+
+        if (symbolsA[i] != symbolsB[i])
+            changedAtoms.push_back(i);
+        else if (!symbolsA[i].empty()) {
+            shared.atoms.push_back(i);
+            shared.symbols.push_back(symbolsA[i]);
+        }
+    }
+    shared.positions.resize(3*shared.atoms.size());
+    shared.isHalo.resize(shared.atoms.size());
+    shared.gradient.resize(3*shared.atoms.size());
+    distance.resize(symbolsA.size());
+    fixedGradientA.resize(3*symbolsA.size());
+    fixedGradientB.resize(3*symbolsA.size());
+}
+
+void CpuANIAlchemy::findDistances(const float* positions, const float* cell) {
+    // The distance from every atom to the nearest changed atom.  Box vectors
+    // in reduced form give the minimum image by subtracting c, b and a in turn.
+
+    const int numAtoms = symbolsA.size();
+    fill(distance.begin(), distance.end(), numeric_limits<float>::max());
+    for (int c : changedAtoms)
+        for (int i = 0; i < numAtoms; i++) {
+            float delta[3];
+            for (int k = 0; k < 3; k++)
+                delta[k] = positions[3*i+k]-positions[3*c+k];
+            if (cell != NULL)
+                for (int v = 2; v >= 0; v--) {
+                    float shift = roundf(delta[v]/cell[4*v]);
+                    for (int k = 0; k < 3; k++)
+                        delta[k] -= shift*cell[3*v+k];
+                }
+            float r = sqrtf(delta[0]*delta[0] + delta[1]*delta[1] + delta[2]*delta[2]);
+            distance[i] = min(distance[i], r);
+        }
+}
+
+void CpuANIAlchemy::selectAffected(const vector<string>& symbols, Part& part) {
+    // The affected atoms that exist in this state, and their neighbors.  The
+    // minimum image is only reliable out to half the box, so in small boxes
+    // every atom is kept as a potential neighbor.
+
+    const float affectedCutoff = cutoff*CUTOFF_SCALE + CUTOFF_PADDING;
+    const float haloCutoff = 2*affectedCutoff;
+    part.atoms.clear();
+    part.symbols.clear();
+    part.isHalo.clear();
+    for (int i = 0; i < symbols.size(); i++)
+        if (!symbols[i].empty() && (!filterHalo || distance[i] < haloCutoff)) {
+            part.atoms.push_back(i);
+            part.symbols.push_back(symbols[i]);
+            part.isHalo.push_back(distance[i] >= affectedCutoff);
+        }
+    part.positions.resize(3*part.atoms.size());
+    part.gradient.resize(3*part.atoms.size());
+}
+
+void CpuANIAlchemy::evaluate(Part& part, const float* positions, const float* cell, bool computeGradient, bool computeVirial) {
+    part.domain.fixedEnergy = 0;
+    fill(part.domain.fixedVirial, part.domain.fixedVirial+9, 0);
+    part.hasDomainAtoms = (find(part.isHalo.begin(), part.isHalo.end(), 0) != part.isHalo.end());
+    if (!part.hasDomainAtoms)
+        return;
+    for (int k = 0; k < part.atoms.size(); k++)
+        for (int j = 0; j < 3; j++)
+            part.positions[3*k+j] = positions[3*part.atoms[k]+j];
+    ANIEvaluation eval;
+    eval.symbols = &part.symbols;
+    eval.positions = part.positions.data();
+    eval.cell = cell;
+    part.domain.isHalo = part.isHalo.data();
+    part.domain.computeVirial = computeVirial;
+    part.domain.fixedGradient = (computeGradient ? part.gradient.data() : NULL);
+    engine.computeDomain(eval, part.domain);
+}
+
+void CpuANIAlchemy::compute(const float* positions, const float* cell, double lambda, double& energyA, double& energyB, float* forces, double* virial) {
+    const int numAtoms = symbolsA.size();
+    const float affectedCutoff = cutoff*CUTOFF_SCALE + CUTOFF_PADDING;
+    filterHalo = true;
+    if (cell != NULL) {
+        double width[3];
+        CpuANINeighborList::getCellWidths(cell, width);
+        filterHalo = (min(width[0], min(width[1], width[2])) >= 2*2*affectedCutoff);
+    }
+    findDistances(positions, cell);
+    numAffected = 0;
+    for (int i = 0; i < numAtoms; i++)
+        if (distance[i] < affectedCutoff)
+            numAffected++;
+    for (int k = 0; k < shared.atoms.size(); k++)
+        shared.isHalo[k] = (distance[shared.atoms[k]] < affectedCutoff);
+    selectAffected(symbolsA, partA);
+    selectAffected(symbolsB, partB);
+    bool computeGradient = (forces != NULL);
+    bool computeVirial = (virial != NULL);
+    evaluate(shared, positions, cell, computeGradient, computeVirial);
+    evaluate(partA, positions, cell, computeGradient, computeVirial);
+    evaluate(partB, positions, cell, computeGradient, computeVirial);
+    energyA = (shared.domain.fixedEnergy+partA.domain.fixedEnergy)/(double) 0x100000000 + selfEnergyA;
+    energyB = (shared.domain.fixedEnergy+partB.domain.fixedEnergy)/(double) 0x100000000 + selfEnergyB;
+
+    // Mix the states.  The sums for each state are formed in fixed point first,
+    // so at lambda = 0 or 1 the result is exactly that of a single state.
+
+    if (computeGradient) {
+        fill(fixedGradientA.begin(), fixedGradientA.end(), 0);
+        fill(fixedGradientB.begin(), fixedGradientB.end(), 0);
+        for (Part* part : {&shared, &partA, &partB})
+            if (part->hasDomainAtoms)
+                for (int k = 0; k < part->atoms.size(); k++)
+                    for (int j = 0; j < 3; j++) {
+                        int index = 3*part->atoms[k]+j;
+                        if (part != &partB)
+                            fixedGradientA[index] += part->gradient[3*k+j];
+                        if (part != &partA)
+                            fixedGradientB[index] += part->gradient[3*k+j];
+                    }
+        for (int i = 0; i < 3*numAtoms; i++)
+            forces[i] = (float) (-((1-lambda)*fixedGradientA[i] + lambda*fixedGradientB[i])/(double) 0x100000000);
+    }
+    if (computeVirial)
+        for (int k = 0; k < 9; k++) {
+            long long virialA = shared.domain.fixedVirial[k]+partA.domain.fixedVirial[k];
+            long long virialB = shared.domain.fixedVirial[k]+partB.domain.fixedVirial[k];
+            virial[k] = ((1-lambda)*virialA + lambda*virialB)/(double) 0x100000000;
+        }
+}
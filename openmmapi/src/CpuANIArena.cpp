@@ -0,0 +1,76 @@
+/* -------------------------------------------------------------------------- *
+ * The MIT License
+ *
+ * SPDX short identifier: MIT
+ *
+ * Copyright 2019 Genentech Inc. South San Francisco
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ * -------------------------------------------------------------------------- */
+
+
+#include "CpuANIArena.h"
+#include <algorithm>
+#include <cstdint>
+
+using namespace ANIPlugin;
+using namespace std;
+
+static char* align(char* pointer) {
+    uintptr_t address = reinterpret_cast<uintptr_t>(pointer);
+    return pointer + (CpuANIArena::ALIGNMENT - address%CpuANIArena::ALIGNMENT)%CpuANIArena::ALIGNMENT;
+}
+
+CpuANIArena::CpuANIArena() : block(NULL), alignedBlock(NULL), capacity(0), used(0), highWaterMark(0), numHeapAllocations(0) {
+}
+
+CpuANIArena::~CpuANIArena() {
+    reset();
+    delete[] block;
+}
+
+void CpuANIArena::reserve(size_t size) {
+    if (size <= capacity)
+        return;
+    delete[] block;
+    block = new char[size+ALIGNMENT];
+    alignedBlock = align(block);
+    capacity = size;
+    numHeapAllocations++;
+}
+
+void CpuANIArena::reset() {
+    for (char* buffer : overflow)
+        delete[] buffer;
+    overflow.clear();
+    highWaterMark = max(highWaterMark, used);
+    used = 0;
+    reserve(highWaterMark);
+}
+
+void* CpuANIArena::allocateBytes(size_t size) {
+    size_t start = used;
+    used += size;
+    if (used <= capacity)
+        return alignedBlock+start;
+    char* buffer = new char[size+ALIGNMENT];
+    overflow.push_back(buffer);
+    numHeapAllocations++;
+    return align(buffer);
+}
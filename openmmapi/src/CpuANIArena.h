@@ -0,0 +1,99 @@
+#ifndef OPENMM_CPU_ANI_ARENA_H_
+#define OPENMM_CPU_ANI_ARENA_H_
+
+/* -------------------------------------------------------------------------- *
+ * The MIT License
+ *
+ * SPDX short identifier: MIT
+ *
+ * Copyright 2019 Genentech Inc. South San Francisco
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ * -------------------------------------------------------------------------- */
+
+
+#include <cstddef>
+#include <vector>
+
+namespace ANIPlugin {
+
+/**
+ * A bump allocator for the temporary buffers of one evaluation.
+ *
+ * All buffers come from a single block and are released together by reset(),
+ * so a step that fits into the block does no heap allocation at all.  If a
+ * step needs more memory than the block holds, the excess is taken from the
+ * heap and the block is enlarged at the next reset() to the largest amount
+ * ever used.  The block therefore only grows when the system does.
+ */
+class CpuANIArena {
+public:
+    /** Every buffer starts on a boundary of this many bytes. */
+    static const size_t ALIGNMENT = 64;
+    CpuANIArena();
+    ~CpuANIArena();
+    /**
+     * Make sure the block holds at least the given number of bytes.  This
+     * must not be called while buffers are in use.
+     */
+    void reserve(size_t size);
+    /**
+     * Release all buffers.
+     */
+    void reset();
+    /**
+     * Allocate an uninitialized buffer for count objects of type T.  T must
+     * be trivially constructible and destructible.
+     */
+    template <class T>
+    T* allocate(size_t count) {
+        return reinterpret_cast<T*>(allocateBytes(getAllocationSize<T>(count)));
+    }
+    /**
+     * Get how many bytes allocate<T>(count) takes from the arena.
+     */
+    template <class T>
+    static size_t getAllocationSize(size_t count) {
+        return (count*sizeof(T)+ALIGNMENT-1)/ALIGNMENT*ALIGNMENT;
+    }
+    /**
+     * Get the size of the block in bytes.
+     */
+    size_t getCapacity() const {
+        return capacity;
+    }
+    /**
+     * Get the number of times memory was requested from the heap, either to
+     * grow the block or for an allocation that did not fit into it.
+     */
+    long long getNumHeapAllocations() const {
+        return numHeapAllocations;
+    }
+private:
+    void* allocateBytes(size_t size);
+    char* block;
+    char* alignedBlock;
+    size_t capacity, used, highWaterMark;
+    std::vector<char*> overflow;
+    long long numHeapAllocations;
+};
+
+} // namespace ANIPlugin
+
+#endif /*OPENMM_CPU_ANI_ARENA_H_*/
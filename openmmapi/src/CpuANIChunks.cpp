@@ -0,0 +1,276 @@
+/* -------------------------------------------------------------------------- *
+ * The MIT License
+ *
+ * SPDX short identifier: MIT
+ *
+ * Copyright 2019 Genentech Inc. South San Francisco
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ * -------------------------------------------------------------------------- */
+
+#include "internal/CpuANIChunks.h"
+#include "CpuANINeighborList.h"
+#include "openmm/OpenMMException.h"
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+
+using namespace ANIPlugin;
+using namespace OpenMM;
+using namespace std;
+
+// Without periodic boundary conditions, the grid has at most this many bins
+// along each axis, as in CpuANINeighborList.
+static const int MAX_BINS_PER_AXIS = 128;
+
+// The bytes this object needs for each atom of a chunk.
+static const size_t CHUNK_ATOM_BYTES = sizeof(int)+sizeof(string)+3*sizeof(float)+sizeof(char)+3*sizeof(long long);
+
+CpuANIChunks::CpuANIChunks(CpuANIEngine& engine, const vector<string>& symbols, size_t maxMemory) :
+        engine(engine), symbols(symbols), maxMemory(maxMemory), peakMemory(0), selfEnergy(0), volume(0), numChunks(0), periodic(false) {
+    const ANIModel& model = engine.getModel();
+    cutoff = max(model.radialCutoff, model.angularCutoff);
+    for (const string& symbol : symbols) {
+        if (model.getSpeciesIndex(symbol) == -1)
+            throw OpenMMException("ANI: the model does not support element "+symbol);
+        selfEnergy += model.selfEnergies[model.getSpeciesIndex(symbol)];
+    }
+    fixedGradient.resize(3*symbols.size());
+}
+
+void CpuANIChunks::assignBins(const float* positions, const float* cell) {
+    // Periodic structures use exactly the grid of CpuANINeighborList, so the
+    // engine pairs an atom of a chunk only with atoms in the adjacent bins.
+
+    const int numAtoms = symbols.size();
+    periodic = (cell != NULL);
+    atomBin.resize(numAtoms);
+    float minPos[3], extent[3];
+    if (periodic) {
+        CpuANINeighborList::getNumPeriodicBins(cell, cutoff, numBins);
+        volume = (double) cell[0]*cell[4]*cell[8];
+    }
+    else {
+        float maxPos[3];
+        for (int k = 0; k < 3; k++)
+            minPos[k] = maxPos[k] = positions[k];
+        for (int i = 1; i < numAtoms; i++)
+            for (int k = 0; k < 3; k++) {
+                minPos[k] = min(minPos[k], positions[3*i+k]);
+                maxPos[k] = max(maxPos[k], positions[3*i+k]);
+            }
+        volume = 1;
+        for (int k = 0; k < 3; k++) {
+            extent[k] = maxPos[k]-minPos[k];
+            numBins[k] = max(1, min(MAX_BINS_PER_AXIS, (int) (extent[k]/cutoff)));
+            volume *= max(extent[k], cutoff);
+        }
+    }
+    for (int i = 0; i < numAtoms; i++) {
+        const float* p = &positions[3*i];
+        float fractional[3];
+        if (periodic) {
+            double z = p[2]/cell[8];
+            double y = (p[1]-cell[7]*z)/cell[4];
+            double x = (p[0]-cell[6]*z-cell[3]*y)/cell[0];
+            fractional[0] = (float) (x-floor(x));
+            fractional[1] = (float) (y-floor(y));
+            fractional[2] = (float) (z-floor(z));
+        }
+        else
+            for (int k = 0; k < 3; k++)
+                fractional[k] = (extent[k] > 0 ? (p[k]-minPos[k])/extent[k] : 0.0f);
+        int b[3];
+        for (int k = 0; k < 3; k++)
+            b[k] = min(numBins[k]-1, (int) (fractional[k]*numBins[k]));
+        atomBin[i] = (b[2]*numBins[1] + b[1])*numBins[0] + b[0];
+    }
+
+    // Sort the atoms into bins, keeping each bin in index order.
+
+    int totalBins = numBins[0]*numBins[1]*numBins[2];
+    binStart.assign(totalBins+1, 0);
+    for (int i = 0; i < numAtoms; i++)
+        binStart[atomBin[i]+1]++;
+    for (int b = 0; b < totalBins; b++)
+        binStart[b+1] += binStart[b];
+    binAtoms.resize(numAtoms);
+    binNext.assign(binStart.begin(), binStart.end()-1);
+    for (int i = 0; i < numAtoms; i++)
+        binAtoms[binNext[atomBin[i]]++] = i;
+}
+
+void CpuANIChunks::getChunkBins(int axis, int chunk, int numChunksOnAxis, int& first, int& last, vector<int>& bins) const {
+    // The chunk owns bins [first, last) along the axis, and its halo adds one
+    // more bin on either side.
+
+    const int n = numBins[axis];
+    first = chunk*n/numChunksOnAxis;
+    last = (chunk+1)*n/numChunksOnAxis;
+    bins.clear();
+    if (periodic && last-first+2 >= n)
+        for (int b = 0; b < n; b++)
+            bins.push_back(b);
+    else if (periodic)
+        for (int b = first-1; b <= last; b++)
+            bins.push_back((b+n)%n);
+    else
+        for (int b = max(0, first-1); b < min(n, last+1); b++)
+            bins.push_back(b);
+}
+
+int CpuANIChunks::getMaxChunkAtoms(const int* numChunksPerAxis) {
+    int maxAtoms = 0, first, last;
+    for (int cz = 0; cz < numChunksPerAxis[2]; cz++) {
+        getChunkBins(2, cz, numChunksPerAxis[2], first, last, axisBins[2]);
+        for (int cy = 0; cy < numChunksPerAxis[1]; cy++) {
+            getChunkBins(1, cy, numChunksPerAxis[1], first, last, axisBins[1]);
+            for (int cx = 0; cx < numChunksPerAxis[0]; cx++) {
+                getChunkBins(0, cx, numChunksPerAxis[0], first, last, axisBins[0]);
+                int numAtoms = 0;
+                for (int bz : axisBins[2])
+                    for (int by : axisBins[1])
+                        for (int bx : axisBins[0]) {
+                            int b = (bz*numBins[1] + by)*numBins[0] + bx;
+                            numAtoms += binStart[b+1]-binStart[b];
+                        }
+                maxAtoms = max(maxAtoms, numAtoms);
+            }
+        }
+    }
+    return maxAtoms;
+}
+
+size_t CpuANIChunks::getOwnMemoryUsage() const {
+    size_t size = (atomBin.capacity()+binStart.capacity()+binNext.capacity()+binAtoms.capacity()+chunkAtoms.capacity())*sizeof(int) +
+                  chunkSymbols.capacity()*sizeof(string) + chunkPositions.capacity()*sizeof(float) + isHalo.capacity() +
+                  (chunkGradient.capacity()+fixedGradient.capacity())*sizeof(long long);
+    for (int k = 0; k < 3; k++)
+        size += axisBins[k].capacity()*sizeof(int);
+    return size;
+}
+
+void CpuANIChunks::compute(ANIEvaluation& eval) {
+    const int numAtoms = symbols.size();
+    const bool computeGradient = (eval.forces != NULL);
+    const bool computeVirial = (eval.virial != NULL);
+    assignBins(eval.positions, eval.cell);
+
+    // Estimate the neighbors of an atom from the mean density, and keep
+    // dividing the chunks along their longest side until the largest one fits.
+
+    double neighborsPerAtom = numAtoms*(4.0/3.0)*M_PI*cutoff*cutoff*cutoff/volume;
+    size_t fixedMemory = 3*numAtoms*sizeof(long long) + (2*numAtoms+2*binStart.size())*sizeof(int);
+    int numChunksPerAxis[3] = {1, 1, 1};
+    while (true) {
+        int maxAtoms = getMaxChunkAtoms(numChunksPerAxis);
+        size_t memory = engine.estimateMemoryUsage(maxAtoms, neighborsPerAtom) + fixedMemory + maxAtoms*CHUNK_ATOM_BYTES;
+        if (memory <= maxMemory)
+            break;
+        int axis = -1;
+        for (int k = 0; k < 3; k++)
+            if (numChunksPerAxis[k] < numBins[k] && (axis == -1 || numBins[k]*numChunksPerAxis[axis] > numBins[axis]*numChunksPerAxis[k]))
+                axis = k;
+        if (axis == -1) {
+            // The chunks are as small as the cutoff allows.
+
+            stringstream message;
+            message << "ANIForce: the memory limit of " << maxMemory/(double) (1<<20) << " MB is too small for this system, which needs at least "
+                    << ceil(10*memory/(double) (1<<20))/10 << " MB";
+            throw OpenMMException(message.str());
+        }
+        numChunksPerAxis[axis]++;
+    }
+
+    // Evaluate the chunks and add up their contributions.
+
+    long long fixedEnergy = 0, fixedVirial[9] = {0, 0, 0, 0, 0, 0, 0, 0, 0};
+    if (computeGradient)
+        fill(fixedGradient.begin(), fixedGradient.end(), 0);
+    numChunks = 0;
+    int first[3], last[3];
+    for (int cz = 0; cz < numChunksPerAxis[2]; cz++)
+        for (int cy = 0; cy < numChunksPerAxis[1]; cy++)
+            for (int cx = 0; cx < numChunksPerAxis[0]; cx++) {
+                int chunk[3] = {cx, cy, cz};
+                for (int k = 0; k < 3; k++)
+                    getChunkBins(k, chunk[k], numChunksPerAxis[k], first[k], last[k], axisBins[k]);
+
+                // Collect the atoms of the chunk and its halo in index order,
+                // as computeDomain() requires.
+
+                chunkAtoms.clear();
+                for (int bz : axisBins[2])
+                    for (int by : axisBins[1])
+                        for (int bx : axisBins[0]) {
+                            int b = (bz*numBins[1] + by)*numBins[0] + bx;
+                            chunkAtoms.insert(chunkAtoms.end(), binAtoms.begin()+binStart[b], binAtoms.begin()+binStart[b+1]);
+                        }
+                sort(chunkAtoms.begin(), chunkAtoms.end());
+                const int n = chunkAtoms.size();
+                isHalo.resize(n);
+                bool hasDomainAtoms = false;
+                for (int j = 0; j < n; j++) {
+                    int bin = atomBin[chunkAtoms[j]];
+                    int b[3] = {bin%numBins[0], (bin/numBins[0])%numBins[1], bin/(numBins[0]*numBins[1])};
+                    bool owned = true;
+                    for (int k = 0; k < 3; k++)
+                        if (b[k] < first[k] || b[k] >= last[k])
+                            owned = false;
+                    isHalo[j] = !owned;
+                    hasDomainAtoms |= owned;
+                }
+                if (!hasDomainAtoms)
+                    continue;
+                chunkSymbols.resize(n);
+                chunkPositions.resize(3*n);
+                chunkGradient.resize(3*n);
+                for (int j = 0; j < n; j++) {
+                    chunkSymbols[j] = symbols[chunkAtoms[j]];
+                    for (int k = 0; k < 3; k++)
+                        chunkPositions[3*j+k] = eval.positions[3*chunkAtoms[j]+k];
+                }
+                ANIEvaluation chunkEval;
+                chunkEval.symbols = &chunkSymbols;
+                chunkEval.positions = chunkPositions.data();
+                chunkEval.cell = eval.cell;
+                CpuANIDomain domain;
+                domain.isHalo = isHalo.data();
+                domain.computeVirial = computeVirial;
+                domain.fixedGradient = (computeGradient ? chunkGradient.data() : NULL);
+                engine.computeDomain(chunkEval, domain);
+                fixedEnergy += domain.fixedEnergy;
+                if (computeVirial)
+                    for (int k = 0; k < 9; k++)
+                        fixedVirial[k] += domain.fixedVirial[k];
+                if (computeGradient)
+                    for (int j = 0; j < n; j++)
+                        for (int k = 0; k < 3; k++)
+                            fixedGradient[3*chunkAtoms[j]+k] += chunkGradient[3*j+k];
+                numChunks++;
+            }
+    eval.energy = fixedEnergy/(double) 0x100000000 + selfEnergy;
+    if (computeGradient)
+        for (int i = 0; i < fixedGradient.size(); i++)
+            eval.forces[i] = (float) (-fixedGradient[i]/(double) 0x100000000);
+    if (computeVirial)
+        for (int k = 0; k < 9; k++)
+            eval.virial[k] = fixedVirial[k]/(double) 0x100000000;
+    peakMemory = max(peakMemory, engine.getMemoryUsage()+getOwnMemoryUsage());
+}
@@ -0,0 +1,1235 @@
+#ifndef OPENMM_CPU_ANI_COMPUTATION_H_
+#define OPENMM_CPU_ANI_COMPUTATION_H_
+
+/* -------------------------------------------------------------------------- *
+ * The MIT License
+ *
+ * SPDX short identifier: MIT
+ *
+ * Copyright 2019 Genentech Inc. South San Francisco
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ * -------------------------------------------------------------------------- */
+
+
+#include "ANIEngine.h"
+#include "internal/ANIModel.h"
+#include "internal/CpuANIEngine.h"
+#include "CpuANIActivations.h"
+#include "CpuANIArena.h"
+#include "CpuANINeighborList.h"
+#include "CpuANISplineTable.h"
+#include "openmm/OpenMMException.h"
+#include "openmm/internal/ThreadPool.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <vector>
+
+namespace ANIPlugin {
+
+/**
+ * Scratch memory used while evaluating one structure.  Every thread of a
+ * CpuANIEngine owns one.  The buffers below are allocated from the arena
+ * during each evaluation and are only valid until it ends.  When several
+ * threads work on one structure, the buffers describing the structure live in
+ * the first thread's workspace and every thread has its own network buffers
+ * and force accumulator.
+ */
+struct CpuANIWorkspace {
+    CpuANIWorkspace() : minSortedAtoms(2048) {
+    }
+    CpuANINeighborList neighbors;
+    CpuANIArena arena;
+    /** structures with at least this many atoms are processed in Morton order */
+    int minSortedAtoms;
+    /** the order in which atoms are processed, or NULL for index order */
+    int* atomOrder;
+    int* species;
+    int* speciesStart;
+    int* speciesAtoms;
+    int* tileSpecies;
+    int* tileStart;
+    /**
+     * The neighbors of atom i are neighbors[neighborStart[i]..neighborStart[i+1]).
+     * Those within the angular cutoff come first and end at angularEnd[i].
+     */
+    int* neighborStart;
+    int* angularEnd;
+    CpuANINeighborList::Pair* neighborList;
+    float* aev;
+    float* aevGrad;
+    float* tileInput;
+    float* tileValues;
+    float* tileGrad;
+    float* layerGrad;
+    /**
+     * The AEV blocks that can be non-zero, as merged [start, end) ranges of
+     * AEV indices: numActiveRanges[t] ranges starting at
+     * activeRanges[2*t*numBlocks] for each atom t of the current tile, and in
+     * slot TILE_SIZE for the tile as a whole.
+     */
+    int* activeRanges;
+    int* numActiveRanges;
+    char* activeBlocks;
+    int* neighborCounts;
+    /** gradient contributions of this thread in 32.32 fixed point */
+    long long* fixedGradient;
+    /** energy contributions of this thread in 32.32 fixed point */
+    long long fixedEnergy;
+    /** energy contributions to each ensemble member, or NULL if they are not needed */
+    long long* fixedEnsembleEnergies;
+    /** virial contributions of this thread in 32.32 fixed point */
+    long long fixedVirial[9];
+};
+
+/**
+ * Evaluates the energy and forces of a single structure for one AEV layout.
+ *
+ * Forces and energies are summed in 64 bit fixed point, the same way the GPU
+ * kernels accumulate forces.  Integer addition is associative, so the result
+ * is bitwise identical no matter how many threads take part or how the work
+ * is divided between them.
+ */
+class CpuANIComputation {
+public:
+    virtual ~CpuANIComputation() {
+    }
+    /**
+     * Get whether this computation was compiled for the model's AEV layout.
+     */
+    virtual bool isSpecialized() const = 0;
+    /**
+     * Compute the energy and, if eval.forces and eval.virial are set, the forces
+     * and virial of a structure on the calling thread.
+     */
+    virtual void compute(ANIEvaluation& eval, CpuANIWorkspace& workspace) const = 0;
+    /**
+     * Compute the energy and, if eval.forces and eval.virial are set, the forces
+     * and virial of a structure using every thread of a pool.  workspaces holds
+     * one workspace per thread.
+     */
+    virtual void compute(ANIEvaluation& eval, OpenMM::ThreadPool& threads, const std::vector<CpuANIWorkspace*>& workspaces) const = 0;
+    /**
+     * Compute the contributions of one domain of a larger structure (see
+     * CpuANIEngine::computeDomain()), on the threads of a pool or, if threads
+     * is NULL, on the calling thread with the first workspace.
+     */
+    virtual void computeDomain(ANIEvaluation& eval, CpuANIDomain& domain, OpenMM::ThreadPool* threads, const std::vector<CpuANIWorkspace*>& workspaces) const = 0;
+    /**
+     * Compute the AEVs of all atoms of a structure on the calling thread and
+     * store them in aevs, one row of getAEVLength() values per atom.
+     */
+    virtual void computeAEVs(const ANIEvaluation& eval, float* aevs, CpuANIWorkspace& workspace) const = 0;
+    /**
+     * Get the number of values in the AEV of one atom.
+     */
+    virtual int getAEVLength() const = 0;
+    /**
+     * Get the number of arena bytes needed to evaluate a structure, not
+     * counting the neighbor lists whose size depends on the geometry.
+     */
+    virtual size_t getWorkspaceSize(int numAtoms) const = 0;
+};
+
+/**
+ * An AEV layout whose sizes are compile time constants.  The loops over radial
+ * and angular shifts then have constant trip counts and the offsets of all AEV
+ * blocks are constants, so the compiler can unroll and vectorize them.  Every
+ * published ANI model uses a single EtaR, EtaA and Zeta value.
+ */
+template <int NUM_SPECIES, int NUM_SHFR, int NUM_SHFA, int NUM_SHFZ>
+class CpuANIFixedLayout {
+public:
+    static const bool isSpecialized = true;
+    CpuANIFixedLayout(const ANIModel& model) {
+    }
+    constexpr int numSpecies() const {
+        return NUM_SPECIES;
+    }
+    constexpr int numEtaR() const {
+        return 1;
+    }
+    constexpr int numShfR() const {
+        return NUM_SHFR;
+    }
+    constexpr int numEtaA() const {
+        return 1;
+    }
+    constexpr int numZeta() const {
+        return 1;
+    }
+    constexpr int numShfA() const {
+        return NUM_SHFA;
+    }
+    constexpr int numShfZ() const {
+        return NUM_SHFZ;
+    }
+    constexpr int radialSubLength() const {
+        return NUM_SHFR;
+    }
+    constexpr int angularSubLength() const {
+        return NUM_SHFA*NUM_SHFZ;
+    }
+    constexpr int radialLength() const {
+        return NUM_SPECIES*NUM_SHFR;
+    }
+    constexpr int aevLength() const {
+        return NUM_SPECIES*NUM_SHFR + NUM_SPECIES*(NUM_SPECIES+1)/2*NUM_SHFA*NUM_SHFZ;
+    }
+};
+
+/**
+ * The generic AEV layout, with all sizes taken from the model at runtime.
+ */
+class CpuANIRuntimeLayout {
+public:
+    static const bool isSpecialized = false;
+    CpuANIRuntimeLayout(const ANIModel& model) : species(model.getNumSpecies()), etaR(model.etaR.size()),
+            shfR(model.shfR.size()), etaA(model.etaA.size()), zeta(model.zeta.size()), shfA(model.shfA.size()),
+            shfZ(model.shfZ.size()) {
+    }
+    int numSpecies() const {
+        return species;
+    }
+    int numEtaR() const {
+        return etaR;
+    }
+    int numShfR() const {
+        return shfR;
+    }
+    int numEtaA() const {
+        return etaA;
+    }
+    int numZeta() const {
+        return zeta;
+    }
+    int numShfA() const {
+        return shfA;
+    }
+    int numShfZ() const {
+        return shfZ;
+    }
+    int radialSubLength() const {
+        return etaR*shfR;
+    }
+    int angularSubLength() const {
+        return etaA*zeta*shfA*shfZ;
+    }
+    int radialLength() const {
+        return species*etaR*shfR;
+    }
+    int aevLength() const {
+        return radialLength() + species*(species+1)/2*angularSubLength();
+    }
+private:
+    int species, etaR, shfR, etaA, zeta, shfA, shfZ;
+};
+
+/**
+ * The AEV and network code, instantiated for each supported layout.
+ */
+template <class LAYOUT>
+class CpuANIComputationImpl : public CpuANIComputation {
+public:
+    CpuANIComputationImpl(const ANIModel& model, CpuANIActivations::Precision activationPrecision, bool fuseAEVs, bool useSplines);
+    bool isSpecialized() const {
+        return LAYOUT::isSpecialized;
+    }
+    void compute(ANIEvaluation& eval, CpuANIWorkspace& workspace) const;
+    void compute(ANIEvaluation& eval, OpenMM::ThreadPool& threads, const std::vector<CpuANIWorkspace*>& workspaces) const;
+    void computeDomain(ANIEvaluation& eval, CpuANIDomain& domain, OpenMM::ThreadPool* threads, const std::vector<CpuANIWorkspace*>& workspaces) const;
+    void computeAEVs(const ANIEvaluation& eval, float* aevs, CpuANIWorkspace& workspace) const;
+    int getAEVLength() const {
+        return layout.aevLength();
+    }
+    size_t getWorkspaceSize(int numAtoms) const;
+private:
+    struct Layer {
+        int inputSize, outputSize;
+        ANIModel::Activation activation;
+        std::vector<float> weights, transposedWeights, biases;
+    };
+    // Atoms of one species are pushed through the networks in tiles of this size.
+    static const int TILE_SIZE = 16;
+    // Threads claim atoms in blocks of this size.
+    static const int ATOM_BLOCK_SIZE = 16;
+    // Upper limit on the number of angular factors in the generic layout.
+    static const int MAX_ANGULAR_FACTORS = 64;
+    // Grid points per Angstrom of the distance tables.
+    static const int TABLE_POINTS_PER_ANGSTROM = 100;
+    // Grid points of the angle table, over the cosine from -1 to 1.
+    static const int ANGLE_TABLE_POINTS = 800;
+    void evaluate(ANIEvaluation& eval, CpuANIDomain* domain, OpenMM::ThreadPool* threads, CpuANIWorkspace* const* workspaces, int numThreads) const;
+    void buildNeighborList(int numAtoms, const float* positions, const float* cell, const char* isHalo, CpuANIWorkspace& ws) const;
+    static void sortAtoms(int numAtoms, const float* positions, const float* cell, CpuANIWorkspace& ws);
+    void computeAEV(int atom, float* aev, const CpuANIWorkspace& ws) const;
+    void evaluateTile(int tile, bool computeGradient, bool computeVirial, CpuANIWorkspace& ws, CpuANIWorkspace& local) const;
+    void findActiveBlocks(int atom, char* active, int* counts, const CpuANIWorkspace& ws) const;
+    int findActiveRanges(const char* active, int* ranges) const;
+    void backpropagateAEV(int atom, const float* aevGrad, bool computeVirial, const CpuANIWorkspace& ws, CpuANIWorkspace& local) const;
+    template <class FUNCTION>
+    static void buildTable(CpuANISplineTable& table, int numFunctions, double minX, double maxX, double spacing, FUNCTION function);
+    float cutoffFunction(float r, float scale) const;
+    float cutoffFunction(float r, float scale, float& derivative) const;
+    static void clearGradient(int numAtoms, CpuANIWorkspace& local);
+    static void addVirial(const float* delta, const float* gradient, long long* virial);
+    const ANIModel& model;
+    LAYOUT layout;
+    CpuANIActivations::Precision activationPrecision;
+    bool fuseAEVs, useSplines;
+    float radialCutoff, angularCutoff;
+    std::vector<float> etaR, shfR, etaA, zeta, shfA, cosShfZ, sinShfZ;
+    CpuANISplineTable radialTable, angularCutoffTable, angularTable, angleTable;
+    std::vector<int> pairIndex;
+    int numBlocks;
+    std::vector<std::vector<std::vector<Layer> > > networks;
+    int maxLayerWidth, maxTotalWidth;
+};
+
+// std::min() binds TILE_SIZE to a reference, which needs a definition when
+// the call is not inlined.
+template <class LAYOUT>
+const int CpuANIComputationImpl<LAYOUT>::TILE_SIZE;
+
+template <class LAYOUT>
+CpuANIComputationImpl<LAYOUT>::CpuANIComputationImpl(const ANIModel& model, CpuANIActivations::Precision activationPrecision, bool fuseAEVs, bool useSplines) :
+        model(model), layout(model), activationPrecision(activationPrecision), fuseAEVs(fuseAEVs), useSplines(useSplines),
+        radialCutoff(model.radialCutoff), angularCutoff(model.angularCutoff), etaR(model.etaR), shfR(model.shfR),
+        etaA(model.etaA), zeta(model.zeta), shfA(model.shfA) {
+    if (layout.numZeta()*layout.numShfZ() > MAX_ANGULAR_FACTORS || layout.numEtaA()*layout.numShfA() > MAX_ANGULAR_FACTORS)
+        throw OpenMM::OpenMMException("ANI: too many angular parameters");
+    for (float z : model.shfZ) {
+        cosShfZ.push_back(cosf(z));
+        sinShfZ.push_back(sinf(z));
+    }
+    if (useSplines) {
+        // Tabulate every radial term together with the cutoff function it is
+        // multiplied by, the angular cutoff, and the distance and angle
+        // factors of the angular terms.  The mean distance of an angular pair
+        // is below the angular cutoff, so all distance tables end at their
+        // cutoff.  The angle factors are tabulated over the cosine of the
+        // angle, which the AEVs scale by 0.95 so its derivative stays finite.
+
+        const int numShfR = layout.numShfR(), numShfA = layout.numShfA(), numShfZ = layout.numShfZ();
+        const double spacing = 1.0/TABLE_POINTS_PER_ANGSTROM;
+        const double radialScale = M_PI/radialCutoff, angularScale = M_PI/angularCutoff;
+        buildTable(radialTable, layout.numEtaR()*numShfR, 0.0, radialCutoff, spacing, [&](double r, double* values, double* derivs) {
+            double fc = 0.5*cos(r*radialScale) + 0.5;
+            double dfc = -0.5*radialScale*sin(r*radialScale);
+            for (int a = 0; a < etaR.size(); a++)
+                for (int k = 0; k < numShfR; k++) {
+                    double dr = r-shfR[k];
+                    double g = 0.25*exp(-etaR[a]*dr*dr);
+                    values[a*numShfR+k] = g*fc;
+                    derivs[a*numShfR+k] = g*(dfc - 2.0*etaR[a]*dr*fc);
+                }
+        });
+        buildTable(angularCutoffTable, 1, 0.0, angularCutoff, spacing, [&](double r, double* values, double* derivs) {
+            values[0] = 0.5*cos(r*angularScale) + 0.5;
+            derivs[0] = -0.5*angularScale*sin(r*angularScale);
+        });
+        buildTable(angularTable, layout.numEtaA()*numShfA, 0.0, angularCutoff, spacing, [&](double r, double* values, double* derivs) {
+            for (int a = 0; a < etaA.size(); a++)
+                for (int m = 0; m < numShfA; m++) {
+                    double dr = r-shfA[m];
+                    values[a*numShfA+m] = exp(-etaA[a]*dr*dr);
+                    derivs[a*numShfA+m] = -2.0*etaA[a]*dr*values[a*numShfA+m];
+                }
+        });
+        buildTable(angleTable, layout.numZeta()*numShfZ, -1.0, 1.0, 2.0/ANGLE_TABLE_POINTS, [&](double c, double* values, double* derivs) {
+            double angle = acos(0.95*c);
+            double dAngledc = -0.95/sqrt(1.0-0.9025*c*c);
+            for (int z = 0; z < zeta.size(); z++)
+                for (int n = 0; n < numShfZ; n++) {
+                    double u = 0.5*(1.0 + cos(angle-model.shfZ[n]));
+                    values[z*numShfZ+n] = pow(u, zeta[z]);
+                    derivs[z*numShfZ+n] = -0.5*zeta[z]*pow(u, zeta[z]-1.0)*sin(angle-model.shfZ[n])*dAngledc;
+                }
+        });
+    }
+
+    // Species pairs are numbered row by row through the upper triangle.
+
+    int numSpecies = layout.numSpecies();
+    pairIndex.resize(numSpecies*numSpecies);
+    for (int i = 0, index = 0; i < numSpecies; i++)
+        for (int j = i; j < numSpecies; j++, index++)
+            pairIndex[i*numSpecies+j] = pairIndex[j*numSpecies+i] = index;
+    numBlocks = numSpecies + numSpecies*(numSpecies+1)/2;
+
+    // Keep each weight matrix in both orientations: the forward pass runs over
+    // rows of the transpose and the backward pass over rows of the original.
+
+    maxLayerWidth = layout.aevLength();
+    maxTotalWidth = 0;
+    networks.resize(model.networks.size());
+    for (int e = 0; e < model.networks.size(); e++)
+        for (const ANIModel::Network& network : model.networks[e]) {
+            std::vector<Layer> layers;
+            int totalWidth = 0;
+            for (const ANIModel::Layer& source : network) {
+                Layer layer;
+                layer.inputSize = source.inputSize;
+                layer.outputSize = source.outputSize;
+                layer.activation = source.activation;
+                layer.weights = source.weights;
+                layer.biases = source.biases;
+                layer.transposedWeights.resize(source.weights.size());
+                for (int o = 0; o < layer.outputSize; o++)
+                    for (int k = 0; k < layer.inputSize; k++)
+                        layer.transposedWeights[k*layer.outputSize+o] = source.weights[o*layer.inputSize+k];
+                maxLayerWidth = std::max(maxLayerWidth, layer.outputSize);
+                totalWidth += layer.outputSize;
+                layers.push_back(layer);
+            }
+            maxTotalWidth = std::max(maxTotalWidth, totalWidth);
+            networks[e].push_back(layers);
+        }
+}
+
+/**
+ * Convert a value to 32.32 fixed point.
+ */
+static inline long long toFixedPoint(double value) {
+    return (long long) (value*0x100000000);
+}
+
+/**
+ * Run a function on every thread of a pool, or only on the calling thread if
+ * there is no pool.  The function receives the thread index.
+ */
+template <class FUNCTION>
+static void runOnThreads(OpenMM::ThreadPool* threads, FUNCTION& function) {
+    class Task : public OpenMM::ThreadPool::Task {
+    public:
+        Task(FUNCTION& function) : function(function) {
+        }
+        void execute(OpenMM::ThreadPool& pool, int threadIndex) {
+            function(threadIndex);
+        }
+        FUNCTION& function;
+    };
+    if (threads == NULL)
+        function(0);
+    else {
+        Task task(function);
+        threads->execute(task);
+        threads->waitForThreads();
+    }
+}
+
+template <class LAYOUT>
+void CpuANIComputationImpl<LAYOUT>::compute(ANIEvaluation& eval, CpuANIWorkspace& workspace) const {
+    CpuANIWorkspace* workspaces[] = {&workspace};
+    evaluate(eval, NULL, NULL, workspaces, 1);
+}
+
+template <class LAYOUT>
+void CpuANIComputationImpl<LAYOUT>::compute(ANIEvaluation& eval, OpenMM::ThreadPool& threads, const std::vector<CpuANIWorkspace*>& workspaces) const {
+    evaluate(eval, NULL, &threads, &workspaces[0], threads.getNumThreads());
+}
+
+template <class LAYOUT>
+void CpuANIComputationImpl<LAYOUT>::computeDomain(ANIEvaluation& eval, CpuANIDomain& domain, OpenMM::ThreadPool* threads, const std::vector<CpuANIWorkspace*>& workspaces) const {
+    evaluate(eval, &domain, threads, &workspaces[0], (threads == NULL ? 1 : threads->getNumThreads()));
+}
+
+template <class LAYOUT>
+void CpuANIComputationImpl<LAYOUT>::computeAEVs(const ANIEvaluation& eval, float* aevs, CpuANIWorkspace& ws) const {
+    // The AEVs are written straight to the caller's array.
+
+    const std::vector<std::string>& symbols = *eval.symbols;
+    const int numAtoms = symbols.size();
+    ws.species = ws.arena.allocate<int>(numAtoms);
+    for (int i = 0; i < numAtoms; i++)
+        ws.species[i] = model.getSpeciesIndex(symbols[i]);
+    buildNeighborList(numAtoms, eval.positions, eval.cell, NULL, ws);
+    for (int i = 0; i < numAtoms; i++)
+        computeAEV(i, &aevs[(size_t) i*layout.aevLength()], ws);
+    ws.arena.reset();
+}
+
+template <class LAYOUT>
+size_t CpuANIComputationImpl<LAYOUT>::getWorkspaceSize(int numAtoms) const {
+    const size_t aevLength = layout.aevLength();
+    int maxTiles = numAtoms/TILE_SIZE + layout.numSpecies();
+    return 5*CpuANIArena::getAllocationSize<int>(numAtoms+1) +
+           CpuANIArena::getAllocationSize<int>(layout.numSpecies()+1) +
+           2*CpuANIArena::getAllocationSize<int>(maxTiles) +
+           (fuseAEVs ? 0 : 2)*CpuANIArena::getAllocationSize<float>(numAtoms*aevLength) +
+           2*CpuANIArena::getAllocationSize<float>(TILE_SIZE*aevLength) +
+           CpuANIArena::getAllocationSize<float>(2*TILE_SIZE*maxTotalWidth) +
+           CpuANIArena::getAllocationSize<float>(2*TILE_SIZE*maxLayerWidth) +
+           CpuANIArena::getAllocationSize<int>(2*(TILE_SIZE+1)*numBlocks) +
+           CpuANIArena::getAllocationSize<int>(TILE_SIZE+1) +
+           CpuANIArena::getAllocationSize<char>((TILE_SIZE+1)*numBlocks) +
+           CpuANIArena::getAllocationSize<int>(layout.numSpecies()) +
+           CpuANIArena::getAllocationSize<long long>(3*numAtoms) +
+           CpuANIArena::getAllocationSize<long long>(networks.size()) +
+           CpuANIArena::getAllocationSize<unsigned long long>(numAtoms);
+}
+
+template <class LAYOUT>
+void CpuANIComputationImpl<LAYOUT>::evaluate(ANIEvaluation& eval, CpuANIDomain* domain, OpenMM::ThreadPool* threads, CpuANIWorkspace* const* workspaces, int numThreads) const {
+    const std::vector<std::string>& symbols = *eval.symbols;
+    const int numAtoms = symbols.size();
+    const int numSpecies = layout.numSpecies();
+    const int aevLength = layout.aevLength();
+    const bool computeVirial = (domain == NULL ? eval.virial != NULL : domain->computeVirial);
+    const bool computeGradient = ((domain == NULL ? eval.forces != NULL : domain->fixedGradient != NULL) || computeVirial);
+    const char* isHalo = (domain == NULL ? NULL : domain->isHalo);
+    CpuANIWorkspace& ws = *workspaces[0];
+
+    // Set up everything that describes the structure on the calling thread:
+    // species, neighbor lists, the order to process the atoms in, and the
+    // tiles of atoms of equal species.  Halo atoms only take part as neighbors.
+
+    ws.species = ws.arena.allocate<int>(numAtoms);
+    for (int i = 0; i < numAtoms; i++)
+        ws.species[i] = model.getSpeciesIndex(symbols[i]);
+    buildNeighborList(numAtoms, eval.positions, eval.cell, isHalo, ws);
+    sortAtoms(numAtoms, eval.positions, eval.cell, ws);
+    const int* order = ws.atomOrder;
+    ws.speciesStart = ws.arena.allocate<int>(numSpecies+1);
+    std::fill(ws.speciesStart, ws.speciesStart+numSpecies+1, 0);
+    for (int i = 0; i < numAtoms; i++)
+        if (isHalo == NULL || !isHalo[i])
+            ws.speciesStart[ws.species[i]+1]++;
+    for (int s = 0; s < numSpecies; s++)
+        ws.speciesStart[s+1] += ws.speciesStart[s];
+    ws.speciesAtoms = ws.arena.allocate<int>(numAtoms);
+    int* next = ws.arena.allocate<int>(numSpecies);
+    std::copy(ws.speciesStart, ws.speciesStart+numSpecies, next);
+    for (int k = 0; k < numAtoms; k++) {
+        int i = (order == NULL ? k : order[k]);
+        if (isHalo == NULL || !isHalo[i])
+            ws.speciesAtoms[next[ws.species[i]]++] = i;
+    }
+    int maxTiles = numAtoms/TILE_SIZE + numSpecies;
+    ws.tileSpecies = ws.arena.allocate<int>(maxTiles);
+    ws.tileStart = ws.arena.allocate<int>(maxTiles);
+    int numTiles = 0;
+    for (int s = 0; s < numSpecies; s++)
+        for (int start = ws.speciesStart[s]; start < ws.speciesStart[s+1]; start += TILE_SIZE) {
+            ws.tileSpecies[numTiles] = s;
+            ws.tileStart[numTiles++] = start;
+        }
+    if (!fuseAEVs) {
+        ws.aev = ws.arena.allocate<float>((size_t) numAtoms*aevLength);
+        if (computeGradient)
+            ws.aevGrad = ws.arena.allocate<float>((size_t) numAtoms*aevLength);
+    }
+
+    for (int t = 0; t < numThreads; t++)
+        workspaces[t]->tileInput = NULL;
+
+    // Compute the AEVs, run the networks, and backpropagate to the atoms.  In
+    // each phase the threads claim blocks of atoms or tiles from a counter.
+    // When the AEVs are fused with the networks, the AEVs of each tile are
+    // computed right before its networks run and the gradient is propagated
+    // to the atoms right after, so only the tile buffers ever hold AEVs.
+
+    std::atomic<int> nextIndex(0);
+    auto computeAEVs = [&] (int threadIndex) {
+        for (int block = nextIndex++; block*ATOM_BLOCK_SIZE < numAtoms; block = nextIndex++)
+            for (int k = block*ATOM_BLOCK_SIZE; k < std::min(numAtoms, (block+1)*ATOM_BLOCK_SIZE); k++) {
+                int i = (order == NULL ? k : order[k]);
+                if (isHalo == NULL || !isHalo[i])
+                    computeAEV(i, &ws.aev[(size_t) i*aevLength], ws);
+            }
+    };
+    if (!fuseAEVs)
+        runOnThreads(threads, computeAEVs);
+    nextIndex = 0;
+    auto evaluateNetworks = [&] (int threadIndex) {
+        CpuANIWorkspace& local = *workspaces[threadIndex];
+        local.fixedEnergy = 0;
+        local.fixedEnsembleEnergies = NULL;
+        if (eval.ensembleEnergies != NULL && domain == NULL) {
+            local.fixedEnsembleEnergies = local.arena.allocate<long long>(networks.size());
+            std::fill(local.fixedEnsembleEnergies, local.fixedEnsembleEnergies+networks.size(), 0);
+        }
+        if (fuseAEVs && computeGradient)
+            clearGradient(numAtoms, local);
+        for (int tile = nextIndex++; tile < numTiles; tile = nextIndex++)
+            evaluateTile(tile, computeGradient, computeVirial, ws, local);
+    };
+    runOnThreads(threads, evaluateNetworks);
+    long long fixedEnergy = 0;
+    for (int t = 0; t < numThreads; t++)
+        fixedEnergy += workspaces[t]->fixedEnergy;
+    double selfEnergy = 0;
+    for (int i = 0; i < numAtoms; i++)
+        selfEnergy += model.selfEnergies[ws.species[i]];
+    if (domain != NULL)
+        domain->fixedEnergy = fixedEnergy;
+    else
+        eval.energy = fixedEnergy/(double) 0x100000000 + selfEnergy;
+    if (eval.ensembleEnergies != NULL && domain == NULL)
+        for (int e = 0; e < networks.size(); e++) {
+            long long sum = 0;
+            for (int t = 0; t < numThreads; t++)
+                sum += workspaces[t]->fixedEnsembleEnergies[e];
+            eval.ensembleEnergies[e] = sum/(double) 0x100000000 + selfEnergy;
+        }
+    if (computeGradient) {
+        nextIndex = 0;
+        auto backpropagate = [&] (int threadIndex) {
+            CpuANIWorkspace& local = *workspaces[threadIndex];
+            clearGradient(numAtoms, local);
+            for (int block = nextIndex++; block*ATOM_BLOCK_SIZE < numAtoms; block = nextIndex++)
+                for (int k = block*ATOM_BLOCK_SIZE; k < std::min(numAtoms, (block+1)*ATOM_BLOCK_SIZE); k++) {
+                    int i = (order == NULL ? k : order[k]);
+                    if (isHalo == NULL || !isHalo[i])
+                        backpropagateAEV(i, &ws.aevGrad[(size_t) i*aevLength], computeVirial, ws, local);
+                }
+        };
+        if (!fuseAEVs)
+            runOnThreads(threads, backpropagate);
+        if (computeVirial)
+            for (int k = 0; k < 9; k++) {
+                long long sum = 0;
+                for (int t = 0; t < numThreads; t++)
+                    sum += workspaces[t]->fixedVirial[k];
+                if (domain != NULL)
+                    domain->fixedVirial[k] = sum;
+                else
+                    eval.virial[k] = sum/(double) 0x100000000;
+            }
+
+        // Sum the threads' contributions.
+
+        nextIndex = 0;
+        auto reduceForces = [&] (int threadIndex) {
+            for (int block = nextIndex++; block*ATOM_BLOCK_SIZE < numAtoms; block = nextIndex++)
+                for (int i = 3*block*ATOM_BLOCK_SIZE; i < 3*std::min(numAtoms, (block+1)*ATOM_BLOCK_SIZE); i++) {
+                    long long sum = 0;
+                    for (int t = 0; t < numThreads; t++)
+                        sum += workspaces[t]->fixedGradient[i];
+                    if (domain != NULL)
+                        domain->fixedGradient[i] = sum;
+                    else
+                        eval.forces[i] = (float) (-sum/(double) 0x100000000);
+                }
+        };
+        if (domain != NULL ? domain->fixedGradient != NULL : eval.forces != NULL)
+            runOnThreads(threads, reduceForces);
+    }
+
+    // Release all buffers right away.  That lets an arena grow now if this
+    // structure did not fit, rather than at the start of the next one.
+
+    for (int t = 0; t < numThreads; t++)
+        workspaces[t]->arena.reset();
+}
+
+template <class LAYOUT>
+void CpuANIComputationImpl<LAYOUT>::sortAtoms(int numAtoms, const float* positions, const float* cell, CpuANIWorkspace& ws) {
+    // Large structures are processed along a Morton (Z-order) curve instead of
+    // in index order, which usually follows the topology rather than space.
+    // Atoms that are processed one after another are then close together, so
+    // they share most of their neighbors, and the neighbors' species and force
+    // accumulators stay in cache.  Only the order of the atoms changes: every
+    // atom still sums over its neighbors in index order, and forces and
+    // energies are accumulated in fixed point, so the results are unchanged.
+
+    ws.atomOrder = NULL;
+    if (numAtoms < ws.minSortedAtoms)
+        return;
+
+    // Map every atom into the unit cube, using fractional coordinates for a
+    // periodic cell and the bounding box otherwise, and interleave the bits of
+    // its 10 bit grid coordinates.  The atom index goes into the low bits of
+    // each key, so sorting the keys gives the order.
+
+    float lower[3] = {0, 0, 0}, scale[3] = {1, 1, 1};
+    if (cell == NULL) {
+        float upper[3];
+        for (int k = 0; k < 3; k++)
+            lower[k] = upper[k] = positions[k];
+        for (int i = 0; i < numAtoms; i++)
+            for (int k = 0; k < 3; k++) {
+                lower[k] = std::min(lower[k], positions[3*i+k]);
+                upper[k] = std::max(upper[k], positions[3*i+k]);
+            }
+        for (int k = 0; k < 3; k++)
+            scale[k] = (upper[k] > lower[k] ? 1.0f/(upper[k]-lower[k]) : 0.0f);
+    }
+    unsigned long long* keys = ws.arena.allocate<unsigned long long>(numAtoms);
+    for (int i = 0; i < numAtoms; i++) {
+        const float* p = &positions[3*i];
+        float x[3];
+        if (cell != NULL) {
+            x[2] = p[2]/cell[8];
+            x[1] = (p[1]-cell[7]*x[2])/cell[4];
+            x[0] = (p[0]-cell[6]*x[2]-cell[3]*x[1])/cell[0];
+            for (int k = 0; k < 3; k++)
+                x[k] -= floorf(x[k]);
+        }
+        else
+            for (int k = 0; k < 3; k++)
+                x[k] = (p[k]-lower[k])*scale[k];
+        unsigned long long code = 0;
+        for (int k = 0; k < 3; k++) {
+            unsigned long long bits = std::min(1023, std::max(0, (int) (x[k]*1024)));
+            bits = (bits | (bits<<16)) & 0x030000FF;
+            bits = (bits | (bits<<8)) & 0x0300F00F;
+            bits = (bits | (bits<<4)) & 0x030C30C3;
+            bits = (bits | (bits<<2)) & 0x09249249;
+            code |= bits<<k;
+        }
+        keys[i] = (code<<32) | i;
+    }
+    std::sort(keys, keys+numAtoms);
+    ws.atomOrder = ws.arena.allocate<int>(numAtoms);
+    for (int i = 0; i < numAtoms; i++)
+        ws.atomOrder[i] = (int) (keys[i] & 0xFFFFFFFF);
+}
+
+template <class LAYOUT>
+void CpuANIComputationImpl<LAYOUT>::buildNeighborList(int numAtoms, const float* positions, const float* cell, const char* isHalo, CpuANIWorkspace& ws) const {
+    ws.neighbors.build(numAtoms, positions, cell, std::max(radialCutoff, angularCutoff));
+    const std::vector<CpuANINeighborList::Pair>& pairs = ws.neighbors.getPairs();
+
+    // Count the neighbors of every atom, then list each pair under both of its
+    // atoms with the displacement pointing away from the atom.  Since the pairs
+    // are sorted, every atom's neighbors are in order of their index.  Halo
+    // atoms get no neighbors of their own.
+
+    ws.neighborStart = ws.arena.allocate<int>(numAtoms+1);
+    ws.angularEnd = ws.arena.allocate<int>(numAtoms);
+    int* angularCount = ws.arena.allocate<int>(numAtoms);
+    std::fill(ws.neighborStart, ws.neighborStart+numAtoms+1, 0);
+    std::fill(angularCount, angularCount+numAtoms, 0);
+    for (const CpuANINeighborList::Pair& pair : pairs) {
+        bool listFirst = (isHalo == NULL || !isHalo[pair.first]);
+        bool listSecond = (isHalo == NULL || !isHalo[pair.second]);
+        ws.neighborStart[pair.first+1] += listFirst;
+        ws.neighborStart[pair.second+1] += listSecond;
+        if (pair.r < angularCutoff) {
+            angularCount[pair.first] += listFirst;
+            angularCount[pair.second] += listSecond;
+        }
+    }
+    for (int i = 0; i < numAtoms; i++)
+        ws.neighborStart[i+1] += ws.neighborStart[i];
+    int* nextAngular = ws.arena.allocate<int>(numAtoms);
+    int* nextRadial = ws.arena.allocate<int>(numAtoms);
+    for (int i = 0; i < numAtoms; i++) {
+        ws.angularEnd[i] = ws.neighborStart[i]+angularCount[i];
+        nextAngular[i] = ws.neighborStart[i];
+        nextRadial[i] = ws.angularEnd[i];
+    }
+    ws.neighborList = ws.arena.allocate<CpuANINeighborList::Pair>(ws.neighborStart[numAtoms]);
+    for (const CpuANINeighborList::Pair& pair : pairs) {
+        bool angular = (pair.r < angularCutoff);
+        if (isHalo == NULL || !isHalo[pair.first]) {
+            CpuANINeighborList::Pair& n1 = ws.neighborList[angular ? nextAngular[pair.first]++ : nextRadial[pair.first]++];
+            n1 = pair;
+        }
+        if (isHalo == NULL || !isHalo[pair.second]) {
+            CpuANINeighborList::Pair& n2 = ws.neighborList[angular ? nextAngular[pair.second]++ : nextRadial[pair.second]++];
+            n2.first = pair.second;
+            n2.second = pair.first;
+            n2.delta[0] = -pair.delta[0];
+            n2.delta[1] = -pair.delta[1];
+            n2.delta[2] = -pair.delta[2];
+            n2.r = pair.r;
+        }
+    }
+}
+
+/**
+ * Build a spline table, refining the grid until the tabulated values match
+ * the functions to 1e-6, which the published models reach with the default
+ * spacing.  If even an eight times finer grid misses that, the model is not
+ * suited to tables.
+ */
+template <class LAYOUT>
+template <class FUNCTION>
+void CpuANIComputationImpl<LAYOUT>::buildTable(CpuANISplineTable& table, int numFunctions, double minX, double maxX, double spacing, FUNCTION function) {
+    for (int i = 0; i < 4; i++, spacing *= 0.5) {
+        table.build(numFunctions, minX, maxX, spacing, function);
+        if (table.getMaxError() <= 1e-6)
+            return;
+    }
+    throw OpenMM::OpenMMException("ANI: spline tables cannot reproduce the AEV functions of this model to 1e-6; use the CPU engine instead");
+}
+
+/**
+ * Compute the angular cutoff function at r, where scale is pi divided by the
+ * angular cutoff.
+ */
+template <class LAYOUT>
+float CpuANIComputationImpl<LAYOUT>::cutoffFunction(float r, float scale) const {
+    if (useSplines) {
+        float t;
+        const float* c = angularCutoffTable.findInterval(r, t);
+        return angularCutoffTable.value(c, 0, t);
+    }
+    return 0.5f*cosf(r*scale) + 0.5f;
+}
+
+/**
+ * Compute the angular cutoff function at r and its derivative.
+ */
+template <class LAYOUT>
+float CpuANIComputationImpl<LAYOUT>::cutoffFunction(float r, float scale, float& derivative) const {
+    if (useSplines) {
+        float t;
+        const float* c = angularCutoffTable.findInterval(r, t);
+        derivative = angularCutoffTable.derivative(c, 0, t);
+        return angularCutoffTable.value(c, 0, t);
+    }
+    derivative = -0.5f*scale*sinf(r*scale);
+    return 0.5f*cosf(r*scale) + 0.5f;
+}
+
+/**
+ * Allocate a thread's gradient accumulator and clear it and the virial.
+ */
+template <class LAYOUT>
+void CpuANIComputationImpl<LAYOUT>::clearGradient(int numAtoms, CpuANIWorkspace& local) {
+    local.fixedGradient = local.arena.allocate<long long>(3*numAtoms);
+    std::fill(local.fixedGradient, local.fixedGradient+3*numAtoms, 0);
+    std::fill(local.fixedVirial, local.fixedVirial+9, 0);
+}
+
+template <class LAYOUT>
+void CpuANIComputationImpl<LAYOUT>::computeAEV(int atom, float* aev, const CpuANIWorkspace& ws) const {
+    const int aevLength = layout.aevLength();
+    const int radialSubLength = layout.radialSubLength();
+    const int radialLength = layout.radialLength();
+    const int angularSubLength = layout.angularSubLength();
+    const int numSpecies = layout.numSpecies();
+    const int numEtaR = layout.numEtaR(), numShfR = layout.numShfR();
+    const int numEtaA = layout.numEtaA(), numZeta = layout.numZeta();
+    const int numShfA = layout.numShfA(), numShfZ = layout.numShfZ();
+    std::fill(aev, aev+aevLength, 0.0f);
+    const int start = ws.neighborStart[atom], angularEnd = ws.angularEnd[atom], end = ws.neighborStart[atom+1];
+
+    // Radial terms.
+
+    const float radialScale = (float) M_PI/radialCutoff;
+    for (int j = start; j < end; j++) {
+        const CpuANINeighborList::Pair& nj = ws.neighborList[j];
+        float r = nj.r;
+        if (r >= radialCutoff)
+            continue;
+        float* block = &aev[ws.species[nj.second]*radialSubLength];
+        if (useSplines) {
+            float t;
+            const float* c = radialTable.findInterval(r, t);
+            for (int i = 0; i < numEtaR*numShfR; i++)
+                block[i] += radialTable.value(c, i, t);
+            continue;
+        }
+        float fc = 0.5f*cosf(r*radialScale) + 0.5f;
+        for (int a = 0; a < numEtaR; a++)
+            for (int k = 0; k < numShfR; k++) {
+                float dr = r-shfR[k];
+                block[a*numShfR+k] += 0.25f*expf(-etaR[a]*dr*dr)*fc;
+            }
+    }
+
+    // Angular terms for every pair of neighbors inside the angular cutoff.
+
+    const float angularScale = (float) M_PI/angularCutoff;
+    float f1[MAX_ANGULAR_FACTORS], f2[MAX_ANGULAR_FACTORS];
+    for (int j = start; j < angularEnd; j++) {
+        const CpuANINeighborList::Pair& nj = ws.neighborList[j];
+        float fcj = cutoffFunction(nj.r, angularScale);
+        for (int k = j+1; k < angularEnd; k++) {
+            const CpuANINeighborList::Pair& nk = ws.neighborList[k];
+            float fck = cutoffFunction(nk.r, angularScale);
+            float dot = nj.delta[0]*nk.delta[0] + nj.delta[1]*nk.delta[1] + nj.delta[2]*nk.delta[2];
+            float meanR = 0.5f*(nj.r+nk.r);
+            if (useSplines) {
+                float t;
+                const float* coeff = angleTable.findInterval(dot/(nj.r*nk.r), t);
+                for (int i = 0; i < numZeta*numShfZ; i++)
+                    f1[i] = angleTable.value(coeff, i, t);
+                coeff = angularTable.findInterval(meanR, t);
+                for (int i = 0; i < numEtaA*numShfA; i++)
+                    f2[i] = 2.0f*angularTable.value(coeff, i, t)*fcj*fck;
+            }
+            else {
+                float cosAngle = 0.95f*dot/(nj.r*nk.r);
+                float sinAngle = sqrtf(std::max(0.0f, 1.0f-cosAngle*cosAngle));
+                for (int z = 0; z < numZeta; z++)
+                    for (int n = 0; n < numShfZ; n++)
+                        f1[z*numShfZ+n] = powf(0.5f*(1.0f + cosAngle*cosShfZ[n] + sinAngle*sinShfZ[n]), zeta[z]);
+                for (int a = 0; a < numEtaA; a++)
+                    for (int m = 0; m < numShfA; m++) {
+                        float dr = meanR-shfA[m];
+                        f2[a*numShfA+m] = 2.0f*expf(-etaA[a]*dr*dr)*fcj*fck;
+                    }
+            }
+            float* block = &aev[radialLength + pairIndex[ws.species[nj.second]*numSpecies + ws.species[nk.second]]*angularSubLength];
+            for (int a = 0; a < numEtaA; a++)
+                for (int z = 0; z < numZeta; z++)
+                    for (int m = 0; m < numShfA; m++) {
+                        float scale = f2[a*numShfA+m];
+                        float* out = &block[((a*numZeta+z)*numShfA+m)*numShfZ];
+                        for (int n = 0; n < numShfZ; n++)
+                            out[n] += scale*f1[z*numShfZ+n];
+                    }
+        }
+    }
+}
+
+template <class LAYOUT>
+void CpuANIComputationImpl<LAYOUT>::evaluateTile(int tile, bool computeGradient, bool computeVirial, CpuANIWorkspace& ws, CpuANIWorkspace& local) const {
+    const int aevLength = layout.aevLength();
+    const int numEnsembles = networks.size();
+    const float ensembleScale = 1.0f/numEnsembles;
+    const int s = ws.tileSpecies[tile];
+    const int tileSize = std::min(TILE_SIZE, ws.speciesStart[s+1]-ws.tileStart[tile]);
+    const int* tileAtoms = &ws.speciesAtoms[ws.tileStart[tile]];
+
+    // The tile buffers belong to the thread and are allocated by its first tile.
+
+    if (local.tileInput == NULL) {
+        local.tileInput = local.arena.allocate<float>(TILE_SIZE*aevLength);
+        local.tileValues = local.arena.allocate<float>(2*TILE_SIZE*maxTotalWidth);
+        local.tileGrad = local.arena.allocate<float>(TILE_SIZE*aevLength);
+        local.layerGrad = local.arena.allocate<float>(2*TILE_SIZE*maxLayerWidth);
+        local.activeRanges = local.arena.allocate<int>(2*(TILE_SIZE+1)*numBlocks);
+        local.numActiveRanges = local.arena.allocate<int>(TILE_SIZE+1);
+        local.activeBlocks = local.arena.allocate<char>((TILE_SIZE+1)*numBlocks);
+        local.neighborCounts = local.arena.allocate<int>(layout.numSpecies());
+    }
+    for (int t = 0; t < tileSize; t++) {
+        if (fuseAEVs)
+            computeAEV(tileAtoms[t], &local.tileInput[t*aevLength], ws);
+        else {
+            const float* aev = &ws.aev[(size_t) tileAtoms[t]*aevLength];
+            std::copy(aev, aev+aevLength, &local.tileInput[t*aevLength]);
+        }
+    }
+
+    // A whole block of an AEV is zero when a species, or pair of species, is
+    // missing from the atom's environment, which for models with many species
+    // is most of the AEV.  The first layer only runs over the blocks that can
+    // be non-zero: in the forward pass those of any atom of the tile, and in
+    // the backward pass those of each atom, which are the only gradients
+    // backpropagateAEV() reads.  Skipped inputs are zero and skipped
+    // gradients are never used, so the results do not change.
+
+    char* tileActive = &local.activeBlocks[TILE_SIZE*numBlocks];
+    std::fill(tileActive, tileActive+numBlocks, 0);
+    for (int t = 0; t < tileSize; t++) {
+        char* active = &local.activeBlocks[t*numBlocks];
+        findActiveBlocks(tileAtoms[t], active, local.neighborCounts, ws);
+        local.numActiveRanges[t] = findActiveRanges(active, &local.activeRanges[2*t*numBlocks]);
+        for (int b = 0; b < numBlocks; b++)
+            tileActive[b] |= active[b];
+    }
+    local.numActiveRanges[TILE_SIZE] = findActiveRanges(tileActive, &local.activeRanges[2*TILE_SIZE*numBlocks]);
+    if (computeGradient)
+        std::fill(local.tileGrad, local.tileGrad+tileSize*aevLength, 0.0f);
+    for (int e = 0; e < numEnsembles; e++) {
+        const std::vector<Layer>& layers = networks[e][s];
+
+        // Forward pass.  The inputs and outputs of every activation are kept
+        // for the backward pass.
+
+        const float* input = local.tileInput;
+        float* values = local.tileValues;
+        for (const Layer& layer : layers) {
+            int in = layer.inputSize, out = layer.outputSize;
+            float* z = values;
+            float* y = values + tileSize*out;
+            bool firstLayer = (input == local.tileInput);
+            int allInputs[2] = {0, in};
+            const int* ranges = (firstLayer ? &local.activeRanges[2*TILE_SIZE*numBlocks] : allInputs);
+            int numRanges = (firstLayer ? local.numActiveRanges[TILE_SIZE] : 1);
+            for (int t = 0; t < tileSize; t++)
+                std::copy(layer.biases.begin(), layer.biases.end(), &z[t*out]);
+            for (int r = 0; r < numRanges; r++)
+                for (int k = ranges[2*r]; k < ranges[2*r+1]; k++) {
+                    const float* w = &layer.transposedWeights[k*out];
+                    for (int t = 0; t < tileSize; t++) {
+                        float x = input[t*in+k];
+                        if (x == 0.0f)
+                            continue;
+                        float* zt = &z[t*out];
+                        for (int o = 0; o < out; o++)
+                            zt[o] += x*w[o];
+                    }
+                }
+            if (activationPrecision == CpuANIActivations::Fast)
+                CpuANIActivations::apply<CpuANIActivations::Fast>(layer.activation, z, y, tileSize*out);
+            else
+                CpuANIActivations::apply<CpuANIActivations::Accurate>(layer.activation, z, y, tileSize*out);
+            input = y;
+            values = y + tileSize*out;
+        }
+        for (int t = 0; t < tileSize; t++)
+            local.fixedEnergy += toFixedPoint(ensembleScale*input[t]);
+        if (local.fixedEnsembleEnergies != NULL)
+            for (int t = 0; t < tileSize; t++)
+                local.fixedEnsembleEnergies[e] += toFixedPoint(input[t]);
+        if (!computeGradient)
+            continue;
+
+        // Backward pass.  The gradient with respect to the AEVs accumulates
+        // over the ensemble in tileGrad.
+
+        float* grad = local.layerGrad;
+        float* nextGrad = &local.layerGrad[TILE_SIZE*maxLayerWidth];
+        for (int t = 0; t < tileSize; t++)
+            grad[t] = ensembleScale;
+        for (int l = layers.size()-1; l >= 0; l--) {
+            const Layer& layer = layers[l];
+            int in = layer.inputSize, out = layer.outputSize;
+            values -= 2*tileSize*out;
+            CpuANIActivations::applyDerivative(layer.activation, values, values+tileSize*out, grad, tileSize*out);
+            float* inputGrad = (l == 0 ? local.tileGrad : nextGrad);
+            if (l > 0)
+                std::fill(inputGrad, inputGrad+tileSize*in, 0.0f);
+            for (int t = 0; t < tileSize; t++) {
+                float* gt = &inputGrad[t*in];
+                int allInputs[2] = {0, in};
+                const int* ranges = (l == 0 ? &local.activeRanges[2*t*numBlocks] : allInputs);
+                int numRanges = (l == 0 ? local.numActiveRanges[t] : 1);
+                for (int o = 0; o < out; o++) {
+                    float g = grad[t*out+o];
+                    if (g == 0.0f)
+                        continue;
+                    const float* w = &layer.weights[o*in];
+                    for (int r = 0; r < numRanges; r++)
+                        for (int k = ranges[2*r]; k < ranges[2*r+1]; k++)
+                            gt[k] += g*w[k];
+                }
+            }
+            std::swap(grad, nextGrad);
+        }
+    }
+    if (computeGradient)
+        for (int t = 0; t < tileSize; t++) {
+            const float* grad = &local.tileGrad[t*aevLength];
+            if (fuseAEVs)
+                backpropagateAEV(tileAtoms[t], grad, computeVirial, ws, local);
+            else
+                std::copy(grad, grad+aevLength, &ws.aevGrad[(size_t) tileAtoms[t]*aevLength]);
+        }
+}
+
+/**
+ * Mark the AEV blocks of an atom that can be non-zero: the radial block of
+ * every species within the radial cutoff, and the angular block of every pair
+ * of species found among the neighbors within the angular cutoff.  Radial
+ * blocks come first, in species order, followed by the angular blocks in the
+ * order of pairIndex.
+ */
+template <class LAYOUT>
+void CpuANIComputationImpl<LAYOUT>::findActiveBlocks(int atom, char* active, int* counts, const CpuANIWorkspace& ws) const {
+    const int numSpecies = layout.numSpecies();
+    const int start = ws.neighborStart[atom], angularEnd = ws.angularEnd[atom], end = ws.neighborStart[atom+1];
+    std::fill(active, active+numBlocks, 0);
+    std::fill(counts, counts+numSpecies, 0);
+    for (int j = start; j < end; j++)
+        if (ws.neighborList[j].r < radialCutoff)
+            active[ws.species[ws.neighborList[j].second]] = 1;
+    for (int j = start; j < angularEnd; j++)
+        counts[ws.species[ws.neighborList[j].second]]++;
+    for (int s1 = 0; s1 < numSpecies; s1++)
+        if (counts[s1] > 0)
+            for (int s2 = s1; s2 < numSpecies; s2++)
+                if (counts[s2] > (s1 == s2 ? 1 : 0))
+                    active[numSpecies+pairIndex[s1*numSpecies+s2]] = 1;
+}
+
+/**
+ * Convert the flags set by findActiveBlocks() to ranges of AEV indices,
+ * merging adjacent blocks, and return the number of ranges.
+ */
+template <class LAYOUT>
+int CpuANIComputationImpl<LAYOUT>::findActiveRanges(const char* active, int* ranges) const {
+    const int numSpecies = layout.numSpecies();
+    const int radialSubLength = layout.radialSubLength();
+    const int angularSubLength = layout.angularSubLength();
+    const int radialLength = layout.radialLength();
+    int numRanges = 0;
+    for (int b = 0; b < numBlocks; b++) {
+        if (!active[b])
+            continue;
+        int start = (b < numSpecies ? b*radialSubLength : radialLength + (b-numSpecies)*angularSubLength);
+        int end = start + (b < numSpecies ? radialSubLength : angularSubLength);
+        if (numRanges > 0 && ranges[2*numRanges-1] == start)
+            ranges[2*numRanges-1] = end;
+        else {
+            ranges[2*numRanges] = start;
+            ranges[2*numRanges+1] = end;
+            numRanges++;
+        }
+    }
+    return numRanges;
+}
+
+template <class LAYOUT>
+void CpuANIComputationImpl<LAYOUT>::backpropagateAEV(int atom, const float* aevGrad, bool computeVirial, const CpuANIWorkspace& ws, CpuANIWorkspace& local) const {
+    const int radialSubLength = layout.radialSubLength();
+    const int radialLength = layout.radialLength();
+    const int angularSubLength = layout.angularSubLength();
+    const int numSpecies = layout.numSpecies();
+    const int numEtaR = layout.numEtaR(), numShfR = layout.numShfR();
+    const int numEtaA = layout.numEtaA(), numZeta = layout.numZeta();
+    const int numShfA = layout.numShfA(), numShfZ = layout.numShfZ();
+    const int start = ws.neighborStart[atom], angularEnd = ws.angularEnd[atom], end = ws.neighborStart[atom+1];
+    long long* gradient = local.fixedGradient;
+
+    // Radial terms.
+
+    const float radialScale = (float) M_PI/radialCutoff;
+    for (int j = start; j < end; j++) {
+        const CpuANINeighborList::Pair& nj = ws.neighborList[j];
+        float r = nj.r;
+        if (r >= radialCutoff)
+            continue;
+        const float* block = &aevGrad[ws.species[nj.second]*radialSubLength];
+        float dEdr = 0.0f;
+        if (useSplines) {
+            float t;
+            const float* c = radialTable.findInterval(r, t);
+            for (int i = 0; i < numEtaR*numShfR; i++)
+                dEdr += block[i]*radialTable.derivative(c, i, t);
+        }
+        else {
+            float fc = 0.5f*cosf(r*radialScale) + 0.5f;
+            float dfc = -0.5f*radialScale*sinf(r*radialScale);
+            for (int a = 0; a < numEtaR; a++)
+                for (int k = 0; k < numShfR; k++) {
+                    float dr = r-shfR[k];
+                    float g = 0.25f*expf(-etaR[a]*dr*dr);
+                    dEdr += block[a*numShfR+k]*g*(dfc - 2.0f*etaR[a]*dr*fc);
+                }
+        }
+        float g[3];
+        for (int d = 0; d < 3; d++) {
+            g[d] = dEdr*nj.delta[d]/r;
+            long long f = toFixedPoint(g[d]);
+            gradient[3*nj.second+d] += f;
+            gradient[3*atom+d] -= f;
+        }
+        if (computeVirial)
+            addVirial(nj.delta, g, local.fixedVirial);
+    }
+
+    // Angular terms.  For every triple the AEV gradient is contracted with the
+    // derivatives of the angular and distance factors, and the result is
+    // applied through the derivatives of the angle and the two distances.
+
+    const float angularScale = (float) M_PI/angularCutoff;
+    float f1[MAX_ANGULAR_FACTORS], df1[MAX_ANGULAR_FACTORS], f2[MAX_ANGULAR_FACTORS], df2[MAX_ANGULAR_FACTORS];
+    for (int j = start; j < angularEnd; j++) {
+        const CpuANINeighborList::Pair& nj = ws.neighborList[j];
+        float dfcj;
+        float fcj = cutoffFunction(nj.r, angularScale, dfcj);
+        for (int k = j+1; k < angularEnd; k++) {
+            const CpuANINeighborList::Pair& nk = ws.neighborList[k];
+            float dfck;
+            float fck = cutoffFunction(nk.r, angularScale, dfck);
+            float c = (nj.delta[0]*nk.delta[0] + nj.delta[1]*nk.delta[1] + nj.delta[2]*nk.delta[2])/(nj.r*nk.r);
+            float meanR = 0.5f*(nj.r+nk.r);
+            if (useSplines) {
+                float t;
+                const float* coeff = angleTable.findInterval(c, t);
+                for (int i = 0; i < numZeta*numShfZ; i++) {
+                    f1[i] = angleTable.value(coeff, i, t);
+                    df1[i] = angleTable.derivative(coeff, i, t);
+                }
+                coeff = angularTable.findInterval(meanR, t);
+                for (int i = 0; i < numEtaA*numShfA; i++) {
+                    f2[i] = angularTable.value(coeff, i, t);
+                    df2[i] = angularTable.derivative(coeff, i, t);
+                }
+            }
+            else {
+                float cosAngle = 0.95f*c;
+                float sinAngle = sqrtf(std::max(0.0f, 1.0f-cosAngle*cosAngle));
+                float dAngledc = (sinAngle > 0.0f ? -0.95f/sinAngle : 0.0f);
+                for (int z = 0; z < numZeta; z++)
+                    for (int n = 0; n < numShfZ; n++) {
+                        float u = 0.5f*(1.0f + cosAngle*cosShfZ[n] + sinAngle*sinShfZ[n]);
+                        float p = powf(u, zeta[z]-1.0f);
+                        float sinDiff = sinAngle*cosShfZ[n] - cosAngle*sinShfZ[n];
+                        f1[z*numShfZ+n] = p*u;
+                        df1[z*numShfZ+n] = -0.5f*zeta[z]*p*sinDiff*dAngledc;
+                    }
+                for (int a = 0; a < numEtaA; a++)
+                    for (int m = 0; m < numShfA; m++) {
+                        float dr = meanR-shfA[m];
+                        f2[a*numShfA+m] = expf(-etaA[a]*dr*dr);
+                        df2[a*numShfA+m] = -2.0f*etaA[a]*dr*f2[a*numShfA+m];
+                    }
+            }
+            const float* block = &aevGrad[radialLength + pairIndex[ws.species[nj.second]*numSpecies + ws.species[nk.second]]*angularSubLength];
+            float g1 = 0.0f, gc = 0.0f, gr = 0.0f;
+            for (int a = 0; a < numEtaA; a++)
+                for (int z = 0; z < numZeta; z++)
+                    for (int m = 0; m < numShfA; m++) {
+                        const float* g = &block[((a*numZeta+z)*numShfA+m)*numShfZ];
+                        float sum1 = 0.0f, sumc = 0.0f;
+                        for (int n = 0; n < numShfZ; n++) {
+                            sum1 += g[n]*f1[z*numShfZ+n];
+                            sumc += g[n]*df1[z*numShfZ+n];
+                        }
+                        g1 += sum1*f2[a*numShfA+m];
+                        gc += sumc*f2[a*numShfA+m];
+                        gr += sum1*df2[a*numShfA+m];
+                    }
+            float dEdc = 2.0f*fcj*fck*gc;
+            float dEdrj = fcj*fck*gr + 2.0f*g1*dfcj*fck;
+            float dEdrk = fcj*fck*gr + 2.0f*g1*fcj*dfck;
+            float gj[3], gk[3];
+            for (int d = 0; d < 3; d++) {
+                float uj = nj.delta[d]/nj.r, uk = nk.delta[d]/nk.r;
+                gj[d] = dEdrj*uj + dEdc*(uk-c*uj)/nj.r;
+                gk[d] = dEdrk*uk + dEdc*(uj-c*uk)/nk.r;
+                long long fj = toFixedPoint(gj[d]);
+                long long fk = toFixedPoint(gk[d]);
+                gradient[3*nj.second+d] += fj;
+                gradient[3*nk.second+d] += fk;
+                gradient[3*atom+d] -= fj+fk;
+            }
+            if (computeVirial) {
+                addVirial(nj.delta, gj, local.fixedVirial);
+                addVirial(nk.delta, gk, local.fixedVirial);
+            }
+        }
+    }
+}
+
+/**
+ * Add the virial of one displacement, given the gradient of the energy with
+ * respect to it.  The force along the displacement is minus the gradient.
+ */
+template <class LAYOUT>
+void CpuANIComputationImpl<LAYOUT>::addVirial(const float* delta, const float* gradient, long long* virial) {
+    for (int a = 0; a < 3; a++)
+        for (int b = 0; b < 3; b++)
+            virial[3*a+b] -= toFixedPoint(delta[a]*gradient[b]);
+}
+
+} // namespace ANIPlugin
+
+#endif /*OPENMM_CPU_ANI_COMPUTATION_H_*/
@@ -0,0 +1,207 @@
+/* -------------------------------------------------------------------------- *
+ * The MIT License
+ *
+ * SPDX short identifier: MIT
+ *
+ * Copyright 2019 Genentech Inc. South San Francisco
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ * -------------------------------------------------------------------------- */
+
+
+#include "internal/CpuANIEngine.h"
+#include "CpuANIComputation.h"
+#include "openmm/OpenMMException.h"
+#include "openmm/internal/ThreadPool.h"
+#include <atomic>
+
+using namespace ANIPlugin;
+using namespace OpenMM;
+using namespace std;
+
+/**
+ * Evaluates the structures of a batch on the threads of the pool, each thread
+ * taking the next unclaimed structure.  If aevs is set, only the AEVs of the
+ * structures are computed.
+ */
+class CpuANIEngine::BatchTask : public ThreadPool::Task {
+public:
+    BatchTask(CpuANIEngine& owner) : owner(owner), batch(NULL), aevs(NULL) {
+    }
+    void execute(ThreadPool& pool, int threadIndex) {
+        while (true) {
+            int index = nextIndex++;
+            if (index >= batch->size())
+                break;
+            if (aevs != NULL)
+                owner.computation->computeAEVs((*batch)[index], (*aevs)[index], *owner.workspaces[threadIndex]);
+            else
+                owner.computation->compute((*batch)[index], *owner.workspaces[threadIndex]);
+        }
+    }
+    CpuANIEngine& owner;
+    vector<ANIEvaluation>* batch;
+    const vector<float*>* aevs;
+    atomic<int> nextIndex;
+};
+
+static bool hasLayout(const ANIModel& model, int numSpecies, int numShfR, int numShfA, int numShfZ) {
+    return (model.getNumSpecies() == numSpecies && model.etaR.size() == 1 && model.shfR.size() == numShfR &&
+            model.etaA.size() == 1 && model.zeta.size() == 1 && model.shfA.size() == numShfA && model.shfZ.size() == numShfZ);
+}
+
+CpuANIEngine::CpuANIEngine(const ANIModelInfo& info, int numThreads, bool useSpecializedLayouts, bool useFastActivations, bool useFusedAEVs,
+                           bool useSplineTables) :
+        CpuANIEngine(ANIModel::load(info), numThreads, useSpecializedLayouts, useFastActivations, useFusedAEVs, useSplineTables) {
+}
+
+CpuANIEngine::CpuANIEngine(const ANIModel& loadedModel, int numThreads, bool useSpecializedLayouts, bool useFastActivations, bool useFusedAEVs,
+                           bool useSplineTables) :
+        model(loadedModel), computation(NULL), threads(NULL), task(NULL), useSpecializedLayouts(useSpecializedLayouts),
+        useFastActivations(useFastActivations), useFusedAEVs(useFusedAEVs), useSplineTables(useSplineTables) {
+    computation = createComputation();
+    threads = new ThreadPool(numThreads);
+    for (int i = 0; i < threads->getNumThreads(); i++)
+        workspaces.push_back(new CpuANIWorkspace());
+    task = new BatchTask(*this);
+}
+
+CpuANIEngine::~CpuANIEngine() {
+    delete task;
+    for (CpuANIWorkspace* workspace : workspaces)
+        delete workspace;
+    delete threads;
+    delete computation;
+}
+
+CpuANIComputation* CpuANIEngine::createComputation() const {
+    CpuANIActivations::Precision precision = (useFastActivations ? CpuANIActivations::Fast : CpuANIActivations::Accurate);
+    if (useSpecializedLayouts) {
+        if (hasLayout(model, 4, 16, 4, 8))
+            return new CpuANIComputationImpl<CpuANIFixedLayout<4, 16, 4, 8> >(model, precision, useFusedAEVs, useSplineTables);
+        if (hasLayout(model, 7, 16, 8, 4))
+            return new CpuANIComputationImpl<CpuANIFixedLayout<7, 16, 8, 4> >(model, precision, useFusedAEVs, useSplineTables);
+    }
+    return new CpuANIComputationImpl<CpuANIRuntimeLayout>(model, precision, useFusedAEVs, useSplineTables);
+}
+
+void CpuANIEngine::setModel(const ANIModel& newModel) {
+    // The computation refers to the engine's copy of the model, so it is
+    // replaced along with it.  The threads and their workspaces are kept.
+
+    delete computation;
+    computation = NULL;
+    model = newModel;
+    computation = createComputation();
+}
+
+bool CpuANIEngine::isSpecialized() const {
+    return computation->isSpecialized();
+}
+
+void CpuANIEngine::checkStructure(const ANIEvaluation& eval) const {
+    for (const string& symbol : *eval.symbols)
+        if (model.getSpeciesIndex(symbol) == -1)
+            throw OpenMMException("ANI: the model does not support element "+symbol);
+    if (eval.cell != NULL)
+        CpuANINeighborList::checkCell(eval.cell, max(model.radialCutoff, model.angularCutoff));
+}
+
+void CpuANIEngine::reserve(int numAtoms) {
+    size_t size = computation->getWorkspaceSize(numAtoms);
+    for (CpuANIWorkspace* workspace : workspaces)
+        workspace->arena.reserve(size);
+}
+
+void CpuANIEngine::setScalingMargin(float margin) {
+    for (CpuANIWorkspace* workspace : workspaces)
+        workspace->neighbors.setScalingMargin(margin);
+}
+
+void CpuANIEngine::setSortingThreshold(int numAtoms) {
+    for (CpuANIWorkspace* workspace : workspaces)
+        workspace->minSortedAtoms = numAtoms;
+}
+
+size_t CpuANIEngine::getMemoryUsage() const {
+    size_t size = 0;
+    for (CpuANIWorkspace* workspace : workspaces)
+        size += workspace->arena.getCapacity() + workspace->neighbors.getMemoryUsage();
+    return size;
+}
+
+size_t CpuANIEngine::estimateMemoryUsage(int numAtoms, double neighborsPerAtom) const {
+    // Every thread may need a full workspace, but only the first one builds
+    // neighbor lists.  Each pair is listed under both of its atoms in the
+    // first thread's arena.
+
+    size_t numPairs = (size_t) (0.5*numAtoms*min(neighborsPerAtom, (double) numAtoms));
+    size_t size = workspaces.size()*computation->getWorkspaceSize(numAtoms);
+    size += CpuANIArena::getAllocationSize<CpuANINeighborList::Pair>(2*numPairs);
+    size += workspaces[0]->neighbors.estimateMemoryUsage(numAtoms, numPairs);
+    return size;
+}
+
+void CpuANIEngine::computeBatch(vector<ANIEvaluation>& batch) {
+    // Validate everything first so no exception is thrown on a worker thread.
+
+    for (const ANIEvaluation& eval : batch)
+        checkStructure(eval);
+    if (threads->getNumThreads() == 1) {
+        for (ANIEvaluation& eval : batch)
+            computation->compute(eval, *workspaces[0]);
+        return;
+    }
+
+    // With fewer structures than threads, let all threads work on each
+    // structure in turn.  Either way the results are the same, since the
+    // computation sums forces in fixed point.
+
+    if (batch.size() < threads->getNumThreads()) {
+        for (ANIEvaluation& eval : batch)
+            computation->compute(eval, *threads, workspaces);
+        return;
+    }
+    task->batch = &batch;
+    task->nextIndex = 0;
+    threads->execute(*task);
+    threads->waitForThreads();
+}
+
+int CpuANIEngine::getAEVLength() const {
+    return computation->getAEVLength();
+}
+
+void CpuANIEngine::computeAEVs(vector<ANIEvaluation>& batch, const vector<float*>& aevs) {
+    if (aevs.size() != batch.size())
+        throw OpenMMException("ANI: computeAEVs() needs one output array per structure");
+    for (const ANIEvaluation& eval : batch)
+        checkStructure(eval);
+    task->batch = &batch;
+    task->aevs = &aevs;
+    task->nextIndex = 0;
+    threads->execute(*task);
+    threads->waitForThreads();
+    task->aevs = NULL;
+}
+
+void CpuANIEngine::computeDomain(ANIEvaluation& eval, CpuANIDomain& domain) {
+    checkStructure(eval);
+    computation->computeDomain(eval, domain, (threads->getNumThreads() == 1 ? NULL : threads), workspaces);
+}
@@ -0,0 +1,196 @@
+/* -------------------------------------------------------------------------- *
+ * The MIT License
+ *
+ * SPDX short identifier: MIT
+ *
+ * Copyright 2019 Genentech Inc. South San Francisco
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ * -------------------------------------------------------------------------- */
+
+#include "internal/CpuANIFrozenAtoms.h"
+#include "CpuANINeighborList.h"
+#include "openmm/OpenMMException.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+using namespace ANIPlugin;
+using namespace OpenMM;
+using namespace std;
+
+// Atoms are classified with slightly enlarged cutoffs.  Treating an atom as
+// active when it is not only costs time, so rounding must only err that way.
+static const float CUTOFF_SCALE = 1.001f;
+static const float CUTOFF_PADDING = 0.01f;
+
+// How far (in Angstrom) a mobile atom may move before the cache must be
+// rebuilt.  A larger margin makes more frozen atoms active on every step, a
+// smaller one makes rebuilds, which evaluate every frozen atom, more frequent.
+static const float MOBILE_MARGIN = 1.0f;
+
+CpuANIFrozenAtoms::CpuANIFrozenAtoms(CpuANIEngine& engine, const vector<string>& symbols, const vector<char>& isFrozen) :
+        engine(engine), symbols(symbols), isFrozen(isFrozen), selfEnergy(0), hasCache(false), numActive(0), numCacheBuilds(0) {
+    if (symbols.size() != isFrozen.size())
+        throw OpenMMException("ANI: the number of frozen flags does not match the number of atoms");
+    const ANIModel& model = engine.getModel();
+    cutoff = max(model.radialCutoff, model.angularCutoff);
+    for (int i = 0; i < symbols.size(); i++) {
+        if (model.getSpeciesIndex(symbols[i]) == -1)
+            throw OpenMMException("ANI: the model does not support element "+symbols[i]);
+        selfEnergy += model.selfEnergies[model.getSpeciesIndex(symbols[i])];
+        if (isFrozen[i]) {
+            frozen.atoms.push_back(i);
+            frozen.symbols.push_back(symbols[i]);
+        }
+        else
+            mobileAtoms.push_back(i);
+    }
+    frozen.positions.resize(3*frozen.atoms.size());
+    frozen.isHalo.resize(frozen.atoms.size());
+    frozen.gradient.resize(3*frozen.atoms.size());
+    distance.resize(symbols.size());
+    cachedPositions.resize(3*symbols.size());
+    fixedGradient.resize(3*symbols.size());
+}
+
+bool CpuANIFrozenAtoms::isCacheValid(const float* positions, const float* cell) const {
+    if (!hasCache)
+        return false;
+    if ((cell == NULL) != cachedCell.empty() || (cell != NULL && memcmp(cell, cachedCell.data(), 9*sizeof(float)) != 0))
+        return false;
+    for (int i : frozen.atoms)
+        if (memcmp(&positions[3*i], &cachedPositions[3*i], 3*sizeof(float)) != 0)
+            return false;
+    for (int i : mobileAtoms) {
+        float dx = positions[3*i]-cachedPositions[3*i];
+        float dy = positions[3*i+1]-cachedPositions[3*i+1];
+        float dz = positions[3*i+2]-cachedPositions[3*i+2];
+        if (dx*dx + dy*dy + dz*dz > MOBILE_MARGIN*MOBILE_MARGIN)
+            return false;
+    }
+    return true;
+}
+
+void CpuANIFrozenAtoms::buildCache(const float* positions, const float* cell) {
+    const int numAtoms = symbols.size();
+    copy(positions, positions+3*numAtoms, cachedPositions.begin());
+    if (cell == NULL)
+        cachedCell.clear();
+    else
+        cachedCell.assign(cell, cell+9);
+
+    // The distance from every atom to the nearest mobile atom.  Box vectors
+    // in reduced form give the minimum image by subtracting c, b and a in turn.
+
+    fill(distance.begin(), distance.end(), numeric_limits<float>::max());
+    for (int m : mobileAtoms)
+        for (int i = 0; i < numAtoms; i++) {
+            float delta[3];
+            for (int k = 0; k < 3; k++)
+                delta[k] = positions[3*i+k]-positions[3*m+k];
+            if (cell != NULL)
+                for (int v = 2; v >= 0; v--) {
+                    float shift = roundf(delta[v]/cell[4*v]);
+                    for (int k = 0; k < 3; k++)
+                        delta[k] -= shift*cell[3*v+k];
+                }
+            float r = sqrtf(delta[0]*delta[0] + delta[1]*delta[1] + delta[2]*delta[2]);
+            distance[i] = min(distance[i], r);
+        }
+
+    // An atom is active if a mobile atom can come within the cutoff of it
+    // before the cache is rebuilt.  The active atoms are evaluated on every
+    // step together with their neighbors.  The minimum image is only reliable
+    // out to half the box, so in small boxes every atom is kept as a potential
+    // neighbor.
+
+    const float activeCutoff = cutoff*CUTOFF_SCALE + CUTOFF_PADDING + MOBILE_MARGIN;
+    const float haloCutoff = activeCutoff + cutoff*CUTOFF_SCALE + CUTOFF_PADDING;
+    bool filterHalo = true;
+    if (cell != NULL) {
+        double width[3];
+        CpuANINeighborList::getCellWidths(cell, width);
+        filterHalo = (min(width[0], min(width[1], width[2])) >= 2*haloCutoff);
+    }
+    active.atoms.clear();
+    active.symbols.clear();
+    active.isHalo.clear();
+    for (int i = 0; i < numAtoms; i++)
+        if (!filterHalo || distance[i] < haloCutoff) {
+            active.atoms.push_back(i);
+            active.symbols.push_back(symbols[i]);
+            active.isHalo.push_back(distance[i] >= activeCutoff);
+        }
+    active.positions.resize(3*active.atoms.size());
+    active.gradient.resize(3*active.atoms.size());
+    numActive = count(active.isHalo.begin(), active.isHalo.end(), 0);
+
+    // The other frozen atoms only see frozen neighbors, so their contributions
+    // are computed once.  The virial is kept too, since it may be asked for
+    // later without forces.
+
+    for (int k = 0; k < frozen.atoms.size(); k++)
+        frozen.isHalo[k] = (distance[frozen.atoms[k]] < activeCutoff);
+    evaluate(frozen, positions, cell, true, true);
+    hasCache = true;
+    numCacheBuilds++;
+}
+
+void CpuANIFrozenAtoms::evaluate(Part& part, const float* positions, const float* cell, bool computeGradient, bool computeVirial) {
+    part.domain.fixedEnergy = 0;
+    fill(part.domain.fixedVirial, part.domain.fixedVirial+9, 0);
+    part.hasDomainAtoms = (find(part.isHalo.begin(), part.isHalo.end(), 0) != part.isHalo.end());
+    if (!part.hasDomainAtoms)
+        return;
+    for (int k = 0; k < part.atoms.size(); k++)
+        for (int j = 0; j < 3; j++)
+            part.positions[3*k+j] = positions[3*part.atoms[k]+j];
+    ANIEvaluation eval;
+    eval.symbols = &part.symbols;
+    eval.positions = part.positions.data();
+    eval.cell = cell;
+    part.domain.isHalo = part.isHalo.data();
+    part.domain.computeVirial = computeVirial;
+    part.domain.fixedGradient = (computeGradient ? part.gradient.data() : NULL);
+    engine.computeDomain(eval, part.domain);
+}
+
+void CpuANIFrozenAtoms::compute(ANIEvaluation& eval) {
+    if (!isCacheValid(eval.positions, eval.cell))
+        buildCache(eval.positions, eval.cell);
+    bool computeGradient = (eval.forces != NULL);
+    bool computeVirial = (eval.virial != NULL);
+    evaluate(active, eval.positions, eval.cell, computeGradient, computeVirial);
+    eval.energy = (frozen.domain.fixedEnergy+active.domain.fixedEnergy)/(double) 0x100000000 + selfEnergy;
+    if (computeGradient) {
+        fill(fixedGradient.begin(), fixedGradient.end(), 0);
+        for (Part* part : {&frozen, &active})
+            if (part->hasDomainAtoms)
+                for (int k = 0; k < part->atoms.size(); k++)
+                    for (int j = 0; j < 3; j++)
+                        fixedGradient[3*part->atoms[k]+j] += part->gradient[3*k+j];
+        for (int i = 0; i < fixedGradient.size(); i++)
+            eval.forces[i] = (float) (-fixedGradient[i]/(double) 0x100000000);
+    }
+    if (computeVirial)
+        for (int k = 0; k < 9; k++)
+            eval.virial[k] = (frozen.domain.fixedVirial[k]+active.domain.fixedVirial[k])/(double) 0x100000000;
+}
@@ -0,0 +1,289 @@
+/* -------------------------------------------------------------------------- *
+ * The MIT License
+ *
+ * SPDX short identifier: MIT
+ *
+ * Copyright 2019 Genentech Inc. South San Francisco
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ * -------------------------------------------------------------------------- */
+
+
+#include "CpuANINeighborList.h"
+#include "openmm/OpenMMException.h"
+#include <algorithm>
+#include <cmath>
+
+using namespace ANIPlugin;
+using namespace OpenMM;
+using namespace std;
+
+// Upper limit on the number of grid cells along one axis of a non periodic structure.
+static const int MAX_BINS_PER_AXIS = 128;
+// How far, relative to the cell size, an atom may be from its scaled position
+// for a structure to still count as uniformly scaled.  This is a few times the
+// rounding error of single precision coordinates.
+static const float SCALING_TOLERANCE = 1e-6f;
+
+void CpuANINeighborList::checkCell(const float* cell, float cutoff) {
+    if (cell[1] != 0 || cell[2] != 0 || cell[5] != 0)
+        throw OpenMMException("ANI: periodic box vectors must be in reduced form");
+    double width[3];
+    getCellWidths(cell, width);
+    if (width[0] < 2*cutoff || width[1] < 2*cutoff || width[2] < 2*cutoff)
+        throw OpenMMException("ANI: the periodic box size must be at least twice the AEV cutoff");
+}
+
+void CpuANINeighborList::getCellWidths(const float* cell, double* width) {
+    // In reduced form a = (ax, 0, 0), b = (bx, by, 0) and c = (cx, cy, cz).  The
+    // distance between the planes of constant fractional coordinate along a
+    // vector is the volume divided by the area spanned by the other two.
+
+    double volume = (double) cell[0]*cell[4]*cell[8];
+    double bc = sqrt((double) cell[4]*cell[8]*cell[4]*cell[8] + (double) cell[3]*cell[8]*cell[3]*cell[8] +
+                     ((double) cell[3]*cell[7]-(double) cell[4]*cell[6])*((double) cell[3]*cell[7]-(double) cell[4]*cell[6]));
+    double ac = cell[0]*sqrt((double) cell[7]*cell[7] + (double) cell[8]*cell[8]);
+    width[0] = volume/bc;
+    width[1] = volume/ac;
+    width[2] = cell[8];
+}
+
+void CpuANINeighborList::getNumPeriodicBins(const float* cell, float cutoff, int* numBins) {
+    double width[3];
+    getCellWidths(cell, width);
+    for (int k = 0; k < 3; k++)
+        numBins[k] = max(1, (int) (width[k]/cutoff));
+}
+
+void CpuANINeighborList::setScalingMargin(float margin) {
+    scalingMargin = margin;
+    cachedPositions.clear();
+}
+
+size_t CpuANINeighborList::getMemoryUsage() const {
+    return (pairs.capacity()+cachedPairs.capacity())*sizeof(Pair) +
+           (cachedPositions.capacity()+fractional.capacity())*sizeof(float) +
+           (atomBin.capacity()+binStart.capacity()+binNext.capacity()+binAtoms.capacity()+neighborBins.capacity())*sizeof(int);
+}
+
+size_t CpuANINeighborList::estimateMemoryUsage(int numAtoms, size_t numPairs) const {
+    // Vectors grow by doubling, so a list may hold up to twice its pairs.
+
+    size_t pairBytes = 2*numPairs*sizeof(Pair);
+    size_t size = pairBytes + 3*numAtoms*sizeof(float) + 4*(numAtoms+1)*sizeof(int);
+    if (scalingMargin > 0.0f) {
+        float scale = 1+scalingMargin;
+        size += (size_t) (pairBytes*scale*scale*scale) + 3*numAtoms*sizeof(float);
+    }
+    return size;
+}
+
+void CpuANINeighborList::build(int numAtoms, const float* positions, const float* cell, float cutoff) {
+    rescaled = false;
+    if (scalingMargin == 0.0f || cell == NULL) {
+        findPairs(numAtoms, positions, cell, cutoff, pairs);
+        return;
+    }
+    float scale;
+    if (findScaling(numAtoms, positions, cell, cutoff, scale)) {
+        // Scale the cached pairs, dropping those that are now beyond the cutoff.
+
+        pairs.clear();
+        for (const Pair& cached : cachedPairs) {
+            float r = cached.r*scale;
+            if (r >= cutoff)
+                continue;
+            Pair pair = cached;
+            pair.delta[0] *= scale;
+            pair.delta[1] *= scale;
+            pair.delta[2] *= scale;
+            pair.r = r;
+            pairs.push_back(pair);
+        }
+        rescaled = true;
+        return;
+    }
+
+    // Search out to the enlarged cutoff and remember the structure, so the
+    // next evaluation can be checked against it.
+
+    findPairs(numAtoms, positions, cell, cutoff*(1+scalingMargin), cachedPairs);
+    cachedPositions.assign(positions, positions+3*numAtoms);
+    copy(cell, cell+9, cachedCell);
+    cachedCutoff = cutoff;
+    pairs.clear();
+    for (const Pair& pair : cachedPairs)
+        if (pair.r < cutoff)
+            pairs.push_back(pair);
+}
+
+bool CpuANINeighborList::findScaling(int numAtoms, const float* positions, const float* cell, float cutoff, float& scale) const {
+    if (cachedPositions.size() != 3*numAtoms || cutoff != cachedCutoff)
+        return false;
+    scale = cell[0]/cachedCell[0];
+    if (scale*(1+scalingMargin) < 1)
+        return false;
+    float tolerance = SCALING_TOLERANCE*(cell[0]+cell[4]+cell[8]);
+    for (int k = 0; k < 9; k++)
+        if (fabsf(cell[k]-scale*cachedCell[k]) > tolerance)
+            return false;
+
+    // Every atom must be at its scaled position, up to a whole number of cell
+    // vectors because the barostat may have wrapped it into the cell.
+
+    for (int i = 0; i < numAtoms; i++) {
+        float d[3];
+        for (int k = 0; k < 3; k++)
+            d[k] = positions[3*i+k]-scale*cachedPositions[3*i+k];
+        float n3 = floorf(d[2]/cell[8]+0.5f);
+        d[0] -= n3*cell[6];
+        d[1] -= n3*cell[7];
+        d[2] -= n3*cell[8];
+        float n2 = floorf(d[1]/cell[4]+0.5f);
+        d[0] -= n2*cell[3];
+        d[1] -= n2*cell[4];
+        float n1 = floorf(d[0]/cell[0]+0.5f);
+        d[0] -= n1*cell[0];
+        if (fabsf(d[0]) > tolerance || fabsf(d[1]) > tolerance || fabsf(d[2]) > tolerance)
+            return false;
+    }
+    return true;
+}
+
+void CpuANINeighborList::findPairs(int numAtoms, const float* positions, const float* cell, float cutoff, vector<Pair>& result) {
+    result.clear();
+    if (numAtoms == 0)
+        return;
+
+    // Compute fractional coordinates of every atom in the grid.  For periodic
+    // structures these are the coordinates in the cell, wrapped into [0, 1).
+
+    fractional.resize(3*numAtoms);
+    int numBins[3];
+    if (cell != NULL) {
+        for (int i = 0; i < numAtoms; i++) {
+            const float* p = &positions[3*i];
+            double z = p[2]/cell[8];
+            double y = (p[1]-cell[7]*z)/cell[4];
+            double x = (p[0]-cell[6]*z-cell[3]*y)/cell[0];
+            fractional[3*i] = (float) (x-floor(x));
+            fractional[3*i+1] = (float) (y-floor(y));
+            fractional[3*i+2] = (float) (z-floor(z));
+        }
+        getNumPeriodicBins(cell, cutoff, numBins);
+    }
+    else {
+        float minPos[3], maxPos[3];
+        for (int k = 0; k < 3; k++)
+            minPos[k] = maxPos[k] = positions[k];
+        for (int i = 1; i < numAtoms; i++)
+            for (int k = 0; k < 3; k++) {
+                minPos[k] = min(minPos[k], positions[3*i+k]);
+                maxPos[k] = max(maxPos[k], positions[3*i+k]);
+            }
+        for (int k = 0; k < 3; k++) {
+            float extent = maxPos[k]-minPos[k];
+            numBins[k] = max(1, min(MAX_BINS_PER_AXIS, (int) (extent/cutoff)));
+            for (int i = 0; i < numAtoms; i++)
+                fractional[3*i+k] = (extent > 0 ? (positions[3*i+k]-minPos[k])/extent : 0.0f);
+        }
+    }
+
+    // Sort the atoms into bins.
+
+    int totalBins = numBins[0]*numBins[1]*numBins[2];
+    atomBin.resize(numAtoms);
+    binStart.assign(totalBins+1, 0);
+    for (int i = 0; i < numAtoms; i++) {
+        int b[3];
+        for (int k = 0; k < 3; k++)
+            b[k] = min(numBins[k]-1, (int) (fractional[3*i+k]*numBins[k]));
+        atomBin[i] = (b[2]*numBins[1] + b[1])*numBins[0] + b[0];
+        binStart[atomBin[i]+1]++;
+    }
+    for (int b = 0; b < totalBins; b++)
+        binStart[b+1] += binStart[b];
+    binAtoms.resize(numAtoms);
+    binNext.assign(binStart.begin(), binStart.end()-1);
+    for (int i = 0; i < numAtoms; i++)
+        binAtoms[binNext[atomBin[i]]++] = i;
+
+    // Loop over each atom and the bins adjacent to its own.
+
+    float cutoff2 = cutoff*cutoff;
+    for (int i = 0; i < numAtoms; i++) {
+        int bin = atomBin[i];
+        int b[3] = {bin%numBins[0], (bin/numBins[0])%numBins[1], bin/(numBins[0]*numBins[1])};
+        neighborBins.clear();
+        for (int dz = -1; dz <= 1; dz++)
+            for (int dy = -1; dy <= 1; dy++)
+                for (int dx = -1; dx <= 1; dx++) {
+                    int n[3] = {b[0]+dx, b[1]+dy, b[2]+dz};
+                    bool valid = true;
+                    for (int k = 0; k < 3; k++) {
+                        if (cell != NULL)
+                            n[k] = (n[k]+numBins[k])%numBins[k];
+                        else if (n[k] < 0 || n[k] >= numBins[k])
+                            valid = false;
+                    }
+                    if (valid)
+                        neighborBins.push_back((n[2]*numBins[1] + n[1])*numBins[0] + n[0]);
+                }
+        sort(neighborBins.begin(), neighborBins.end());
+        neighborBins.erase(unique(neighborBins.begin(), neighborBins.end()), neighborBins.end());
+        const float* pi = &positions[3*i];
+        size_t firstPair = result.size();
+        for (int neighborBin : neighborBins) {
+            for (int index = binStart[neighborBin]; index < binStart[neighborBin+1]; index++) {
+                int j = binAtoms[index];
+                if (j <= i)
+                    continue;
+                const float* pj = &positions[3*j];
+                float d[3] = {pj[0]-pi[0], pj[1]-pi[1], pj[2]-pi[2]};
+                if (cell != NULL) {
+                    float scale3 = floorf(d[2]/cell[8]+0.5f);
+                    d[0] -= scale3*cell[6];
+                    d[1] -= scale3*cell[7];
+                    d[2] -= scale3*cell[8];
+                    float scale2 = floorf(d[1]/cell[4]+0.5f);
+                    d[0] -= scale2*cell[3];
+                    d[1] -= scale2*cell[4];
+                    float scale1 = floorf(d[0]/cell[0]+0.5f);
+                    d[0] -= scale1*cell[0];
+                }
+                float r2 = d[0]*d[0] + d[1]*d[1] + d[2]*d[2];
+                if (r2 >= cutoff2)
+                    continue;
+                Pair pair;
+                pair.first = i;
+                pair.second = j;
+                pair.delta[0] = d[0];
+                pair.delta[1] = d[1];
+                pair.delta[2] = d[2];
+                pair.r = sqrtf(r2);
+                result.push_back(pair);
+            }
+        }
+
+        // List the pairs of each atom in order of the second atom, so the order
+        // does not depend on the grid.
+
+        sort(result.begin()+firstPair, result.end(), [] (const Pair& a, const Pair& b) {return a.second < b.second;});
+    }
+}
@@ -0,0 +1,134 @@
+#ifndef OPENMM_CPU_ANI_NEIGHBOR_LIST_H_
+#define OPENMM_CPU_ANI_NEIGHBOR_LIST_H_
+
+/* -------------------------------------------------------------------------- *
+ * The MIT License
+ *
+ * SPDX short identifier: MIT
+ *
+ * Copyright 2019 Genentech Inc. South San Francisco
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ * -------------------------------------------------------------------------- */
+
+
+#include <cstddef>
+#include <vector>
+
+namespace ANIPlugin {
+
+/**
+ * A half neighbor list built with a cell grid.  Every pair of atoms closer than
+ * the cutoff is listed once, with the displacement from the first to the second
+ * atom (the minimum image for periodic structures).  The first atom of every
+ * pair has the lower index, and pairs are sorted by the first and then the
+ * second atom.  The order therefore only depends on the atom indices, not on
+ * the grid, so any subset of the atoms that keeps their relative order lists
+ * the pairs among them in the same order (see CpuANIEngine::computeDomain()).
+ */
+class CpuANINeighborList {
+public:
+    struct Pair {
+        int first, second;
+        float delta[3];
+        float r;
+    };
+    CpuANINeighborList() : scalingMargin(0.0f), rescaled(false) {
+    }
+    /**
+     * Check that a periodic cell can be used with a cutoff: it must be in OpenMM's
+     * reduced form and at least twice the cutoff wide in every direction, as
+     * measured by getCellWidths().  An OpenMMException is thrown otherwise.
+     */
+    static void checkCell(const float* cell, float cutoff);
+    /**
+     * Get the distances between the opposite faces of a periodic cell in
+     * reduced form, measured perpendicular to the faces.  In a triclinic cell
+     * these are less than the diagonal elements of the cell.
+     */
+    static void getCellWidths(const float* cell, double* width);
+    /**
+     * Get the number of grid cells along each cell vector of a periodic
+     * structure.  Atoms are binned by their fractional coordinates, so each
+     * bin is made at least one cutoff thick measured perpendicular to the
+     * faces it shares with its neighbors, which in a triclinic cell is less
+     * than the length of the cell vector.  Every pair within the cutoff is
+     * then in the same or adjacent bins.
+     */
+    static void getNumPeriodicBins(const float* cell, float cutoff, int* numBins);
+    /**
+     * Build the list.
+     *
+     * @param numAtoms    the number of atoms
+     * @param positions   3*numAtoms coordinates
+     * @param cell        the periodic cell (row major) or NULL
+     * @param cutoff      the cutoff distance
+     */
+    void build(int numAtoms, const float* positions, const float* cell, float cutoff);
+    const std::vector<Pair>& getPairs() const {
+        return pairs;
+    }
+    /**
+     * Get the margin set by setScalingMargin().
+     */
+    float getScalingMargin() const {
+        return scalingMargin;
+    }
+    /**
+     * Let build() reuse the previous list when a periodic structure and its cell
+     * have only been scaled uniformly, as a Monte Carlo barostat does, possibly
+     * with atoms shifted by whole cell vectors.  The distances of the cached
+     * pairs are then scaled instead of searching for pairs again.  The cache
+     * holds pairs out to cutoff*(1+margin), so it can be reused as long as the
+     * structure has not shrunk by more than that factor since the last search.
+     * A margin of 0 (the default) disables this.
+     */
+    void setScalingMargin(float margin);
+    /**
+     * Get whether the last call to build() scaled the cached pairs instead of
+     * searching for pairs.
+     */
+    bool wasRescaled() const {
+        return rescaled;
+    }
+    /**
+     * Get the number of bytes held by the list and its scratch buffers.
+     */
+    size_t getMemoryUsage() const;
+    /**
+     * Estimate the number of bytes getMemoryUsage() reaches when building a list.
+     *
+     * @param numAtoms   the number of atoms
+     * @param numPairs   the number of pairs within the cutoff
+     */
+    size_t estimateMemoryUsage(int numAtoms, size_t numPairs) const;
+private:
+    void findPairs(int numAtoms, const float* positions, const float* cell, float cutoff, std::vector<Pair>& result);
+    bool findScaling(int numAtoms, const float* positions, const float* cell, float cutoff, float& scale) const;
+    std::vector<Pair> pairs, cachedPairs;
+    std::vector<float> cachedPositions;
+    float cachedCell[9], cachedCutoff, scalingMargin;
+    bool rescaled;
+    std::vector<int> atomBin, binStart, binNext, binAtoms, neighborBins;
+    std::vector<float> fractional;
+};
+
+} // namespace ANIPlugin
+
+#endif /*OPENMM_CPU_ANI_NEIGHBOR_LIST_H_*/
@@ -0,0 +1,157 @@
+#ifndef OPENMM_CPU_ANI_SPLINE_TABLE_H_
+#define OPENMM_CPU_ANI_SPLINE_TABLE_H_
+
+/* -------------------------------------------------------------------------- *
+ * The MIT License
+ *
+ * SPDX short identifier: MIT
+ *
+ * Copyright 2019 Genentech Inc. South San Francisco
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ * -------------------------------------------------------------------------- */
+
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <vector>
+
+namespace ANIPlugin {
+
+/**
+ * Cubic spline tables for a set of smooth functions of one variable, all
+ * sampled on the same uniform grid over [minX, maxX].
+ *
+ * Each interval holds a cubic Hermite polynomial matching the values and
+ * derivatives of every function at both of its ends, so the tabulated
+ * functions are continuous with continuous derivatives, and the error of the
+ * values shrinks with the fourth power of the spacing.  The coefficients of
+ * one interval are stored together, grouped by power, so looking up all
+ * functions at one point reads a single contiguous block and the loop
+ * over functions vectorizes.
+ */
+class CpuANISplineTable {
+public:
+    CpuANISplineTable() : numFunctions(0), numIntervals(0), minX(0.0f), spacing(0.0f), invSpacing(0.0f), maxError(0.0), maxDerivativeError(0.0) {
+    }
+    /**
+     * Tabulate the functions.
+     *
+     * @param numFunctions   the number of functions
+     * @param minX           the start of the tabulated range
+     * @param maxX           the end of the tabulated range
+     * @param maxSpacing     the largest allowed distance between grid points
+     * @param function       called as function(x, values, derivatives) to compute the values
+     *                       and derivatives of all functions at x in double precision
+     */
+    template <class FUNCTION>
+    void build(int numFunctions, double minX, double maxX, double maxSpacing, FUNCTION function) {
+        this->numFunctions = numFunctions;
+        this->minX = (float) minX;
+        numIntervals = std::max(1, (int) ceil((maxX-minX)/maxSpacing));
+        double h = (maxX-minX)/numIntervals;
+        spacing = (float) h;
+        invSpacing = (float) (numIntervals/(maxX-minX));
+        std::vector<double> values((numIntervals+1)*numFunctions), derivs((numIntervals+1)*numFunctions);
+        for (int i = 0; i <= numIntervals; i++)
+            function(minX+i*h, &values[i*numFunctions], &derivs[i*numFunctions]);
+        coefficients.resize(4*(size_t) numIntervals*numFunctions);
+        for (int i = 0; i < numIntervals; i++) {
+            float* c = &coefficients[4*(size_t) i*numFunctions];
+            for (int f = 0; f < numFunctions; f++) {
+                double p0 = values[i*numFunctions+f], p1 = values[(i+1)*numFunctions+f];
+                double m0 = derivs[i*numFunctions+f], m1 = derivs[(i+1)*numFunctions+f];
+                double slope = (p1-p0)/h;
+                c[f] = (float) p0;
+                c[numFunctions+f] = (float) m0;
+                c[2*numFunctions+f] = (float) ((3*slope-2*m0-m1)/h);
+                c[3*numFunctions+f] = (float) ((m0+m1-2*slope)/(h*h));
+            }
+        }
+
+        // Measure the error against the functions at points between the
+        // grid points, where it is largest.
+
+        maxError = maxDerivativeError = 0.0;
+        std::vector<double> exactValues(numFunctions), exactDerivs(numFunctions);
+        for (int i = 0; i < numIntervals; i++)
+            for (double fraction : {0.25, 0.5, 0.75}) {
+                double x = minX+(i+fraction)*h;
+                function(x, exactValues.data(), exactDerivs.data());
+                float t;
+                const float* c = findInterval((float) x, t);
+                for (int f = 0; f < numFunctions; f++) {
+                    maxError = std::max(maxError, fabs(value(c, f, t)-exactValues[f]));
+                    maxDerivativeError = std::max(maxDerivativeError, fabs(derivative(c, f, t)-exactDerivs[f]));
+                }
+            }
+    }
+    /**
+     * Find the interval containing x.  This returns the interval's
+     * coefficients and sets t to the offset of x from its start.  Points
+     * outside the table use the first or last interval.
+     */
+    const float* findInterval(float x, float& t) const {
+        x -= minX;
+        int i = std::max(0, std::min((int) (x*invSpacing), numIntervals-1));
+        t = x - i*spacing;
+        return &coefficients[4*(size_t) i*numFunctions];
+    }
+    /**
+     * Get the value of function f from the coefficients of an interval.
+     */
+    float value(const float* c, int f, float t) const {
+        return c[f] + t*(c[numFunctions+f] + t*(c[2*numFunctions+f] + t*c[3*numFunctions+f]));
+    }
+    /**
+     * Get the derivative of function f from the coefficients of an interval.
+     */
+    float derivative(const float* c, int f, float t) const {
+        return c[numFunctions+f] + t*(2.0f*c[2*numFunctions+f] + 3.0f*t*c[3*numFunctions+f]);
+    }
+    /**
+     * Get the largest absolute error of any tabulated value, measured when the
+     * table was built.
+     */
+    double getMaxError() const {
+        return maxError;
+    }
+    /**
+     * Get the largest absolute error of any tabulated derivative.
+     */
+    double getMaxDerivativeError() const {
+        return maxDerivativeError;
+    }
+    /**
+     * Get the number of bytes the table occupies.
+     */
+    size_t getMemoryUsage() const {
+        return coefficients.size()*sizeof(float);
+    }
+private:
+    int numFunctions, numIntervals;
+    float minX, spacing, invSpacing;
+    double maxError, maxDerivativeError;
+    std::vector<float> coefficients;
+};
+
+} // namespace ANIPlugin
+
+#endif /*OPENMM_CPU_ANI_SPLINE_TABLE_H_*/
@@ -0,0 +1,106 @@
+/* -------------------------------------------------------------------------- *
+ * The MIT License
+ *
+ * SPDX short identifier: MIT
+ *
+ * Copyright 2019 Genentech Inc. South San Francisco
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ * -------------------------------------------------------------------------- */
+
+
+#include "internal/NeuroChemANIEngine.h"
+#include "openmm/OpenMMException.h"
+#include <algorithm>
+#include <mutex>
+#include "neurochemcpp_iface.h"
+
+using namespace ANIPlugin;
+using namespace OpenMM;
+using namespace std;
+
+// The model NeuroChem holds and how many users share it.
+static string currentEnsemble;
+static int numEnsembleUsers = 0;
+
+static string getEnsembleKey(const ANIModelInfo& info) {
+    return info.netWorkDir+"\n"+info.paramFile+"\n"+info.atomFitFile+"\n"+to_string(info.nEnsembles);
+}
+
+mutex& NeuroChemANIEngine::getLock() {
+    static mutex neuroChemLock;
+    return neuroChemLock;
+}
+
+void NeuroChemANIEngine::acquireEnsemble(const ANIModelInfo& info) {
+    string key = getEnsembleKey(info);
+    if (numEnsembleUsers > 0) {
+        if (key != currentEnsemble)
+            throw OpenMMException("ANI: NeuroChem can only hold one model at a time, and a different one ("+info.netWorkDir+
+                                  ") is in use by another engine or Context in this process");
+        numEnsembleUsers++;
+        return;
+    }
+    neurochem::instantiate_ani_ensemble(info.paramFile, info.atomFitFile, info.netWorkDir, info.nEnsembles);
+    currentEnsemble = key;
+    numEnsembleUsers = 1;
+}
+
+void NeuroChemANIEngine::releaseEnsemble() {
+    // Cleanup instances (required to shut the classes down before the driver shuts down)
+    if (--numEnsembleUsers == 0) {
+        neurochem::molecule_instances.clear();
+        currentEnsemble.clear();
+    }
+}
+
+void NeuroChemANIEngine::setCell(const float* cell) {
+    // NeuroChem keeps the cell until it is set again, so a non periodic
+    // structure explicitly turns periodic boundary conditions off.
+
+    static const float identity[9] = {1, 0, 0, 0, 1, 0, 0, 0, 1};
+    bool periodic = (cell != NULL);
+    vector<float> neuroChemCell(periodic ? cell : identity, (periodic ? cell : identity)+9);
+    neurochem::set_cell(neuroChemCell, periodic, periodic, periodic);
+}
+
+NeuroChemANIEngine::NeuroChemANIEngine(const ANIModelInfo& info) {
+    lock_guard<mutex> lock(getLock());
+    acquireEnsemble(info);
+}
+
+NeuroChemANIEngine::~NeuroChemANIEngine() {
+    lock_guard<mutex> lock(getLock());
+    releaseEnsemble();
+}
+
+void NeuroChemANIEngine::computeBatch(vector<ANIEvaluation>& batch) {
+    lock_guard<mutex> lock(getLock());
+    for (ANIEvaluation& eval : batch) {
+        int numAtoms = eval.symbols->size();
+        positions.assign(eval.positions, eval.positions+3*numAtoms);
+        symbols = *eval.symbols;
+        setCell(eval.cell);
+        eval.energy = neurochem::compute_ensemble_energy(positions, symbols);
+        if (eval.forces != NULL) {
+            vector<float> forces = neurochem::compute_ensemble_force(numAtoms);
+            copy(forces.begin(), forces.end(), eval.forces);
+        }
+    }
+}
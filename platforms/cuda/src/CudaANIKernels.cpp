@@ -31,8 +31,13 @@
 
 #include "CudaANIKernels.h"
 #include "CudaANIKernelSources.h"
+#include "internal/ANIModelInfo.h"
+#include "internal/ANIModelLoader.h"
+#include "internal/NeuroChemANIEngine.h"
+#include "openmm/OpenMMException.h"
 #include "openmm/internal/ContextImpl.h"
 #include <map>
+#include <mutex>
 #include <iostream>
 #include "neurochemcpp_iface.h"
 
@@ -46,6 +51,12 @@ using namespace OpenMM;
 using namespace std;
 
 CudaCalcANIForceKernel::~CudaCalcANIForceKernel() {
+    // Other Contexts or engines may still be using the ensemble, so it is
+    // only shut down when the last of them releases it.
+    if (hasEnsemble) {
+        lock_guard<mutex> lock(NeuroChemANIEngine::getLock());
+        NeuroChemANIEngine::releaseEnsemble();
+    }
 }
 
    
@@ -53,13 +64,44 @@ void CudaCalcANIForceKernel::initialize(const System& system, const ANIForce& fo
 
     // cu is OpenMM::CudaContext&
     cu.setAsCurrent();
+    if (!force.getAlchemicalSymbols().empty())
+        throw OpenMMException("ANIForce: alchemical states are not supported on the CUDA platform");
+    if (!force.getServer().empty())
+        throw OpenMMException("ANIForce: evaluation servers are not supported on the CUDA platform");
+    if (force.getNumDomainWorkers() > 0)
+        throw OpenMMException("ANIForce: domain workers are not supported on the CUDA platform");
+    if (force.getMaxMemory() > 0)
+        throw OpenMMException("ANIForce: memory limits are not supported on the CUDA platform");
     usePeriodic = force.usesPeriodicBoundaryConditions();
     atomicSymbols = force.getAtomSymbols();
     int numParticles = system.getNumParticles();
 
+    // Load the graph from the file.
+
+    infoFile = force.getInfoFile();
+    ANIModelInfo info = ANIModelInfo::read(infoFile);
+
+    // NeuroChem reads the files itself, so the model ANIForce started loading
+    // on the CPU is not needed.
+
+    ANIModelLoader::discard(infoFile);
+
+    cerr << "initilized ANI with args=" << infoFile << " paramFile:" << info.paramFile
+         << " atomFitFile:"<<info.atomFitFile << " netWorkDir:"<<info.netWorkDir
+         << " nEnsambles:"<<info.nEnsembles << endl;
+
+    // Initialize ANI Network as ensamble of multiple networks
+    {
+        lock_guard<mutex> lock(NeuroChemANIEngine::getLock());
+        NeuroChemANIEngine::acquireEnsemble(info);
+        hasEnsemble = true;
+    }
+
     // Construct input tensors.
 
     aniPositions.resize(numParticles*3);
+    positions.resize(numParticles);
+    cell.resize(9);
      
     //if (usePeriodic) {
     //    int64_t boxVectorsDims[] = {3, 3};
@@ -73,6 +115,45 @@ void CudaCalcANIForceKernel::initialize(const System& system, const ANIForce& fo
     defines["FORCES_TYPE"] = "float";
     CUmodule module = cu.createModule(CudaANIKernelSources::aniForce, defines);
     addForcesKernel = cu.getKernel(module, "addForces");
+    if (!force.getRecordingFile().empty())
+        recorder.reset(new ANIEvaluationLogWriter(force.getRecordingFile(), infoFile, atomicSymbols, force.getRecordingInterval(),
+                                                  (size_t) (force.getMaxRecordingSize()*(1<<20))));
+}
+
+
+void CudaCalcANIForceKernel::copyParametersToContext(ContextImpl& context, const ANIForce& force) {
+    if (force.getAtomSymbols() != atomicSymbols)
+        throw OpenMMException("ANIForce: updateParametersInContext() cannot change the atom symbols");
+    if (force.getInfoFile() == infoFile)
+        return;
+
+    // A recording names the model in its header, so switching the model
+    // would leave evaluations of the new one attributed to the old one.
+
+    if (recorder)
+        throw OpenMMException("ANIForce: the model cannot be changed while evaluations are being recorded");
+
+    // NeuroChem holds a single ensemble, so the old one is released before
+    // the new one is acquired.  That fails if another Context or engine still
+    // uses the old one, and then this Context keeps it.  The CUDA arrays do
+    // not depend on the model.
+
+    cu.setAsCurrent();
+    ANIModelInfo info = ANIModelInfo::read(force.getInfoFile());
+    ANIModelInfo oldInfo = ANIModelInfo::read(infoFile);
+    ANIModelLoader::discard(force.getInfoFile());
+    {
+        lock_guard<mutex> lock(NeuroChemANIEngine::getLock());
+        NeuroChemANIEngine::releaseEnsemble();
+        try {
+            NeuroChemANIEngine::acquireEnsemble(info);
+        }
+        catch (...) {
+            NeuroChemANIEngine::acquireEnsemble(oldInfo);
+            throw;
+        }
+    }
+    infoFile = force.getInfoFile();
 }
 
 
@@ -83,7 +164,7 @@ void CudaCalcANIForceKernel::initialize(const System& system, const ANIForce& fo
  */
 double CudaCalcANIForceKernel::execute(ContextImpl& context, bool includeForces, bool includeEnergy) {
 
-    vector<Vec3> pos;
+    vector<Vec3>& pos = positions;
     context.getPositions(pos);
     int numParticles = cu.getNumAtoms();
 
@@ -101,25 +182,24 @@ double CudaCalcANIForceKernel::execute(ContextImpl& context, bool includeForces,
     }
 
 
-    //cerr<<"usePeriodic " << usePeriodic << "\t";
+    // NeuroChem is shared by every Context and engine in the process, so the
+    // cell is set for every evaluation, and turned off for non periodic ones.
+
     if (usePeriodic) {
-       // Example PBC usage -- set the periodic cell (use angstroms)
        // units A
-       //=================Code below=================
        Vec3 box[3];
        cu.getPeriodicBoxVectors(box[0], box[1], box[2]);
-       std::vector<float> cell(9);
        for (int i = 0; i < 3; i++)
            for (int j = 0; j < 3; j++)
-           {  cell[3*i+j] = box[i][j] * NM_TO_ANGST; 
-              //cerr<< cell[3*i+j] << " ";
-           }
-       neurochem::set_cell(cell, true, true, true);
+               cell[3*i+j] = box[i][j] * NM_TO_ANGST;
     }
-    //cerr<<endl;
+    lock_guard<mutex> lock(NeuroChemANIEngine::getLock());
+    NeuroChemANIEngine::setCell(usePeriodic ? cell.data() : NULL);
 
     // Compute energies for the ensemble, libANI ennergies are in Hartree's
+    bool record = (recorder && recorder->startCall());
     double energy = neurochem::compute_ensemble_energy(aniPositions, atomicSymbols);
+    const double hartreeEnergy = energy;
     if( PRINT_RESULTS ) cerr << "ANI Energy [H]     =" << energy << endl;
     energy *= HARTREE_TO_KJ_MOL;
     if( PRINT_RESULTS ) cerr << "ANI Energy [KJ/Mol]=" << energy << endl;
@@ -128,6 +208,10 @@ double CudaCalcANIForceKernel::execute(ContextImpl& context, bool includeForces,
         // Compute forces for the ensemble
         // libANI forces are in Hartree/A, OpenMM Forces are in KJ/Mol/nM
         vector<float> forces = neurochem::compute_ensemble_force(numParticles);
+        if (record) {
+            recorder->record(aniPositions.data(), (usePeriodic ? cell.data() : NULL), hartreeEnergy, forces.data());
+            record = false;
+        }
 
         if( PRINT_RESULTS ) {
             cerr << "   ANI Forces [H/A      ]: ";
@@ -154,5 +238,15 @@ double CudaCalcANIForceKernel::execute(ContextImpl& context, bool includeForces,
         cu.executeKernel(addForcesKernel, args, numParticles);
 
     }
+    if (record)
+        recorder->record(aniPositions.data(), (usePeriodic ? cell.data() : NULL), hartreeEnergy, NULL);
     return energy;
 }
+
+void CudaCalcANIForceKernel::computeVirial(ContextImpl& context, vector<Vec3>& virial) {
+    throw OpenMMException("ANIForce: the virial is not available on the CUDA platform");
+}
+
+double CudaCalcANIForceKernel::getPeakMemory(ContextImpl& context) {
+    throw OpenMMException("ANIForce: the peak memory is not available on the CUDA platform");
+}
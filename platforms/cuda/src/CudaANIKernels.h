@@ -33,15 +33,11 @@
 
 
 #include "ANIKernels.h"
+#include "ANIEngine.h"
+#include "internal/ANIEvaluationLog.h"
 #include "openmm/cuda/CudaContext.h"
 #include "openmm/cuda/CudaArray.h"
-
-
-
-#define NM_TO_ANGST 10
-#define HARTREE_TO_KJ_MOL 2625.50
-#define HARTREE_A_TO_KJ_MOL_NM (HARTREE_TO_KJ_MOL * NM_TO_ANGST)
-
+#include <memory>
 
 
 namespace ANIPlugin {
@@ -52,7 +48,7 @@ namespace ANIPlugin {
 class CudaCalcANIForceKernel : public CalcANIForceKernel {
 public:
     CudaCalcANIForceKernel(std::string name, const OpenMM::Platform& platform, OpenMM::CudaContext& cu) :
-            CalcANIForceKernel(name, platform), hasInitializedKernel(false), cu(cu) {
+            CalcANIForceKernel(name, platform), hasInitializedKernel(false), hasEnsemble(false), cu(cu) {
     }
 
     ~CudaCalcANIForceKernel();
@@ -73,15 +69,34 @@ public:
      * @return the potential energy due to the force
      */
     double execute(OpenMM::ContextImpl& context, bool includeForces, bool includeEnergy);
+    /**
+     * Switch to the model of the force if it has changed, by loading it into NeuroChem.
+     *
+     * @param context        the context to copy parameters to
+     * @param force          the ANIForce to copy the parameters from
+     */
+    void copyParametersToContext(OpenMM::ContextImpl& context, const ANIForce& force);
+    /**
+     * The virial is not available from NeuroChem, so this throws an exception.
+     */
+    void computeVirial(OpenMM::ContextImpl& context, std::vector<OpenMM::Vec3>& virial);
+    /**
+     * NeuroChem manages its own memory, so this throws an exception.
+     */
+    double getPeakMemory(OpenMM::ContextImpl& context);
 
 private:
-    bool hasInitializedKernel;
+    bool hasInitializedKernel, hasEnsemble;
     OpenMM::CudaContext& cu;
+    vector<OpenMM::Vec3> positions;
     vector<float> aniPositions;
+    vector<float> cell;
     vector<string> atomicSymbols;
+    string infoFile;
     bool usePeriodic;
     OpenMM::CudaArray networkForces;
     CUfunction addForcesKernel;
+    std::unique_ptr<ANIEvaluationLogWriter> recorder;
 };
 
 } // namespace ANIPlugin
@@ -36,6 +36,7 @@
 #include "CudaANIKernels.h"
 #include "openmm/internal/AssertionUtilities.h"
 #include "openmm/Context.h"
+#include "openmm/OpenMMException.h"
 #include "openmm/Platform.h"
 #include "openmm/System.h"
 #include "openmm/VerletIntegrator.h"
@@ -132,49 +133,33 @@ void testForceH2O() {
     cerr << " e=" << state.getPotentialEnergy() << endl;
 }
 
-/*
-void testPeriodicForce() {
-    // Create a random cloud of particles.
-
-    const int numParticles = 10;
-    System system;
-    system.setDefaultPeriodicBoxVectors(Vec3(2, 0, 0), Vec3(0, 3, 0), Vec3(0, 0, 4));
-    vector<Vec3> positions(numParticles);
-    OpenMM_SFMT::SFMT sfmt;
-    init_gen_rand(0, sfmt);
-    for (int i = 0; i < numParticles; i++) {
-        system.addParticle(1.0);
-        positions[i] = Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt))*10;
-    }
-    
-    vector<int> dummy = vector<int>(0);
-    ANIForce* force = new ANIForce("tests/periodic.pb", dummy);
-    force->setUsesPeriodicBoundaryConditions(true);
-    system.addForce(force);
-
-    // Compute the forces and energy.
-
-    VerletIntegrator integ(1.0);
-    Platform& platform = Platform::getPlatformByName("CUDA");
-    Context context(system, integ, platform);
-    context.setPositions(positions);
-    State state = context.getState(State::Energy | State::Forces);
-
-    // See if the energy is correct.  The network defines a potential of the form E(r) = |r|^2
-
-    double expectedEnergy = 0;
-    for (int i = 0; i < numParticles; i++) {
-        Vec3 pos = positions[i];
-        pos[0] -= floor(pos[0]/2.0)*2.0;
-        pos[1] -= floor(pos[1]/3.0)*3.0;
-        pos[2] -= floor(pos[2]/4.0)*4.0;
-        double r = sqrt(pos.dot(pos));
-        expectedEnergy += r*r;
-        ASSERT_EQUAL_VEC(pos*(-2.0), state.getForces()[i], 1e-5);
+void testUnsupportedOptions() {
+    // Options the CUDA platform cannot provide must be rejected, not ignored.
+
+    for (int option = 0; option < 3; option++) {
+        System system;
+        for (int i = 0; i < 3; i++)
+            system.addParticle(1.0);
+        vector<string> atomSym = { "O", "H", "H" };
+        ANIForce* force = new ANIForce("tests/testAniInfo.txt", atomSym);
+        if (option == 0)
+            force->setServer("ani-server.sock");
+        else if (option == 1)
+            force->setNumDomainWorkers(2);
+        else
+            force->setMaxMemory(100.0);
+        system.addForce(force);
+        VerletIntegrator integ(1.0);
+        bool threw = false;
+        try {
+            Context context(system, integ, Platform::getPlatformByName("CUDA"));
+        }
+        catch (const OpenMMException& e) {
+            threw = true;
+        }
+        ASSERT(threw);
     }
-    ASSERT_EQUAL_TOL(expectedEnergy, state.getPotentialEnergy(), 1e-5);
 }
-*/
 
 int main(int argc, char* argv[]) {
     try {
@@ -183,7 +168,7 @@ int main(int argc, char* argv[]) {
             Platform::getPlatformByName("CUDA").setPropertyDefaultValue("Precision", string(argv[1]));
         testForceH2O();
         testForce();
- //       testPeriodicForce();
+        testUnsupportedOptions();
     }
     catch(const std::exception& e) {
         cerr << "exception: " << e.what() << std::endl;
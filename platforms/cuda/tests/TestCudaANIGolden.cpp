@@ -0,0 +1,129 @@
+/* -------------------------------------------------------------------------- *
+ * The MIT License
+ * 
+ * SPDX short identifier: MIT
+ * 
+ * Copyright 2019 Genentech Inc. South San Francisco
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a 
+ * copy of this software and associated documentation files (the "Software"), 
+ * to deal in the Software without restriction, including without limitation 
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense, 
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included 
+ * in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS 
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER 
+ * DEALINGS IN THE SOFTWARE.
+ * -------------------------------------------------------------------------- */
+/* -------------------------------------------------------------------------- *
+ * Portions of this software were derived from code originally developed
+ * by Peter Eastman and copyrighted by Stanford University and the Authors
+ * -------------------------------------------------------------------------- */
+
+/**
+ * This checks the CUDA implementation of ANIForce against the golden
+ * reference data in tests/golden.  See TestReferenceANIGolden for the
+ * complete suite, which also records timings.
+ */
+
+#include "ANIForce.h"
+#include "openmm/internal/AssertionUtilities.h"
+#include "openmm/Context.h"
+#include "openmm/Platform.h"
+#include "openmm/System.h"
+#include "openmm/VerletIntegrator.h"
+
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+using namespace ANIPlugin;
+using namespace OpenMM;
+using namespace std;
+
+extern "C" OPENMM_EXPORT void registerANICudaKernelFactories();
+
+void checkStructure(istream& in, const string& header) {
+    istringstream headerStream(header);
+    string keyword, name;
+    int numAtoms, periodic;
+    headerStream >> keyword >> name >> numAtoms >> periodic;
+    System system;
+    vector<string> symbols(numAtoms);
+    vector<Vec3> positions(numAtoms);
+    if (periodic) {
+        Vec3 box[3];
+        in >> keyword;
+        for (int i = 0; i < 3; i++)
+            in >> box[i][0] >> box[i][1] >> box[i][2];
+        system.setDefaultPeriodicBoxVectors(box[0]/NM_TO_ANGST, box[1]/NM_TO_ANGST, box[2]/NM_TO_ANGST);
+    }
+    for (int i = 0; i < numAtoms; i++) {
+        in >> symbols[i] >> positions[i][0] >> positions[i][1] >> positions[i][2];
+        positions[i] /= NM_TO_ANGST;
+        system.addParticle(1.0);
+    }
+    ANIForce* force = new ANIForce("tests/golden/aniInfo.txt", symbols);
+    force->setUsesPeriodicBoundaryConditions(periodic != 0);
+    system.addForce(force);
+    VerletIntegrator integ(1.0);
+    Context context(system, integ, Platform::getPlatformByName("CUDA"));
+    context.setPositions(positions);
+    auto start = chrono::steady_clock::now();
+    State state = context.getState(State::Energy | State::Forces);
+    double ms = 1000*chrono::duration<double>(chrono::steady_clock::now()-start).count();
+
+    // Compare with the reference energy and forces.
+
+    double energy;
+    in >> keyword >> energy;
+    double energyError = fabs(state.getPotentialEnergy()/HARTREE_TO_KJ_MOL-energy)/numAtoms;
+    double forceError = 0;
+    while (in >> keyword && keyword == "force") {
+        int atom;
+        Vec3 expected;
+        in >> atom >> expected[0] >> expected[1] >> expected[2];
+        Vec3 delta = state.getForces()[atom]/HARTREE_A_TO_KJ_MOL_NM-expected;
+        forceError = max(forceError, max(fabs(delta[0]), max(fabs(delta[1]), fabs(delta[2]))));
+    }
+    cerr << name << ": energy error " << energyError << " force error " << forceError << " time " << ms << " ms" << endl;
+    ASSERT(energyError < 1e-6);
+    ASSERT(forceError < 1e-4);
+}
+
+void testGoldenReference() {
+    ifstream in("tests/golden/reference.txt");
+    ASSERT(in.good());
+    string line;
+    while (getline(in, line))
+        if (!line.empty() && line[0] != '#') {
+            checkStructure(in, line);
+            getline(in, line);
+        }
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        registerANICudaKernelFactories();
+        if (argc > 1)
+            Platform::getPlatformByName("CUDA").setPropertyDefaultValue("Precision", string(argv[1]));
+        testGoldenReference();
+    }
+    catch(const std::exception& e) {
+        cerr << "exception: " << e.what() << std::endl;
+        return 1;
+    }
+    cerr << "Done" << std::endl;
+    return 0;
+}
@@ -0,0 +1,377 @@
+/* -------------------------------------------------------------------------- *
+ * The MIT License
+ *
+ * SPDX short identifier: MIT
+ *
+ * Copyright 2019 Genentech Inc. South San Francisco
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ * -------------------------------------------------------------------------- */
+/* -------------------------------------------------------------------------- *
+ * Portions of this software were derived from code originally developed
+ * by Peter Eastman and copyrighted by Stanford University and the Authors
+ * -------------------------------------------------------------------------- */
+
+#include "OpenCLANIKernels.h"
+#include "OpenCLANIKernelSources.h"
+#include "internal/ANIModel.h"
+#include "internal/ANIModelLoader.h"
+#include "openmm/OpenMMException.h"
+#include "openmm/internal/ContextImpl.h"
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <sstream>
+
+using namespace ANIPlugin;
+using namespace OpenMM;
+using namespace std;
+
+/**
+ * Format a value as a single precision OpenCL literal.
+ */
+static string floatToString(double value) {
+    stringstream s;
+    s.precision(9);
+    s << scientific << value << "f";
+    return s.str();
+}
+
+template <class T>
+static string formatArray(const string& type, const string& name, const vector<T>& values) {
+    stringstream s;
+    s << "__constant " << type << " " << name << "[] = {";
+    for (int i = 0; i < values.size(); i++)
+        s << (i > 0 ? ", " : "") << values[i];
+    s << "};\n";
+    return s.str();
+}
+
+static string formatArray(const string& name, const vector<float>& values) {
+    vector<string> literals;
+    for (float v : values)
+        literals.push_back(floatToString(v));
+    return formatArray("float", name, literals);
+}
+
+/**
+ * Allocate an array, or resize it if it already exists because a different
+ * model was loaded before.
+ */
+template <class T>
+static void initializeArray(OpenCLContext& cl, OpenCLArray& array, int size, const string& name) {
+    if (array.isInitialized())
+        array.resize(size);
+    else
+        array.initialize<T>(cl, size, name);
+}
+
+void OpenCLCalcANIForceKernel::initialize(const System& system, const ANIForce& force) {
+    if (!force.getAlchemicalSymbols().empty())
+        throw OpenMMException("ANIForce: alchemical states are not supported on the OpenCL platform");
+    if (!force.getServer().empty())
+        throw OpenMMException("ANIForce: evaluation servers are not supported on the OpenCL platform");
+    if (force.getNumDomainWorkers() > 0)
+        throw OpenMMException("ANIForce: domain workers are not supported on the OpenCL platform");
+    if (force.getMaxMemory() > 0)
+        throw OpenMMException("ANIForce: memory limits are not supported on the OpenCL platform");
+    if (force.getUseSharedEngine())
+        throw OpenMMException("ANIForce: shared engines are not supported on the OpenCL platform");
+    if (!cl.getSupports64BitGlobalAtomics())
+        throw OpenMMException("ANIForce: the OpenCL platform needs a device that supports 64 bit atomic operations");
+    atomSymbols = force.getAtomSymbols();
+    int numAtoms = system.getNumParticles();
+    if (atomSymbols.size() != numAtoms)
+        throw OpenMMException("ANIForce: the number of atom symbols does not match the number of particles");
+    usePeriodic = force.usesPeriodicBoundaryConditions();
+    positions.initialize<mm_float4>(cl, numAtoms, "aniPositions");
+    localIndex.initialize<cl_int>(cl, numAtoms, "aniLocalIndex");
+    neighbors.initialize<cl_int>(cl, neighborCapacity*numAtoms, "aniNeighbors");
+    neighborDeltas.initialize<mm_float4>(cl, neighborCapacity*numAtoms, "aniNeighborDeltas");
+    numNeighbors.initialize<cl_int>(cl, numAtoms, "aniNumNeighbors");
+    numAngularNeighbors.initialize<cl_int>(cl, numAtoms, "aniNumAngularNeighbors");
+    maxNeighbors.initialize<cl_int>(cl, 1, "aniMaxNeighbors");
+    energy.initialize<cl_long>(cl, 1, "aniEnergy");
+    loadModel(force.getInfoFile());
+    if (!force.getRecordingFile().empty())
+        recorder.reset(new ANIEvaluationLogWriter(force.getRecordingFile(), infoFile, atomSymbols, force.getRecordingInterval(),
+                                                  (size_t) (force.getMaxRecordingSize()*(1<<20))));
+}
+
+void OpenCLCalcANIForceKernel::copyParametersToContext(ContextImpl& context, const ANIForce& force) {
+    if (force.getAtomSymbols() != atomSymbols)
+        throw OpenMMException("ANIForce: updateParametersInContext() cannot change the atom symbols");
+    if (force.getInfoFile() == infoFile)
+        return;
+
+    // A recording names the model in its header, so switching the model
+    // would leave evaluations of the new one attributed to the old one.
+
+    if (recorder)
+        throw OpenMMException("ANIForce: the model cannot be changed while evaluations are being recorded");
+    loadModel(force.getInfoFile());
+}
+
+void OpenCLCalcANIForceKernel::loadModel(const string& modelInfoFile) {
+    int numAtoms = atomSymbols.size();
+    shared_ptr<const ANIModel> model = ANIModelLoader::get(modelInfoFile);
+    if (model->angularCutoff > model->radialCutoff)
+        throw OpenMMException("ANIForce: the OpenCL platform needs an angular cutoff no larger than the radial cutoff");
+
+    // Look up the species of every atom.  Their self energies are constant, so
+    // they are added on the host.  Nothing is changed until the model is known
+    // to work, so a failed switch leaves the previous model in place.
+
+    vector<int> atomSpecies(numAtoms);
+    double modelSelfEnergy = 0;
+    for (int i = 0; i < numAtoms; i++) {
+        atomSpecies[i] = model->getSpeciesIndex(atomSymbols[i]);
+        if (atomSpecies[i] < 0)
+            throw OpenMMException("ANI: the model does not support element "+atomSymbols[i]);
+        modelSelfEnergy += model->selfEnergies[atomSpecies[i]];
+    }
+
+    // Concatenate all networks into one array, each layer's weights followed by
+    // its biases, and describe the layers with tables that are compiled into
+    // the kernels.
+
+    int numSpecies = model->getNumSpecies();
+    int numEnsembles = model->getNumEnsembles();
+    vector<float> allWeights;
+    vector<int> networkLayers(1, 0), layerInput, layerOutput, layerActivation, layerWeights;
+    int maxLayerWidth = 1, maxValues = 1;
+    for (int e = 0; e < numEnsembles; e++)
+        for (int s = 0; s < numSpecies; s++) {
+            const ANIModel::Network& network = model->networks[e][s];
+            int numValues = 0;
+            for (int l = 0; l < network.size(); l++) {
+                const ANIModel::Layer& layer = network[l];
+                layerInput.push_back(layer.inputSize);
+                layerOutput.push_back(layer.outputSize);
+                layerActivation.push_back(layer.activation);
+                layerWeights.push_back(allWeights.size());
+                allWeights.insert(allWeights.end(), layer.weights.begin(), layer.weights.end());
+                allWeights.insert(allWeights.end(), layer.biases.begin(), layer.biases.end());
+                numValues += 2*layer.outputSize;
+                maxLayerWidth = max(maxLayerWidth, layer.outputSize);
+                if (l > 0)
+                    maxLayerWidth = max(maxLayerWidth, layer.inputSize);
+            }
+            maxValues = max(maxValues, numValues);
+            networkLayers.push_back(layerInput.size());
+        }
+
+    // Species pairs are numbered row by row through the upper triangle, as in
+    // the CPU engine.
+
+    vector<int> pairIndex(numSpecies*numSpecies);
+    for (int i = 0, index = 0; i < numSpecies; i++)
+        for (int j = i; j < numSpecies; j++, index++)
+            pairIndex[i*numSpecies+j] = pairIndex[j*numSpecies+i] = index;
+    vector<float> cosShfZ, sinShfZ;
+    for (float z : model->shfZ) {
+        cosShfZ.push_back(cosf(z));
+        sinShfZ.push_back(sinf(z));
+    }
+
+    // Create the arrays.
+
+    int aevLength = model->getAEVLength();
+    initializeArray<cl_int>(cl, species, numAtoms, "aniSpecies");
+    species.upload(atomSpecies);
+    initializeArray<cl_float>(cl, weights, allWeights.size(), "aniWeights");
+    weights.upload(allWeights);
+    initializeArray<cl_float>(cl, aev, aevLength*numAtoms, "aniAEV");
+    initializeArray<cl_float>(cl, aevGrad, aevLength*numAtoms, "aniAEVGrad");
+    initializeArray<cl_float>(cl, values, maxValues*numAtoms, "aniValues");
+    initializeArray<cl_float>(cl, grads, 2*maxLayerWidth*numAtoms, "aniGrads");
+
+    // Compile the kernels.
+
+    map<string, string> defines;
+    defines["NUM_ATOMS"] = cl.intToString(numAtoms);
+    defines["PADDED_NUM_ATOMS"] = cl.intToString(cl.getPaddedNumAtoms());
+    defines["POSQ_TYPE"] = (cl.getUseDoublePrecision() ? "double4" : "float4");
+    defines["NM_TO_ANGST"] = cl.intToString(NM_TO_ANGST);
+    defines["FORCE_SCALE"] = floatToString(HARTREE_A_TO_KJ_MOL_NM*(double) 0x100000000);
+    defines["NUM_SPECIES"] = cl.intToString(numSpecies);
+    defines["NUM_ENSEMBLES"] = cl.intToString(numEnsembles);
+    defines["NUM_ETA_R"] = cl.intToString(model->etaR.size());
+    defines["NUM_SHF_R"] = cl.intToString(model->shfR.size());
+    defines["NUM_ETA_A"] = cl.intToString(model->etaA.size());
+    defines["NUM_ZETA"] = cl.intToString(model->zeta.size());
+    defines["NUM_SHF_A"] = cl.intToString(model->shfA.size());
+    defines["NUM_SHF_Z"] = cl.intToString(model->shfZ.size());
+    defines["RADIAL_SUB_LENGTH"] = cl.intToString(model->getRadialSubLength());
+    defines["RADIAL_LENGTH"] = cl.intToString(numSpecies*model->getRadialSubLength());
+    defines["ANGULAR_SUB_LENGTH"] = cl.intToString(model->getAngularSubLength());
+    defines["AEV_LENGTH"] = cl.intToString(aevLength);
+    defines["MAX_LAYER_WIDTH"] = cl.intToString(maxLayerWidth);
+    defines["RADIAL_CUTOFF"] = floatToString(model->radialCutoff);
+    defines["ANGULAR_CUTOFF"] = floatToString(model->angularCutoff);
+    defines["RADIAL_SCALE"] = floatToString((float) M_PI/model->radialCutoff);
+    defines["ANGULAR_SCALE"] = floatToString((float) M_PI/model->angularCutoff);
+    defines["ACTIVATION_CELU"] = cl.intToString(ANIModel::CELU);
+    defines["ACTIVATION_GAUSSIAN"] = cl.intToString(ANIModel::Gaussian);
+    if (usePeriodic)
+        defines["USE_PERIODIC"] = "1";
+    stringstream source;
+    source << formatArray("ETA_R", model->etaR);
+    source << formatArray("SHF_R", model->shfR);
+    source << formatArray("ETA_A", model->etaA);
+    source << formatArray("ZETA", model->zeta);
+    source << formatArray("SHF_A", model->shfA);
+    source << formatArray("COS_SHF_Z", cosShfZ);
+    source << formatArray("SIN_SHF_Z", sinShfZ);
+    source << formatArray("int", "PAIR_INDEX", pairIndex);
+    source << formatArray("int", "NETWORK_LAYERS", networkLayers);
+    source << formatArray("int", "LAYER_INPUT", layerInput);
+    source << formatArray("int", "LAYER_OUTPUT", layerOutput);
+    source << formatArray("int", "LAYER_ACTIVATION", layerActivation);
+    source << formatArray("int", "LAYER_WEIGHTS", layerWeights);
+    source << OpenCLANIKernelSources::ani;
+    cl::Program program = cl.createProgram(source.str(), defines);
+    copyPositionsKernel = cl::Kernel(program, "copyPositions");
+    findNeighborsKernel = cl::Kernel(program, "findNeighbors");
+    computeAEVsKernel = cl::Kernel(program, "computeAEVs");
+    computeNetworksKernel = cl::Kernel(program, "computeNetworks");
+    computeForcesKernel = cl::Kernel(program, "computeForces");
+    setKernelArgs();
+    for (int i = 0; i < 3; i++)
+        findNeighborsKernel.setArg<mm_float4>(7+i, mm_float4(0.0f, 0.0f, 0.0f, 0.0f));
+    infoFile = modelInfoFile;
+    radialCutoff = model->radialCutoff;
+    selfEnergy = modelSelfEnergy;
+}
+
+void OpenCLCalcANIForceKernel::setKernelArgs() {
+    copyPositionsKernel.setArg<cl::Buffer>(0, cl.getPosq().getDeviceBuffer());
+    copyPositionsKernel.setArg<cl::Buffer>(1, cl.getAtomIndexArray().getDeviceBuffer());
+    copyPositionsKernel.setArg<cl::Buffer>(2, positions.getDeviceBuffer());
+    copyPositionsKernel.setArg<cl::Buffer>(3, localIndex.getDeviceBuffer());
+    copyPositionsKernel.setArg<cl::Buffer>(4, energy.getDeviceBuffer());
+    copyPositionsKernel.setArg<cl::Buffer>(5, maxNeighbors.getDeviceBuffer());
+    findNeighborsKernel.setArg<cl::Buffer>(0, positions.getDeviceBuffer());
+    findNeighborsKernel.setArg<cl::Buffer>(1, neighbors.getDeviceBuffer());
+    findNeighborsKernel.setArg<cl::Buffer>(2, neighborDeltas.getDeviceBuffer());
+    findNeighborsKernel.setArg<cl::Buffer>(3, numNeighbors.getDeviceBuffer());
+    findNeighborsKernel.setArg<cl::Buffer>(4, numAngularNeighbors.getDeviceBuffer());
+    findNeighborsKernel.setArg<cl::Buffer>(5, maxNeighbors.getDeviceBuffer());
+    findNeighborsKernel.setArg<cl_int>(6, neighborCapacity);
+    computeAEVsKernel.setArg<cl::Buffer>(0, species.getDeviceBuffer());
+    computeAEVsKernel.setArg<cl::Buffer>(1, neighbors.getDeviceBuffer());
+    computeAEVsKernel.setArg<cl::Buffer>(2, neighborDeltas.getDeviceBuffer());
+    computeAEVsKernel.setArg<cl::Buffer>(3, numNeighbors.getDeviceBuffer());
+    computeAEVsKernel.setArg<cl::Buffer>(4, numAngularNeighbors.getDeviceBuffer());
+    computeAEVsKernel.setArg<cl::Buffer>(5, maxNeighbors.getDeviceBuffer());
+    computeAEVsKernel.setArg<cl_int>(6, neighborCapacity);
+    computeAEVsKernel.setArg<cl::Buffer>(7, aev.getDeviceBuffer());
+    computeNetworksKernel.setArg<cl::Buffer>(0, species.getDeviceBuffer());
+    computeNetworksKernel.setArg<cl::Buffer>(1, weights.getDeviceBuffer());
+    computeNetworksKernel.setArg<cl::Buffer>(2, aev.getDeviceBuffer());
+    computeNetworksKernel.setArg<cl::Buffer>(3, values.getDeviceBuffer());
+    computeNetworksKernel.setArg<cl::Buffer>(4, grads.getDeviceBuffer());
+    computeNetworksKernel.setArg<cl::Buffer>(5, aevGrad.getDeviceBuffer());
+    computeNetworksKernel.setArg<cl::Buffer>(6, energy.getDeviceBuffer());
+    computeNetworksKernel.setArg<cl::Buffer>(7, maxNeighbors.getDeviceBuffer());
+    computeNetworksKernel.setArg<cl_int>(8, neighborCapacity);
+    computeForcesKernel.setArg<cl::Buffer>(0, species.getDeviceBuffer());
+    computeForcesKernel.setArg<cl::Buffer>(1, neighbors.getDeviceBuffer());
+    computeForcesKernel.setArg<cl::Buffer>(2, neighborDeltas.getDeviceBuffer());
+    computeForcesKernel.setArg<cl::Buffer>(3, numNeighbors.getDeviceBuffer());
+    computeForcesKernel.setArg<cl::Buffer>(4, numAngularNeighbors.getDeviceBuffer());
+    computeForcesKernel.setArg<cl::Buffer>(5, maxNeighbors.getDeviceBuffer());
+    computeForcesKernel.setArg<cl_int>(6, neighborCapacity);
+    computeForcesKernel.setArg<cl::Buffer>(7, aevGrad.getDeviceBuffer());
+    computeForcesKernel.setArg<cl::Buffer>(8, localIndex.getDeviceBuffer());
+    computeForcesKernel.setArg<cl::Buffer>(9, cl.getLongForceBuffer().getDeviceBuffer());
+}
+
+double OpenCLCalcANIForceKernel::execute(ContextImpl& context, bool includeForces, bool includeEnergy) {
+    int numAtoms = cl.getNumAtoms();
+    if (usePeriodic) {
+        Vec3 box[3];
+        cl.getPeriodicBoxVectors(box[0], box[1], box[2]);
+
+        // The faces of a triclinic box are closer together than its diagonal
+        // elements, so the widths are measured perpendicular to them.
+
+        double volume = box[0][0]*box[1][1]*box[2][2];
+        Vec3 bc = box[1].cross(box[2]), ca = box[2].cross(box[0]), ab = box[0].cross(box[1]);
+        double maxArea = max(sqrt(bc.dot(bc)), max(sqrt(ca.dot(ca)), sqrt(ab.dot(ab))));
+        if (volume/maxArea < 2*radialCutoff/NM_TO_ANGST)
+            throw OpenMMException("ANIForce: the periodic box must be at least twice the cutoff in every direction");
+        for (int i = 0; i < 3; i++)
+            findNeighborsKernel.setArg<mm_float4>(7+i, mm_float4((float) (box[i][0]*NM_TO_ANGST),
+                    (float) (box[i][1]*NM_TO_ANGST), (float) (box[i][2]*NM_TO_ANGST), 0.0f));
+    }
+    computeNetworksKernel.setArg<cl_int>(9, includeForces ? 1 : 0);
+    while (true) {
+        cl.executeKernel(copyPositionsKernel, numAtoms);
+        cl.executeKernel(findNeighborsKernel, numAtoms);
+        cl.executeKernel(computeAEVsKernel, numAtoms);
+        cl.executeKernel(computeNetworksKernel, numAtoms);
+        if (includeForces)
+            cl.executeKernel(computeForcesKernel, numAtoms);
+        int required;
+        maxNeighbors.download(&required);
+        if (required <= neighborCapacity)
+            break;
+
+        // Some atom had more neighbors than fit in the list, so the other kernels
+        // did nothing.  Enlarge the list and try again.
+
+        neighborCapacity = required + required/4;
+        neighbors.resize(neighborCapacity*numAtoms);
+        neighborDeltas.resize(neighborCapacity*numAtoms);
+        setKernelArgs();
+    }
+    cl_long fixedEnergy;
+    energy.download(&fixedEnergy);
+    double hartreeEnergy = fixedEnergy/(double) 0x100000000 + selfEnergy;
+    if (recorder && recorder->startCall()) {
+        // The forces go straight into the context's force buffer, so only the
+        // structure and its energy are recorded.
+
+        vector<Vec3> pos;
+        context.getPositions(pos);
+        vector<float> recordedPositions(3*numAtoms);
+        for (int i = 0; i < numAtoms; i++)
+            for (int j = 0; j < 3; j++)
+                recordedPositions[3*i+j] = pos[i][j]*NM_TO_ANGST;
+        float recordedCell[9];
+        if (usePeriodic) {
+            Vec3 box[3];
+            cl.getPeriodicBoxVectors(box[0], box[1], box[2]);
+            for (int i = 0; i < 3; i++)
+                for (int j = 0; j < 3; j++)
+                    recordedCell[3*i+j] = box[i][j]*NM_TO_ANGST;
+        }
+        recorder->record(recordedPositions.data(), (usePeriodic ? recordedCell : NULL), hartreeEnergy, NULL);
+    }
+    return hartreeEnergy*HARTREE_TO_KJ_MOL;
+}
+
+void OpenCLCalcANIForceKernel::computeVirial(ContextImpl& context, vector<Vec3>& virial) {
+    throw OpenMMException("ANIForce: the virial is not available on the OpenCL platform");
+}
+
+double OpenCLCalcANIForceKernel::getPeakMemory(ContextImpl& context) {
+    throw OpenMMException("ANIForce: the peak memory is not available on the OpenCL platform");
+}
@@ -0,0 +1,109 @@
+#ifndef OPENCL_ANI_KERNELS_H_
+#define OPENCL_ANI_KERNELS_H_
+
+/* -------------------------------------------------------------------------- *
+ * The MIT License
+ *
+ * SPDX short identifier: MIT
+ *
+ * Copyright 2019 Genentech Inc. South San Francisco
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ * -------------------------------------------------------------------------- */
+/* -------------------------------------------------------------------------- *
+ * Portions of this software were derived from code originally developed
+ * by Peter Eastman and copyrighted by Stanford University and the Authors
+ * -------------------------------------------------------------------------- */
+
+
+
+#include "ANIKernels.h"
+#include "ANIEngine.h"
+#include "internal/ANIEvaluationLog.h"
+#include "openmm/opencl/OpenCLContext.h"
+#include "openmm/opencl/OpenCLArray.h"
+#include <memory>
+
+
+namespace ANIPlugin {
+
+/**
+ * This kernel is invoked by ANIForce to calculate the forces acting on the system and the energy of the system.
+ * Unlike the CUDA kernel it does not use NeuroChem: the AEVs and networks are evaluated by OpenCL kernels from
+ * the model files read by ANIModelLoader, so it also runs on CPU OpenCL implementations such as PoCL.
+ */
+class OpenCLCalcANIForceKernel : public CalcANIForceKernel {
+public:
+    OpenCLCalcANIForceKernel(std::string name, const OpenMM::Platform& platform, OpenMM::OpenCLContext& cl) :
+            CalcANIForceKernel(name, platform), cl(cl), neighborCapacity(64) {
+    }
+
+    /**
+     * Initialize the kernel.
+     * 
+     * @param system         the System this kernel will be applied to
+     * @param force          the ANIForce this kernel will be used for
+     */
+    void initialize(const OpenMM::System& system, const ANIForce& force);
+    /**
+     * Execute the kernel to calculate the forces and/or energy.
+     *
+     * @param context        the context in which to execute this kernel
+     * @param includeForces  true if forces should be calculated
+     * @param includeEnergy  true if the energy should be calculated
+     * @return the potential energy due to the force
+     */
+    double execute(OpenMM::ContextImpl& context, bool includeForces, bool includeEnergy);
+    /**
+     * Switch to the model of the force, rebuilding the kernels for it.
+     *
+     * @param context        the context to copy parameters to
+     * @param force          the ANIForce to copy the parameters from
+     */
+    void copyParametersToContext(OpenMM::ContextImpl& context, const ANIForce& force);
+    /**
+     * The virial is not implemented on the OpenCL platform, so this throws an exception.
+     */
+    void computeVirial(OpenMM::ContextImpl& context, std::vector<OpenMM::Vec3>& virial);
+    /**
+     * Device memory is managed by the OpenCL context, so this throws an exception.
+     */
+    double getPeakMemory(OpenMM::ContextImpl& context);
+
+private:
+    void loadModel(const std::string& modelInfoFile);
+    void setKernelArgs();
+    OpenMM::OpenCLContext& cl;
+    std::string infoFile;
+    std::vector<std::string> atomSymbols;
+    bool usePeriodic;
+    float radialCutoff;
+    /** sum of the self energies of all atoms (Hartree) */
+    double selfEnergy;
+    /** how many neighbors of each atom the neighbor list can hold */
+    int neighborCapacity;
+    OpenMM::OpenCLArray species, weights, positions, localIndex, neighbors, neighborDeltas, numNeighbors,
+            numAngularNeighbors, maxNeighbors, aev, aevGrad, values, grads, energy;
+    cl::Kernel copyPositionsKernel, findNeighborsKernel, computeAEVsKernel, computeNetworksKernel, computeForcesKernel;
+    std::unique_ptr<ANIEvaluationLogWriter> recorder;
+};
+
+} // namespace ANIPlugin
+
+#endif /*OPENCL_ANI_KERNELS_H_*/
@@ -0,0 +1,393 @@
+/* -------------------------------------------------------------------------- *
+ * The MIT License
+ *
+ * SPDX short identifier: MIT
+ *
+ * Copyright 2019 Genentech Inc. South San Francisco
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ * -------------------------------------------------------------------------- */
+/* -------------------------------------------------------------------------- *
+ * Portions of this software were derived from code originally developed
+ * by Peter Eastman and copyrighted by Stanford University and the Authors
+ * -------------------------------------------------------------------------- */
+
+
+/*
+ * The kernels evaluate ANIForce in the atom order of the System, so their
+ * results do not depend on how the context reorders atoms.  Per atom arrays
+ * that are indexed by a second dimension (neighbors, AEVs, layer values) are
+ * stored interleaved, element k of atom i at k*NUM_ATOMS+i, so that work items
+ * for consecutive atoms access consecutive addresses.
+ *
+ * The model's hyperparameters and network layout are compiled in as constants
+ * by OpenCLCalcANIForceKernel::initialize().  Energies and forces are summed in
+ * 32.32 fixed point, which makes the results independent of the order in which
+ * work items finish.
+ */
+
+#pragma OPENCL EXTENSION cl_khr_int64_base_atomics : enable
+
+#define FIXED_POINT_SCALE 4294967296.0f
+#define AEV(k) aev[(k)*NUM_ATOMS+atom]
+#define AEV_GRAD(k) aevGrad[(k)*NUM_ATOMS+atom]
+#define VALUE(k) values[(k)*NUM_ATOMS+atom]
+#define GRAD(k) grads[(k)*NUM_ATOMS+atom]
+
+/**
+ * Compute the displacement from one atom to another, using the nearest
+ * periodic image if the system is periodic.
+ */
+inline float4 computeDelta(float4 posI, float4 posJ, float4 boxX, float4 boxY, float4 boxZ) {
+    float4 delta = posJ-posI;
+#ifdef USE_PERIODIC
+    delta -= boxZ*round(delta.z/boxZ.z);
+    delta -= boxY*round(delta.y/boxY.y);
+    delta -= boxX*round(delta.x/boxX.x);
+#endif
+    return delta;
+}
+
+inline float activate(int activation, float x) {
+    if (activation == ACTIVATION_CELU)
+        return (x > 0.0f ? x : 0.1f*(exp(10.0f*x)-1.0f));
+    if (activation == ACTIVATION_GAUSSIAN)
+        return exp(-x*x);
+    return x;
+}
+
+/**
+ * The derivative of an activation, given its input x and output y.
+ */
+inline float activationDerivative(int activation, float x, float y) {
+    if (activation == ACTIVATION_CELU)
+        return (x > 0.0f ? 1.0f : 10.0f*y+1.0f);
+    if (activation == ACTIVATION_GAUSSIAN)
+        return -2.0f*x*y;
+    return 1.0f;
+}
+
+/**
+ * Add the force corresponding to a gradient (in Hartree/A) to the context's
+ * fixed point force buffer.
+ */
+inline void addGradient(__global long* restrict forceBuffers, int index, float3 gradient) {
+    atom_add(&forceBuffers[index], (long) (-gradient.x*FORCE_SCALE));
+    atom_add(&forceBuffers[index+PADDED_NUM_ATOMS], (long) (-gradient.y*FORCE_SCALE));
+    atom_add(&forceBuffers[index+2*PADDED_NUM_ATOMS], (long) (-gradient.z*FORCE_SCALE));
+}
+
+/**
+ * Convert the context's positions to Angstroms in System order and record where
+ * every atom is stored in the context.  This also resets the accumulators.
+ */
+__kernel void copyPositions(__global const POSQ_TYPE* restrict posq, __global const int* restrict atomIndex,
+        __global float4* restrict positions, __global int* restrict localIndex, __global long* restrict energy,
+        __global int* restrict maxNeighbors) {
+    if (get_global_id(0) == 0) {
+        *energy = 0;
+        *maxNeighbors = 0;
+    }
+    for (int i = get_global_id(0); i < NUM_ATOMS; i += get_global_size(0)) {
+        int atom = atomIndex[i];
+        POSQ_TYPE pos = posq[i];
+        positions[atom] = (float4) ((float) (pos.x*NM_TO_ANGST), (float) (pos.y*NM_TO_ANGST), (float) (pos.z*NM_TO_ANGST), 0.0f);
+        localIndex[atom] = i;
+    }
+}
+
+/**
+ * Build the neighbor list of every atom.  Neighbors inside the angular cutoff
+ * come first, each group in the order of the atoms.  The displacement to each
+ * neighbor is stored with the distance in its w component.  If an atom has
+ * more neighbors than fit, only the count is recorded and the host enlarges
+ * the list and starts over.
+ */
+__kernel void findNeighbors(__global const float4* restrict positions, __global int* restrict neighbors,
+        __global float4* restrict neighborDeltas, __global int* restrict numNeighbors,
+        __global int* restrict numAngularNeighbors, __global int* restrict maxNeighbors, int neighborCapacity,
+        float4 boxX, float4 boxY, float4 boxZ) {
+    for (int atom = get_global_id(0); atom < NUM_ATOMS; atom += get_global_size(0)) {
+        float4 pos = positions[atom];
+        int n = 0;
+        for (int pass = 0; pass < 2; pass++) {
+            float minR2 = (pass == 0 ? 0.0f : ANGULAR_CUTOFF*ANGULAR_CUTOFF);
+            float maxR2 = (pass == 0 ? ANGULAR_CUTOFF*ANGULAR_CUTOFF : RADIAL_CUTOFF*RADIAL_CUTOFF);
+            for (int j = 0; j < NUM_ATOMS; j++) {
+                if (j == atom)
+                    continue;
+                float4 delta = computeDelta(pos, positions[j], boxX, boxY, boxZ);
+                float r2 = delta.x*delta.x + delta.y*delta.y + delta.z*delta.z;
+                if (r2 < minR2 || r2 >= maxR2)
+                    continue;
+                if (n < neighborCapacity) {
+                    delta.w = sqrt(r2);
+                    neighbors[n*NUM_ATOMS+atom] = j;
+                    neighborDeltas[n*NUM_ATOMS+atom] = delta;
+                }
+                n++;
+            }
+            if (pass == 0)
+                numAngularNeighbors[atom] = n;
+        }
+        numNeighbors[atom] = n;
+        atomic_max(maxNeighbors, n);
+    }
+}
+
+/**
+ * Compute the AEV of every atom.
+ */
+__kernel void computeAEVs(__global const int* restrict species, __global const int* restrict neighbors,
+        __global const float4* restrict neighborDeltas, __global const int* restrict numNeighbors,
+        __global const int* restrict numAngularNeighbors, __global const int* restrict maxNeighbors,
+        int neighborCapacity, __global float* restrict aev) {
+    if (*maxNeighbors > neighborCapacity)
+        return;
+    for (int atom = get_global_id(0); atom < NUM_ATOMS; atom += get_global_size(0)) {
+        for (int k = 0; k < AEV_LENGTH; k++)
+            AEV(k) = 0.0f;
+        const int end = numNeighbors[atom], angularEnd = numAngularNeighbors[atom];
+
+        // Radial terms.
+
+        for (int j = 0; j < end; j++) {
+            float r = neighborDeltas[j*NUM_ATOMS+atom].w;
+            float fc = 0.5f*cos(r*RADIAL_SCALE) + 0.5f;
+            int block = species[neighbors[j*NUM_ATOMS+atom]]*RADIAL_SUB_LENGTH;
+            for (int a = 0; a < NUM_ETA_R; a++)
+                for (int k = 0; k < NUM_SHF_R; k++) {
+                    float dr = r-SHF_R[k];
+                    AEV(block+a*NUM_SHF_R+k) += 0.25f*exp(-ETA_R[a]*dr*dr)*fc;
+                }
+        }
+
+        // Angular terms for every pair of neighbors inside the angular cutoff.
+
+        float f1[NUM_ZETA*NUM_SHF_Z], f2[NUM_ETA_A*NUM_SHF_A];
+        for (int j = 0; j < angularEnd; j++) {
+            float4 deltaJ = neighborDeltas[j*NUM_ATOMS+atom];
+            float fcj = 0.5f*cos(deltaJ.w*ANGULAR_SCALE) + 0.5f;
+            int speciesJ = species[neighbors[j*NUM_ATOMS+atom]];
+            for (int k = j+1; k < angularEnd; k++) {
+                float4 deltaK = neighborDeltas[k*NUM_ATOMS+atom];
+                float fck = 0.5f*cos(deltaK.w*ANGULAR_SCALE) + 0.5f;
+                float cosAngle = 0.95f*dot(deltaJ.xyz, deltaK.xyz)/(deltaJ.w*deltaK.w);
+                float sinAngle = sqrt(max(0.0f, 1.0f-cosAngle*cosAngle));
+                float meanR = 0.5f*(deltaJ.w+deltaK.w);
+                for (int z = 0; z < NUM_ZETA; z++)
+                    for (int n = 0; n < NUM_SHF_Z; n++)
+                        f1[z*NUM_SHF_Z+n] = pow(0.5f*(1.0f + cosAngle*COS_SHF_Z[n] + sinAngle*SIN_SHF_Z[n]), ZETA[z]);
+                for (int a = 0; a < NUM_ETA_A; a++)
+                    for (int m = 0; m < NUM_SHF_A; m++) {
+                        float dr = meanR-SHF_A[m];
+                        f2[a*NUM_SHF_A+m] = 2.0f*exp(-ETA_A[a]*dr*dr)*fcj*fck;
+                    }
+                int block = RADIAL_LENGTH + PAIR_INDEX[speciesJ*NUM_SPECIES + species[neighbors[k*NUM_ATOMS+atom]]]*ANGULAR_SUB_LENGTH;
+                for (int a = 0; a < NUM_ETA_A; a++)
+                    for (int z = 0; z < NUM_ZETA; z++)
+                        for (int m = 0; m < NUM_SHF_A; m++) {
+                            float scale = f2[a*NUM_SHF_A+m];
+                            int out = block + ((a*NUM_ZETA+z)*NUM_SHF_A+m)*NUM_SHF_Z;
+                            for (int n = 0; n < NUM_SHF_Z; n++)
+                                AEV(out+n) += scale*f1[z*NUM_SHF_Z+n];
+                        }
+            }
+        }
+    }
+}
+
+/**
+ * Evaluate the networks of the ensemble for every atom, add the mean energy to
+ * the energy accumulator and, if requested, store the gradient of the energy
+ * with respect to the AEV.  The inputs and outputs of every layer are kept in
+ * values for the backward pass, which uses grads as two alternating buffers.
+ */
+__kernel void computeNetworks(__global const int* restrict species, __global const float* restrict weights,
+        __global const float* restrict aev, __global float* restrict values, __global float* restrict grads,
+        __global float* restrict aevGrad, __global long* restrict energy, __global const int* restrict maxNeighbors,
+        int neighborCapacity, int computeGradient) {
+    if (*maxNeighbors > neighborCapacity)
+        return;
+    for (int atom = get_global_id(0); atom < NUM_ATOMS; atom += get_global_size(0)) {
+        const int s = species[atom];
+        float atomEnergy = 0.0f;
+        if (computeGradient)
+            for (int k = 0; k < AEV_LENGTH; k++)
+                AEV_GRAD(k) = 0.0f;
+        for (int e = 0; e < NUM_ENSEMBLES; e++) {
+            const int firstLayer = NETWORK_LAYERS[e*NUM_SPECIES+s], endLayer = NETWORK_LAYERS[e*NUM_SPECIES+s+1];
+
+            // Forward pass.
+
+            int input = -1, offset = 0;
+            for (int l = firstLayer; l < endLayer; l++) {
+                const int in = LAYER_INPUT[l], out = LAYER_OUTPUT[l], activation = LAYER_ACTIVATION[l];
+                __global const float* w = &weights[LAYER_WEIGHTS[l]];
+                __global const float* bias = &w[in*out];
+                for (int o = 0; o < out; o++) {
+                    float z = bias[o];
+                    if (input < 0) {
+                        for (int k = 0; k < in; k++)
+                            z += w[o*in+k]*AEV(k);
+                    }
+                    else {
+                        for (int k = 0; k < in; k++)
+                            z += w[o*in+k]*VALUE(input+k);
+                    }
+                    VALUE(offset+o) = z;
+                    VALUE(offset+out+o) = activate(activation, z);
+                }
+                input = offset+out;
+                offset += 2*out;
+            }
+            atomEnergy += VALUE(input)/NUM_ENSEMBLES;
+            if (!computeGradient)
+                continue;
+
+            // Backward pass.  The gradient with respect to the AEV accumulates
+            // over the ensemble.
+
+            int grad = 0, nextGrad = MAX_LAYER_WIDTH;
+            GRAD(grad) = 1.0f/NUM_ENSEMBLES;
+            for (int l = endLayer-1; l >= firstLayer; l--) {
+                const int in = LAYER_INPUT[l], out = LAYER_OUTPUT[l], activation = LAYER_ACTIVATION[l];
+                __global const float* w = &weights[LAYER_WEIGHTS[l]];
+                offset -= 2*out;
+                for (int o = 0; o < out; o++)
+                    GRAD(grad+o) *= activationDerivative(activation, VALUE(offset+o), VALUE(offset+out+o));
+                for (int k = 0; k < in; k++) {
+                    float sum = 0.0f;
+                    for (int o = 0; o < out; o++)
+                        sum += GRAD(grad+o)*w[o*in+k];
+                    if (l == firstLayer)
+                        AEV_GRAD(k) += sum;
+                    else
+                        GRAD(nextGrad+k) = sum;
+                }
+                int swap = grad;
+                grad = nextGrad;
+                nextGrad = swap;
+            }
+        }
+        atom_add(energy, (long) (atomEnergy*FIXED_POINT_SCALE));
+    }
+}
+
+/**
+ * Apply the chain rule from the AEV gradients to the atom positions and add
+ * the forces to the context.
+ */
+__kernel void computeForces(__global const int* restrict species, __global const int* restrict neighbors,
+        __global const float4* restrict neighborDeltas, __global const int* restrict numNeighbors,
+        __global const int* restrict numAngularNeighbors, __global const int* restrict maxNeighbors,
+        int neighborCapacity, __global const float* restrict aevGrad, __global const int* restrict localIndex,
+        __global long* restrict forceBuffers) {
+    if (*maxNeighbors > neighborCapacity)
+        return;
+    for (int atom = get_global_id(0); atom < NUM_ATOMS; atom += get_global_size(0)) {
+        const int end = numNeighbors[atom], angularEnd = numAngularNeighbors[atom];
+        float3 atomGradient = (float3) 0.0f;
+
+        // Radial terms.
+
+        for (int j = 0; j < end; j++) {
+            float4 delta = neighborDeltas[j*NUM_ATOMS+atom];
+            float r = delta.w;
+            float fc = 0.5f*cos(r*RADIAL_SCALE) + 0.5f;
+            float dfc = -0.5f*RADIAL_SCALE*sin(r*RADIAL_SCALE);
+            int neighbor = neighbors[j*NUM_ATOMS+atom];
+            int block = species[neighbor]*RADIAL_SUB_LENGTH;
+            float dEdr = 0.0f;
+            for (int a = 0; a < NUM_ETA_R; a++)
+                for (int k = 0; k < NUM_SHF_R; k++) {
+                    float dr = r-SHF_R[k];
+                    float g = 0.25f*exp(-ETA_R[a]*dr*dr);
+                    dEdr += AEV_GRAD(block+a*NUM_SHF_R+k)*g*(dfc - 2.0f*ETA_R[a]*dr*fc);
+                }
+            float3 g = dEdr*delta.xyz/r;
+            addGradient(forceBuffers, localIndex[neighbor], g);
+            atomGradient -= g;
+        }
+
+        // Angular terms.  For every triple the AEV gradient is contracted with the
+        // derivatives of the angular and distance factors, and the result is
+        // applied through the derivatives of the angle and the two distances.
+
+        float f1[NUM_ZETA*NUM_SHF_Z], df1[NUM_ZETA*NUM_SHF_Z], f2[NUM_ETA_A*NUM_SHF_A], df2[NUM_ETA_A*NUM_SHF_A];
+        for (int j = 0; j < angularEnd; j++) {
+            float4 deltaJ = neighborDeltas[j*NUM_ATOMS+atom];
+            float fcj = 0.5f*cos(deltaJ.w*ANGULAR_SCALE) + 0.5f;
+            float dfcj = -0.5f*ANGULAR_SCALE*sin(deltaJ.w*ANGULAR_SCALE);
+            int neighborJ = neighbors[j*NUM_ATOMS+atom];
+            float3 gradientJ = (float3) 0.0f;
+            for (int k = j+1; k < angularEnd; k++) {
+                float4 deltaK = neighborDeltas[k*NUM_ATOMS+atom];
+                float fck = 0.5f*cos(deltaK.w*ANGULAR_SCALE) + 0.5f;
+                float dfck = -0.5f*ANGULAR_SCALE*sin(deltaK.w*ANGULAR_SCALE);
+                int neighborK = neighbors[k*NUM_ATOMS+atom];
+                float c = dot(deltaJ.xyz, deltaK.xyz)/(deltaJ.w*deltaK.w);
+                float cosAngle = 0.95f*c;
+                float sinAngle = sqrt(max(0.0f, 1.0f-cosAngle*cosAngle));
+                float dAngledc = (sinAngle > 0.0f ? -0.95f/sinAngle : 0.0f);
+                float meanR = 0.5f*(deltaJ.w+deltaK.w);
+                for (int z = 0; z < NUM_ZETA; z++)
+                    for (int n = 0; n < NUM_SHF_Z; n++) {
+                        float u = 0.5f*(1.0f + cosAngle*COS_SHF_Z[n] + sinAngle*SIN_SHF_Z[n]);
+                        float p = pow(u, ZETA[z]-1.0f);
+                        float sinDiff = sinAngle*COS_SHF_Z[n] - cosAngle*SIN_SHF_Z[n];
+                        f1[z*NUM_SHF_Z+n] = p*u;
+                        df1[z*NUM_SHF_Z+n] = -0.5f*ZETA[z]*p*sinDiff*dAngledc;
+                    }
+                for (int a = 0; a < NUM_ETA_A; a++)
+                    for (int m = 0; m < NUM_SHF_A; m++) {
+                        float dr = meanR-SHF_A[m];
+                        f2[a*NUM_SHF_A+m] = exp(-ETA_A[a]*dr*dr);
+                        df2[a*NUM_SHF_A+m] = -2.0f*ETA_A[a]*dr*f2[a*NUM_SHF_A+m];
+                    }
+                int block = RADIAL_LENGTH + PAIR_INDEX[species[neighborJ]*NUM_SPECIES + species[neighborK]]*ANGULAR_SUB_LENGTH;
+                float g1 = 0.0f, gc = 0.0f, gr = 0.0f;
+                for (int a = 0; a < NUM_ETA_A; a++)
+                    for (int z = 0; z < NUM_ZETA; z++)
+                        for (int m = 0; m < NUM_SHF_A; m++) {
+                            int g = block + ((a*NUM_ZETA+z)*NUM_SHF_A+m)*NUM_SHF_Z;
+                            float sum1 = 0.0f, sumc = 0.0f;
+                            for (int n = 0; n < NUM_SHF_Z; n++) {
+                                sum1 += AEV_GRAD(g+n)*f1[z*NUM_SHF_Z+n];
+                                sumc += AEV_GRAD(g+n)*df1[z*NUM_SHF_Z+n];
+                            }
+                            g1 += sum1*f2[a*NUM_SHF_A+m];
+                            gc += sumc*f2[a*NUM_SHF_A+m];
+                            gr += sum1*df2[a*NUM_SHF_A+m];
+                        }
+                float dEdc = 2.0f*fcj*fck*gc;
+                float dEdrj = fcj*fck*gr + 2.0f*g1*dfcj*fck;
+                float dEdrk = fcj*fck*gr + 2.0f*g1*fcj*dfck;
+                float3 uj = deltaJ.xyz/deltaJ.w, uk = deltaK.xyz/deltaK.w;
+                float3 gj = dEdrj*uj + dEdc*(uk-c*uj)/deltaJ.w;
+                float3 gk = dEdrk*uk + dEdc*(uj-c*uk)/deltaK.w;
+                addGradient(forceBuffers, localIndex[neighborK], gk);
+                gradientJ += gj;
+                atomGradient -= gj+gk;
+            }
+            addGradient(forceBuffers, localIndex[neighborJ], gradientJ);
+        }
+        addGradient(forceBuffers, localIndex[atom], atomGradient);
+    }
+}
@@ -0,0 +1,208 @@
+/* -------------------------------------------------------------------------- *
+ * The MIT License
+ * 
+ * SPDX short identifier: MIT
+ * 
+ * Copyright 2019 Genentech Inc. South San Francisco
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a 
+ * copy of this software and associated documentation files (the "Software"), 
+ * to deal in the Software without restriction, including without limitation 
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense, 
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included 
+ * in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS 
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER 
+ * DEALINGS IN THE SOFTWARE.
+ * -------------------------------------------------------------------------- */
+/* -------------------------------------------------------------------------- *
+ * Portions of this software were derived from code originally developed
+ * by Peter Eastman and copyrighted by Stanford University and the Authors
+ * -------------------------------------------------------------------------- */
+
+/**
+ * This tests the OpenCL implementation of ANIForce.  TestOpenCLANIGolden
+ * checks its accuracy.
+ */
+
+#include "ANIForce.h"
+#include "openmm/internal/AssertionUtilities.h"
+#include "openmm/Context.h"
+#include "openmm/OpenMMException.h"
+#include "openmm/Platform.h"
+#include "openmm/System.h"
+#include "openmm/VerletIntegrator.h"
+#include "sfmt/SFMT.h"
+
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+using namespace ANIPlugin;
+using namespace OpenMM;
+using namespace std;
+
+extern "C" OPENMM_EXPORT void registerANIOpenCLKernelFactories();
+
+const string infoFile = "tests/testAniInfo.txt";
+
+/**
+ * Build a random cluster of H, C, N and O atoms with no two atoms closer than 0.1 nm.
+ */
+void createCluster(int numParticles, double size, System& system, vector<Vec3>& positions, vector<string>& symbols) {
+    const string elements[] = {"H", "C", "N", "O"};
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    while (positions.size() < numParticles) {
+        Vec3 pos = Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt))*size;
+        bool tooClose = false;
+        for (const Vec3& other : positions)
+            if ((pos-other).dot(pos-other) < 0.01)
+                tooClose = true;
+        if (tooClose)
+            continue;
+        system.addParticle(1.0);
+        positions.push_back(pos);
+        symbols.push_back(elements[positions.size()%4]);
+    }
+}
+
+void testFiniteDifferences() {
+    System system;
+    vector<Vec3> positions;
+    vector<string> symbols;
+    createCluster(10, 0.5, system, positions, symbols);
+    ANIForce* force = new ANIForce(infoFile, symbols);
+    system.addForce(force);
+    VerletIntegrator integ(1.0);
+    Context context(system, integ, Platform::getPlatformByName("OpenCL"));
+    context.setPositions(positions);
+    State state = context.getState(State::Forces);
+
+    // Displace each atom along its force and compare the energy change to the
+    // projected force.
+
+    const double delta = 1e-3;
+    for (int i = 0; i < positions.size(); i++) {
+        Vec3 f = state.getForces()[i];
+        double norm = sqrt(f.dot(f));
+        if (norm == 0.0)
+            continue;
+        Vec3 step = f*(delta/norm);
+        vector<Vec3> displaced = positions;
+        displaced[i] = positions[i]+step;
+        context.setPositions(displaced);
+        double e1 = context.getState(State::Energy).getPotentialEnergy();
+        displaced[i] = positions[i]-step;
+        context.setPositions(displaced);
+        double e2 = context.getState(State::Energy).getPotentialEnergy();
+        ASSERT_EQUAL_TOL(norm, (e2-e1)/(2*delta), 1e-2);
+    }
+}
+
+void testPeriodic() {
+    System system;
+    vector<Vec3> positions;
+    vector<string> symbols;
+    createCluster(30, 1.2, system, positions, symbols);
+    system.setDefaultPeriodicBoxVectors(Vec3(1.2, 0, 0), Vec3(0.2, 1.2, 0), Vec3(-0.1, 0.3, 1.2));
+    ANIForce* force = new ANIForce(infoFile, symbols);
+    force->setUsesPeriodicBoundaryConditions(true);
+    system.addForce(force);
+    VerletIntegrator integ(1.0);
+    Context context(system, integ, Platform::getPlatformByName("OpenCL"));
+    context.setPositions(positions);
+    State state1 = context.getState(State::Energy | State::Forces);
+
+    // Translating atoms by box vectors should not change anything.
+
+    for (int i = 0; i < positions.size(); i += 3)
+        positions[i] += Vec3(1.2*(i%2), -1.2, 2.4);
+    context.setPositions(positions);
+    State state2 = context.getState(State::Energy | State::Forces);
+    ASSERT_EQUAL_TOL(state1.getPotentialEnergy(), state2.getPotentialEnergy(), 1e-6);
+    for (int i = 0; i < positions.size(); i++)
+        ASSERT_EQUAL_VEC(state1.getForces()[i], state2.getForces()[i], 1e-4);
+}
+
+void testNeighborListGrowth() {
+    // Pack enough atoms into the box that the initial neighbor list is too small.
+
+    System system;
+    vector<Vec3> positions;
+    vector<string> symbols;
+    createCluster(250, 1.1, system, positions, symbols);
+    system.setDefaultPeriodicBoxVectors(Vec3(1.1, 0, 0), Vec3(0, 1.1, 0), Vec3(0, 0, 1.1));
+    ANIForce* force = new ANIForce(infoFile, symbols);
+    force->setUsesPeriodicBoundaryConditions(true);
+    system.addForce(force);
+    VerletIntegrator integ(1.0);
+    Context context(system, integ, Platform::getPlatformByName("OpenCL"));
+    context.setPositions(positions);
+    State state1 = context.getState(State::Energy | State::Forces);
+
+    // The sums are in fixed point, so the evaluation after the list has grown
+    // must reproduce the first one exactly.
+
+    State state2 = context.getState(State::Energy | State::Forces);
+    ASSERT_EQUAL(state1.getPotentialEnergy(), state2.getPotentialEnergy());
+    for (int i = 0; i < positions.size(); i++)
+        for (int j = 0; j < 3; j++)
+            ASSERT_EQUAL(state1.getForces()[i][j], state2.getForces()[i][j]);
+}
+
+void testUnsupportedOptions() {
+    // Options the OpenCL platform cannot provide must be rejected, not ignored.
+
+    for (int option = 0; option < 4; option++) {
+        System system;
+        vector<Vec3> positions;
+        vector<string> symbols;
+        createCluster(10, 0.5, system, positions, symbols);
+        ANIForce* force = new ANIForce(infoFile, symbols);
+        if (option == 0)
+            force->setServer("ani-server.sock");
+        else if (option == 1)
+            force->setNumDomainWorkers(2);
+        else if (option == 2)
+            force->setMaxMemory(100.0);
+        else
+            force->setUseSharedEngine(true);
+        system.addForce(force);
+        VerletIntegrator integ(1.0);
+        bool threw = false;
+        try {
+            Context context(system, integ, Platform::getPlatformByName("OpenCL"));
+        }
+        catch (const OpenMMException& e) {
+            threw = true;
+        }
+        ASSERT(threw);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        registerANIOpenCLKernelFactories();
+        if (argc > 1)
+            Platform::getPlatformByName("OpenCL").setPropertyDefaultValue("Precision", string(argv[1]));
+        testFiniteDifferences();
+        testPeriodic();
+        testNeighborListGrowth();
+        testUnsupportedOptions();
+    }
+    catch(const std::exception& e) {
+        cerr << "exception: " << e.what() << std::endl;
+        return 1;
+    }
+    cerr << "Done" << std::endl;
+    return 0;
+}
@@ -0,0 +1,341 @@
+/* -------------------------------------------------------------------------- *
+ * The MIT License
+ *
+ * SPDX short identifier: MIT
+ *
+ * Copyright 2019 Genentech Inc. South San Francisco
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ * -------------------------------------------------------------------------- */
+/* -------------------------------------------------------------------------- *
+ * Portions of this software were derived from code originally developed
+ * by Peter Eastman and copyrighted by Stanford University and the Authors
+ * -------------------------------------------------------------------------- */
+
+
+#include "ReferenceANIKernels.h"
+#include "internal/ANIModelLoader.h"
+#include "openmm/MonteCarloBarostat.h"
+#include "openmm/OpenMMException.h"
+#include "openmm/internal/ContextImpl.h"
+#include "openmm/reference/ReferencePlatform.h"
+#include <algorithm>
+#include <map>
+
+using namespace ANIPlugin;
+using namespace OpenMM;
+using namespace std;
+
+// How much a periodic system may shrink under a barostat before the cached
+// neighbor lists must be rebuilt.  This covers many trial moves of a Monte
+// Carlo barostat while adding only about 6% more candidate pairs.
+static const float BAROSTAT_SCALING_MARGIN = 0.02f;
+
+// Above this many bytes of stored AEVs and AEV gradients, computing the AEVs
+// tile by tile as the networks need them is faster than streaming them
+// through memory.  Both give identical results.
+static const size_t MAX_STORED_AEV_BYTES = 16<<20;
+
+static vector<Vec3>& extractPositions(ContextImpl& context) {
+    ReferencePlatform::PlatformData* data = reinterpret_cast<ReferencePlatform::PlatformData*>(context.getPlatformData());
+    return *((vector<Vec3>*) data->positions);
+}
+
+static vector<Vec3>& extractForces(ContextImpl& context) {
+    ReferencePlatform::PlatformData* data = reinterpret_cast<ReferencePlatform::PlatformData*>(context.getPlatformData());
+    return *((vector<Vec3>*) data->forces);
+}
+
+static map<string, double>& extractEnergyParameterDerivatives(ContextImpl& context) {
+    ReferencePlatform::PlatformData* data = reinterpret_cast<ReferencePlatform::PlatformData*>(context.getPlatformData());
+    return *((map<string, double>*) data->energyParameterDerivatives);
+}
+
+static Vec3* extractBoxVectors(ContextImpl& context) {
+    ReferencePlatform::PlatformData* data = reinterpret_cast<ReferencePlatform::PlatformData*>(context.getPlatformData());
+    return (Vec3*) data->periodicBoxVectors;
+}
+
+ReferenceCalcANIForceKernel::~ReferenceCalcANIForceKernel() {
+    if (alchemy != NULL)
+        delete alchemy;
+    if (frozenAtoms != NULL)
+        delete frozenAtoms;
+    if (chunks != NULL)
+        delete chunks;
+    if (recorder != NULL)
+        delete recorder;
+    if (engine != NULL)
+        delete engine;
+    if (domains != NULL)
+        delete domains;
+    if (client != NULL)
+        delete client;
+    if (service)
+        service->removeClient();
+}
+
+void ReferenceCalcANIForceKernel::initialize(const System& system, const ANIForce& force) {
+    atomSymbols = force.getAtomSymbols();
+    infoFile = force.getInfoFile();
+    if (atomSymbols.size() != system.getNumParticles())
+        throw OpenMMException("ANIForce: the number of atom symbols does not match the number of particles");
+    usePeriodic = force.usesPeriodicBoundaryConditions();
+    positions.resize(3*atomSymbols.size());
+    forces.resize(3*atomSymbols.size());
+    cell.resize(9);
+    batch.resize(1);
+    batch[0].symbols = &atomSymbols;
+    batch[0].positions = positions.data();
+    if (!force.getRecordingFile().empty()) {
+        if (!force.getAlchemicalSymbols().empty())
+            throw OpenMMException("ANIForce: the evaluations of an alchemical force cannot be recorded");
+        recorder = new ANIEvaluationLogWriter(force.getRecordingFile(), infoFile, atomSymbols, force.getRecordingInterval(),
+                                              (size_t) (force.getMaxRecordingSize()*(1<<20)));
+    }
+    maxMemory = force.getMaxMemory();
+    if (maxMemory > 0 && (force.getUseSharedEngine() || force.getNumDomainWorkers() > 0 || !force.getAlchemicalSymbols().empty()))
+        throw OpenMMException("ANIForce: a memory limit cannot be combined with a shared engine, domain workers or alchemical states");
+    if (!force.getServer().empty()) {
+        if (force.getUseSharedEngine() || force.getNumDomainWorkers() > 0 || maxMemory > 0 || !force.getAlchemicalSymbols().empty())
+            throw OpenMMException("ANIForce: a server cannot be combined with a shared engine, domain workers, a memory limit or alchemical states");
+        ANIModelLoader::discard(infoFile);
+        client = new ANIEvaluationClient(force.getServer(), infoFile, atomSymbols, force.getMaxBatchWait());
+        return;
+    }
+    if (!force.getAlchemicalSymbols().empty()) {
+        if (force.getUseSharedEngine() || force.getNumDomainWorkers() > 0)
+            throw OpenMMException("ANIForce: an alchemical force cannot use a shared engine or domain workers");
+        engine = new CpuANIEngine(*ANIModelLoader::get(force.getInfoFile()), numThreads);
+        alchemicalSymbols = force.getAlchemicalSymbols();
+        alchemy = new CpuANIAlchemy(*engine, atomSymbols, alchemicalSymbols);
+        lambdaParameter = force.getAlchemicalParameter();
+        return;
+    }
+    if (force.getUseSharedEngine()) {
+        service = ANIBatchingService::get(force.getInfoFile(), "CPU");
+        service->addClient();
+        maxBatchWait = force.getMaxBatchWait();
+        return;
+    }
+    if (force.getNumDomainWorkers() > 0) {
+        domains = new ANIDomainDecomposition(*ANIModelLoader::get(force.getInfoFile()), force.getNumDomainWorkers(), atomSymbols.size());
+        return;
+    }
+    shared_ptr<const ANIModel> model = ANIModelLoader::get(force.getInfoFile());
+    bool fuseAEVs = 2*sizeof(float)*atomSymbols.size()*model->getAEVLength() > MAX_STORED_AEV_BYTES;
+    engine = new CpuANIEngine(*model, numThreads, true, false, fuseAEVs);
+    if (maxMemory > 0)
+        chunks = new CpuANIChunks(*engine, atomSymbols, (size_t) (maxMemory*(1<<20)));
+
+    // Particles with zero mass never move, so the contributions of those far
+    // from any moving particle can be cached.
+
+    vector<char> isFrozen(atomSymbols.size());
+    for (int i = 0; i < atomSymbols.size(); i++)
+        isFrozen[i] = (system.getParticleMass(i) == 0.0);
+    if (chunks == NULL && find(isFrozen.begin(), isFrozen.end(), 1) != isFrozen.end())
+        frozenAtoms = new CpuANIFrozenAtoms(*engine, atomSymbols, isFrozen);
+
+    // A Monte Carlo barostat scales the whole system for each trial move.  It
+    // moves the centers of molecules, so the neighbor lists can only be scaled
+    // along with it if every atom is its own molecule.  That is checked once
+    // the Context knows its molecules.
+
+    if (usePeriodic)
+        for (int i = 0; i < system.getNumForces(); i++)
+            if (dynamic_cast<const MonteCarloBarostat*>(&system.getForce(i)) != NULL)
+                checkBarostat = true;
+
+    // Allocate everything execute() needs up front, unless memory is limited.
+    // Then the engine only ever grows to the size of the largest chunk.
+
+    if (chunks == NULL)
+        engine->reserve(atomSymbols.size());
+}
+
+void ReferenceCalcANIForceKernel::copyParametersToContext(ContextImpl& context, const ANIForce& force) {
+    if (force.getAtomSymbols() != atomSymbols)
+        throw OpenMMException("ANIForce: updateParametersInContext() cannot change the atom symbols");
+    if (force.getInfoFile() == infoFile)
+        return;
+
+    // A recording names the model in its header, so switching the model
+    // would leave evaluations of the new one attributed to the old one.
+
+    if (recorder != NULL)
+        throw OpenMMException("ANIForce: the model cannot be changed while evaluations are being recorded");
+
+    // The server loads the model and checks the atoms against it.
+
+    if (client != NULL) {
+        ANIModelLoader::discard(force.getInfoFile());
+        ANIEvaluationClient* newClient = new ANIEvaluationClient(force.getServer(), force.getInfoFile(), atomSymbols, force.getMaxBatchWait());
+        delete client;
+        client = newClient;
+        infoFile = force.getInfoFile();
+        return;
+    }
+    shared_ptr<const ANIModel> model = ANIModelLoader::get(force.getInfoFile());
+    for (const vector<string>* symbols : {&atomSymbols, &alchemicalSymbols})
+        for (const string& symbol : *symbols)
+            if (!symbol.empty() && model->getSpeciesIndex(symbol) == -1)
+                throw OpenMMException("ANI: the model does not support element "+symbol);
+
+    // Replace whatever evaluates the networks.  The engine keeps its threads
+    // and scratch memory, and the helpers built on it are cheap to recreate.
+
+    if (service) {
+        shared_ptr<ANIBatchingService> newService = ANIBatchingService::get(force.getInfoFile(), "CPU");
+        newService->addClient();
+        service->removeClient();
+        service = newService;
+    }
+    else if (domains != NULL) {
+        ANIDomainDecomposition* newDomains = new ANIDomainDecomposition(*model, domains->getNumWorkers(), atomSymbols.size());
+        delete domains;
+        domains = newDomains;
+    }
+    else {
+        // Build the helpers for the new model before releasing the old ones,
+        // so a model that cannot be used leaves the Context as it was.
+
+        ANIModel oldModel = engine->getModel();
+        CpuANIAlchemy* newAlchemy = NULL;
+        CpuANIFrozenAtoms* newFrozenAtoms = NULL;
+        CpuANIChunks* newChunks = NULL;
+        try {
+            engine->setModel(*model);
+            if (alchemy != NULL)
+                newAlchemy = new CpuANIAlchemy(*engine, atomSymbols, alchemicalSymbols);
+            if (frozenAtoms != NULL) {
+                vector<char> isFrozen(atomSymbols.size());
+                for (int i = 0; i < atomSymbols.size(); i++)
+                    isFrozen[i] = (context.getSystem().getParticleMass(i) == 0.0);
+                newFrozenAtoms = new CpuANIFrozenAtoms(*engine, atomSymbols, isFrozen);
+            }
+            if (chunks != NULL)
+                newChunks = new CpuANIChunks(*engine, atomSymbols, (size_t) (maxMemory*(1<<20)));
+        }
+        catch (...) {
+            delete newAlchemy;
+            delete newFrozenAtoms;
+            delete newChunks;
+            engine->setModel(oldModel);
+            throw;
+        }
+        if (alchemy != NULL) {
+            delete alchemy;
+            alchemy = newAlchemy;
+        }
+        if (frozenAtoms != NULL) {
+            delete frozenAtoms;
+            frozenAtoms = newFrozenAtoms;
+        }
+        if (chunks != NULL) {
+            delete chunks;
+            chunks = newChunks;
+        }
+        else
+            engine->reserve(atomSymbols.size());
+    }
+    infoFile = force.getInfoFile();
+}
+
+void ReferenceCalcANIForceKernel::copyPositions(ContextImpl& context) {
+    if (checkBarostat) {
+        checkBarostat = false;
+        bool atomsAreMolecules = true;
+        for (const vector<int>& molecule : context.getMolecules())
+            if (molecule.size() > 1)
+                atomsAreMolecules = false;
+        if (atomsAreMolecules)
+            engine->setScalingMargin(BAROSTAT_SCALING_MARGIN);
+    }
+    if (alchemy != NULL)
+        lambda = context.getParameter(lambdaParameter);
+    vector<Vec3>& pos = extractPositions(context);
+    int numParticles = atomSymbols.size();
+    for (int i = 0; i < numParticles; i++)
+        for (int j = 0; j < 3; j++)
+            positions[3*i+j] = pos[i][j]*NM_TO_ANGST;
+    if (usePeriodic) {
+        Vec3* box = extractBoxVectors(context);
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 3; j++)
+                cell[3*i+j] = box[i][j]*NM_TO_ANGST;
+        batch[0].cell = cell.data();
+    }
+}
+
+void ReferenceCalcANIForceKernel::evaluate() {
+    if (client != NULL)
+        client->computeBatch(batch);
+    else if (service)
+        service->evaluate(batch[0], maxBatchWait);
+    else if (domains != NULL)
+        domains->computeBatch(batch);
+    else if (alchemy != NULL) {
+        alchemy->compute(batch[0].positions, batch[0].cell, lambda, energyA, energyB, batch[0].forces, batch[0].virial);
+        batch[0].energy = (1-lambda)*energyA + lambda*energyB;
+    }
+    else if (frozenAtoms != NULL)
+        frozenAtoms->compute(batch[0]);
+    else if (chunks != NULL)
+        chunks->compute(batch[0]);
+    else
+        engine->computeBatch(batch);
+}
+
+double ReferenceCalcANIForceKernel::execute(ContextImpl& context, bool includeForces, bool includeEnergy) {
+    copyPositions(context);
+    batch[0].forces = (includeForces ? forces.data() : NULL);
+    bool record = (recorder != NULL && recorder->startCall());
+    evaluate();
+    if (record)
+        recorder->record(positions.data(), batch[0].cell, batch[0].energy, batch[0].forces);
+    if (alchemy != NULL)
+        extractEnergyParameterDerivatives(context)[lambdaParameter] += (energyB-energyA)*HARTREE_TO_KJ_MOL;
+    if (includeForces) {
+        vector<Vec3>& force = extractForces(context);
+        for (int i = 0; i < atomSymbols.size(); i++)
+            for (int j = 0; j < 3; j++)
+                force[i][j] += forces[3*i+j]*HARTREE_A_TO_KJ_MOL_NM;
+    }
+    return batch[0].energy*HARTREE_TO_KJ_MOL;
+}
+
+void ReferenceCalcANIForceKernel::computeVirial(ContextImpl& context, vector<Vec3>& virial) {
+    copyPositions(context);
+    double w[9];
+    batch[0].forces = NULL;
+    batch[0].virial = w;
+    evaluate();
+    batch[0].virial = NULL;
+    virial.resize(3);
+    for (int i = 0; i < 3; i++)
+        virial[i] = Vec3(w[3*i], w[3*i+1], w[3*i+2])*HARTREE_TO_KJ_MOL;
+}
+
+double ReferenceCalcANIForceKernel::getPeakMemory(ContextImpl& context) {
+    if (service || domains != NULL || client != NULL)
+        throw OpenMMException("ANIForce: the peak memory is not available with a shared engine, domain workers or a server");
+    size_t bytes = (chunks != NULL ? chunks->getPeakMemory() : engine->getMemoryUsage());
+    return bytes/(double) (1<<20);
+}
@@ -0,0 +1,139 @@
+#ifndef REFERENCE_ANI_KERNELS_H_
+#define REFERENCE_ANI_KERNELS_H_
+
+/* -------------------------------------------------------------------------- *
+ * The MIT License
+ *
+ * SPDX short identifier: MIT
+ *
+ * Copyright 2019 Genentech Inc. South San Francisco
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ * -------------------------------------------------------------------------- */
+/* -------------------------------------------------------------------------- *
+ * Portions of this software were derived from code originally developed
+ * by Peter Eastman and copyrighted by Stanford University and the Authors
+ * -------------------------------------------------------------------------- */
+
+
+#include "ANIKernels.h"
+#include "ANIEngine.h"
+#include "internal/ANIBatchingService.h"
+#include "internal/ANIDomainDecomposition.h"
+#include "internal/ANIEvaluationServer.h"
+#include "internal/ANIEvaluationLog.h"
+#include "internal/CpuANIAlchemy.h"
+#include "internal/CpuANIChunks.h"
+#include "internal/CpuANIEngine.h"
+#include "internal/CpuANIFrozenAtoms.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace ANIPlugin {
+
+/**
+ * This kernel is invoked by ANIForce to calculate the forces acting on the system and the energy of the system.
+ * It evaluates the networks with a CpuANIEngine, so neither NeuroChem nor a GPU is needed.
+ * If the force asks for a shared engine, the evaluations go to an ANIBatchingService instead,
+ * and if it asks for domain workers, to an ANIDomainDecomposition.  Alchemical forces
+ * evaluate both of their states with a CpuANIAlchemy, systems with frozen (zero mass)
+ * particles are evaluated with a CpuANIFrozenAtoms, and forces with a memory limit
+ * with a CpuANIChunks.  Forces that name a server are evaluated through an
+ * ANIEvaluationClient.
+ */
+class ReferenceCalcANIForceKernel : public CalcANIForceKernel {
+public:
+    /**
+     * Create the kernel.
+     *
+     * @param name        the name of the kernel
+     * @param platform    the Platform the kernel belongs to
+     * @param numThreads  the number of threads the CpuANIEngine should use.  If this is 0,
+     *                    it uses one thread per core.
+     */
+    ReferenceCalcANIForceKernel(std::string name, const OpenMM::Platform& platform, int numThreads=0) :
+            CalcANIForceKernel(name, platform), numThreads(numThreads), engine(NULL), domains(NULL), alchemy(NULL), frozenAtoms(NULL), chunks(NULL), recorder(NULL), client(NULL), checkBarostat(false) {
+    }
+    ~ReferenceCalcANIForceKernel();
+    /**
+     * Initialize the kernel.
+     * 
+     * @param system         the System this kernel will be applied to
+     * @param force          the ANIForce this kernel will be used for
+     */
+    void initialize(const OpenMM::System& system, const ANIForce& force);
+    /**
+     * Execute the kernel to calculate the forces and/or energy.
+     *
+     * @param context        the context in which to execute this kernel
+     * @param includeForces  true if forces should be calculated
+     * @param includeEnergy  true if the energy should be calculated
+     * @return the potential energy due to the force
+     */
+    double execute(OpenMM::ContextImpl& context, bool includeForces, bool includeEnergy);
+    /**
+     * Switch to the model of the force if it has changed.  The engine keeps its
+     * threads and scratch memory.
+     *
+     * @param context        the context to copy parameters to
+     * @param force          the ANIForce to copy the parameters from
+     */
+    void copyParametersToContext(OpenMM::ContextImpl& context, const ANIForce& force);
+    /**
+     * Compute the virial of the force for the current positions and box: the
+     * 3x3 tensor W[a][b] = sum r_a*f_b (in kJ/mol) over the displacements r
+     * between atoms and the forces f along them.
+     *
+     * @param context        the context in which to execute this kernel
+     * @param virial         on exit, the three rows of the virial
+     */
+    void computeVirial(OpenMM::ContextImpl& context, std::vector<OpenMM::Vec3>& virial);
+    /**
+     * Get the most scratch memory (in megabytes) that evaluating the force has
+     * used so far.
+     *
+     * @param context        the context in which to execute this kernel
+     */
+    double getPeakMemory(OpenMM::ContextImpl& context);
+private:
+    void copyPositions(OpenMM::ContextImpl& context);
+    void evaluate();
+    int numThreads;
+    CpuANIEngine* engine;
+    ANIDomainDecomposition* domains;
+    CpuANIAlchemy* alchemy;
+    CpuANIFrozenAtoms* frozenAtoms;
+    CpuANIChunks* chunks;
+    ANIEvaluationLogWriter* recorder;
+    ANIEvaluationClient* client;
+    std::string infoFile, lambdaParameter;
+    std::vector<std::string> alchemicalSymbols;
+    double lambda, energyA, energyB;
+    std::shared_ptr<ANIBatchingService> service;
+    double maxBatchWait, maxMemory;
+    std::vector<std::string> atomSymbols;
+    std::vector<float> positions, forces, cell;
+    std::vector<ANIEvaluation> batch;
+    bool usePeriodic, checkBarostat;
+};
+
+} // namespace ANIPlugin
+
+#endif /*REFERENCE_ANI_KERNELS_H_*/
@@ -0,0 +1,71 @@
+#ifndef OPENMM_ANI_TEST_MOLECULES_H_
+#define OPENMM_ANI_TEST_MOLECULES_H_
+
+/* -------------------------------------------------------------------------- *
+ * The MIT License
+ *
+ * SPDX short identifier: MIT
+ *
+ * Copyright 2019 Genentech Inc. South San Francisco
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ * -------------------------------------------------------------------------- */
+
+/**
+ * Molecules shared by several of the tests.
+ */
+
+#include "ANIEngine.h"
+#include "ANIOptimizer.h"
+#include "openmm/Vec3.h"
+#include "openmm/internal/AssertionUtilities.h"
+#include <cmath>
+#include <string>
+#include <vector>
+
+namespace ANIPlugin {
+
+/**
+ * Build ammonia (symbols N, H, H, H) with its symmetry axis along z, minimize it, and
+ * center it on the origin.  Without distortion the structure keeps its threefold
+ * symmetry, so the inverted structure is its mirror image through the xy plane.  The
+ * test model's true minimum is not symmetric; a distortion of 1 lets the optimizer
+ * find it.
+ */
+inline std::vector<OpenMM::Vec3> createAmmonia(ANIEngine& engine, const std::vector<std::string>& symbols, double distortion=0.0) {
+    std::vector<OpenMM::Vec3> positions = {OpenMM::Vec3(0.001*distortion, -0.002*distortion, 0.01)};
+    for (int i = 0; i < 3; i++)
+        positions.push_back(OpenMM::Vec3(0.095*cos(2*M_PI*i/3+0.1*i*distortion), (0.095+0.005*distortion)*sin(2*M_PI*i/3), -0.035+0.002*i*distortion));
+    ANIOptimizer optimizer(engine);
+    optimizer.setTolerance(0.01);
+    optimizer.addMolecule(symbols, positions);
+    optimizer.minimize();
+    ASSERT(optimizer.isConverged(0));
+    positions = optimizer.getPositions(0);
+    OpenMM::Vec3 center;
+    for (const OpenMM::Vec3& pos : positions)
+        center += pos/positions.size();
+    for (OpenMM::Vec3& pos : positions)
+        pos -= center;
+    return positions;
+}
+
+} // namespace ANIPlugin
+
+#endif /*OPENMM_ANI_TEST_MOLECULES_H_*/
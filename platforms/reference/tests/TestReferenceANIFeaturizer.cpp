@@ -0,0 +1,189 @@
+/* -------------------------------------------------------------------------- *
+ * The MIT License
+ *
+ * SPDX short identifier: MIT
+ *
+ * Copyright 2019 Genentech Inc. South San Francisco
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ * -------------------------------------------------------------------------- */
+
+/**
+ * This tests the AEV export of CpuANIEngine and the files written by ANIFeaturizer.
+ */
+
+#include "ANIFeaturizer.h"
+#include "internal/CpuANIEngine.h"
+#include "openmm/internal/AssertionUtilities.h"
+#include "sfmt/SFMT.h"
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace ANIPlugin;
+using namespace OpenMM;
+using namespace std;
+
+const string infoFile = "tests/golden/aniInfo.txt";
+
+void testLayout() {
+    // An O-H pair within the angular cutoff: each atom has a single neighbor,
+    // so only the radial block of the other atom's species is filled.
+
+    CpuANIEngine engine(ANIModelInfo::read(infoFile), 1);
+    const ANIModel& model = engine.getModel();
+    const int aevLength = engine.getAEVLength();
+    ASSERT_EQUAL(model.getAEVLength(), aevLength);
+    vector<string> symbols = {"O", "H"};
+    vector<float> positions = {0, 0, 0, 0.9f, 0.3f, 0.1f};
+    vector<float> aevs(2*aevLength);
+    vector<ANIEvaluation> batch(1);
+    batch[0].symbols = &symbols;
+    batch[0].positions = positions.data();
+    engine.computeAEVs(batch, {aevs.data()});
+    const int radialSubLength = model.getRadialSubLength();
+    for (int atom = 0; atom < 2; atom++) {
+        int neighborSpecies = model.getSpeciesIndex(symbols[1-atom]);
+        for (int k = 0; k < aevLength; k++) {
+            bool inNeighborBlock = (k/radialSubLength == neighborSpecies);
+            if (!inNeighborBlock)
+                ASSERT_EQUAL(0.0f, aevs[atom*aevLength+k]);
+        }
+        float sum = 0;
+        for (int k = 0; k < radialSubLength; k++)
+            sum += aevs[atom*aevLength+neighborSpecies*radialSubLength+k];
+        ASSERT(sum > 0.0f);
+    }
+
+    // The pair is symmetric, so both radial blocks hold the same values.
+
+    for (int k = 0; k < radialSubLength; k++)
+        ASSERT_EQUAL(aevs[model.getSpeciesIndex("H")*radialSubLength+k], aevs[aevLength+model.getSpeciesIndex("O")*radialSubLength+k]);
+}
+
+void createMolecule(int numAtoms, OpenMM_SFMT::SFMT& sfmt, vector<string>& symbols, vector<float>& positions) {
+    const char* elements[] = {"H", "C", "N", "O"};
+    symbols.clear();
+    positions.clear();
+    for (int i = 0; i < numAtoms; i++) {
+        symbols.push_back(elements[i%4]);
+        for (int j = 0; j < 3; j++)
+            positions.push_back(1.5f*i*(j == 0) + (float) genrand_real2(sfmt));
+    }
+}
+
+void testFile() {
+    // Write structures of different sizes, in more than one batch.
+
+    const int numStructures = 7;
+    const string fileName = "testFeaturizer.aev";
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    vector<vector<string> > symbols(numStructures);
+    vector<vector<float> > positions(numStructures);
+    float cell[9] = {12, 0, 0, 0, 12, 0, 1, 0, 12};
+    int aevLength;
+    vector<string> species;
+    {
+        ANIFeaturizer featurizer(infoFile, fileName, 3, 2);
+        aevLength = featurizer.getAEVLength();
+        species = featurizer.getSpecies();
+        for (int i = 0; i < numStructures; i++) {
+            createMolecule(3+2*i, sfmt, symbols[i], positions[i]);
+            featurizer.addStructure(symbols[i], positions[i].data(), i%2 == 1 ? cell : NULL);
+        }
+        ASSERT_EQUAL(numStructures, featurizer.getNumStructures());
+        featurizer.close();
+    }
+
+    // Read the file back and compare it to the AEVs the engine computes.
+
+    ifstream in(fileName, ios::binary);
+    vector<char> data((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+    ASSERT_EQUAL(0, memcmp(data.data(), "ANIAEV", 6));
+    int header[4];
+    long long counts[3];
+    memcpy(header, &data[8], sizeof(header));
+    memcpy(counts, &data[24], sizeof(counts));
+    ASSERT_EQUAL(1, header[0]);
+    ASSERT_EQUAL(aevLength, header[1]);
+    ASSERT_EQUAL(species.size(), header[2]);
+    ASSERT_EQUAL(0, header[3]%64);
+    ASSERT_EQUAL(numStructures, counts[0]);
+    ASSERT_EQUAL(0, counts[2]%64);
+    for (int s = 0; s < species.size(); s++)
+        ASSERT_EQUAL(species[s], string(&data[64+4*s]));
+    vector<long long> offsets(numStructures+1);
+    memcpy(offsets.data(), &data[counts[2]], offsets.size()*sizeof(long long));
+    const signed char* atomSpecies = (const signed char*) &data[counts[2]+offsets.size()*sizeof(long long)];
+    ASSERT_EQUAL(counts[1], offsets.back());
+    ASSERT_EQUAL(counts[2]+offsets.size()*sizeof(long long)+counts[1], data.size());
+    CpuANIEngine engine(ANIModelInfo::read(infoFile), 1);
+    for (int i = 0; i < numStructures; i++) {
+        int numAtoms = symbols[i].size();
+        ASSERT_EQUAL(numAtoms, offsets[i+1]-offsets[i]);
+        vector<float> expected(numAtoms*aevLength);
+        vector<ANIEvaluation> batch(1);
+        batch[0].symbols = &symbols[i];
+        batch[0].positions = positions[i].data();
+        batch[0].cell = (i%2 == 1 ? cell : NULL);
+        engine.computeAEVs(batch, {expected.data()});
+        const float* aevs = (const float*) &data[header[3]+offsets[i]*aevLength*sizeof(float)];
+        for (int j = 0; j < numAtoms*aevLength; j++)
+            ASSERT_EQUAL(expected[j], aevs[j]);
+        for (int j = 0; j < numAtoms; j++)
+            ASSERT_EQUAL(symbols[i][j], species[atomSpecies[offsets[i]+j]]);
+    }
+    remove(fileName.c_str());
+}
+
+void testUnknownElement() {
+    const string fileName = "testFeaturizer.aev";
+    ANIFeaturizer featurizer(infoFile, fileName);
+    vector<string> symbols = {"O", "Xe"};
+    vector<float> positions = {0, 0, 0, 1, 0, 0};
+    bool threw = false;
+    try {
+        featurizer.addStructure(symbols, positions.data(), NULL);
+    }
+    catch (const OpenMMException& e) {
+        threw = true;
+    }
+    ASSERT(threw);
+    ASSERT_EQUAL(0, featurizer.getNumStructures());
+    featurizer.close();
+    remove(fileName.c_str());
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        testLayout();
+        testFile();
+        testUnknownElement();
+    }
+    catch(const std::exception& e) {
+        cerr << "exception: " << e.what() << std::endl;
+        return 1;
+    }
+    cerr << "Done" << std::endl;
+    return 0;
+}
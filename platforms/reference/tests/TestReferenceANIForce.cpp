@@ -0,0 +1,1554 @@
+/* -------------------------------------------------------------------------- *
+ * The MIT License
+ *
+ * SPDX short identifier: MIT
+ *
+ * Copyright 2019 Genentech Inc. South San Francisco
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ * -------------------------------------------------------------------------- */
+/* -------------------------------------------------------------------------- *
+ * Portions of this software were derived from code originally developed
+ * by Peter Eastman and copyrighted by Stanford University and the Authors
+ * -------------------------------------------------------------------------- */
+
+/**
+ * This tests the Reference and CPU implementation of ANIForce.
+ */
+
+#include "ANIForce.h"
+#include "internal/ANIBatchingService.h"
+#include "internal/ANIDomainDecomposition.h"
+#include "internal/ANIEvaluationServer.h"
+#include "internal/ANIEvaluationLog.h"
+#include "internal/ANIModelLoader.h"
+#include "internal/CpuANIChunks.h"
+#include "internal/CpuANIEngine.h"
+#include "internal/CpuANIFrozenAtoms.h"
+#include "openmm/internal/AssertionUtilities.h"
+#include "openmm/Context.h"
+#include "openmm/HarmonicBondForce.h"
+#include "openmm/MonteCarloBarostat.h"
+#include "openmm/OpenMMException.h"
+#include "openmm/Platform.h"
+#include "openmm/System.h"
+#include "openmm/VerletIntegrator.h"
+#include "sfmt/SFMT.h"
+
+#include <algorithm>
+#include <bzlib.h>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <new>
+#include <thread>
+#include <vector>
+#include <sys/stat.h>
+
+using namespace ANIPlugin;
+using namespace OpenMM;
+using namespace std;
+
+extern "C" OPENMM_EXPORT void registerANIReferenceKernelFactories();
+
+const string infoFile = "tests/testAniInfo.txt";
+string platformName = "Reference";
+
+// Replacing the global operator new lets tests count heap allocations.
+
+static bool countAllocations = false;
+static long long numAllocations = 0;
+
+void* operator new(size_t size) {
+    if (countAllocations)
+        numAllocations++;
+    void* pointer = malloc(size > 0 ? size : 1);
+    if (pointer == NULL)
+        throw bad_alloc();
+    return pointer;
+}
+
+void operator delete(void* pointer) noexcept {
+    free(pointer);
+}
+
+/**
+ * Build a random molecule-sized cluster of H, C, N and O atoms with no two atoms closer than 0.1 nm.
+ */
+void createCluster(int numParticles, double size, System& system, vector<Vec3>& positions, vector<string>& symbols) {
+    const string elements[] = {"H", "C", "N", "O"};
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    while (positions.size() < numParticles) {
+        Vec3 pos = Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt))*size;
+        bool tooClose = false;
+        for (const Vec3& other : positions)
+            if ((pos-other).dot(pos-other) < 0.01)
+                tooClose = true;
+        if (tooClose)
+            continue;
+        system.addParticle(1.0);
+        positions.push_back(pos);
+        symbols.push_back(elements[positions.size()%4]);
+    }
+}
+
+void testSpecializedMatchesGeneric() {
+    System system;
+    vector<Vec3> positions;
+    vector<string> symbols;
+    createCluster(20, 0.7, system, positions, symbols);
+    ANIForce* force = new ANIForce(infoFile, symbols);
+    system.addForce(force);
+    VerletIntegrator integ(1.0);
+    Context context(system, integ, Platform::getPlatformByName(platformName));
+    context.setPositions(positions);
+    State state = context.getState(State::Energy | State::Forces);
+
+    // Evaluate the same structure with the generic layout.
+
+    CpuANIEngine engine(ANIModelInfo::read(infoFile), 1, false);
+    ASSERT(!engine.isSpecialized());
+    vector<float> aniPositions, aniForces(3*positions.size());
+    for (const Vec3& pos : positions)
+        for (int j = 0; j < 3; j++)
+            aniPositions.push_back(pos[j]*NM_TO_ANGST);
+    vector<ANIEvaluation> batch(1);
+    batch[0].symbols = &symbols;
+    batch[0].positions = aniPositions.data();
+    batch[0].forces = aniForces.data();
+    engine.computeBatch(batch);
+    ASSERT_EQUAL_TOL(batch[0].energy*HARTREE_TO_KJ_MOL, state.getPotentialEnergy(), 1e-6);
+    for (int i = 0; i < positions.size(); i++) {
+        Vec3 expected(aniForces[3*i], aniForces[3*i+1], aniForces[3*i+2]);
+        ASSERT_EQUAL_VEC(expected*HARTREE_A_TO_KJ_MOL_NM, state.getForces()[i], 1e-4);
+    }
+}
+
+void testFastActivations() {
+    System system;
+    vector<Vec3> positions;
+    vector<string> symbols;
+    createCluster(50, 1.0, system, positions, symbols);
+    vector<float> aniPositions;
+    for (const Vec3& pos : positions)
+        for (int j = 0; j < 3; j++)
+            aniPositions.push_back(pos[j]*NM_TO_ANGST);
+
+    // The fast exp() has a relative error of a few 1e-6, which should change
+    // the energy by far less than the accuracy of the model itself.
+
+    ANIModelInfo info = ANIModelInfo::read(infoFile);
+    CpuANIEngine accurate(info, 1, true, false);
+    CpuANIEngine fast(info, 1, true, true);
+    vector<float> accurateForces(aniPositions.size()), fastForces(aniPositions.size());
+    vector<ANIEvaluation> batch(1);
+    batch[0].symbols = &symbols;
+    batch[0].positions = aniPositions.data();
+    batch[0].forces = accurateForces.data();
+    accurate.computeBatch(batch);
+    double accurateEnergy = batch[0].energy;
+    batch[0].forces = fastForces.data();
+    fast.computeBatch(batch);
+    double fastEnergy = batch[0].energy;
+    double deviation = fabs(fastEnergy-accurateEnergy)*HARTREE_TO_KJ_MOL/positions.size();
+    cerr << "Fast activations change the energy by " << deviation << " kJ/mol per atom" << endl;
+    ASSERT(deviation < 1e-3);
+    for (int i = 0; i < positions.size(); i++) {
+        Vec3 f1(accurateForces[3*i], accurateForces[3*i+1], accurateForces[3*i+2]);
+        Vec3 f2(fastForces[3*i], fastForces[3*i+1], fastForces[3*i+2]);
+        ASSERT_EQUAL_VEC(f1, f2, 1e-4);
+    }
+}
+
+void testFusedAEVs() {
+    System system;
+    vector<Vec3> positions;
+    vector<string> symbols;
+    createCluster(60, 1.0, system, positions, symbols);
+    vector<float> aniPositions;
+    for (const Vec3& pos : positions)
+        for (int j = 0; j < 3; j++)
+            aniPositions.push_back(pos[j]*NM_TO_ANGST);
+
+    // Computing the AEVs tile by tile does the same arithmetic in the same
+    // order as storing them, so the results must be bitwise identical.
+
+    ANIModelInfo info = ANIModelInfo::read(infoFile);
+    for (int numThreads = 1; numThreads <= 3; numThreads += 2) {
+        CpuANIEngine stored(info, numThreads);
+        CpuANIEngine fused(info, numThreads, true, false, true);
+        vector<float> storedForces(aniPositions.size()), fusedForces(aniPositions.size());
+        double storedVirial[9], fusedVirial[9];
+        vector<ANIEvaluation> batch(1);
+        batch[0].symbols = &symbols;
+        batch[0].positions = aniPositions.data();
+        batch[0].forces = storedForces.data();
+        batch[0].virial = storedVirial;
+        stored.computeBatch(batch);
+        double storedEnergy = batch[0].energy;
+        batch[0].forces = fusedForces.data();
+        batch[0].virial = fusedVirial;
+        fused.computeBatch(batch);
+        ASSERT_EQUAL(storedEnergy, batch[0].energy);
+        for (int i = 0; i < storedForces.size(); i++)
+            ASSERT_EQUAL(storedForces[i], fusedForces[i]);
+        for (int i = 0; i < 9; i++)
+            ASSERT_EQUAL(storedVirial[i], fusedVirial[i]);
+    }
+}
+
+void testSplineTables() {
+    System system;
+    vector<Vec3> positions;
+    vector<string> symbols;
+    createCluster(60, 1.0, system, positions, symbols);
+    vector<float> aniPositions;
+    for (const Vec3& pos : positions)
+        for (int j = 0; j < 3; j++)
+            aniPositions.push_back(pos[j]*NM_TO_ANGST);
+
+    // The tables reproduce the AEVs to about 1e-6 of their size, so the
+    // energies and forces must agree with the analytic functions as closely
+    // as the golden test requires of the analytic functions themselves.
+
+    ANIModelInfo info = ANIModelInfo::read(infoFile);
+    for (bool specialized : {true, false}) {
+        CpuANIEngine analytic(info, 1, specialized);
+        CpuANIEngine tabulated(info, 1, specialized, false, false, true);
+        int aevLength = analytic.getAEVLength();
+        vector<float> analyticAEVs(symbols.size()*aevLength), tabulatedAEVs(symbols.size()*aevLength);
+        vector<ANIEvaluation> batch(1);
+        batch[0].symbols = &symbols;
+        batch[0].positions = aniPositions.data();
+        analytic.computeAEVs(batch, vector<float*>(1, analyticAEVs.data()));
+        tabulated.computeAEVs(batch, vector<float*>(1, tabulatedAEVs.data()));
+        for (int i = 0; i < analyticAEVs.size(); i++)
+            ASSERT_EQUAL_TOL(analyticAEVs[i], tabulatedAEVs[i], 1e-5);
+        vector<float> analyticForces(aniPositions.size()), tabulatedForces(aniPositions.size());
+        batch[0].forces = analyticForces.data();
+        analytic.computeBatch(batch);
+        double analyticEnergy = batch[0].energy;
+        batch[0].forces = tabulatedForces.data();
+        tabulated.computeBatch(batch);
+        ASSERT(fabs(batch[0].energy-analyticEnergy)/symbols.size() < 5e-8);
+        for (int i = 0; i < positions.size(); i++) {
+            Vec3 f1(analyticForces[3*i], analyticForces[3*i+1], analyticForces[3*i+2]);
+            Vec3 f2(tabulatedForces[3*i], tabulatedForces[3*i+1], tabulatedForces[3*i+2]);
+            ASSERT_EQUAL_VEC(f1, f2, 1e-5);
+        }
+    }
+
+    // Gaussians far narrower than the grid cannot be tabulated to that
+    // accuracy, which must be reported rather than silently accepted.
+
+    ANIModel narrow = ANIModel::load(info);
+    narrow.etaR[0] = 1e4;
+    bool threw = false;
+    try {
+        CpuANIEngine tabulated(narrow, 1, true, false, false, true);
+    }
+    catch (const OpenMMException& e) {
+        threw = true;
+    }
+    ASSERT(threw);
+}
+
+void testSparseEnvironments() {
+    System system;
+    vector<Vec3> positions;
+    vector<string> symbols;
+    createCluster(40, 1.0, system, positions, symbols);
+
+    // Build two clusters far apart, one without O and one without N, so the
+    // atoms of each species have different AEV blocks that are zero.
+    // Evaluating them together must give the same results as evaluating each
+    // cluster alone.
+
+    vector<vector<string> > clusterSymbols(2);
+    vector<vector<float> > clusterPositions(2);
+    vector<string> allSymbols;
+    vector<float> allPositions;
+    for (int c = 0; c < 2; c++)
+        for (int i = 0; i < positions.size(); i++) {
+            string symbol = symbols[i];
+            if (symbol == (c == 0 ? "O" : "N"))
+                symbol = "C";
+            clusterSymbols[c].push_back(symbol);
+            allSymbols.push_back(symbol);
+            for (int j = 0; j < 3; j++) {
+                float x = (positions[i][j] + (j == 0 ? 3.0*c : 0.0))*NM_TO_ANGST;
+                clusterPositions[c].push_back(x);
+                allPositions.push_back(x);
+            }
+        }
+    CpuANIEngine engine(ANIModelInfo::read(infoFile), 1);
+    vector<float> allForces(allPositions.size());
+    vector<ANIEvaluation> batch(1);
+    batch[0].symbols = &allSymbols;
+    batch[0].positions = allPositions.data();
+    batch[0].forces = allForces.data();
+    engine.computeBatch(batch);
+    double allEnergy = batch[0].energy;
+    double energy = 0;
+    for (int c = 0; c < 2; c++) {
+        vector<float> forces(clusterPositions[c].size());
+        batch[0].symbols = &clusterSymbols[c];
+        batch[0].positions = clusterPositions[c].data();
+        batch[0].forces = forces.data();
+        engine.computeBatch(batch);
+        energy += batch[0].energy;
+        for (int i = 0; i < forces.size(); i++)
+            ASSERT_EQUAL_TOL(forces[i], allForces[c*forces.size()+i], 1e-5);
+    }
+    ASSERT_EQUAL_TOL(energy, allEnergy, 1e-10);
+}
+
+void testSpatialOrder() {
+    System system;
+    vector<Vec3> positions;
+    vector<string> symbols;
+    createCluster(150, 1.5, system, positions, symbols);
+    vector<float> aniPositions;
+    for (const Vec3& pos : positions)
+        for (int j = 0; j < 3; j++)
+            aniPositions.push_back(pos[j]*NM_TO_ANGST);
+    float cell[9] = {15.0f, 0, 0, 0, 15.0f, 0, 0, 0, 15.0f};
+
+    // Processing the atoms in Morton order instead of index order must not
+    // change a single bit, with or without periodic boundary conditions.
+
+    ANIModelInfo info = ANIModelInfo::read(infoFile);
+    for (bool periodic : {false, true})
+        for (int numThreads = 1; numThreads <= 3; numThreads += 2) {
+            CpuANIEngine indexed(info, numThreads);
+            CpuANIEngine sorted(info, numThreads);
+            indexed.setSortingThreshold(positions.size()+1);
+            sorted.setSortingThreshold(1);
+            vector<float> indexedForces(aniPositions.size()), sortedForces(aniPositions.size());
+            double indexedVirial[9], sortedVirial[9];
+            vector<ANIEvaluation> batch(1);
+            batch[0].symbols = &symbols;
+            batch[0].positions = aniPositions.data();
+            batch[0].cell = (periodic ? cell : NULL);
+            batch[0].forces = indexedForces.data();
+            batch[0].virial = indexedVirial;
+            indexed.computeBatch(batch);
+            double indexedEnergy = batch[0].energy;
+            batch[0].forces = sortedForces.data();
+            batch[0].virial = sortedVirial;
+            sorted.computeBatch(batch);
+            ASSERT_EQUAL(indexedEnergy, batch[0].energy);
+            for (int i = 0; i < indexedForces.size(); i++)
+                ASSERT_EQUAL(indexedForces[i], sortedForces[i]);
+            for (int i = 0; i < 9; i++)
+                ASSERT_EQUAL(indexedVirial[i], sortedVirial[i]);
+        }
+}
+
+void testThreadDeterminism() {
+    System system;
+    vector<Vec3> positions;
+    vector<string> symbols;
+    createCluster(50, 1.0, system, positions, symbols);
+    vector<float> aniPositions;
+    for (const Vec3& pos : positions)
+        for (int j = 0; j < 3; j++)
+            aniPositions.push_back(pos[j]*NM_TO_ANGST);
+    ANIModelInfo info = ANIModelInfo::read(infoFile);
+    vector<float> expectedForces(aniPositions.size());
+    vector<ANIEvaluation> batch(1);
+    batch[0].symbols = &symbols;
+    batch[0].positions = aniPositions.data();
+    batch[0].forces = expectedForces.data();
+    CpuANIEngine serial(info, 1);
+    serial.computeBatch(batch);
+    double expectedEnergy = batch[0].energy;
+
+    // Forces are summed in fixed point, so splitting one structure between
+    // any number of threads must give exactly the same bits every time.
+
+    for (int numThreads = 2; numThreads <= 4; numThreads++) {
+        CpuANIEngine engine(info, numThreads);
+        for (int repeat = 0; repeat < 3; repeat++) {
+            vector<float> forces(aniPositions.size());
+            batch[0].forces = forces.data();
+            engine.computeBatch(batch);
+            ASSERT_EQUAL(expectedEnergy, batch[0].energy);
+            for (int i = 0; i < forces.size(); i++)
+                ASSERT_EQUAL(expectedForces[i], forces[i]);
+        }
+    }
+}
+
+void testPreload() {
+    // A model loaded in the background should be identical to one loaded on demand.
+
+    ANIForce::preloadModel(infoFile);
+    shared_ptr<const ANIModel> preloaded = ANIModelLoader::get(infoFile);
+    ANIModel loaded = ANIModel::load(ANIModelInfo::read(infoFile));
+    ASSERT(loaded.species == preloaded->species);
+    ASSERT(loaded.selfEnergies == preloaded->selfEnergies);
+    ASSERT_EQUAL(loaded.getNumEnsembles(), preloaded->getNumEnsembles());
+    for (int e = 0; e < loaded.getNumEnsembles(); e++)
+        for (int s = 0; s < loaded.getNumSpecies(); s++)
+            for (int layer = 0; layer < loaded.networks[e][s].size(); layer++) {
+                ASSERT(loaded.networks[e][s][layer].weights == preloaded->networks[e][s][layer].weights);
+                ASSERT(loaded.networks[e][s][layer].biases == preloaded->networks[e][s][layer].biases);
+            }
+
+    // Errors in the background should be reported when the model is needed.
+
+    ANIForce::preloadModel("missing/aniInfo.txt");
+    bool threw = false;
+    try {
+        ANIModelLoader::get("missing/aniInfo.txt");
+    }
+    catch (const OpenMMException& e) {
+        threw = true;
+    }
+    ASSERT(threw);
+
+    // Every Context of a force should share the model the force holds, until
+    // the force is deleted.
+
+    ANIForce* force = new ANIForce(infoFile, vector<string>(1, "C"));
+    shared_ptr<const ANIModel> held = ANIModelLoader::get(infoFile);
+    ASSERT(ANIModelLoader::get(infoFile) == held);
+    delete force;
+    ASSERT(ANIModelLoader::get(infoFile) != held);
+
+    // A discarded model should be loaded again when it is needed, and then kept.
+
+    force = new ANIForce(infoFile, vector<string>(1, "C"));
+    held = ANIModelLoader::get(infoFile);
+    ANIModelLoader::discard(infoFile);
+    shared_ptr<const ANIModel> reloaded = ANIModelLoader::get(infoFile);
+    ASSERT(reloaded != held);
+    ASSERT(ANIModelLoader::get(infoFile) == reloaded);
+    delete force;
+}
+
+void testNoAllocations() {
+    System system;
+    vector<Vec3> positions;
+    vector<string> symbols;
+    createCluster(50, 1.0, system, positions, symbols);
+    vector<float> aniPositions, aniForces(3*positions.size());
+    for (const Vec3& pos : positions)
+        for (int j = 0; j < 3; j++)
+            aniPositions.push_back(pos[j]*NM_TO_ANGST);
+    CpuANIEngine engine(ANIModelInfo::read(infoFile), 1);
+    engine.reserve(positions.size());
+    vector<ANIEvaluation> batch(1);
+    batch[0].symbols = &symbols;
+    batch[0].positions = aniPositions.data();
+    batch[0].forces = aniForces.data();
+
+    // The first step sizes the neighbor lists.  After that, evaluating
+    // the same system should not touch the heap.
+
+    engine.computeBatch(batch);
+    numAllocations = 0;
+    countAllocations = true;
+    for (int step = 0; step < 10; step++) {
+        aniPositions[0] += (step%2 == 0 ? 1e-3f : -1e-3f);
+        engine.computeBatch(batch);
+    }
+    countAllocations = false;
+    ASSERT_EQUAL(0, numAllocations);
+}
+
+void testFiniteDifferences() {
+    System system;
+    vector<Vec3> positions;
+    vector<string> symbols;
+    createCluster(10, 0.5, system, positions, symbols);
+    ANIForce* force = new ANIForce(infoFile, symbols);
+    system.addForce(force);
+    VerletIntegrator integ(1.0);
+    Context context(system, integ, Platform::getPlatformByName(platformName));
+    context.setPositions(positions);
+    State state = context.getState(State::Forces);
+
+    // Displace each atom along its force and compare the energy change to the
+    // projected force.
+
+    const double delta = 1e-3;
+    for (int i = 0; i < positions.size(); i++) {
+        Vec3 f = state.getForces()[i];
+        double norm = sqrt(f.dot(f));
+        if (norm == 0.0)
+            continue;
+        Vec3 step = f*(delta/norm);
+        vector<Vec3> displaced = positions;
+        displaced[i] = positions[i]+step;
+        context.setPositions(displaced);
+        double e1 = context.getState(State::Energy).getPotentialEnergy();
+        displaced[i] = positions[i]-step;
+        context.setPositions(displaced);
+        double e2 = context.getState(State::Energy).getPotentialEnergy();
+        ASSERT_EQUAL_TOL(norm, (e2-e1)/(2*delta), 1e-2);
+    }
+}
+
+void testPlatformThreads() {
+    // The CPU platform's Threads property sets the number of threads the engine uses.
+    // Forces are summed in fixed point, so every setting must give the same bits.
+
+    if (platformName != "CPU")
+        return;
+    System system;
+    vector<Vec3> positions;
+    vector<string> symbols;
+    createCluster(50, 0.8, system, positions, symbols);
+    system.addForce(new ANIForce(infoFile, symbols));
+    VerletIntegrator integ1(1.0), integ2(1.0);
+    Platform& platform = Platform::getPlatformByName(platformName);
+    map<string, string> serialProperties, threadedProperties;
+    serialProperties["Threads"] = "1";
+    threadedProperties["Threads"] = "3";
+    Context serial(system, integ1, platform, serialProperties);
+    Context threaded(system, integ2, platform, threadedProperties);
+    ASSERT_EQUAL("1", platform.getPropertyValue(serial, "Threads"));
+    serial.setPositions(positions);
+    threaded.setPositions(positions);
+    State state1 = serial.getState(State::Energy | State::Forces);
+    State state2 = threaded.getState(State::Energy | State::Forces);
+    ASSERT_EQUAL(state1.getPotentialEnergy(), state2.getPotentialEnergy());
+    for (int i = 0; i < positions.size(); i++)
+        ASSERT_EQUAL_VEC(state1.getForces()[i], state2.getForces()[i], 0);
+}
+
+void testPeriodic() {
+    System system;
+    vector<Vec3> positions;
+    vector<string> symbols;
+    createCluster(30, 1.2, system, positions, symbols);
+    system.setDefaultPeriodicBoxVectors(Vec3(1.2, 0, 0), Vec3(0, 1.2, 0), Vec3(0, 0, 1.2));
+    ANIForce* force = new ANIForce(infoFile, symbols);
+    force->setUsesPeriodicBoundaryConditions(true);
+    system.addForce(force);
+    VerletIntegrator integ(1.0);
+    Context context(system, integ, Platform::getPlatformByName(platformName));
+    context.setPositions(positions);
+    State state1 = context.getState(State::Energy | State::Forces);
+
+    // Translating atoms by box vectors should not change anything.
+
+    for (int i = 0; i < positions.size(); i += 3)
+        positions[i] += Vec3(1.2*(i%2), -1.2, 2.4);
+    context.setPositions(positions);
+    State state2 = context.getState(State::Energy | State::Forces);
+    ASSERT_EQUAL_TOL(state1.getPotentialEnergy(), state2.getPotentialEnergy(), 1e-6);
+    for (int i = 0; i < positions.size(); i++)
+        ASSERT_EQUAL_VEC(state1.getForces()[i], state2.getForces()[i], 1e-4);
+}
+
+/**
+ * Create a Context for a periodic cluster, optionally with a barostat.
+ */
+Context* createPeriodicContext(System& system, vector<Vec3>& positions, VerletIntegrator& integ, bool useBarostat) {
+    vector<string> symbols;
+    createCluster(30, 1.2, system, positions, symbols);
+    system.setDefaultPeriodicBoxVectors(Vec3(1.2, 0, 0), Vec3(0.2, 1.2, 0), Vec3(-0.1, 0.3, 1.2));
+    ANIForce* force = new ANIForce(infoFile, symbols);
+    force->setUsesPeriodicBoundaryConditions(true);
+    system.addForce(force);
+    if (useBarostat)
+        system.addForce(new MonteCarloBarostat(1.0, 300.0));
+    Context* context = new Context(system, integ, Platform::getPlatformByName(platformName));
+    context->setPositions(positions);
+    return context;
+}
+
+void testVirial() {
+    System system;
+    vector<Vec3> positions;
+    VerletIntegrator integ(1.0);
+    Context* context = createPeriodicContext(system, positions, integ, false);
+    ANIForce& force = dynamic_cast<ANIForce&>(system.getForce(0));
+    vector<Vec3> virial = force.computeVirial(*context);
+    Vec3 box[3];
+    context->getState(0).getPeriodicBoxVectors(box[0], box[1], box[2]);
+
+    // The diagonal of the virial is minus the derivative of the energy with
+    // respect to stretching the system along one axis.
+
+    const double delta = 1e-3;
+    for (int axis = 0; axis < 3; axis++) {
+        double energy[2];
+        for (int k = 0; k < 2; k++) {
+            double scale = 1+(k == 0 ? delta : -delta);
+            vector<Vec3> scaledPos = positions;
+            Vec3 scaledBox[3] = {box[0], box[1], box[2]};
+            for (Vec3& pos : scaledPos)
+                pos[axis] *= scale;
+            for (Vec3& v : scaledBox)
+                v[axis] *= scale;
+            context->setPeriodicBoxVectors(scaledBox[0], scaledBox[1], scaledBox[2]);
+            context->setPositions(scaledPos);
+            energy[k] = context->getState(State::Energy).getPotentialEnergy();
+        }
+        ASSERT_EQUAL_TOL(-(energy[0]-energy[1])/(2*delta), virial[axis][axis], 1e-2);
+    }
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < i; j++)
+            ASSERT_EQUAL_TOL(virial[i][j], virial[j][i], 1e-4);
+    delete context;
+}
+
+void testEnsembleEnergies() {
+    System system;
+    vector<Vec3> positions;
+    vector<string> symbols;
+    createCluster(30, 0.8, system, positions, symbols);
+    vector<float> aniPositions;
+    for (const Vec3& pos : positions)
+        for (int j = 0; j < 3; j++)
+            aniPositions.push_back(pos[j]*NM_TO_ANGST);
+    ANIModelInfo info = ANIModelInfo::read(infoFile);
+    vector<double> ensembleEnergies(info.nEnsembles);
+    vector<ANIEvaluation> batch(1);
+    batch[0].symbols = &symbols;
+    batch[0].positions = aniPositions.data();
+    batch[0].ensembleEnergies = ensembleEnergies.data();
+    CpuANIEngine serial(info, 1);
+    serial.computeBatch(batch);
+
+    // The energy is the mean over the ensemble.
+
+    double mean = 0;
+    for (double energy : ensembleEnergies)
+        mean += energy/info.nEnsembles;
+    ASSERT_EQUAL_TOL(batch[0].energy, mean, 1e-10);
+    ASSERT(*min_element(ensembleEnergies.begin(), ensembleEnergies.end()) < *max_element(ensembleEnergies.begin(), ensembleEnergies.end()));
+
+    // Like the total energy, they do not depend on the number of threads.
+
+    vector<double> threadedEnergies(info.nEnsembles);
+    batch[0].ensembleEnergies = threadedEnergies.data();
+    CpuANIEngine threaded(info, 3);
+    threaded.computeBatch(batch);
+    for (int e = 0; e < info.nEnsembles; e++)
+        ASSERT_EQUAL(ensembleEnergies[e], threadedEnergies[e]);
+}
+
+void testBarostatScaling() {
+    System system1, system2;
+    vector<Vec3> positions;
+    VerletIntegrator integ1(1.0), integ2(1.0);
+    Context* plain = createPeriodicContext(system1, positions, integ1, false);
+    Context* scaled = createPeriodicContext(system2, positions, integ2, true);
+    Vec3 box[3];
+    plain->getState(0).getPeriodicBoxVectors(box[0], box[1], box[2]);
+    scaled->getState(State::Energy);
+
+    // Scaling the system as a barostat does should reuse the neighbor lists
+    // and give the same results as building them from scratch.  Some atoms
+    // are also moved by box vectors, which a barostat may do as well.
+
+    for (double scale : {0.995, 1.01, 0.98, 1.0}) {
+        vector<Vec3> scaledPos = positions;
+        for (int i = 0; i < scaledPos.size(); i++) {
+            scaledPos[i] *= scale;
+            if (i%5 == 0)
+                scaledPos[i] -= box[1]*scale;
+        }
+        for (Context* context : {plain, scaled}) {
+            context->setPeriodicBoxVectors(box[0]*scale, box[1]*scale, box[2]*scale);
+            context->setPositions(scaledPos);
+        }
+        State state1 = plain->getState(State::Energy | State::Forces);
+        State state2 = scaled->getState(State::Energy | State::Forces);
+        ASSERT_EQUAL_TOL(state1.getPotentialEnergy(), state2.getPotentialEnergy(), 1e-6);
+        for (int i = 0; i < positions.size(); i++)
+            ASSERT_EQUAL_VEC(state1.getForces()[i], state2.getForces()[i], 1e-4);
+    }
+    delete plain;
+    delete scaled;
+}
+
+void testBarostatMolecules() {
+    // A barostat scales the centers of molecules, so the neighbor lists are
+    // only cached for scaling when no atoms are bonded together.  Evaluate the
+    // same structure without a barostat, with one, and with one and bonds.
+
+    double memory[3];
+    for (int mode = 0; mode < 3; mode++) {
+        System system;
+        vector<Vec3> positions;
+        vector<string> symbols;
+        createCluster(30, 1.2, system, positions, symbols);
+        system.setDefaultPeriodicBoxVectors(Vec3(1.2, 0, 0), Vec3(0, 1.2, 0), Vec3(0, 0, 1.2));
+        ANIForce* force = new ANIForce(infoFile, symbols);
+        force->setUsesPeriodicBoundaryConditions(true);
+        system.addForce(force);
+        if (mode > 0)
+            system.addForce(new MonteCarloBarostat(1.0, 300.0, 1));
+        if (mode == 2) {
+            HarmonicBondForce* bonds = new HarmonicBondForce();
+            for (int i = 0; i+1 < positions.size(); i += 2)
+                bonds->addBond(i, i+1, sqrt((positions[i]-positions[i+1]).dot(positions[i]-positions[i+1])), 1000.0);
+            bonds->setForceGroup(1);
+            system.addForce(bonds);
+        }
+        VerletIntegrator integ(0.0005);
+        Context context(system, integ, Platform::getPlatformByName(platformName));
+        context.setPositions(positions);
+        context.getState(State::Energy);
+        memory[mode] = force->getPeakMemory(context);
+        if (mode != 2)
+            continue;
+
+        // Let the barostat move the molecules, and check that the energy
+        // matches a Context that builds its neighbor lists from scratch.
+
+        integ.step(20);
+        State state = context.getState(State::Positions | State::Energy | State::Forces, false, 1<<0);
+        Vec3 box[3];
+        state.getPeriodicBoxVectors(box[0], box[1], box[2]);
+        ASSERT(box[0][0] != 1.2);
+        System plainSystem;
+        for (int i = 0; i < positions.size(); i++)
+            plainSystem.addParticle(1.0);
+        plainSystem.setDefaultPeriodicBoxVectors(box[0], box[1], box[2]);
+        ANIForce* plainForce = new ANIForce(infoFile, symbols);
+        plainForce->setUsesPeriodicBoundaryConditions(true);
+        plainSystem.addForce(plainForce);
+        VerletIntegrator integ2(0.0005);
+        Context plain(plainSystem, integ2, Platform::getPlatformByName(platformName));
+        plain.setPositions(state.getPositions());
+        State plainState = plain.getState(State::Energy | State::Forces);
+        ASSERT_EQUAL_TOL(plainState.getPotentialEnergy(), state.getPotentialEnergy(), 1e-6);
+        for (int i = 0; i < positions.size(); i++)
+            ASSERT_EQUAL_VEC(plainState.getForces()[i], state.getForces()[i], 1e-4);
+    }
+    ASSERT(memory[1] > memory[0]);
+    ASSERT_EQUAL(memory[0], memory[2]);
+}
+
+void testSharedEngine() {
+    const int numReplicas = 4;
+    const int numSteps = 5;
+    vector<Vec3> positions[numReplicas];
+    vector<VerletIntegrator*> integrators;
+    vector<Context*> shared, separate;
+    for (int i = 0; i < numReplicas; i++)
+        for (bool share : {true, false}) {
+            System* system = new System();
+            vector<string> symbols;
+            positions[i].clear();
+            createCluster(10+5*i, 0.7, *system, positions[i], symbols);
+            ANIForce* force = new ANIForce(infoFile, symbols);
+            force->setUseSharedEngine(share);
+            force->setMaxBatchWait(1.0);
+            system->addForce(force);
+            integrators.push_back(new VerletIntegrator(1.0));
+            Context* context = new Context(*system, *integrators.back(), Platform::getPlatformByName(platformName));
+            context->setPositions(positions[i]);
+            (share ? shared : separate).push_back(context);
+        }
+
+    // Evaluate the replicas on separate threads.  Once all of them have
+    // submitted a request, their structures are evaluated as one batch.
+
+    vector<double> energies(numReplicas*numSteps);
+    vector<thread> threads;
+    for (int i = 0; i < numReplicas; i++)
+        threads.push_back(thread([&, i] () {
+            for (int step = 0; step < numSteps; step++) {
+                positions[i][0][0] += 0.01;
+                shared[i]->setPositions(positions[i]);
+                energies[i*numSteps+step] = shared[i]->getState(State::Energy).getPotentialEnergy();
+            }
+        }));
+    for (thread& t : threads)
+        t.join();
+    shared_ptr<ANIBatchingService> service = ANIBatchingService::get(infoFile, "CPU");
+    ASSERT_EQUAL(numReplicas*numSteps, service->getNumEvaluations());
+    ASSERT(service->getNumBatches() < numReplicas*numSteps);
+
+    // The results should match evaluating each replica on its own.
+
+    for (int i = 0; i < numReplicas; i++) {
+        positions[i][0][0] -= 0.01*numSteps;
+        for (int step = 0; step < numSteps; step++) {
+            positions[i][0][0] += 0.01;
+            separate[i]->setPositions(positions[i]);
+            ASSERT_EQUAL_TOL(separate[i]->getState(State::Energy).getPotentialEnergy(), energies[i*numSteps+step], 1e-6);
+        }
+    }
+    for (vector<Context*>* contexts : {&shared, &separate})
+        for (Context* context : *contexts) {
+            const System* system = &context->getSystem();
+            delete context;
+            delete system;
+        }
+    for (VerletIntegrator* integrator : integrators)
+        delete integrator;
+}
+
+void testEvaluationServer() {
+    const int numClients = 3;
+    const int numSteps = 4;
+    ANIEvaluationServer server("testEvaluationServer.sock");
+    server.start();
+    vector<Vec3> positions[numClients];
+    vector<VerletIntegrator*> integrators;
+    vector<Context*> remote, local;
+    for (int i = 0; i < numClients; i++)
+        for (bool useServer : {true, false}) {
+            System* system = new System();
+            vector<string> symbols;
+            positions[i].clear();
+            createCluster(10+5*i, 0.7, *system, positions[i], symbols);
+            ANIForce* force = new ANIForce(infoFile, symbols);
+            if (useServer)
+                force->setServer(server.getSocketPath());
+            force->setMaxBatchWait(1.0);
+            system->addForce(force);
+            integrators.push_back(new VerletIntegrator(1.0));
+            Context* context = new Context(*system, *integrators.back(), Platform::getPlatformByName(platformName));
+            context->setPositions(positions[i]);
+            (useServer ? remote : local).push_back(context);
+        }
+    ASSERT_EQUAL(numClients, server.getNumClients());
+    ASSERT_EQUAL(1, server.getNumModels());
+
+    // Evaluate the clients on separate threads, so the server can combine
+    // their requests into batches.
+
+    vector<State> states;
+    for (int i = 0; i < numClients*numSteps; i++)
+        states.push_back(State());
+    vector<thread> threads;
+    for (int i = 0; i < numClients; i++)
+        threads.push_back(thread([&, i] () {
+            vector<Vec3> pos = positions[i];
+            for (int step = 0; step < numSteps; step++) {
+                pos[0][0] += 0.01;
+                remote[i]->setPositions(pos);
+                states[i*numSteps+step] = remote[i]->getState(State::Energy | State::Forces);
+            }
+        }));
+    for (thread& t : threads)
+        t.join();
+    ASSERT_EQUAL(numClients*numSteps, server.getNumEvaluations());
+    ASSERT(server.getNumBatches() < numClients*numSteps);
+
+    // The results should match evaluating each structure in its own process.
+
+    for (int i = 0; i < numClients; i++)
+        for (int step = 0; step < numSteps; step++) {
+            positions[i][0][0] += 0.01;
+            local[i]->setPositions(positions[i]);
+            State expected = local[i]->getState(State::Energy | State::Forces);
+            const State& state = states[i*numSteps+step];
+            ASSERT_EQUAL_TOL(expected.getPotentialEnergy(), state.getPotentialEnergy(), 1e-10);
+            for (int j = 0; j < positions[i].size(); j++)
+                ASSERT_EQUAL_VEC(expected.getForces()[j], state.getForces()[j], 1e-6);
+        }
+
+    // Errors on the server should be reported to the client.
+
+    System system;
+    vector<Vec3> pos;
+    vector<string> symbols;
+    createCluster(5, 0.7, system, pos, symbols);
+    symbols[0] = "Xe";
+    ANIForce* force = new ANIForce(infoFile, symbols);
+    force->setServer(server.getSocketPath());
+    system.addForce(force);
+    VerletIntegrator integ(1.0);
+    bool threwException = false;
+    try {
+        Context context(system, integ, Platform::getPlatformByName(platformName));
+    }
+    catch (const OpenMMException& e) {
+        threwException = true;
+    }
+    ASSERT(threwException);
+    for (vector<Context*>* contexts : {&remote, &local})
+        for (Context* context : *contexts) {
+            const System* system = &context->getSystem();
+            delete context;
+            delete system;
+        }
+    for (VerletIntegrator* integrator : integrators)
+        delete integrator;
+
+    // So should a missing server.
+
+    force->setServer("testEvaluationServer.missing.sock");
+    threwException = false;
+    try {
+        Context context(system, integ, Platform::getPlatformByName(platformName));
+    }
+    catch (const OpenMMException& e) {
+        threwException = true;
+    }
+    ASSERT(threwException);
+}
+
+void testDomainDecomposition() {
+    for (bool periodic : {false, true}) {
+        System system;
+        vector<Vec3> positions;
+        vector<string> symbols;
+        createCluster(200, 2.0, system, positions, symbols);
+        system.setDefaultPeriodicBoxVectors(Vec3(2.0, 0, 0), Vec3(0.3, 2.0, 0), Vec3(-0.2, 0.1, 2.0));
+        ANIForce* force = new ANIForce(infoFile, symbols);
+        force->setUsesPeriodicBoundaryConditions(periodic);
+        system.addForce(force);
+        VerletIntegrator integ1(1.0), integ2(1.0);
+        Context context1(system, integ1, Platform::getPlatformByName(platformName));
+        force->setNumDomainWorkers(3);
+        Context context2(system, integ2, Platform::getPlatformByName(platformName));
+        for (int step = 0; step < 3; step++) {
+            positions[step][1] += 0.05;
+            context1.setPositions(positions);
+            context2.setPositions(positions);
+            State state1 = context1.getState(State::Energy | State::Forces);
+            State state2 = context2.getState(State::Energy | State::Forces);
+
+            // Every contribution is accumulated in fixed point in a canonical
+            // order, so splitting the system must not change a single bit.
+
+            ASSERT_EQUAL(state1.getPotentialEnergy(), state2.getPotentialEnergy());
+            for (int i = 0; i < positions.size(); i++)
+                for (int j = 0; j < 3; j++)
+                    ASSERT_EQUAL(state1.getForces()[i][j], state2.getForces()[i][j]);
+        }
+    }
+}
+
+void testDomainWorkerFailure() {
+    System system;
+    vector<Vec3> positions;
+    vector<string> symbols;
+    createCluster(50, 1.0, system, positions, symbols);
+    vector<float> aniPositions, aniForces(3*positions.size());
+    for (const Vec3& pos : positions)
+        for (int j = 0; j < 3; j++)
+            aniPositions.push_back(pos[j]*NM_TO_ANGST);
+    vector<ANIEvaluation> batch(1);
+    batch[0].symbols = &symbols;
+    batch[0].positions = aniPositions.data();
+    batch[0].forces = aniForces.data();
+
+    // The workers must outlive the thread that created the engine.
+
+    shared_ptr<const ANIModel> model = ANIModelLoader::get(infoFile);
+    ANIDomainDecomposition* engine = NULL;
+    thread creator([&] () {engine = new ANIDomainDecomposition(*model, 2, symbols.size());});
+    creator.join();
+    engine->computeBatch(batch);
+
+    // Once a worker has died, every evaluation should fail rather than hang.
+
+    kill(engine->getWorkerProcesses()[0], SIGKILL);
+    for (int i = 0; i < 2; i++) {
+        bool threw = false;
+        try {
+            engine->computeBatch(batch);
+        }
+        catch (const OpenMMException& e) {
+            threw = true;
+        }
+        ASSERT(threw);
+    }
+    delete engine;
+}
+
+void testMemoryLimit() {
+    for (bool periodic : {false, true}) {
+        System system;
+        vector<Vec3> positions;
+        vector<string> symbols;
+        createCluster(600, 4.0, system, positions, symbols);
+        system.setDefaultPeriodicBoxVectors(Vec3(4.0, 0, 0), Vec3(0, 4.0, 0), Vec3(0, 0, 4.0));
+        ANIForce* force = new ANIForce(infoFile, symbols);
+        force->setUsesPeriodicBoundaryConditions(periodic);
+        system.addForce(force);
+        VerletIntegrator integ1(1.0), integ2(1.0);
+        Context context1(system, integ1, Platform::getPlatformByName(platformName));
+        force->setMaxMemory(0.6);
+        ASSERT_EQUAL(0.6, force->getMaxMemory());
+        Context context2(system, integ2, Platform::getPlatformByName(platformName));
+        context1.setPositions(positions);
+        context2.setPositions(positions);
+        State state1 = context1.getState(State::Energy | State::Forces);
+        State state2 = context2.getState(State::Energy | State::Forces);
+
+        // Evaluating the system in chunks must not change a single bit, and
+        // must need less memory than evaluating it at once.
+
+        ASSERT_EQUAL(state1.getPotentialEnergy(), state2.getPotentialEnergy());
+        for (int i = 0; i < positions.size(); i++)
+            for (int j = 0; j < 3; j++)
+                ASSERT_EQUAL(state1.getForces()[i][j], state2.getForces()[i][j]);
+        ASSERT(force->getPeakMemory(context2) > 0);
+        ASSERT(force->getPeakMemory(context2) < force->getPeakMemory(context1));
+
+        // Chunks cannot be smaller than the cutoff, so a limit too small for
+        // them must be reported rather than exceeded.
+
+        force->setMaxMemory(0.01);
+        VerletIntegrator integ3(1.0);
+        Context context3(system, integ3, Platform::getPlatformByName(platformName));
+        context3.setPositions(positions);
+        bool threw = false;
+        try {
+            context3.getState(State::Energy);
+        }
+        catch (const OpenMMException& e) {
+            threw = true;
+        }
+        ASSERT(threw);
+    }
+}
+
+void testTriclinicNeighbors() {
+    // In a strongly skewed cell the faces are closer together than the length
+    // of the cell vectors, so binning by the vector lengths would miss pairs.
+
+    const float cell[9] = {21, 0, 0, 10.5, 21, 0, 10.5, 10.5, 21};
+    const string elements[] = {"H", "C", "N", "O"};
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    vector<string> symbols;
+    vector<float> positions;
+    while (symbols.size() < 600) {
+        double u = genrand_real2(sfmt), v = genrand_real2(sfmt), w = genrand_real2(sfmt);
+        float pos[3] = {(float) (u*cell[0]+v*cell[3]+w*cell[6]), (float) (v*cell[4]+w*cell[7]), (float) (w*cell[8])};
+        bool tooClose = false;
+        for (int i = 0; i < symbols.size(); i++) {
+            float dx = pos[0]-positions[3*i], dy = pos[1]-positions[3*i+1], dz = pos[2]-positions[3*i+2];
+            if (dx*dx+dy*dy+dz*dz < 1.0f)
+                tooClose = true;
+        }
+        if (tooClose)
+            continue;
+        symbols.push_back(elements[symbols.size()%4]);
+        positions.insert(positions.end(), pos, pos+3);
+    }
+    const int numAtoms = symbols.size();
+    CpuANIEngine engine(ANIModelInfo::read(infoFile));
+    ANIEvaluation eval;
+    eval.symbols = &symbols;
+    eval.positions = positions.data();
+    eval.cell = cell;
+    vector<char> noHalo(numAtoms, 0);
+    vector<long long> periodicGradient(3*numAtoms);
+    CpuANIDomain periodic;
+    periodic.isHalo = noHalo.data();
+    periodic.fixedGradient = periodicGradient.data();
+    engine.computeDomain(eval, periodic);
+
+    // Every atom is inside the cell, so a block of 3x3x3 copies of it holds
+    // all neighbors of the central copy.  Evaluating that block without
+    // periodic boundary conditions, with every other copy as a halo, gives the
+    // energy and forces by brute force.
+
+    vector<string> blockSymbols;
+    vector<float> blockPositions;
+    vector<char> isHalo;
+    for (int i = -1; i <= 1; i++)
+        for (int j = -1; j <= 1; j++)
+            for (int k = -1; k <= 1; k++)
+                for (int atom = 0; atom < numAtoms; atom++) {
+                    blockSymbols.push_back(symbols[atom]);
+                    for (int m = 0; m < 3; m++)
+                        blockPositions.push_back(positions[3*atom+m]+i*cell[m]+j*cell[3+m]+k*cell[6+m]);
+                    isHalo.push_back(i != 0 || j != 0 || k != 0);
+                }
+    vector<long long> blockGradient(blockPositions.size());
+    ANIEvaluation blockEval;
+    blockEval.symbols = &blockSymbols;
+    blockEval.positions = blockPositions.data();
+    CpuANIDomain block;
+    block.isHalo = isHalo.data();
+    block.fixedGradient = blockGradient.data();
+    engine.computeDomain(blockEval, block);
+    double periodicEnergy = periodic.fixedEnergy/(double) 0x100000000;
+    double blockEnergy = block.fixedEnergy/(double) 0x100000000;
+    ASSERT(fabs(periodicEnergy-blockEnergy) < 1e-6);
+    for (int atom = 0; atom < numAtoms; atom++)
+        for (int m = 0; m < 3; m++) {
+            double expected = 0;
+            for (int copy = 0; copy < 27; copy++)
+                expected += blockGradient[3*(copy*numAtoms+atom)+m]/(double) 0x100000000;
+            ASSERT(fabs(periodicGradient[3*atom+m]/(double) 0x100000000-expected) < 1e-5);
+        }
+
+    // Evaluating the cell in chunks must find the same pairs.
+
+    vector<float> forces(3*numAtoms), chunkForces(3*numAtoms);
+    vector<ANIEvaluation> batch(1, eval);
+    batch[0].forces = forces.data();
+    engine.computeBatch(batch);
+    CpuANIEngine chunkEngine(ANIModelInfo::read(infoFile));
+    CpuANIChunks chunks(chunkEngine, symbols, (size_t) (2.6*(1<<20)));
+    eval.forces = chunkForces.data();
+    chunks.compute(eval);
+    ASSERT(chunks.getNumChunks() > 1);
+    ASSERT_EQUAL(batch[0].energy, eval.energy);
+    for (int i = 0; i < 3*numAtoms; i++)
+        ASSERT_EQUAL(forces[i], chunkForces[i]);
+
+    // A cell whose diagonal is twice the cutoff can still be too thin across.
+
+    const float thinCell[9] = {11, 0, 0, 5.5, 11, 0, 5.5, 5.5, 11};
+    batch[0].cell = thinCell;
+    bool threw = false;
+    try {
+        engine.computeBatch(batch);
+    }
+    catch (const OpenMMException& e) {
+        threw = true;
+    }
+    ASSERT(threw);
+}
+
+void testRecording() {
+    System system;
+    vector<Vec3> positions;
+    vector<string> symbols;
+    createCluster(20, 0.8, system, positions, symbols);
+    ANIForce* force = new ANIForce(infoFile, symbols);
+    const string logFile = "testRecording.anilog";
+    force->setRecording(logFile, 2);
+    system.addForce(force);
+    vector<double> energies;
+    vector<vector<Vec3> > allForces;
+    {
+        VerletIntegrator integ(1.0);
+        Context context(system, integ, Platform::getPlatformByName(platformName));
+        for (int step = 0; step < 5; step++) {
+            positions[0][0] += 0.01;
+            context.setPositions(positions);
+            State state = context.getState(step == 2 ? State::Energy : State::Energy | State::Forces);
+            energies.push_back(state.getPotentialEnergy());
+            allForces.push_back(step == 2 ? vector<Vec3>() : state.getForces());
+        }
+
+        // Another Context, or any other writer of the same file however it is
+        // named, would truncate the log this one is writing.
+
+        VerletIntegrator integ2(1.0);
+        bool threw = false;
+        try {
+            Context context2(system, integ2, Platform::getPlatformByName(platformName));
+        }
+        catch (const OpenMMException& e) {
+            threw = true;
+        }
+        ASSERT(threw);
+        threw = false;
+        try {
+            ANIEvaluationLogWriter writer("./"+logFile, infoFile, symbols, 1, 1<<20);
+        }
+        catch (const OpenMMException& e) {
+            threw = true;
+        }
+        ASSERT(threw);
+    }
+
+    // Every second evaluation should have been recorded with its results.
+
+    ANIEvaluationLogReader reader(logFile);
+    ASSERT_EQUAL(infoFile, reader.getInfoFile());
+    ASSERT(symbols == reader.getSymbols());
+    ANILoggedEvaluation record;
+    for (int step = 0; step < 5; step += 2) {
+        ASSERT(reader.read(record));
+        ASSERT_EQUAL(step, record.call);
+        ASSERT(record.cell.empty());
+        ASSERT_EQUAL_TOL(positions[0][0]-0.01*(4-step), record.positions[0]/NM_TO_ANGST, 1e-5);
+        ASSERT_EQUAL_TOL(energies[step], record.energy*HARTREE_TO_KJ_MOL, 1e-6);
+        ASSERT_EQUAL(allForces[step].size()*3, record.forces.size());
+        for (int i = 0; i < allForces[step].size(); i++)
+            for (int j = 0; j < 3; j++)
+                ASSERT_EQUAL_TOL(allForces[step][i][j], record.forces[3*i+j]*HARTREE_A_TO_KJ_MOL_NM, 1e-5);
+    }
+    ASSERT(!reader.read(record));
+
+    // Once the Context that wrote the log is gone, another one may record.
+
+    {
+        VerletIntegrator integ(1.0);
+        Context context(system, integ, Platform::getPlatformByName(platformName));
+    }
+    remove(logFile.c_str());
+}
+
+void testFrozenAtoms() {
+    System system, referenceSystem;
+    vector<Vec3> positions;
+    vector<string> symbols;
+    createCluster(300, 2.2, system, positions, symbols);
+
+    // Freeze everything except a small region in one corner.
+
+    vector<char> isFrozen(positions.size());
+    int numMobile = 0;
+    for (int i = 0; i < positions.size(); i++) {
+        isFrozen[i] = (positions[i].dot(positions[i]) > 0.7*0.7);
+        if (isFrozen[i])
+            system.setParticleMass(i, 0.0);
+        else
+            numMobile++;
+        referenceSystem.addParticle(1.0);
+    }
+    ASSERT(numMobile > 0);
+    system.addForce(new ANIForce(infoFile, symbols));
+    referenceSystem.addForce(new ANIForce(infoFile, symbols));
+    VerletIntegrator integ1(1.0), integ2(1.0);
+    Context context(system, integ1, Platform::getPlatformByName(platformName));
+    Context referenceContext(referenceSystem, integ2, Platform::getPlatformByName(platformName));
+    CpuANIEngine engine(ANIModelInfo::read(infoFile));
+    CpuANIFrozenAtoms frozen(engine, symbols, isFrozen);
+    vector<float> aniPositions(3*positions.size()), forces(3*positions.size());
+    ANIEvaluation eval;
+    eval.positions = aniPositions.data();
+    eval.forces = forces.data();
+
+    // Small moves of the mobile atoms reuse the cache, larger ones and moving
+    // a frozen atom rebuild it.  The results must be exactly those of
+    // evaluating the whole system every time.
+
+    int expectedBuilds[] = {1, 1, 2, 3};
+    for (int step = 0; step < 4; step++) {
+        if (step == 1 || step == 2)
+            for (int i = 0; i < positions.size(); i++)
+                if (!isFrozen[i])
+                    positions[i][0] += (step == 1 ? 0.005 : 0.2);
+        if (step == 3)
+            positions[find(isFrozen.begin(), isFrozen.end(), 1)-isFrozen.begin()][1] += 0.01;
+        context.setPositions(positions);
+        referenceContext.setPositions(positions);
+        State state = context.getState(State::Energy | State::Forces);
+        State referenceState = referenceContext.getState(State::Energy | State::Forces);
+        ASSERT_EQUAL(referenceState.getPotentialEnergy(), state.getPotentialEnergy());
+        for (int i = 0; i < positions.size(); i++)
+            for (int j = 0; j < 3; j++)
+                ASSERT_EQUAL(referenceState.getForces()[i][j], state.getForces()[i][j]);
+        for (int i = 0; i < positions.size(); i++)
+            for (int j = 0; j < 3; j++)
+                aniPositions[3*i+j] = positions[i][j]*NM_TO_ANGST;
+        frozen.compute(eval);
+        ASSERT_EQUAL(expectedBuilds[step], frozen.getNumCacheBuilds());
+        ASSERT_EQUAL_TOL(referenceState.getPotentialEnergy(), eval.energy*HARTREE_TO_KJ_MOL, 1e-10);
+        ASSERT(frozen.getNumActiveAtoms() > numMobile);
+        ASSERT(frozen.getNumActiveAtoms() < positions.size()/2);
+    }
+}
+
+void testUpdateModel() {
+    System system;
+    vector<Vec3> positions;
+    vector<string> symbols;
+    createCluster(30, 0.9, system, positions, symbols);
+
+    // Write an info file for the same networks with a smaller ensemble.
+
+    ifstream in(infoFile);
+    vector<string> lines;
+    for (string line; getline(in, line);)
+        lines.push_back(line);
+    in.close();
+    const string smallInfoFile = "smallEnsembleAniInfo.txt";
+    ofstream out(smallInfoFile);
+    for (int i = 0; i < 3; i++)
+        out << lines[i] << endl;
+    out << 1 << endl;
+    out.close();
+
+    ANIForce* force = new ANIForce(infoFile, symbols);
+    system.addForce(force);
+    VerletIntegrator integ(1.0);
+    Context context(system, integ, Platform::getPlatformByName(platformName));
+    context.setPositions(positions);
+    State fullState = context.getState(State::Energy | State::Forces);
+
+    // Switching the model must give exactly the same results as a Context
+    // created for it, and switching back must restore the original ones.
+
+    System smallSystem;
+    for (int i = 0; i < positions.size(); i++)
+        smallSystem.addParticle(1.0);
+    smallSystem.addForce(new ANIForce(smallInfoFile, symbols));
+    VerletIntegrator integ2(1.0);
+    Context smallContext(smallSystem, integ2, Platform::getPlatformByName(platformName));
+    smallContext.setPositions(positions);
+    State smallState = smallContext.getState(State::Energy | State::Forces);
+    ASSERT(smallState.getPotentialEnergy() != fullState.getPotentialEnergy());
+    for (int repeat = 0; repeat < 2; repeat++) {
+        force->setInfoFile(smallInfoFile);
+        force->updateParametersInContext(context);
+        State state = context.getState(State::Energy | State::Forces);
+        ASSERT_EQUAL(smallState.getPotentialEnergy(), state.getPotentialEnergy());
+        for (int i = 0; i < positions.size(); i++)
+            ASSERT_EQUAL_VEC(smallState.getForces()[i], state.getForces()[i], 0);
+        force->setInfoFile(infoFile);
+        force->updateParametersInContext(context);
+        state = context.getState(State::Energy | State::Forces);
+        ASSERT_EQUAL(fullState.getPotentialEnergy(), state.getPotentialEnergy());
+        for (int i = 0; i < positions.size(); i++)
+            ASSERT_EQUAL_VEC(fullState.getForces()[i], state.getForces()[i], 0);
+    }
+
+    // A recording names its model, so a Context that records must keep it.
+
+    const string logFile = "testUpdateModel.anilog";
+    force->setRecording(logFile);
+    {
+        VerletIntegrator integ3(1.0);
+        Context recordingContext(system, integ3, Platform::getPlatformByName(platformName));
+        recordingContext.setPositions(positions);
+        force->setInfoFile(smallInfoFile);
+        bool threw = false;
+        try {
+            force->updateParametersInContext(recordingContext);
+        }
+        catch (const OpenMMException& e) {
+            threw = true;
+        }
+        ASSERT(threw);
+        State state = recordingContext.getState(State::Energy);
+        ASSERT_EQUAL(fullState.getPotentialEnergy(), state.getPotentialEnergy());
+    }
+    ANIEvaluationLogReader reader(logFile);
+    ASSERT_EQUAL(infoFile, reader.getInfoFile());
+    remove(logFile.c_str());
+    remove(smallInfoFile.c_str());
+}
+
+void testAlchemical() {
+    System system;
+    vector<Vec3> positions;
+    vector<string> symbols;
+    createCluster(60, 1.2, system, positions, symbols);
+    vector<string> symbolsB = symbols;
+    symbolsB[3] = (symbols[3] == "C" ? "N" : "C");
+    symbolsB[7] = "";
+    ANIForce* force = new ANIForce(infoFile, symbols);
+    force->setAlchemicalSymbols(symbolsB);
+    system.addForce(force);
+    VerletIntegrator integ(1.0);
+    Context context(system, integ, Platform::getPlatformByName(platformName));
+    context.setPositions(positions);
+
+    // Compute the end states separately: state A is the unmodified system,
+    // state B has atom 7 removed.
+
+    System systemA, systemB;
+    vector<Vec3> positionsB;
+    vector<string> symbolsWithoutDummy;
+    for (int i = 0; i < positions.size(); i++) {
+        systemA.addParticle(1.0);
+        if (i != 7) {
+            systemB.addParticle(1.0);
+            positionsB.push_back(positions[i]);
+            symbolsWithoutDummy.push_back(symbolsB[i]);
+        }
+    }
+    systemA.addForce(new ANIForce(infoFile, symbols));
+    systemB.addForce(new ANIForce(infoFile, symbolsWithoutDummy));
+    VerletIntegrator integA(1.0), integB(1.0);
+    Context contextA(systemA, integA, Platform::getPlatformByName(platformName));
+    Context contextB(systemB, integB, Platform::getPlatformByName(platformName));
+    contextA.setPositions(positions);
+    contextB.setPositions(positionsB);
+    State stateA = contextA.getState(State::Energy | State::Forces);
+    State stateB = contextB.getState(State::Energy | State::Forces);
+    double energyA = stateA.getPotentialEnergy();
+    double energyB = stateB.getPotentialEnergy();
+    for (double lambda : {0.0, 0.3, 1.0}) {
+        context.setParameter("lambda_ani", lambda);
+        State state = context.getState(State::Energy | State::Forces | State::ParameterDerivatives);
+        ASSERT_EQUAL_TOL((1-lambda)*energyA + lambda*energyB, state.getPotentialEnergy(), 1e-6);
+        ASSERT_EQUAL_TOL(energyB-energyA, state.getEnergyParameterDerivatives().at("lambda_ani"), 1e-5);
+        for (int i = 0, j = 0; i < positions.size(); i++) {
+            Vec3 expected = stateA.getForces()[i]*(1-lambda);
+            if (i != 7)
+                expected += stateB.getForces()[j++]*lambda;
+            ASSERT_EQUAL_VEC(expected, state.getForces()[i], 1e-4);
+        }
+    }
+}
+
+/**
+ * Write a small single-layer model for H, C and N to the directory "dir" and return its info file.
+ */
+string writeModelWithoutOxygen(const string& dir) {
+    const vector<string> species = {"H", "C", "N"};
+    const int aevLength = 30;
+    mkdir(dir.c_str(), 0755);
+    mkdir((dir+"/train0").c_str(), 0755);
+    mkdir((dir+"/train0/networks").c_str(), 0755);
+    ofstream params(dir+"/model.params");
+    params << "TM = 1\nRcr = 5.2\nRca = 3.5\nEtaR = [1.6e1]\nShfR = [9.0e-1,2.5e0]\nEtaA = [8.0e0]\nZeta = [3.2e1]\n";
+    params << "ShfA = [9.0e-1,2.2e0]\nShfZ = [1.9634954e-1,1.1780972e0]\nAtyp = [H,C,N]\n";
+    params.close();
+    ofstream selfEnergies(dir+"/sae_linfit.dat");
+    selfEnergies << "H,0=-0.6\nC,1=-38.1\nN,2=-54.7\n";
+    selfEnergies.close();
+    for (int i = 0; i < species.size(); i++) {
+        string prefix = dir+"/train0/networks/ANN-"+species[i];
+        vector<float> weights(aevLength), bias(1, 0.01f*(i+1));
+        for (int j = 0; j < aevLength; j++)
+            weights[j] = 0.01f*sin(j+i);
+        ofstream(prefix+"-0-W.wparam", ios::binary).write((char*) weights.data(), weights.size()*sizeof(float));
+        ofstream(prefix+"-0-B.wparam", ios::binary).write((char*) bias.data(), bias.size()*sizeof(float));
+        string text = "layer [\nblocksize="+to_string(aevLength)+";\nnodes=1;\nactivation=6;\n";
+        text += "weights=FILE:ANN-"+species[i]+"-0-W.wparam["+to_string(aevLength)+"];\n";
+        text += "biases=FILE:ANN-"+species[i]+"-0-B.wparam[1];\n]\n";
+        text.push_back('\0');
+        vector<char> compressed(text.size()+1000);
+        unsigned int compressedSize = compressed.size();
+        ASSERT(BZ2_bzBuffToBuffCompress(compressed.data(), &compressedSize, &text[0], text.size(), 9, 0, 0) == BZ_OK);
+        ofstream network(prefix+".nnf", ios::binary);
+        network << "!NetParameters\nnnf_version=\n";
+        network.write(compressed.data(), compressedSize);
+    }
+    string modelInfoFile = dir+"/aniInfo.txt";
+    ofstream info(modelInfoFile);
+    info << dir << "\nmodel.params\nsae_linfit.dat\n1\n";
+    return modelInfoFile;
+}
+
+void testUpdateAlchemicalModel() {
+    System system;
+    vector<Vec3> positions;
+    vector<string> symbols;
+    createCluster(40, 1.1, system, positions, symbols);
+    for (string& symbol : symbols)
+        if (symbol == "O")
+            symbol = "N";
+    vector<string> symbolsB = symbols;
+    symbolsB[3] = "O";
+    ANIForce* force = new ANIForce(infoFile, symbols);
+    force->setAlchemicalSymbols(symbolsB);
+    system.addForce(force);
+    VerletIntegrator integ(1.0);
+    Context context(system, integ, Platform::getPlatformByName(platformName));
+    context.setPositions(positions);
+    context.setParameter("lambda_ani", 0.4);
+    State state1 = context.getState(State::Energy | State::Forces | State::ParameterDerivatives);
+
+    // The new model supports every atom in state A but not state B, so it
+    // must be rejected without disturbing the Context.
+
+    const string modelDir = "modelWithoutOxygen";
+    force->setInfoFile(writeModelWithoutOxygen(modelDir));
+    bool threw = false;
+    try {
+        force->updateParametersInContext(context);
+    }
+    catch (const OpenMMException& e) {
+        threw = true;
+        ASSERT(string(e.what()).find("element O") != string::npos);
+    }
+    ASSERT(threw);
+    State state2 = context.getState(State::Energy | State::Forces | State::ParameterDerivatives);
+    ASSERT_EQUAL(state1.getPotentialEnergy(), state2.getPotentialEnergy());
+    ASSERT_EQUAL(state1.getEnergyParameterDerivatives().at("lambda_ani"), state2.getEnergyParameterDerivatives().at("lambda_ani"));
+    for (int i = 0; i < positions.size(); i++)
+        ASSERT_EQUAL_VEC(state1.getForces()[i], state2.getForces()[i], 0);
+    for (const string& species : {"H", "C", "N"}) {
+        string prefix = modelDir+"/train0/networks/ANN-"+species;
+        remove((prefix+".nnf").c_str());
+        remove((prefix+"-0-W.wparam").c_str());
+        remove((prefix+"-0-B.wparam").c_str());
+    }
+    for (const string& file : {"/model.params", "/sae_linfit.dat", "/aniInfo.txt", "/train0/networks", "/train0", ""})
+        remove((modelDir+file).c_str());
+}
+
+void testPerformance() {
+    System system;
+    vector<Vec3> positions;
+    vector<string> symbols;
+    createCluster(200, 1.5, system, positions, symbols);
+    ANIForce* force = new ANIForce(infoFile, symbols);
+    system.addForce(force);
+    VerletIntegrator integ(1.0);
+    Context context(system, integ, Platform::getPlatformByName(platformName));
+    context.setPositions(positions);
+    context.getState(State::Forces);
+    const int numSteps = 10;
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < numSteps; i++) {
+        positions[0][0] += 1e-4;
+        context.setPositions(positions);
+        context.getState(State::Energy | State::Forces);
+    }
+    auto end = chrono::steady_clock::now();
+    cerr << platformName << ": " << chrono::duration<double, milli>(end-start).count()/numSteps
+         << " ms per evaluation of " << positions.size() << " atoms" << endl;
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        registerANIReferenceKernelFactories();
+        if (argc > 1)
+            platformName = argv[1];
+        testSpecializedMatchesGeneric();
+        testFastActivations();
+        testFusedAEVs();
+        testSplineTables();
+        testSparseEnvironments();
+        testSpatialOrder();
+        testThreadDeterminism();
+        testPreload();
+        testNoAllocations();
+        testFiniteDifferences();
+        testPlatformThreads();
+        testPeriodic();
+        testVirial();
+        testEnsembleEnergies();
+        testBarostatScaling();
+        testBarostatMolecules();
+        testSharedEngine();
+        testEvaluationServer();
+        testDomainDecomposition();
+        testDomainWorkerFailure();
+        testMemoryLimit();
+        testTriclinicNeighbors();
+        testRecording();
+        testAlchemical();
+        testUpdateAlchemicalModel();
+        testFrozenAtoms();
+        testUpdateModel();
+        testPerformance();
+    }
+    catch(const std::exception& e) {
+        cerr << "exception: " << e.what() << std::endl;
+        return 1;
+    }
+    cerr << "Done" << std::endl;
+    return 0;
+}
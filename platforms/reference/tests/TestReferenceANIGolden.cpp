@@ -0,0 +1,307 @@
+/* -------------------------------------------------------------------------- *
+ * The MIT License
+ *
+ * SPDX short identifier: MIT
+ *
+ * Copyright 2019 Genentech Inc. South San Francisco
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ * -------------------------------------------------------------------------- */
+
+/**
+ * Checks the CPU engines and the Reference/CPU implementation of ANIForce
+ * against the golden reference data in tests/golden, and measures how fast
+ * each of them evaluates every structure.
+ *
+ * Usage: TestReferenceANIGolden [platform] [--record results.csv] [--baseline results.csv]
+ *
+ * --record writes the accuracy and timing of every mode and structure to a
+ * file.  --baseline compares the timings with a file written earlier on the
+ * same machine and fails if any evaluation became more than 25% slower.
+ */
+
+#include "ANIForce.h"
+#include "internal/CpuANIEngine.h"
+#include "openmm/internal/AssertionUtilities.h"
+#include "openmm/Context.h"
+#include "openmm/Platform.h"
+#include "openmm/System.h"
+#include "openmm/VerletIntegrator.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <vector>
+
+using namespace ANIPlugin;
+using namespace OpenMM;
+using namespace std;
+
+extern "C" OPENMM_EXPORT void registerANIReferenceKernelFactories();
+
+const string infoFile = "tests/golden/aniInfo.txt";
+const string referenceFile = "tests/golden/reference.txt";
+// A timing counts as a slowdown if it exceeds the baseline by more than this factor.
+const double SLOWDOWN_TOLERANCE = 1.25;
+// Each structure is evaluated repeatedly for at least this long (in seconds) when timing it.
+const double MIN_TIMING_INTERVAL = 0.2;
+
+/**
+ * A structure from the reference file, with its reference energy and the
+ * reference forces on some of its atoms.
+ */
+struct GoldenStructure {
+    string name;
+    vector<string> symbols;
+    vector<float> positions, cell;
+    double energy;
+    vector<int> forceAtoms;
+    vector<Vec3> forces;
+};
+
+/**
+ * One way of evaluating the structures, with the largest errors it may make:
+ * in the energy per atom (Hartree) and in any force component (Hartree/Angstrom).
+ */
+struct Mode {
+    string name;
+    double energyTolerance, forceTolerance;
+    function<void (GoldenStructure&, double&, vector<float>&)> evaluate;
+};
+
+struct Result {
+    double energyError, forceError, msPerEvaluation;
+};
+
+vector<GoldenStructure> loadReference(const string& file) {
+    ifstream in(file);
+    if (!in)
+        throw OpenMMException("Cannot open "+file);
+    vector<GoldenStructure> structures;
+    string line;
+    while (getline(in, line)) {
+        if (line.empty() || line[0] == '#')
+            continue;
+        istringstream header(line);
+        string keyword;
+        int numAtoms, periodic;
+        header >> keyword;
+        if (keyword != "structure")
+            throw OpenMMException("Unexpected line in "+file+": "+line);
+        GoldenStructure structure;
+        header >> structure.name >> numAtoms >> periodic;
+        if (periodic) {
+            in >> keyword;
+            structure.cell.resize(9);
+            for (float& c : structure.cell)
+                in >> c;
+        }
+        for (int i = 0; i < numAtoms; i++) {
+            string symbol;
+            float x, y, z;
+            in >> symbol >> x >> y >> z;
+            structure.symbols.push_back(symbol);
+            structure.positions.push_back(x);
+            structure.positions.push_back(y);
+            structure.positions.push_back(z);
+        }
+        in >> keyword >> structure.energy;
+        while (in >> keyword && keyword == "force") {
+            int atom;
+            double fx, fy, fz;
+            in >> atom >> fx >> fy >> fz;
+            structure.forceAtoms.push_back(atom);
+            structure.forces.push_back(Vec3(fx, fy, fz));
+        }
+        getline(in, line);
+        structures.push_back(structure);
+    }
+    return structures;
+}
+
+/**
+ * Create a mode that evaluates structures with a CpuANIEngine.
+ */
+Mode createEngineMode(const string& name, double energyTolerance, double forceTolerance, shared_ptr<CpuANIEngine> engine) {
+    Mode mode = {name, energyTolerance, forceTolerance};
+    mode.evaluate = [engine] (GoldenStructure& structure, double& energy, vector<float>& forces) {
+        vector<ANIEvaluation> batch(1);
+        batch[0].symbols = &structure.symbols;
+        batch[0].positions = structure.positions.data();
+        batch[0].cell = (structure.cell.size() > 0 ? structure.cell.data() : NULL);
+        batch[0].forces = forces.data();
+        engine->computeBatch(batch);
+        energy = batch[0].energy;
+    };
+    return mode;
+}
+
+/**
+ * Create a mode that evaluates structures with an ANIForce in a Context.
+ * Contexts are created the first time each structure is seen.
+ */
+Mode createPlatformMode(const string& platformName, double energyTolerance, double forceTolerance) {
+    Mode mode = {platformName+" platform", energyTolerance, forceTolerance};
+    shared_ptr<map<string, shared_ptr<Context> > > contexts = make_shared<map<string, shared_ptr<Context> > >();
+    mode.evaluate = [platformName, contexts] (GoldenStructure& structure, double& energy, vector<float>& forces) {
+        shared_ptr<Context>& context = (*contexts)[structure.name];
+        if (!context) {
+            System* system = new System();
+            for (int i = 0; i < structure.symbols.size(); i++)
+                system->addParticle(1.0);
+            ANIForce* force = new ANIForce(infoFile, structure.symbols);
+            if (structure.cell.size() > 0) {
+                const vector<float>& c = structure.cell;
+                system->setDefaultPeriodicBoxVectors(Vec3(c[0], c[1], c[2])/NM_TO_ANGST, Vec3(c[3], c[4], c[5])/NM_TO_ANGST, Vec3(c[6], c[7], c[8])/NM_TO_ANGST);
+                force->setUsesPeriodicBoundaryConditions(true);
+            }
+            system->addForce(force);
+            VerletIntegrator* integrator = new VerletIntegrator(0.001);
+            context = shared_ptr<Context>(new Context(*system, *integrator, Platform::getPlatformByName(platformName)),
+                    [system, integrator] (Context* context) {
+                        delete context;
+                        delete integrator;
+                        delete system;
+                    });
+            vector<Vec3> positions;
+            for (int i = 0; i < structure.symbols.size(); i++)
+                positions.push_back(Vec3(structure.positions[3*i], structure.positions[3*i+1], structure.positions[3*i+2])/NM_TO_ANGST);
+            context->setPositions(positions);
+        }
+        State state = context->getState(State::Energy | State::Forces);
+        energy = state.getPotentialEnergy()/HARTREE_TO_KJ_MOL;
+        for (int i = 0; i < structure.symbols.size(); i++)
+            for (int j = 0; j < 3; j++)
+                forces[3*i+j] = state.getForces()[i][j]/HARTREE_A_TO_KJ_MOL_NM;
+    };
+    return mode;
+}
+
+Result checkMode(Mode& mode, GoldenStructure& structure) {
+    int numAtoms = structure.symbols.size();
+    double energy;
+    vector<float> forces(3*numAtoms);
+    mode.evaluate(structure, energy, forces);
+    Result result;
+    result.energyError = fabs(energy-structure.energy)/numAtoms;
+    result.forceError = 0;
+    for (int i = 0; i < structure.forceAtoms.size(); i++)
+        for (int j = 0; j < 3; j++)
+            result.forceError = max(result.forceError, fabs(forces[3*structure.forceAtoms[i]+j]-structure.forces[i][j]));
+
+    // Time repeated evaluations of the same structure.
+
+    int numEvaluations = 0;
+    auto start = chrono::steady_clock::now();
+    double elapsed;
+    do {
+        mode.evaluate(structure, energy, forces);
+        numEvaluations++;
+        elapsed = chrono::duration<double>(chrono::steady_clock::now()-start).count();
+    } while (elapsed < MIN_TIMING_INTERVAL);
+    result.msPerEvaluation = 1000*elapsed/numEvaluations;
+    return result;
+}
+
+map<string, double> loadBaseline(const string& file) {
+    ifstream in(file);
+    if (!in)
+        throw OpenMMException("Cannot open "+file);
+    map<string, double> baseline;
+    string line;
+    getline(in, line);
+    while (getline(in, line)) {
+        vector<string> fields;
+        istringstream fieldStream(line);
+        string field;
+        while (getline(fieldStream, field, ','))
+            fields.push_back(field);
+        if (fields.size() == 6)
+            baseline[fields[0]+","+fields[1]] = stod(fields[5]);
+    }
+    return baseline;
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        registerANIReferenceKernelFactories();
+        string platformName = "Reference";
+        string recordFile, baselineFile;
+        for (int i = 1; i < argc; i++) {
+            string arg = argv[i];
+            if (arg == "--record" && i+1 < argc)
+                recordFile = argv[++i];
+            else if (arg == "--baseline" && i+1 < argc)
+                baselineFile = argv[++i];
+            else
+                platformName = arg;
+        }
+        vector<GoldenStructure> structures = loadReference(referenceFile);
+        ANIModelInfo info = ANIModelInfo::read(infoFile);
+        vector<Mode> modes;
+        modes.push_back(createEngineMode("CPU", 5e-8, 5e-6, make_shared<CpuANIEngine>(info)));
+        modes.push_back(createEngineMode("CPU generic", 5e-8, 5e-6, make_shared<CpuANIEngine>(info, 0, false)));
+        modes.push_back(createEngineMode("CPU single thread", 5e-8, 5e-6, make_shared<CpuANIEngine>(info, 1)));
+        modes.push_back(createEngineMode("CPUFast", 5e-6, 1e-5, make_shared<CpuANIEngine>(info, 0, true, true)));
+        modes.push_back(createEngineMode("CPUFused", 5e-8, 5e-6, make_shared<CpuANIEngine>(info, 0, true, false, true)));
+        modes.push_back(createEngineMode("CPUTabulated", 5e-8, 5e-6, make_shared<CpuANIEngine>(info, 0, true, false, false, true)));
+        modes.push_back(createPlatformMode(platformName, 5e-8, 5e-6));
+        map<string, double> baseline;
+        if (!baselineFile.empty())
+            baseline = loadBaseline(baselineFile);
+        ofstream record;
+        if (!recordFile.empty()) {
+            record.open(recordFile);
+            record << "mode,structure,atoms,energyError,forceError,msPerEvaluation" << endl;
+        }
+
+        // Evaluate everything before checking, so the full table is printed
+        // even when something is wrong.
+
+        bool passed = true;
+        cerr << "mode                 structure     atoms   energy error   force error   ms/evaluation" << endl;
+        for (Mode& mode : modes)
+            for (GoldenStructure& structure : structures) {
+                Result result = checkMode(mode, structure);
+                bool accurate = (result.energyError <= mode.energyTolerance && result.forceError <= mode.forceTolerance);
+                string key = mode.name+","+structure.name;
+                bool fast = (baseline.find(key) == baseline.end() || result.msPerEvaluation <= SLOWDOWN_TOLERANCE*baseline[key]);
+                char text[200];
+                snprintf(text, sizeof(text), "%-20s %-12s %6d   %12.3e   %11.3e   %13.3f", mode.name.c_str(), structure.name.c_str(),
+                        (int) structure.symbols.size(), result.energyError, result.forceError, result.msPerEvaluation);
+                cerr << text << (accurate ? "" : "   INACCURATE") << (fast ? "" : "   SLOWER THAN BASELINE") << endl;
+                if (record.is_open())
+                    record << key << "," << structure.symbols.size() << "," << result.energyError << "," << result.forceError << "," << result.msPerEvaluation << endl;
+                passed &= accurate && fast;
+            }
+        ASSERT(passed);
+    }
+    catch(const std::exception& e) {
+        cerr << "exception: " << e.what() << std::endl;
+        return 1;
+    }
+    cerr << "Done" << std::endl;
+    return 0;
+}
@@ -0,0 +1,156 @@
+/* -------------------------------------------------------------------------- *
+ * The MIT License
+ *
+ * SPDX short identifier: MIT
+ *
+ * Copyright 2019 Genentech Inc. South San Francisco
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ * -------------------------------------------------------------------------- */
+
+/**
+ * This tests the finite difference Hessian and normal modes of ANIHessian.
+ */
+
+#include "ANIHessian.h"
+#include "ANITestMolecules.h"
+#include "internal/CpuANIEngine.h"
+#include "openmm/internal/AssertionUtilities.h"
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace ANIPlugin;
+using namespace OpenMM;
+using namespace std;
+
+const string infoFile = "tests/golden/aniInfo.txt";
+
+/**
+ * Compute the forces (in kJ/mol/nm) of a structure given in single precision Angstroms.
+ */
+vector<double> computeForces(ANIEngine& engine, const vector<string>& symbols, const vector<float>& positions) {
+    vector<float> forces(positions.size());
+    vector<ANIEvaluation> batch(1);
+    batch[0].symbols = &symbols;
+    batch[0].positions = positions.data();
+    batch[0].forces = forces.data();
+    engine.computeBatch(batch);
+    vector<double> result(forces.size());
+    for (int i = 0; i < forces.size(); i++)
+        result[i] = forces[i]*HARTREE_A_TO_KJ_MOL_NM;
+    return result;
+}
+
+void testHessian() {
+    CpuANIEngine engine(ANIModelInfo::read(infoFile), 1);
+    vector<string> symbols = {"N", "H", "H", "H"};
+    vector<Vec3> positions = createAmmonia(engine, symbols, 1.0);
+    ANIHessian hessian(engine);
+    hessian.setMaxBatchSize(7);
+    hessian.computeHessian(symbols, positions);
+    int n3 = 3*symbols.size();
+    ASSERT_EQUAL((2*n3+1+6)/7, hessian.getNumBatchEvaluations());
+    const vector<double>& h = hessian.getHessian();
+    ASSERT_EQUAL(n3*n3, h.size());
+
+    // Every row should match the difference of the analytic forces at the
+    // two displaced structures, divided by the displacement that was applied.
+    // The matrix is symmetrized, so compare with the average of the row and
+    // the column, and check that they agree in the first place.
+
+    vector<float> reference(n3);
+    for (int i = 0; i < symbols.size(); i++)
+        for (int j = 0; j < 3; j++)
+            reference[3*i+j] = positions[i][j]*NM_TO_ANGST;
+    double delta = hessian.getDisplacement()*NM_TO_ANGST;
+    vector<double> rows((size_t) n3*n3);
+    double norm = 0.0;
+    for (int k = 0; k < n3; k++) {
+        vector<float> plus = reference, minus = reference;
+        plus[k] = (float) (reference[k]+delta);
+        minus[k] = (float) (reference[k]-delta);
+        vector<double> forcesPlus = computeForces(engine, symbols, plus);
+        vector<double> forcesMinus = computeForces(engine, symbols, minus);
+        double step = ((double) plus[k]-(double) minus[k])/NM_TO_ANGST;
+        for (int j = 0; j < n3; j++) {
+            rows[k*n3+j] = (forcesMinus[j]-forcesPlus[j])/step;
+            norm = max(norm, fabs(rows[k*n3+j]));
+        }
+    }
+    for (int i = 0; i < n3; i++)
+        for (int j = 0; j < n3; j++) {
+            ASSERT_EQUAL(h[i*n3+j], h[j*n3+i]);
+            ASSERT(fabs(0.5*(rows[i*n3+j]+rows[j*n3+i])-h[i*n3+j]) < 1e-6*norm);
+            ASSERT(fabs(rows[i*n3+j]-rows[j*n3+i]) < 1e-2*norm);
+        }
+
+    // A nonlinear molecule at a minimum has six modes with (nearly) zero
+    // frequency for the translations and rotations, and 3N-6 real vibrations.
+
+    hessian.computeNormalModes({14.007, 1.008, 1.008, 1.008});
+    const vector<double>& frequencies = hessian.getFrequencies();
+    ASSERT_EQUAL(n3, frequencies.size());
+    vector<double> magnitudes;
+    for (double f : frequencies)
+        magnitudes.push_back(fabs(f));
+    sort(magnitudes.begin(), magnitudes.end());
+    for (int i = 0; i < 6; i++)
+        ASSERT(magnitudes[i] < 50.0);
+    for (int i = 6; i < n3; i++)
+        ASSERT(magnitudes[i] > 500.0);
+    for (int i = 6; i < n3; i++)
+        ASSERT(frequencies[i] > 500.0);
+}
+
+void testFloatDisplacements() {
+    // Far from the origin a small displacement is rounded noticeably in single
+    // precision.  Dividing by the displacement that was applied keeps the
+    // Hessian independent of where the molecule is.
+
+    CpuANIEngine engine(ANIModelInfo::read(infoFile), 1);
+    vector<string> symbols = {"N", "H", "H", "H"};
+    vector<Vec3> positions = createAmmonia(engine, symbols, 1.0);
+    vector<Vec3> shifted = positions;
+    for (Vec3& pos : shifted)
+        pos += Vec3(41.3, -37.7, 45.1);
+    ANIHessian hessian(engine), shiftedHessian(engine);
+    hessian.computeHessian(symbols, positions);
+    shiftedHessian.computeHessian(symbols, shifted);
+    double norm = 0.0;
+    for (double x : hessian.getHessian())
+        norm = max(norm, fabs(x));
+    for (int i = 0; i < hessian.getHessian().size(); i++)
+        ASSERT(fabs(hessian.getHessian()[i]-shiftedHessian.getHessian()[i]) < 3e-4*norm);
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        testHessian();
+        testFloatDisplacements();
+    }
+    catch(const std::exception& e) {
+        cerr << "exception: " << e.what() << std::endl;
+        return 1;
+    }
+    cerr << "Done" << std::endl;
+    return 0;
+}
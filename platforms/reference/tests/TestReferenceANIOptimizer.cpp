@@ -0,0 +1,206 @@
+/* -------------------------------------------------------------------------- *
+ * The MIT License
+ *
+ * SPDX short identifier: MIT
+ *
+ * Copyright 2019 Genentech Inc. South San Francisco
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ * -------------------------------------------------------------------------- */
+
+/**
+ * This tests the batched L-BFGS minimization of ANIOptimizer.
+ */
+
+#include "ANIOptimizer.h"
+#include "internal/CpuANIEngine.h"
+#include "openmm/internal/AssertionUtilities.h"
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace ANIPlugin;
+using namespace OpenMM;
+using namespace std;
+
+const string infoFile = "tests/golden/aniInfo.txt";
+
+/**
+ * An engine that records the molecules of every batch it evaluates.
+ */
+class RecordingEngine : public ANIEngine {
+public:
+    RecordingEngine(ANIEngine& engine) : engine(engine) {
+    }
+    void computeBatch(vector<ANIEvaluation>& batch) {
+        batches.push_back(vector<int>());
+        for (ANIEvaluation& eval : batch)
+            batches.back().push_back(eval.symbols->size());
+        engine.computeBatch(batch);
+    }
+    ANIEngine& engine;
+    vector<vector<int> > batches;
+};
+
+/**
+ * Build a few small molecules with distorted geometries.  They have different
+ * numbers of atoms, so the recorded batches show which ones were evaluated.
+ */
+void createMolecules(vector<vector<string> >& symbols, vector<vector<Vec3> >& positions) {
+    symbols = {{"O", "H", "H"}, {"N", "H", "H", "H"}, {"C", "H", "H", "H", "H"}};
+    positions = {{Vec3(0, 0, 0), Vec3(0.105, 0.01, 0), Vec3(-0.02, 0.09, 0.01)},
+                 {Vec3(0, 0, 0.01), Vec3(0.11, 0, -0.03), Vec3(-0.05, 0.08, -0.04), Vec3(-0.04, -0.09, -0.02)},
+                 {Vec3(0, 0, 0), Vec3(0.1, 0.01, 0.01), Vec3(-0.04, 0.1, 0), Vec3(-0.03, -0.05, 0.09), Vec3(-0.04, -0.04, -0.1)}};
+}
+
+double computeRMSForce(ANIEngine& engine, const vector<string>& symbols, const vector<Vec3>& positions) {
+    vector<float> pos, forces(3*symbols.size());
+    for (const Vec3& p : positions)
+        for (int j = 0; j < 3; j++)
+            pos.push_back(p[j]*NM_TO_ANGST);
+    vector<ANIEvaluation> batch(1);
+    batch[0].symbols = &symbols;
+    batch[0].positions = pos.data();
+    batch[0].forces = forces.data();
+    engine.computeBatch(batch);
+    double sum = 0.0;
+    for (float f : forces)
+        sum += f*f;
+    return sqrt(sum/forces.size())*HARTREE_A_TO_KJ_MOL_NM;
+}
+
+void testBatchedConvergence() {
+    CpuANIEngine engine(ANIModelInfo::read(infoFile), 1);
+    vector<vector<string> > symbols;
+    vector<vector<Vec3> > positions;
+    createMolecules(symbols, positions);
+    ANIOptimizer optimizer(engine);
+    optimizer.setTolerance(1.0);
+    for (int i = 0; i < symbols.size(); i++)
+        ASSERT_EQUAL(i, optimizer.addMolecule(symbols[i], positions[i]));
+    optimizer.minimize();
+
+    // Every molecule should have converged, and every batch evaluates all
+    // molecules that are still running, so there are no more batches than
+    // evaluations of the slowest molecule.
+
+    int maxEvaluations = 0;
+    for (int i = 0; i < symbols.size(); i++) {
+        ASSERT(optimizer.isConverged(i));
+        ASSERT(optimizer.getNumIterations(i) > 0);
+        ASSERT(computeRMSForce(engine, symbols[i], optimizer.getPositions(i)) <= 1.0);
+
+        // Minimizing a molecule on its own takes the same path.
+
+        ANIOptimizer single(engine);
+        single.setTolerance(1.0);
+        single.addMolecule(symbols[i], positions[i]);
+        single.minimize();
+        ASSERT(single.isConverged(0));
+        ASSERT_EQUAL(single.getNumIterations(0), optimizer.getNumIterations(i));
+        ASSERT_EQUAL_TOL(single.getEnergy(0), optimizer.getEnergy(i), 1e-10);
+        for (int j = 0; j < symbols[i].size(); j++)
+            ASSERT_EQUAL_VEC(single.getPositions(0)[j], optimizer.getPositions(i)[j], 1e-10);
+        maxEvaluations = max(maxEvaluations, single.getNumBatchEvaluations());
+    }
+    ASSERT_EQUAL(maxEvaluations, optimizer.getNumBatchEvaluations());
+
+    // Minimizing again does nothing once everything has converged.
+
+    optimizer.minimize();
+    ASSERT_EQUAL(maxEvaluations, optimizer.getNumBatchEvaluations());
+}
+
+void testConvergedMoleculesDropOut() {
+    CpuANIEngine engine(ANIModelInfo::read(infoFile), 1);
+    vector<vector<string> > symbols;
+    vector<vector<Vec3> > positions;
+    createMolecules(symbols, positions);
+
+    // Minimize water first, so it is already converged when methane is added.
+
+    ANIOptimizer water(engine);
+    water.setTolerance(1.0);
+    water.addMolecule(symbols[0], positions[0]);
+    water.minimize();
+    ASSERT(water.isConverged(0));
+    RecordingEngine recorder(engine);
+    ANIOptimizer optimizer(recorder);
+    optimizer.setTolerance(1.0);
+    optimizer.addMolecule(symbols[0], water.getPositions(0));
+    optimizer.addMolecule(symbols[1], positions[1]);
+    optimizer.addMolecule(symbols[2], positions[2]);
+    optimizer.minimize();
+    for (int i = 0; i < 3; i++)
+        ASSERT(optimizer.isConverged(i));
+    ASSERT_EQUAL(0, optimizer.getNumIterations(0));
+
+    // Water is only in the first batch, and each molecule stays in the batch
+    // until it converges and then never returns.
+
+    ASSERT_EQUAL(optimizer.getNumBatchEvaluations(), recorder.batches.size());
+    ASSERT_EQUAL(3, recorder.batches[0].size());
+    for (int i = 1; i < recorder.batches.size(); i++) {
+        const vector<int>& batch = recorder.batches[i];
+        ASSERT(find(batch.begin(), batch.end(), 3) == batch.end());
+        ASSERT(!batch.empty() && batch.size() <= recorder.batches[i-1].size());
+        for (int numAtoms : batch)
+            ASSERT(find(recorder.batches[i-1].begin(), recorder.batches[i-1].end(), numAtoms) != recorder.batches[i-1].end());
+    }
+    ASSERT_EQUAL(1, recorder.batches.back().size());
+}
+
+void testIterationLimit() {
+    CpuANIEngine engine(ANIModelInfo::read(infoFile), 1);
+    vector<vector<string> > symbols;
+    vector<vector<Vec3> > positions;
+    createMolecules(symbols, positions);
+    ANIOptimizer optimizer(engine);
+    optimizer.setTolerance(1e-6);
+    optimizer.setMaxIterations(3);
+    optimizer.addMolecule(symbols[2], positions[2]);
+    optimizer.minimize();
+    ASSERT(!optimizer.isConverged(0));
+    ASSERT_EQUAL(3, optimizer.getNumIterations(0));
+    double energy = optimizer.getEnergy(0);
+
+    // The limit applies to each call, and a later call continues where the
+    // last one stopped.
+
+    optimizer.minimize();
+    ASSERT(!optimizer.isConverged(0));
+    ASSERT_EQUAL(6, optimizer.getNumIterations(0));
+    ASSERT(optimizer.getEnergy(0) < energy);
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        testBatchedConvergence();
+        testConvergedMoleculesDropOut();
+        testIterationLimit();
+    }
+    catch(const std::exception& e) {
+        cerr << "exception: " << e.what() << std::endl;
+        return 1;
+    }
+    cerr << "Done" << std::endl;
+    return 0;
+}
@@ -0,0 +1,136 @@
+/* -------------------------------------------------------------------------- *
+ * The MIT License
+ *
+ * SPDX short identifier: MIT
+ *
+ * Copyright 2019 Genentech Inc. South San Francisco
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ * -------------------------------------------------------------------------- */
+
+/**
+ * This tests the nudged elastic band optimization of ANIReactionPath.
+ */
+
+#include "ANIReactionPath.h"
+#include "ANITestMolecules.h"
+#include "internal/CpuANIEngine.h"
+#include "openmm/internal/AssertionUtilities.h"
+#include <cmath>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace ANIPlugin;
+using namespace OpenMM;
+using namespace std;
+
+const string infoFile = "tests/golden/aniInfo.txt";
+
+void testInversion() {
+    CpuANIEngine engine(ANIModelInfo::read(infoFile), 1);
+    vector<string> symbols = {"N", "H", "H", "H"};
+    vector<Vec3> start = createAmmonia(engine, symbols);
+    vector<Vec3> end = start;
+    for (Vec3& pos : end)
+        pos[2] = -pos[2];
+    const int numImages = 7;
+    ANIReactionPath path(engine, symbols);
+    path.interpolate(start, end, numImages);
+
+    // Converge the path loosely, then let the middle image climb to the saddle
+    // point.  Every iteration evaluates all images in one batch.
+
+    path.setTolerance(20.0);
+    path.optimize();
+    ASSERT(path.isConverged());
+    ASSERT_EQUAL(-1, path.getClimbingImage());
+    ASSERT_EQUAL(path.getNumIterations()+1, path.getNumBatchEvaluations());
+    path.setUseClimbingImage(true);
+    path.setTolerance(2.0);
+    path.optimize();
+    ASSERT(path.isConverged());
+    ASSERT_EQUAL(path.getNumIterations()+1, path.getNumBatchEvaluations());
+    ASSERT_EQUAL(numImages/2, path.getClimbingImage());
+
+    // The saddle point is planar, and the true forces on it vanish.
+
+    vector<Vec3> saddle = path.getPositions(numImages/2);
+    double hydrogenHeight = (saddle[1][2]+saddle[2][2]+saddle[3][2])/3;
+    ASSERT_EQUAL_TOL(hydrogenHeight, saddle[0][2], 1e-3);
+    double sum = 0.0;
+    for (const Vec3& f : path.getForces(numImages/2))
+        sum += f.dot(f);
+    ASSERT(sqrt(sum/12) <= 2.0);
+    double barrier = path.getEnergy(numImages/2)-path.getEnergy(0);
+    ASSERT(barrier > 1.0 && barrier < 100.0);
+
+    // The path is symmetric and the springs keep the images evenly spaced.
+
+    ASSERT_EQUAL_TOL(path.getEnergy(0), path.getEnergy(numImages-1), 1e-6);
+    double minSpacing = 1e10, maxSpacing = 0.0;
+    for (int image = 1; image < numImages; image++) {
+        ASSERT_EQUAL_TOL(path.getEnergy(image), path.getEnergy(numImages-1-image), 1e-3);
+        vector<Vec3> p1 = path.getPositions(image-1), p2 = path.getPositions(image);
+        double dist2 = 0.0;
+        for (int i = 0; i < symbols.size(); i++)
+            dist2 += (p2[i]-p1[i]).dot(p2[i]-p1[i]);
+        minSpacing = min(minSpacing, sqrt(dist2));
+        maxSpacing = max(maxSpacing, sqrt(dist2));
+        ASSERT(path.getEnergy(image) <= barrier+path.getEnergy(0)+1e-6);
+    }
+    ASSERT(maxSpacing < 1.2*minSpacing);
+}
+
+void testInvalidPath() {
+    CpuANIEngine engine(ANIModelInfo::read(infoFile), 1);
+    vector<string> symbols = {"O", "H"};
+    ANIReactionPath path(engine, symbols);
+    path.addImage({Vec3(0, 0, 0), Vec3(0.1, 0, 0)});
+    path.addImage({Vec3(0, 0, 0), Vec3(0.11, 0, 0)});
+    bool threw = false;
+    try {
+        path.optimize();
+    }
+    catch (const OpenMMException& ex) {
+        threw = true;
+    }
+    ASSERT(threw);
+    threw = false;
+    try {
+        path.addImage({Vec3(0, 0, 0)});
+    }
+    catch (const OpenMMException& ex) {
+        threw = true;
+    }
+    ASSERT(threw);
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        testInversion();
+        testInvalidPath();
+    }
+    catch(const std::exception& e) {
+        cerr << "exception: " << e.what() << std::endl;
+        return 1;
+    }
+    cerr << "Done" << std::endl;
+    return 0;
+}
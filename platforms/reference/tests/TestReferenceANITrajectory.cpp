@@ -0,0 +1,213 @@
+/* -------------------------------------------------------------------------- *
+ * The MIT License
+ *
+ * SPDX short identifier: MIT
+ *
+ * Copyright 2019 Genentech Inc. South San Francisco
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ * -------------------------------------------------------------------------- */
+
+/**
+ * This tests ANITrajectoryReader, which ani-rescore and ani-featurize use to stream trajectories.
+ */
+
+#include "internal/ANITrajectoryReader.h"
+#include "openmm/internal/AssertionUtilities.h"
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace ANIPlugin;
+using namespace OpenMM;
+using namespace std;
+
+const int numAtoms = 5;
+const int numFrames = 4;
+
+float getCoordinate(int frame, int atom, int axis) {
+    return 0.5f*frame + 1.25f*atom + 0.125f*axis;
+}
+
+void writeRecord(ofstream& out, const void* data, int size) {
+    out.write((const char*) &size, sizeof(int));
+    out.write((const char*) data, size);
+    out.write((const char*) &size, sizeof(int));
+}
+
+/**
+ * Write a DCD file the way OpenMM does, with a cubic unit cell whose angles
+ * are stored as cosines, followed by a partially written frame.
+ */
+void writeDcd(const string& fileName) {
+    ofstream out(fileName, ios::binary);
+    char header[84] = {0};
+    int control[20] = {numFrames, 0, 1};
+    control[10] = 1;
+    control[19] = 24;
+    memcpy(header, "CORD", 4);
+    memcpy(header+4, control, sizeof(control));
+    writeRecord(out, header, 84);
+    char title[84] = {0};
+    title[0] = 1;
+    writeRecord(out, title, 84);
+    int atoms = numAtoms;
+    writeRecord(out, &atoms, sizeof(int));
+    for (int frame = 0; frame < numFrames; frame++) {
+        double cell[6] = {20.0+frame, 0.0, 21.0, 0.0, 0.0, 22.0};
+        writeRecord(out, cell, sizeof(cell));
+        for (int axis = 0; axis < 3; axis++) {
+            float coords[numAtoms];
+            for (int i = 0; i < numAtoms; i++)
+                coords[i] = getCoordinate(frame, i, axis);
+            writeRecord(out, coords, sizeof(coords));
+        }
+    }
+    int partial = 48;
+    out.write((const char*) &partial, sizeof(int));
+}
+
+void writeXyz(const string& fileName, bool periodic) {
+    ofstream out(fileName);
+    const char* symbols[] = {"C", "H", "H", "O", "N"};
+    for (int frame = 0; frame < numFrames; frame++) {
+        out << numAtoms << endl;
+        if (periodic)
+            out << "Lattice=\"" << 20+frame << " 0 0 0 21 0 0 0 22\" Properties=species:S:1:pos:R:3" << endl;
+        else
+            out << "frame " << frame << endl;
+        for (int i = 0; i < numAtoms; i++)
+            out << symbols[i] << " " << getCoordinate(frame, i, 0) << " " << getCoordinate(frame, i, 1) << " " << getCoordinate(frame, i, 2) << endl;
+    }
+}
+
+void checkFrames(ANITrajectoryReader& reader, bool periodic) {
+    ASSERT_EQUAL(numAtoms, reader.getNumAtoms());
+    ASSERT_EQUAL(periodic, reader.hasCell());
+    vector<float> positions(3*numAtoms);
+    float cell[9];
+    for (int frame = 0; frame < numFrames; frame++) {
+        ASSERT(reader.readFrame(positions.data(), cell));
+        for (int i = 0; i < numAtoms; i++)
+            for (int j = 0; j < 3; j++)
+                ASSERT_EQUAL_TOL(getCoordinate(frame, i, j), positions[3*i+j], 1e-6);
+        if (periodic) {
+            float expected[9] = {20.0f+frame, 0, 0, 0, 21, 0, 0, 0, 22};
+            for (int i = 0; i < 9; i++)
+                ASSERT_EQUAL_TOL(expected[i], cell[i], 1e-6);
+        }
+    }
+    ASSERT(!reader.readFrame(positions.data(), cell));
+    ASSERT_EQUAL(numFrames, reader.getNumFramesRead());
+}
+
+void testDcd() {
+    string fileName = "testTrajectory.dcd";
+    writeDcd(fileName);
+    {
+        ANITrajectoryReader reader(fileName);
+        ASSERT_EQUAL(0, reader.getSymbols().size());
+        checkFrames(reader, true);
+    }
+    remove(fileName.c_str());
+}
+
+void testXyz() {
+    for (int periodic = 0; periodic < 2; periodic++) {
+        string fileName = "testTrajectory.xyz";
+        writeXyz(fileName, periodic);
+        {
+            ANITrajectoryReader reader(fileName);
+            vector<string> expected = {"C", "H", "H", "O", "N"};
+            ASSERT(expected == reader.getSymbols());
+            checkFrames(reader, periodic);
+        }
+        remove(fileName.c_str());
+    }
+}
+
+void testStructures() {
+    // A data set of molecules of different sizes, only some of them periodic.
+
+    string fileName = "testStructures.xyz";
+    {
+        ofstream out(fileName);
+        for (int structure = 0; structure < 3; structure++) {
+            out << structure+2 << endl;
+            if (structure == 1)
+                out << "Lattice=\"20 0 0 0 21 0 0 0 22\"" << endl;
+            else
+                out << "molecule " << structure << endl;
+            for (int i = 0; i < structure+2; i++)
+                out << (i == 0 ? "O" : "H") << " " << getCoordinate(structure, i, 0) << " " << getCoordinate(structure, i, 1) << " " << getCoordinate(structure, i, 2) << endl;
+        }
+    }
+    {
+        ANITrajectoryReader reader(fileName);
+        ASSERT_EQUAL(2, reader.getNumAtoms());
+        vector<string> symbols;
+        vector<float> positions, cell;
+        for (int structure = 0; structure < 3; structure++) {
+            ASSERT(reader.readStructure(symbols, positions, cell));
+            ASSERT_EQUAL(structure+2, symbols.size());
+            ASSERT_EQUAL(3*(structure+2), positions.size());
+            ASSERT_EQUAL("O", symbols[0]);
+            ASSERT_EQUAL("H", symbols.back());
+            for (int i = 0; i < structure+2; i++)
+                for (int j = 0; j < 3; j++)
+                    ASSERT_EQUAL_TOL(getCoordinate(structure, i, j), positions[3*i+j], 1e-6);
+            ASSERT_EQUAL(structure == 1 ? 9 : 0, cell.size());
+            if (structure == 1)
+                ASSERT_EQUAL_TOL(21.0, cell[4], 1e-6);
+        }
+        ASSERT(!reader.readStructure(symbols, positions, cell));
+        ASSERT_EQUAL(3, reader.getNumFramesRead());
+    }
+    remove(fileName.c_str());
+}
+
+void testUnknownFormat() {
+    bool threw = false;
+    try {
+        ANITrajectoryReader reader("trajectory.pdb");
+    }
+    catch (const OpenMMException& e) {
+        threw = true;
+    }
+    ASSERT(threw);
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        testDcd();
+        testXyz();
+        testStructures();
+        testUnknownFormat();
+    }
+    catch(const std::exception& e) {
+        cerr << "exception: " << e.what() << std::endl;
+        return 1;
+    }
+    cerr << "Done" << std::endl;
+    return 0;
+}
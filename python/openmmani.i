@@ -32,6 +32,10 @@
 %module openmmani
 %{
     #include "ANIForce.h"
+    #include "ANIOptimizer.h"
+    #include "ANIHessian.h"
+    #include "ANIReactionPath.h"
+    #include "ANIFeaturizer.h"
     #include "OpenMM.h"
     #include "OpenMMAmoeba.h"
     #include "OpenMMDrude.h"
@@ -49,6 +53,7 @@
 
 namespace std {
    %template(StringVector) vector<string>;
+   %template(DoubleVector) vector<double>;
 };
 
 using namespace std;
@@ -59,9 +64,108 @@ namespace ANIPlugin {
     class ANIForce : public OpenMM::Force {
     public:
         ANIForce(const string& aniInfoFile, vector<string> atomSymbols);
+        static void preloadModel(const string& aniInfoFile);
         const string& getInfoFile() const;
+        void setInfoFile(const string& aniInfoFile);
         const vector<string> getAtomSymbols() const;
         void setUsesPeriodicBoundaryConditions(bool periodic);
         bool usesPeriodicBoundaryConditions() const;
+        void setUseSharedEngine(bool shared);
+        bool getUseSharedEngine() const;
+        void setMaxBatchWait(double wait);
+        double getMaxBatchWait() const;
+        void setServer(const string& socketPath);
+        const string& getServer() const;
+        void setNumDomainWorkers(int workers);
+        int getNumDomainWorkers() const;
+        void setMaxMemory(double megabytes);
+        double getMaxMemory() const;
+        void setRecording(const string& file, int interval=1, double maxMegabytes=1000);
+        const string& getRecordingFile() const;
+        int getRecordingInterval() const;
+        double getMaxRecordingSize() const;
+        void setAlchemicalSymbols(const vector<string>& symbols);
+        const vector<string>& getAlchemicalSymbols() const;
+        void setAlchemicalParameter(const string& name);
+        const string& getAlchemicalParameter() const;
+        std::vector<OpenMM::Vec3> computeVirial(OpenMM::Context& context);
+        void updateParametersInContext(OpenMM::Context& context);
+        double getPeakMemory(OpenMM::Context& context);
+    };
+
+    class ANIOptimizer {
+    public:
+        ANIOptimizer(const string& aniInfoFile, const string& engineName="CPU");
+        int addMolecule(const vector<string>& atomSymbols, const std::vector<OpenMM::Vec3>& positions);
+        int getNumMolecules() const;
+        double getTolerance() const;
+        void setTolerance(double tolerance);
+        int getMaxIterations() const;
+        void setMaxIterations(int maxIterations);
+        int getHistorySize() const;
+        void setHistorySize(int size);
+        double getMaxStepSize() const;
+        void setMaxStepSize(double size);
+        void minimize();
+        std::vector<OpenMM::Vec3> getPositions(int molecule) const;
+        double getEnergy(int molecule) const;
+        int getNumIterations(int molecule) const;
+        bool isConverged(int molecule) const;
+        int getNumBatchEvaluations() const;
+    };
+
+    class ANIHessian {
+    public:
+        ANIHessian(const string& aniInfoFile, const string& engineName="CPU");
+        double getDisplacement() const;
+        void setDisplacement(double displacement);
+        int getMaxBatchSize() const;
+        void setMaxBatchSize(int size);
+        void computeHessian(const vector<string>& atomSymbols, const std::vector<OpenMM::Vec3>& positions);
+        void computeNormalModes(const vector<double>& masses);
+        int getNumAtoms() const;
+        double getEnergy() const;
+        std::vector<OpenMM::Vec3> getForces() const;
+        const vector<double>& getHessian() const;
+        const vector<double>& getFrequencies() const;
+        std::vector<OpenMM::Vec3> getNormalMode(int index) const;
+        int getNumBatchEvaluations() const;
+    };
+
+    class ANIReactionPath {
+    public:
+        ANIReactionPath(const string& aniInfoFile, const vector<string>& atomSymbols, const string& engineName="CPU");
+        int addImage(const std::vector<OpenMM::Vec3>& positions);
+        void interpolate(const std::vector<OpenMM::Vec3>& start, const std::vector<OpenMM::Vec3>& end, int numImages);
+        int getNumImages() const;
+        double getSpringConstant() const;
+        void setSpringConstant(double k);
+        bool getUseClimbingImage() const;
+        void setUseClimbingImage(bool use);
+        double getTolerance() const;
+        void setTolerance(double tolerance);
+        int getMaxIterations() const;
+        void setMaxIterations(int maxIterations);
+        double getMaxStepSize() const;
+        void setMaxStepSize(double size);
+        void optimize();
+        std::vector<OpenMM::Vec3> getPositions(int image) const;
+        double getEnergy(int image) const;
+        std::vector<OpenMM::Vec3> getForces(int image) const;
+        int getClimbingImage() const;
+        bool isConverged() const;
+        int getNumIterations() const;
+        int getNumBatchEvaluations() const;
+    };
+
+    class ANIFeaturizer {
+    public:
+        ANIFeaturizer(const string& aniInfoFile, const string& outputFile, int batchSize=256, int numThreads=0);
+        int getAEVLength() const;
+        const vector<string>& getSpecies() const;
+        void addStructure(const vector<string>& atomSymbols, const std::vector<OpenMM::Vec3>& positions);
+        void addStructure(const vector<string>& atomSymbols, const std::vector<OpenMM::Vec3>& positions, const std::vector<OpenMM::Vec3>& boxVectors);
+        long long getNumStructures() const;
+        void close();
     };
 }
@@ -31,6 +31,7 @@
 
 #include "ANIForceProxy.h"
 #include "ANIForce.h"
+#include "openmm/OpenMMException.h"
 #include "openmm/serialization/SerializationNode.h"
 #include <string>
 #include <vector>
@@ -47,34 +48,72 @@ ANIForceProxy::ANIForceProxy() : SerializationProxy("ANIForce") {
 }
 
 void ANIForceProxy::serialize(const void* object, SerializationNode& node) const {
-    node.setIntProperty("version", 1);
+    node.setIntProperty("version", 2);
     const ANIForce& force = *reinterpret_cast<const ANIForce*>(object);
-    node.setStringProperty("aniSerFile", ANI_SERIALIZATION_FILE);
-    
-    string aniInfoFile = force.getInfoFile();
-    vector<string> atomTypes = force.getAtomSymbols();
+    node.setIntProperty("forceGroup", force.getForceGroup());
+    node.setStringProperty("infoFile", force.getInfoFile());
+    node.setBoolProperty("usesPeriodic", force.usesPeriodicBoundaryConditions());
+    node.setBoolProperty("useSharedEngine", force.getUseSharedEngine());
+    node.setDoubleProperty("maxBatchWait", force.getMaxBatchWait());
+    node.setStringProperty("server", force.getServer());
+    node.setIntProperty("numDomainWorkers", force.getNumDomainWorkers());
+    node.setDoubleProperty("maxMemory", force.getMaxMemory());
+    node.setStringProperty("recordingFile", force.getRecordingFile());
+    node.setIntProperty("recordingInterval", force.getRecordingInterval());
+    node.setDoubleProperty("maxRecordingSize", force.getMaxRecordingSize());
+    node.setStringProperty("alchemicalParameter", force.getAlchemicalParameter());
+    SerializationNode& atoms = node.createChildNode("Atoms");
+    for (const string& symbol : force.getAtomSymbols())
+        atoms.createChildNode("Atom").setStringProperty("symbol", symbol);
+    SerializationNode& alchemicalAtoms = node.createChildNode("AlchemicalAtoms");
+    for (const string& symbol : force.getAlchemicalSymbols())
+        alchemicalAtoms.createChildNode("Atom").setStringProperty("symbol", symbol);
+}
 
-    ofstream ofs{ANI_SERIALIZATION_FILE};
-    if( ! ofs ) runtime_error("could not open " + ANI_SERIALIZATION_FILE);
-    ofs << aniInfoFile << endl;
-    for(string at:atomTypes)
-        ofs << at << endl;
+static vector<string> readSymbols(const SerializationNode& node) {
+    vector<string> symbols;
+    for (const SerializationNode& atom : node.getChildren())
+        symbols.push_back(atom.getStringProperty("symbol"));
+    return symbols;
 }
 
 void* ANIForceProxy::deserialize(const SerializationNode& node) const {
-    if (node.getIntProperty("version") != 1)
+    int version = node.getIntProperty("version");
+    if (version < 1 || version > 2)
         throw OpenMMException("Unsupported version number");
 
-    string aniInfoFile;
+    // Version 1 kept only the info file and the atoms, in a separate file.
+
+    if (version == 1) {
+        string aniInfoFile;
 
-    string serFile = node.getStringProperty("aniSerFile");
-    ifstream ifs{serFile};
+        string serFile = node.getStringProperty("aniSerFile");
+        ifstream ifs{serFile};
 
-    getline(ifs, aniInfoFile);
+        getline(ifs, aniInfoFile);
 
-    vector<string> atomTypes;
-    for( string at; ifs >> at; )
-        atomTypes.push_back(at);
-    ANIForce* force = new ANIForce(aniInfoFile, atomTypes);
+        vector<string> atomTypes;
+        for( string at; ifs >> at; )
+            atomTypes.push_back(at);
+        ANIForce* force = new ANIForce(aniInfoFile, atomTypes);
+        return force;
+    }
+    ANIForce* force = new ANIForce(node.getStringProperty("infoFile"), readSymbols(node.getChildNode("Atoms")));
+    try {
+        force->setForceGroup(node.getIntProperty("forceGroup"));
+        force->setUsesPeriodicBoundaryConditions(node.getBoolProperty("usesPeriodic"));
+        force->setUseSharedEngine(node.getBoolProperty("useSharedEngine"));
+        force->setMaxBatchWait(node.getDoubleProperty("maxBatchWait"));
+        force->setServer(node.getStringProperty("server"));
+        force->setNumDomainWorkers(node.getIntProperty("numDomainWorkers"));
+        force->setMaxMemory(node.getDoubleProperty("maxMemory"));
+        force->setRecording(node.getStringProperty("recordingFile"), node.getIntProperty("recordingInterval"), node.getDoubleProperty("maxRecordingSize"));
+        force->setAlchemicalParameter(node.getStringProperty("alchemicalParameter"));
+        force->setAlchemicalSymbols(readSymbols(node.getChildNode("AlchemicalAtoms")));
+    }
+    catch (...) {
+        delete force;
+        throw;
+    }
     return force;
 }
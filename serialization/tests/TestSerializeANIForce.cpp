@@ -48,6 +48,16 @@ void testSerialization() {
 
     vector<string> dummy = { "O","H","H" };
     ANIForce force("test_aniInfoFile.txt", dummy);
+    force.setForceGroup(3);
+    force.setUsesPeriodicBoundaryConditions(true);
+    force.setUseSharedEngine(true);
+    force.setMaxBatchWait(0.25);
+    force.setServer("ani.sock");
+    force.setNumDomainWorkers(4);
+    force.setMaxMemory(512.5);
+    force.setRecording("evaluations.anilog", 10, 64.0);
+    force.setAlchemicalSymbols({"N", "H", "H"});
+    force.setAlchemicalParameter("lambda_water");
 
     // Serialize and then deserialize it.
 
@@ -62,10 +72,24 @@ void testSerialization() {
 
     vector<string> atT1 = force.getAtomSymbols();
     vector<string> atT2 = force2.getAtomSymbols();
+    ASSERT_EQUAL(atT1.size(), atT2.size());
     for( int i=0; i<atT1.size(); i++ ) {
        //cerr << atT1[i] << " " << atT2[i] << endl;
        ASSERT_EQUAL(atT1[i], atT2[i]);
     }
+    ASSERT_EQUAL(force.getForceGroup(), force2.getForceGroup());
+    ASSERT_EQUAL(force.usesPeriodicBoundaryConditions(), force2.usesPeriodicBoundaryConditions());
+    ASSERT_EQUAL(force.getUseSharedEngine(), force2.getUseSharedEngine());
+    ASSERT_EQUAL(force.getMaxBatchWait(), force2.getMaxBatchWait());
+    ASSERT_EQUAL(force.getServer(), force2.getServer());
+    ASSERT_EQUAL(force.getNumDomainWorkers(), force2.getNumDomainWorkers());
+    ASSERT_EQUAL(force.getMaxMemory(), force2.getMaxMemory());
+    ASSERT_EQUAL(force.getRecordingFile(), force2.getRecordingFile());
+    ASSERT_EQUAL(force.getRecordingInterval(), force2.getRecordingInterval());
+    ASSERT_EQUAL(force.getMaxRecordingSize(), force2.getMaxRecordingSize());
+    ASSERT(force.getAlchemicalSymbols() == force2.getAlchemicalSymbols());
+    ASSERT_EQUAL(force.getAlchemicalParameter(), force2.getAlchemicalParameter());
+    delete copy;
 }
 
 int main() {
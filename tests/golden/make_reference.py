@@ -0,0 +1,280 @@
+#!/usr/bin/env python
+#
+# Generates the golden reference data used by TestReferenceANIGolden and
+# TestCudaANIGolden.
+#
+# It writes a small ANI ensemble with the H,C,N,O AEV layout of ANI-1x (so the
+# specialized CPU code is exercised) to model/, and a set of molecules and
+# periodic boxes of up to 3000 atoms together with their reference energies and
+# forces to reference.txt.  The reference values come from the straightforward
+# double precision implementation of the ANI equations below, which shares no
+# code with the plugin.  Forces are central finite differences of the energy for
+# a sample of atoms in each structure.
+#
+# Everything is generated from fixed seeds, so running this again reproduces the
+# committed files.  It only needs a standard Python installation:
+#
+#   python make_reference.py
+#
+import bz2
+import math
+import os
+import random
+import struct
+
+SPECIES = ['H', 'C', 'N', 'O']
+RCR = 5.2
+RCA = 3.5
+ETA_R = [16.0]
+SHF_R = [0.9 + 0.26875*i for i in range(16)]
+ETA_A = [8.0]
+ZETA = [32.0]
+SHF_A = [0.9, 1.55, 2.2, 2.85]
+SHF_Z = [0.19634954 + 0.39269908*i for i in range(8)]
+SELF_ENERGIES = {'H': -0.60095298, 'C': -38.08316124, 'N': -54.70775770, 'O': -75.19446356}
+HIDDEN = [12, 6]
+ACTIVATIONS = [9, 5]
+NUM_ENSEMBLES = 2
+
+# name, number of atoms, periodic box size (0 for none), number of sampled forces
+STRUCTURES = [
+    ('molecule12', 12, 0.0, 12),
+    ('molecule60', 60, 0.0, 10),
+    ('cluster250', 250, 0.0, 8),
+    ('box300', 300, 14.4, 8),
+    ('box1000', 1000, 21.5, 6),
+    ('box3000', 3000, 31.0, 6),
+]
+FD_STEP = 1e-4
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+
+def fmtList(values):
+    return '[' + ','.join('%.8e' % v for v in values) + ']'
+
+
+def aevLength():
+    ns = len(SPECIES)
+    return ns*len(ETA_R)*len(SHF_R) + ns*(ns+1)//2*len(ETA_A)*len(ZETA)*len(SHF_A)*len(SHF_Z)
+
+
+def writeModel(directory):
+    rng = random.Random(1)
+    with open(os.path.join(directory, 'model.params'), 'w') as f:
+        f.write('TM = 1\nRcr = %g\nRca = %g\n' % (RCR, RCA))
+        f.write('EtaR = %s\nShfR = %s\nZeta = %s\nShfZ = %s\nEtaA = %s\nShfA = %s\n' % (
+            fmtList(ETA_R), fmtList(SHF_R), fmtList(ZETA), fmtList(SHF_Z), fmtList(ETA_A), fmtList(SHF_A)))
+        f.write('Atyp = [%s]\n' % ','.join(SPECIES))
+    with open(os.path.join(directory, 'sae_linfit.dat'), 'w') as f:
+        for i, s in enumerate(SPECIES):
+            f.write('%s,%d=%.10f\n' % (s, i, SELF_ENERGIES[s]))
+    sizes = [aevLength()] + HIDDEN + [1]
+    for e in range(NUM_ENSEMBLES):
+        networkDir = os.path.join(directory, 'train%d' % e, 'networks')
+        if not os.path.isdir(networkDir):
+            os.makedirs(networkDir)
+        for s in SPECIES:
+            text = '!InputFile for Force Prediction Network\nsublayers=1;\n\nnetwork_setup {\n    inputsize=%d;\n' % sizes[0]
+            for l in range(len(sizes)-1):
+                n, m = sizes[l], sizes[l+1]
+                weights = [rng.gauss(0, 1/math.sqrt(n)) for i in range(n*m)]
+                biases = [rng.gauss(0, 0.1) for i in range(m)]
+                activation = ACTIVATIONS[l] if l < len(HIDDEN) else 6
+                weightFile = 'ANN-%s-%d-W.wparam' % (s, l)
+                biasFile = 'ANN-%s-%d-B.wparam' % (s, l)
+                with open(os.path.join(networkDir, weightFile), 'wb') as f:
+                    f.write(struct.pack('<%df' % len(weights), *weights))
+                with open(os.path.join(networkDir, biasFile), 'wb') as f:
+                    f.write(struct.pack('<%df' % len(biases), *biases))
+                text += ('    layer [\n        nodes=%d;\n        activation=%d;\n        type=0;\n        dropout=0;\n'
+                         '        dropset=0.5;\n        maxnorm=0;\n        norm=3.0;\n        normupdate=0;\n'
+                         '        blocksize=%d;\n        weights=FILE:%s[%d];\n        biases=FILE:%s[%d];\n    ]\n'
+                         % (m, activation, n, weightFile, n*m, biasFile, m))
+            text += '}\n\0'
+            with open(os.path.join(networkDir, 'ANN-%s.nnf' % s), 'wb') as f:
+                f.write(b'!NetParameters\nnnf_version=\n' + bz2.compress(text.encode()))
+
+
+def readModel(directory):
+    # Read back the weights as single precision values, exactly as the plugin sees them.
+    networks = []
+    sizes = [aevLength()] + HIDDEN + [1]
+    for e in range(NUM_ENSEMBLES):
+        networkDir = os.path.join(directory, 'train%d' % e, 'networks')
+        species = {}
+        for s in SPECIES:
+            layers = []
+            for l in range(len(sizes)-1):
+                n, m = sizes[l], sizes[l+1]
+                with open(os.path.join(networkDir, 'ANN-%s-%d-W.wparam' % (s, l)), 'rb') as f:
+                    weights = struct.unpack('<%df' % (n*m), f.read())
+                with open(os.path.join(networkDir, 'ANN-%s-%d-B.wparam' % (s, l)), 'rb') as f:
+                    biases = struct.unpack('<%df' % m, f.read())
+                activation = ACTIVATIONS[l] if l < len(HIDDEN) else 6
+                layers.append((n, m, activation, weights, biases))
+            species[s] = layers
+        networks.append(species)
+    return networks
+
+
+class Structure(object):
+    def __init__(self, name, symbols, positions, box):
+        self.name = name
+        self.symbols = symbols
+        self.positions = positions
+        self.box = box
+        # Bin the atoms so neighbors can be found quickly.
+        self.binSize = RCR
+        self.bins = {}
+        for i, p in enumerate(positions):
+            self.bins.setdefault(self.binOf(p), []).append(i)
+
+    def binOf(self, p):
+        if self.box > 0:
+            n = max(1, int(self.box/self.binSize))
+            return tuple(int((x % self.box)/self.box*n) % n for x in p)
+        return tuple(int(math.floor(x/self.binSize)) for x in p)
+
+    def delta(self, p, q):
+        d = [q[k]-p[k] for k in range(3)]
+        if self.box > 0:
+            d = [x - self.box*round(x/self.box) for x in d]
+        return d
+
+    def neighbors(self, i, p):
+        # All atoms other than i within RCR of the point p, with their displacements.
+        b = self.binOf(p)
+        n = max(1, int(self.box/self.binSize)) if self.box > 0 else None
+        seen = set()
+        result = []
+        for dx in (-1, 0, 1):
+            for dy in (-1, 0, 1):
+                for dz in (-1, 0, 1):
+                    key = (b[0]+dx, b[1]+dy, b[2]+dz)
+                    if n is not None:
+                        key = tuple(k % n for k in key)
+                    if key in seen:
+                        continue
+                    seen.add(key)
+                    for j in self.bins.get(key, []):
+                        if j == i:
+                            continue
+                        d = self.delta(p, self.positions[j])
+                        r = math.sqrt(d[0]*d[0] + d[1]*d[1] + d[2]*d[2])
+                        if r < RCR:
+                            result.append((j, d, r))
+        return result
+
+
+def cutoff(r, rc):
+    return 0.5*math.cos(math.pi*r/rc) + 0.5
+
+
+def atomEnergy(structure, networks, i):
+    ns = len(SPECIES)
+    radialSize = len(ETA_R)*len(SHF_R)
+    angularSize = len(ETA_A)*len(ZETA)*len(SHF_A)*len(SHF_Z)
+    aev = [0.0]*aevLength()
+    neighbors = structure.neighbors(i, structure.positions[i])
+    angular = []
+    for j, d, r in neighbors:
+        s = SPECIES.index(structure.symbols[j])
+        t = 0
+        for eta in ETA_R:
+            for shift in SHF_R:
+                aev[s*radialSize+t] += 0.25*math.exp(-eta*(r-shift)**2)*cutoff(r, RCR)
+                t += 1
+        if r < RCA:
+            angular.append((s, d, r))
+    pairIndex = {}
+    index = 0
+    for a in range(ns):
+        for b in range(a, ns):
+            pairIndex[(a, b)] = pairIndex[(b, a)] = index
+            index += 1
+    for a in range(len(angular)):
+        for b in range(a+1, len(angular)):
+            sj, dj, rj = angular[a]
+            sk, dk, rk = angular[b]
+            cosine = (dj[0]*dk[0] + dj[1]*dk[1] + dj[2]*dk[2])/(rj*rk)
+            theta = math.acos(0.95*cosine)
+            base = ns*radialSize + pairIndex[(sj, sk)]*angularSize
+            scale = cutoff(rj, RCA)*cutoff(rk, RCA)
+            t = 0
+            for eta in ETA_A:
+                for zeta in ZETA:
+                    for shiftA in SHF_A:
+                        radial = math.exp(-eta*((rj+rk)/2-shiftA)**2)
+                        for shiftZ in SHF_Z:
+                            aev[base+t] += 2*((1+math.cos(theta-shiftZ))/2)**zeta*radial*scale
+                            t += 1
+    energy = 0.0
+    for network in networks:
+        x = aev
+        for n, m, activation, weights, biases in network[structure.symbols[i]]:
+            y = [biases[o] + sum(weights[o*n+k]*x[k] for k in range(n)) for o in range(m)]
+            if activation == 9:
+                y = [v if v > 0 else 0.1*(math.exp(v/0.1)-1) for v in y]
+            elif activation == 5:
+                y = [math.exp(-v*v) for v in y]
+            x = y
+        energy += x[0]/len(networks)
+    return energy + SELF_ENERGIES[structure.symbols[i]]
+
+
+def createStructure(name, numAtoms, box, rng):
+    # Random atoms no closer than 1 Angstrom, at about the density of a liquid.
+    size = box if box > 0 else (numAtoms/0.1)**(1.0/3.0)
+    positions = []
+    while len(positions) < numAtoms:
+        p = [rng.uniform(0, size) for k in range(3)]
+        structure = Structure(name, [], positions, box)
+        if all(r >= 1.0 for j, d, r in structure.neighbors(-1, p)):
+            positions.append(p)
+    symbols = [rng.choice(SPECIES) for i in range(numAtoms)]
+    return Structure(name, symbols, positions, box)
+
+
+def main():
+    modelDir = os.path.join(HERE, 'model')
+    if not os.path.isdir(modelDir):
+        os.makedirs(modelDir)
+    writeModel(modelDir)
+    networks = readModel(modelDir)
+    rng = random.Random(2)
+    with open(os.path.join(HERE, 'reference.txt'), 'w') as out:
+        out.write('# Golden reference data written by make_reference.py.  Energies are in Hartree,\n')
+        out.write('# positions in Angstrom and forces in Hartree/Angstrom.\n')
+        for name, numAtoms, box, numForces in STRUCTURES:
+            structure = createStructure(name, numAtoms, box, rng)
+            # Round the positions to what is written, so the file is exact.
+            structure = Structure(name, structure.symbols, [[float('%.6f' % x) for x in p] for p in structure.positions], box)
+            energy = sum(atomEnergy(structure, networks, i) for i in range(numAtoms))
+            out.write('structure %s %d %d\n' % (name, numAtoms, 1 if box > 0 else 0))
+            if box > 0:
+                out.write('cell %g 0 0 0 %g 0 0 0 %g\n' % (box, box, box))
+            for s, p in zip(structure.symbols, structure.positions):
+                out.write('%s %.6f %.6f %.6f\n' % (s, p[0], p[1], p[2]))
+            out.write('energy %.12f\n' % energy)
+
+            # Moving one atom only changes the energies of the atoms within the
+            # cutoff, so only those are recomputed for the finite differences.
+
+            for i in rng.sample(range(numAtoms), numForces):
+                affected = [i] + [j for j, d, r in structure.neighbors(i, structure.positions[i])]
+                force = []
+                for k in range(3):
+                    energies = []
+                    for step in (FD_STEP, -FD_STEP):
+                        positions = [list(p) for p in structure.positions]
+                        positions[i][k] += step
+                        displaced = Structure(name, structure.symbols, positions, box)
+                        energies.append(sum(atomEnergy(displaced, networks, j) for j in affected))
+                    force.append(-(energies[0]-energies[1])/(2*FD_STEP))
+                out.write('force %d %.10e %.10e %.10e\n' % (i, force[0], force[1], force[2]))
+            out.write('end\n')
+            print('%s: %d atoms, E = %.8f' % (name, numAtoms, energy))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,132 @@
+/* -------------------------------------------------------------------------- *
+ * The MIT License
+ *
+ * SPDX short identifier: MIT
+ *
+ * Copyright 2019 Genentech Inc. South San Francisco
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ * -------------------------------------------------------------------------- */
+
+/**
+ * ani-featurize computes the AEVs of every structure in one or more XYZ files
+ * and writes them to a memory mappable file (see ANIFeaturizer for its
+ * layout), to produce training data with the same descriptors the plugin uses.
+ *
+ * The structures may differ in their atoms, as in a data set of molecules.
+ * Each structure may have its own extended XYZ lattice.  The input files are
+ * memory mapped and streamed, and the AEVs of one batch are written while the
+ * next batch is computed.
+ */
+
+#include "ANIFeaturizer.h"
+#include "internal/ANITrajectoryReader.h"
+#include "openmm/OpenMMException.h"
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace ANIPlugin;
+using namespace OpenMM;
+using namespace std;
+
+struct Options {
+    string infoFile, outputFile;
+    vector<string> inputFiles;
+    int batchSize, numThreads;
+    bool periodic;
+};
+
+static void printUsage() {
+    cerr << "Usage: ani-featurize [options] aniInfo.txt input.xyz [input2.xyz ...] output.aev" << endl;
+    cerr << "Computes the AEVs of every structure of one or more .xyz files." << endl;
+    cerr << "  --batch n          the number of structures featurized together (default 256)" << endl;
+    cerr << "  --threads n        the number of threads (default: one per core)" << endl;
+    cerr << "  --no-pbc           ignore the lattices of the structures" << endl;
+}
+
+static Options parseOptions(int argc, char* argv[]) {
+    Options options = {"", "", vector<string>(), 256, 0, true};
+    vector<string> files;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        bool hasValue = (i+1 < argc);
+        if (arg == "--batch" && hasValue)
+            options.batchSize = atoi(argv[++i]);
+        else if (arg == "--threads" && hasValue)
+            options.numThreads = atoi(argv[++i]);
+        else if (arg == "--no-pbc")
+            options.periodic = false;
+        else if (arg.size() > 1 && arg[0] == '-')
+            throw OpenMMException("Unknown option: "+arg);
+        else
+            files.push_back(arg);
+    }
+    if (files.size() < 3)
+        throw OpenMMException("Expected an info file, at least one input file and an output file");
+    options.infoFile = files.front();
+    options.outputFile = files.back();
+    options.inputFiles.assign(files.begin()+1, files.end()-1);
+    if (options.batchSize < 1)
+        throw OpenMMException("The batch size must be at least 1");
+    return options;
+}
+
+static void featurize(const Options& options) {
+    ANIFeaturizer featurizer(options.infoFile, options.outputFile, options.batchSize, options.numThreads);
+    vector<string> symbols;
+    vector<float> positions, cell;
+    long long numAtoms = 0;
+    for (const string& inputFile : options.inputFiles) {
+        ANITrajectoryReader reader(inputFile, "xyz");
+        while (reader.readStructure(symbols, positions, cell)) {
+            try {
+                featurizer.addStructure(symbols, positions.data(), options.periodic && !cell.empty() ? cell.data() : NULL);
+            }
+            catch (const OpenMMException& e) {
+                throw OpenMMException(inputFile+", structure "+to_string(reader.getNumFramesRead()-1)+": "+e.what());
+            }
+            numAtoms += symbols.size();
+        }
+    }
+    featurizer.close();
+    cerr << "Featurized " << featurizer.getNumStructures() << " structures with " << numAtoms << " atoms, ";
+    cerr << featurizer.getAEVLength() << " values per atom" << endl;
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        if (argc < 2 || string(argv[1]) == "--help" || string(argv[1]) == "-h") {
+            printUsage();
+            return (argc < 2 ? 1 : 0);
+        }
+        Options options = parseOptions(argc, argv);
+        auto start = chrono::steady_clock::now();
+        featurize(options);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now()-start).count();
+        cerr << "Finished in " << seconds << " seconds" << endl;
+    }
+    catch (const exception& e) {
+        cerr << "ani-featurize: " << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
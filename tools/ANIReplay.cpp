@@ -0,0 +1,193 @@
+/* -------------------------------------------------------------------------- *
+ * The MIT License
+ *
+ * SPDX short identifier: MIT
+ *
+ * Copyright 2019 Genentech Inc. South San Francisco
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ * -------------------------------------------------------------------------- */
+
+/**
+ * ani-replay evaluates the structures of an evaluation log, recorded by an
+ * ANIForce with setRecording(), again with any engine, for example to
+ * benchmark an engine on a production workload or to check how much a
+ * different engine or precision changes the results.
+ *
+ * Every record is evaluated on its own, as the force did during the run, and
+ * timed without the time spent reading the log.  The report lists the time
+ * per evaluation and the largest and RMS deviations of the energies and
+ * forces from the recorded ones.
+ */
+
+#include "ANIEngine.h"
+#include "internal/ANIEvaluationLog.h"
+#include "internal/ANIModelInfo.h"
+#include "internal/CpuANIEngine.h"
+#include "openmm/OpenMMException.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace ANIPlugin;
+using namespace OpenMM;
+using namespace std;
+
+struct Options {
+    string logFile, infoFile, engineName;
+    int numThreads, numRepeats;
+    bool forces;
+};
+
+/**
+ * Accumulates the largest and RMS deviation of a set of values.
+ */
+struct Deviation {
+    Deviation() : max(0), sumSquared(0), count(0) {
+    }
+    void add(double difference) {
+        max = std::max(max, fabs(difference));
+        sumSquared += difference*difference;
+        count++;
+    }
+    double rms() const {
+        return (count == 0 ? 0.0 : sqrt(sumSquared/count));
+    }
+    double max, sumSquared;
+    long long count;
+};
+
+static void printUsage() {
+    cerr << "Usage: ani-replay [options] log" << endl;
+    cerr << "Evaluates the structures of an evaluation log recorded by ANIForce.setRecording() again," << endl;
+    cerr << "and reports the time per evaluation and the deviations from the recorded results." << endl;
+    cerr << "  --info file        the model to evaluate (default: the one the log was recorded with)" << endl;
+    cerr << "  --engine name      CPU (default), CPUFast, CPUTabulated or NeuroChem" << endl;
+    cerr << "  --threads n        the number of threads of the CPU engines (default: one per core)" << endl;
+    cerr << "  --repeat n         replay the log n times (default 1)" << endl;
+    cerr << "  --no-forces        only compute energies" << endl;
+}
+
+static Options parseOptions(int argc, char* argv[]) {
+    Options options = {"", "", "CPU", 0, 1, true};
+    vector<string> files;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        bool hasValue = (i+1 < argc);
+        if (arg == "--info" && hasValue)
+            options.infoFile = argv[++i];
+        else if (arg == "--engine" && hasValue)
+            options.engineName = argv[++i];
+        else if (arg == "--threads" && hasValue)
+            options.numThreads = atoi(argv[++i]);
+        else if (arg == "--repeat" && hasValue)
+            options.numRepeats = atoi(argv[++i]);
+        else if (arg == "--no-forces")
+            options.forces = false;
+        else if (arg.size() > 1 && arg[0] == '-')
+            throw OpenMMException("Unknown option: "+arg);
+        else
+            files.push_back(arg);
+    }
+    if (files.size() != 1)
+        throw OpenMMException("Expected a log file");
+    options.logFile = files[0];
+    if (options.numRepeats < 1)
+        throw OpenMMException("The number of repeats must be at least 1");
+    return options;
+}
+
+static void replay(const Options& options) {
+    string infoFile = options.infoFile;
+    if (infoFile.empty())
+        infoFile = ANIEvaluationLogReader(options.logFile).getInfoFile();
+    unique_ptr<ANIEngine> engine;
+    if (options.engineName == "CPU" || options.engineName == "CPUFast" || options.engineName == "CPUTabulated")
+        engine.reset(new CpuANIEngine(ANIModelInfo::read(infoFile), options.numThreads, true, options.engineName == "CPUFast", false,
+                                      options.engineName == "CPUTabulated"));
+    else
+        engine.reset(ANIEngine::create(infoFile, options.engineName));
+
+    // Replay the log, timing only the evaluations.
+
+    vector<double> times;
+    Deviation energyDeviation, forceDeviation;
+    int numAtoms = 0;
+    for (int repeat = 0; repeat < options.numRepeats; repeat++) {
+        ANIEvaluationLogReader reader(options.logFile);
+        const vector<string>& symbols = reader.getSymbols();
+        numAtoms = symbols.size();
+        ANILoggedEvaluation record;
+        vector<float> forces(3*numAtoms);
+        vector<ANIEvaluation> batch(1);
+        while (reader.read(record)) {
+            ANIEvaluation& eval = batch[0];
+            eval.symbols = &symbols;
+            eval.positions = record.positions.data();
+            eval.cell = (record.cell.empty() ? NULL : record.cell.data());
+            eval.forces = (options.forces ? forces.data() : NULL);
+            auto start = chrono::steady_clock::now();
+            engine->computeBatch(batch);
+            times.push_back(chrono::duration<double, milli>(chrono::steady_clock::now()-start).count());
+            energyDeviation.add(eval.energy-record.energy);
+            if (options.forces && !record.forces.empty())
+                for (int i = 0; i < 3*numAtoms; i++)
+                    forceDeviation.add(forces[i]-record.forces[i]);
+        }
+    }
+    if (times.empty())
+        throw OpenMMException(options.logFile+" contains no evaluations");
+
+    // Report the results.
+
+    double total = 0;
+    for (double t : times)
+        total += t;
+    vector<double> sorted = times;
+    sort(sorted.begin(), sorted.end());
+    printf("Replayed %d evaluations of %d atoms with the %s engine\n", (int) times.size(), numAtoms, options.engineName.c_str());
+    printf("Time per evaluation (ms): mean %.3f, median %.3f, min %.3f, max %.3f\n",
+           total/times.size(), sorted[sorted.size()/2], sorted.front(), sorted.back());
+    printf("Energy deviation (Hartree): max %.3g, RMS %.3g\n", energyDeviation.max, energyDeviation.rms());
+    if (forceDeviation.count > 0)
+        printf("Force deviation (Hartree/A): max %.3g, RMS %.3g\n", forceDeviation.max, forceDeviation.rms());
+    else
+        printf("Force deviation (Hartree/A): no recorded forces to compare\n");
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        if (argc < 2 || string(argv[1]) == "--help" || string(argv[1]) == "-h") {
+            printUsage();
+            return (argc < 2 ? 1 : 0);
+        }
+        replay(parseOptions(argc, argv));
+    }
+    catch (const exception& e) {
+        cerr << "ani-replay: " << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
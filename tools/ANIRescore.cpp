@@ -0,0 +1,404 @@
+/* -------------------------------------------------------------------------- *
+ * The MIT License
+ *
+ * SPDX short identifier: MIT
+ *
+ * Copyright 2019 Genentech Inc. South San Francisco
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ * -------------------------------------------------------------------------- */
+
+/**
+ * ani-rescore computes the ANI energies of every frame of a DCD or XYZ
+ * trajectory, for example to re-score a classical simulation.
+ *
+ * The trajectory is memory mapped and streamed through three threads: one
+ * reads batches of frames, one evaluates them with an ANIEngine and one
+ * writes the results.  A fixed number of batches circulates between them, so
+ * memory use does not depend on the length of the trajectory, and reading and
+ * writing overlap with the evaluation.
+ *
+ * The output is either CSV, or a binary file with the following layout (all
+ * values little endian):
+ *
+ *   header:    char[8] "ANISCORE", int32 version (1), int32 number of atoms,
+ *              int32 flags (1: forces, 2: ensemble standard deviation)
+ *   per frame: float64 energy, float64 standard deviation (if flag 2),
+ *              float32[3*atoms] forces (if flag 1)
+ *
+ * Energies are in Hartree and forces in Hartree/Angstrom.
+ */
+
+#include "ANIEngine.h"
+#include "internal/ANIModelInfo.h"
+#include "internal/ANITrajectoryReader.h"
+#include "internal/CpuANIEngine.h"
+#include "openmm/OpenMMException.h"
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace ANIPlugin;
+using namespace OpenMM;
+using namespace std;
+
+// The number of batches circulating between the threads.
+static const int NUM_BATCHES = 3;
+
+struct Options {
+    string infoFile, trajectoryFile, outputFile, engineName, symbolsFile, format;
+    int batchSize, numThreads;
+    bool forces, ensembleStd, periodic;
+};
+
+/**
+ * A batch of frames together with the results computed for them.
+ */
+struct FrameBatch {
+    long long firstFrame;
+    int numFrames;
+    vector<float> positions, cells, forces;
+    vector<double> energies, ensembleEnergies;
+};
+
+/**
+ * A queue of batches passed from one thread to the next.  pop() blocks until
+ * a batch is available and returns false once the queue has been closed and
+ * is empty, or when the whole pipeline has been aborted.
+ */
+class BatchQueue {
+public:
+    BatchQueue() : closed(false), aborted(false) {
+    }
+    void push(FrameBatch* batch) {
+        lock_guard<mutex> guard(lock);
+        batches.push_back(batch);
+        condition.notify_one();
+    }
+    bool pop(FrameBatch*& batch) {
+        unique_lock<mutex> guard(lock);
+        condition.wait(guard, [&] () {return aborted || closed || !batches.empty();});
+        if (aborted || batches.empty())
+            return false;
+        batch = batches.front();
+        batches.pop_front();
+        return true;
+    }
+    void close() {
+        lock_guard<mutex> guard(lock);
+        closed = true;
+        condition.notify_all();
+    }
+    void abort() {
+        lock_guard<mutex> guard(lock);
+        aborted = true;
+        condition.notify_all();
+    }
+private:
+    mutex lock;
+    condition_variable condition;
+    deque<FrameBatch*> batches;
+    bool closed, aborted;
+};
+
+/**
+ * Writes the results of each frame in CSV or binary form.
+ */
+class ScoreWriter {
+public:
+    ScoreWriter(const Options& options, int numAtoms, int numEnsembles) : options(options), numAtoms(numAtoms), numEnsembles(numEnsembles) {
+        file = fopen(options.outputFile.c_str(), "wb");
+        if (file == NULL)
+            throw OpenMMException("Cannot create "+options.outputFile);
+        setvbuf(file, NULL, _IOFBF, 1<<20);
+        if (options.format == "csv") {
+            fprintf(file, "frame,energy");
+            if (options.ensembleStd)
+                fprintf(file, ",std");
+            if (options.forces)
+                for (int i = 0; i < numAtoms; i++)
+                    fprintf(file, ",fx%d,fy%d,fz%d", i, i, i);
+            fprintf(file, "\n");
+        }
+        else {
+            int header[3] = {1, numAtoms, (options.forces ? 1 : 0) | (options.ensembleStd ? 2 : 0)};
+            fwrite("ANISCORE", 1, 8, file);
+            fwrite(header, sizeof(int), 3, file);
+        }
+    }
+    ~ScoreWriter() {
+        if (file != NULL)
+            fclose(file);
+    }
+    void write(const FrameBatch& batch) {
+        for (int i = 0; i < batch.numFrames; i++) {
+            double std = 0;
+            if (options.ensembleStd) {
+                const double* energies = &batch.ensembleEnergies[i*numEnsembles];
+                for (int e = 0; e < numEnsembles; e++)
+                    std += (energies[e]-batch.energies[i])*(energies[e]-batch.energies[i]);
+                std = sqrt(std/numEnsembles);
+            }
+            const float* forces = (options.forces ? &batch.forces[3*i*numAtoms] : NULL);
+            if (options.format == "csv") {
+                fprintf(file, "%lld,%.8f", batch.firstFrame+i, batch.energies[i]);
+                if (options.ensembleStd)
+                    fprintf(file, ",%.8f", std);
+                if (options.forces)
+                    for (int j = 0; j < 3*numAtoms; j++)
+                        fprintf(file, ",%.7g", forces[j]);
+                fprintf(file, "\n");
+            }
+            else {
+                fwrite(&batch.energies[i], sizeof(double), 1, file);
+                if (options.ensembleStd)
+                    fwrite(&std, sizeof(double), 1, file);
+                if (options.forces)
+                    fwrite(forces, sizeof(float), 3*numAtoms, file);
+            }
+        }
+        if (ferror(file))
+            throw OpenMMException("Error writing "+options.outputFile);
+    }
+private:
+    const Options& options;
+    int numAtoms, numEnsembles;
+    FILE* file;
+};
+
+static void printUsage() {
+    cerr << "Usage: ani-rescore [options] aniInfo.txt trajectory output" << endl;
+    cerr << "Computes the ANI energy of every frame of a .dcd or .xyz trajectory." << endl;
+    cerr << "  --engine name      CPU (default), CPUFast, CPUTabulated or NeuroChem" << endl;
+    cerr << "  --symbols file     the atom symbols, separated by whitespace, or an .xyz file" << endl;
+    cerr << "                     with the atoms.  Required for DCD trajectories." << endl;
+    cerr << "  --batch n          the number of frames evaluated together (default 32)" << endl;
+    cerr << "  --threads n        the number of threads of the CPU engines (default: one per core)" << endl;
+    cerr << "  --forces           also write the forces" << endl;
+    cerr << "  --std              also write the standard deviation of the ensemble energies (CPU engines)" << endl;
+    cerr << "  --no-pbc           ignore the periodic cell of the trajectory" << endl;
+    cerr << "  --format f         csv or binary (default: csv if the output ends in .csv, binary otherwise)" << endl;
+}
+
+static Options parseOptions(int argc, char* argv[]) {
+    Options options = {"", "", "", "CPU", "", "", 32, 0, false, false, true};
+    vector<string> files;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        bool hasValue = (i+1 < argc);
+        if (arg == "--engine" && hasValue)
+            options.engineName = argv[++i];
+        else if (arg == "--symbols" && hasValue)
+            options.symbolsFile = argv[++i];
+        else if (arg == "--batch" && hasValue)
+            options.batchSize = atoi(argv[++i]);
+        else if (arg == "--threads" && hasValue)
+            options.numThreads = atoi(argv[++i]);
+        else if (arg == "--format" && hasValue)
+            options.format = argv[++i];
+        else if (arg == "--forces")
+            options.forces = true;
+        else if (arg == "--std")
+            options.ensembleStd = true;
+        else if (arg == "--no-pbc")
+            options.periodic = false;
+        else if (arg.size() > 1 && arg[0] == '-')
+            throw OpenMMException("Unknown option: "+arg);
+        else
+            files.push_back(arg);
+    }
+    if (files.size() != 3)
+        throw OpenMMException("Expected an info file, a trajectory and an output file");
+    options.infoFile = files[0];
+    options.trajectoryFile = files[1];
+    options.outputFile = files[2];
+    if (options.format.empty()) {
+        const string& out = options.outputFile;
+        options.format = (out.size() > 4 && out.substr(out.size()-4) == ".csv" ? "csv" : "binary");
+    }
+    if (options.format != "csv" && options.format != "binary")
+        throw OpenMMException("Unknown output format: "+options.format);
+    if (options.batchSize < 1)
+        throw OpenMMException("The batch size must be at least 1");
+    return options;
+}
+
+static vector<string> readSymbols(const string& file) {
+    size_t length = file.size();
+    if (length > 4 && (file.substr(length-4) == ".xyz" || file.substr(length-4) == ".XYZ"))
+        return ANITrajectoryReader(file, "xyz").getSymbols();
+    ifstream in(file);
+    if (!in)
+        throw OpenMMException("Cannot open "+file);
+    vector<string> symbols;
+    string symbol;
+    while (in >> symbol)
+        symbols.push_back(symbol);
+    return symbols;
+}
+
+static void rescore(const Options& options) {
+    ANITrajectoryReader reader(options.trajectoryFile);
+    const int numAtoms = reader.getNumAtoms();
+    vector<string> symbols = reader.getSymbols();
+    if (!options.symbolsFile.empty())
+        symbols = readSymbols(options.symbolsFile);
+    if (symbols.empty())
+        throw OpenMMException(options.trajectoryFile+" does not contain atom symbols: use --symbols");
+    if (symbols.size() != numAtoms)
+        throw OpenMMException("The trajectory has "+to_string(numAtoms)+" atoms but "+to_string(symbols.size())+" symbols were given");
+    const bool periodic = (options.periodic && reader.hasCell());
+
+    // Create the engine.
+
+    ANIModelInfo info = ANIModelInfo::read(options.infoFile);
+    unique_ptr<ANIEngine> engine;
+    if (options.engineName == "CPU" || options.engineName == "CPUFast" || options.engineName == "CPUTabulated")
+        engine.reset(new CpuANIEngine(info, options.numThreads, true, options.engineName == "CPUFast", false,
+                                      options.engineName == "CPUTabulated"));
+    else if (options.ensembleStd)
+        throw OpenMMException("--std requires a CPU engine");
+    else
+        engine.reset(ANIEngine::create(options.infoFile, options.engineName));
+    const int numEnsembles = info.nEnsembles;
+
+    vector<FrameBatch> batches(NUM_BATCHES);
+    BatchQueue freeBatches, toEvaluate, toWrite;
+    for (FrameBatch& batch : batches) {
+        batch.positions.resize(3*numAtoms*options.batchSize);
+        batch.cells.resize(9*options.batchSize);
+        batch.energies.resize(options.batchSize);
+        if (options.ensembleStd)
+            batch.ensembleEnergies.resize(numEnsembles*options.batchSize);
+        if (options.forces)
+            batch.forces.resize(3*numAtoms*options.batchSize);
+        freeBatches.push(&batch);
+    }
+    ScoreWriter writer(options, numAtoms, numEnsembles);
+
+    // Whichever thread fails first records its exception and stops the others.
+
+    mutex errorLock;
+    exception_ptr error;
+    auto fail = [&] () {
+        lock_guard<mutex> guard(errorLock);
+        if (!error)
+            error = current_exception();
+        freeBatches.abort();
+        toEvaluate.abort();
+        toWrite.abort();
+    };
+    long long numFrames = 0;
+    thread readThread([&] () {
+        try {
+            FrameBatch* batch;
+            bool more = true;
+            while (more && freeBatches.pop(batch)) {
+                batch->firstFrame = reader.getNumFramesRead();
+                batch->numFrames = 0;
+                while (batch->numFrames < options.batchSize) {
+                    int i = batch->numFrames;
+                    if (!reader.readFrame(&batch->positions[3*numAtoms*i], &batch->cells[9*i])) {
+                        more = false;
+                        break;
+                    }
+                    batch->numFrames++;
+                }
+                if (batch->numFrames > 0)
+                    toEvaluate.push(batch);
+            }
+            toEvaluate.close();
+        }
+        catch (...) {
+            fail();
+        }
+    });
+    thread writeThread([&] () {
+        try {
+            FrameBatch* batch;
+            while (toWrite.pop(batch)) {
+                writer.write(*batch);
+                numFrames += batch->numFrames;
+                freeBatches.push(batch);
+            }
+        }
+        catch (...) {
+            fail();
+        }
+    });
+    try {
+        vector<ANIEvaluation> evaluations;
+        FrameBatch* batch;
+        while (toEvaluate.pop(batch)) {
+            evaluations.resize(batch->numFrames);
+            for (int i = 0; i < batch->numFrames; i++) {
+                ANIEvaluation& eval = evaluations[i];
+                eval.symbols = &symbols;
+                eval.positions = &batch->positions[3*numAtoms*i];
+                eval.cell = (periodic ? &batch->cells[9*i] : NULL);
+                eval.forces = (options.forces ? &batch->forces[3*numAtoms*i] : NULL);
+                eval.ensembleEnergies = (options.ensembleStd ? &batch->ensembleEnergies[numEnsembles*i] : NULL);
+            }
+            engine->computeBatch(evaluations);
+            for (int i = 0; i < batch->numFrames; i++)
+                batch->energies[i] = evaluations[i].energy;
+            toWrite.push(batch);
+        }
+        toWrite.close();
+    }
+    catch (...) {
+        fail();
+    }
+    readThread.join();
+    writeThread.join();
+    if (error)
+        rethrow_exception(error);
+    cerr << "Scored " << numFrames << " frames of " << numAtoms << " atoms" << endl;
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        if (argc < 2 || string(argv[1]) == "--help" || string(argv[1]) == "-h") {
+            printUsage();
+            return (argc < 2 ? 1 : 0);
+        }
+        Options options = parseOptions(argc, argv);
+        auto start = chrono::steady_clock::now();
+        rescore(options);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now()-start).count();
+        cerr << "Finished in " << seconds << " seconds" << endl;
+    }
+    catch (const exception& e) {
+        cerr << "ani-rescore: " << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
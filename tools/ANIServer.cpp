@@ -0,0 +1,116 @@
+/* -------------------------------------------------------------------------- *
+ * The MIT License
+ *
+ * SPDX short identifier: MIT
+ *
+ * Copyright 2019 Genentech Inc. South San Francisco
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ * -------------------------------------------------------------------------- */
+
+/**
+ * ani-server evaluates ANI models for the simulations running on the same
+ * node.  An ANIForce whose setServer() names the server's socket sends its
+ * structures to the server instead of evaluating them itself, so many small
+ * simulations share one copy of each model and one pool of threads, and
+ * requests that arrive together are evaluated as one batch.
+ *
+ * The server runs until it receives SIGINT or SIGTERM, and then reports how
+ * many structures it evaluated.
+ */
+
+#include "internal/ANIEvaluationServer.h"
+#include "openmm/OpenMMException.h"
+#include <csignal>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace ANIPlugin;
+using namespace OpenMM;
+using namespace std;
+
+struct Options {
+    string socketPath, engineName;
+};
+
+static ANIEvaluationServer* server = NULL;
+
+static void handleSignal(int signal) {
+    if (server != NULL)
+        server->stop();
+}
+
+static void printUsage() {
+    cerr << "Usage: ani-server [options] socket" << endl;
+    cerr << "Evaluates ANI models for the ANIForces on this node whose setServer() names the socket." << endl;
+    cerr << "  --engine name      CPU (default), CPUFast, CPUTabulated or NeuroChem" << endl;
+}
+
+static Options parseOptions(int argc, char* argv[]) {
+    Options options = {"", "CPU"};
+    vector<string> files;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        bool hasValue = (i+1 < argc);
+        if (arg == "--engine" && hasValue)
+            options.engineName = argv[++i];
+        else if (arg.size() > 1 && arg[0] == '-')
+            throw OpenMMException("Unknown option: "+arg);
+        else
+            files.push_back(arg);
+    }
+    if (files.size() != 1)
+        throw OpenMMException("Expected a socket path");
+    options.socketPath = files[0];
+    return options;
+}
+
+static void serve(const Options& options) {
+    ANIEvaluationServer evaluationServer(options.socketPath, options.engineName);
+    server = &evaluationServer;
+    signal(SIGINT, handleSignal);
+    signal(SIGTERM, handleSignal);
+    printf("Listening on %s with the %s engine\n", options.socketPath.c_str(), options.engineName.c_str());
+    fflush(stdout);
+    evaluationServer.run();
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    server = NULL;
+    long long numEvaluations = evaluationServer.getNumEvaluations();
+    long long numBatches = evaluationServer.getNumBatches();
+    printf("Evaluated %lld structures in %lld batches (%.2f per batch), models loaded: %d\n", numEvaluations, numBatches,
+           (numBatches == 0 ? 0.0 : numEvaluations/(double) numBatches), evaluationServer.getNumModels());
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        if (argc < 2 || string(argv[1]) == "--help" || string(argv[1]) == "-h") {
+            printUsage();
+            return (argc < 2 ? 1 : 0);
+        }
+        serve(parseOptions(argc, argv));
+    }
+    catch (const exception& e) {
+        cerr << "ani-server: " << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}